@@ -0,0 +1,25 @@
+# zlib comes with the Orthanc framework, zstd and lz4 are used when found
+
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY NAMES zstd)
+
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+    message("Compression: zstd found in ${ZSTD_LIBRARY}")
+    add_definitions(-DHAVE_ZSTD=1)
+    include_directories(${ZSTD_INCLUDE_DIR})
+    link_libraries(${ZSTD_LIBRARY})
+else()
+    message("Compression: zstd not found, codec disabled")
+endif()
+
+find_path(LZ4_INCLUDE_DIR lz4.h)
+find_library(LZ4_LIBRARY NAMES lz4)
+
+if (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+    message("Compression: lz4 found in ${LZ4_LIBRARY}")
+    add_definitions(-DHAVE_LZ4=1)
+    include_directories(${LZ4_INCLUDE_DIR})
+    link_libraries(${LZ4_LIBRARY})
+else()
+    message("Compression: lz4 not found, codec disabled")
+endif()
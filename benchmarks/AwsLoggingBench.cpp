@@ -0,0 +1,111 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/*
+ * AWS SDK logging cost on the thread making a request. Every simulated
+ * request goes through the SDK log macros six times, about what the SDK
+ * logs per HTTP request at info.
+ *
+ *  - console_info: the previous setup, ConsoleLogSystem at info writing
+ *                  synchronously (to a null stdout here)
+ *  - orthanc_warn: AwsLogSystem at warn, the default: the macros stop at
+ *                  the level check
+ *  - orthanc_info: AwsLogSystem at info, formatted on the calling thread
+ *                  and pushed to the AsyncLog ring
+ *
+ * Reported is the CPU time of the calling thread per request.
+ */
+
+#include "AsyncLog.hpp"
+#include "AwsLogSystem.hpp"
+
+#include <aws/core/utils/logging/AWSLogging.h>
+#include <aws/core/utils/logging/ConsoleLogSystem.h>
+#include <aws/core/utils/logging/LogMacros.h>
+
+#include <ctime>
+#include <iostream>
+#include <streambuf>
+
+namespace {
+
+using namespace OrthancPlugins;
+namespace AwsLogging = Aws::Utils::Logging;
+
+OrthancPluginErrorCode invokeService(OrthancPluginContext*, _OrthancPluginService, const void*) {
+    return OrthancPluginErrorCode_Success;
+}
+
+OrthancPluginContext context = {nullptr, "1.4.0", nullptr, invokeService};
+
+class NullBuffer : public std::streambuf
+{
+protected:
+    int overflow(int c) override { return c; };
+    std::streamsize xsputn(const char*, std::streamsize n) override { return n; };
+};
+
+uint64_t threadCpuNs() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+void request(size_t i) {
+    AWS_LOGSTREAM_INFO("AWSClient", "Making request to https://bucket.s3.eu-central-1.amazonaws.com/" << i);
+    AWS_LOGSTREAM_DEBUG("CurlHttpClient", "Obtained connection handle " << i);
+    AWS_LOGSTREAM_INFO("AWSAuthV4Signer", "Canonical Header String: host:bucket.s3.eu-central-1.amazonaws.com");
+    AWS_LOGSTREAM_DEBUG("CurlHttpClient", "Returned http response code 200");
+    AWS_LOG_INFO("CurlHttpClient", "Releasing curl handle %zu", i);
+    AWS_LOGSTREAM_INFO("AWSClient", "Request successful " << i);
+}
+
+void run(const char* name, std::shared_ptr<AwsLogging::LogSystemInterface> logSystem) {
+    const size_t iterations = 100000;
+    AwsLogging::InitializeAWSLogging(logSystem);
+
+    NullBuffer null;
+    std::streambuf* stdoutBuffer = std::cout.rdbuf(&null);
+    const uint64_t start = threadCpuNs();
+    for (size_t i = 0; i < iterations; ++i) {
+        request(i);
+    }
+    const uint64_t ns = threadCpuNs() - start;
+    std::cout.rdbuf(stdoutBuffer);
+
+    AwsLogging::ShutdownAWSLogging();
+    std::cout << name << '\t' << static_cast<double>(ns) / iterations << std::endl;
+}
+
+}
+
+int main() {
+    auto log = std::make_shared<AsyncLog>(&context, LogLevel::WARNING, 0, 0);
+    log->Start();
+
+    std::cout << "mode\tns_per_request" << std::endl;
+    run("console_info", std::make_shared<AwsLogging::ConsoleLogSystem>(AwsLogging::LogLevel::Info));
+    run("orthanc_warn", std::make_shared<AwsLogSystem>(log, AwsLogging::LogLevel::Warn));
+    run("orthanc_info", std::make_shared<AwsLogSystem>(log, AwsLogging::LogLevel::Info));
+
+    log->Stop();
+    return 0;
+}
@@ -0,0 +1,120 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/*
+ * Local side of a TransferManager download: parts arrive in parallel and
+ * are written at their offsets into the download stream, as the SDK does.
+ * Compares the former /tmp file + read back path with writing straight
+ * into the malloc'ed buffer handed over to Orthanc. Network is left out.
+ */
+
+#include "MemStreamBuf.hpp"
+#include "Timer.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const size_t PART_SIZE = 5 * 1024 * 1024; //TransferManager default bufferSize
+const size_t THREADS = 4;
+
+//the SDK downloads each part into its own buffer, then copies it into the stream
+void writeParts(std::iostream& out, std::mutex& mutex, const std::vector<char>& part, size_t total) {
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < THREADS; ++t) {
+        workers.push_back(std::thread([&, t]() {
+            for (size_t offset = t * PART_SIZE; offset < total; offset += THREADS * PART_SIZE) {
+                const size_t n = std::min(PART_SIZE, total - offset);
+                std::lock_guard<std::mutex> lock(mutex);
+                out.seekp(static_cast<std::streamoff>(offset));
+                out.write(part.data(), static_cast<std::streamsize>(n));
+            }
+        }));
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+}
+
+void* tempFilePath(const std::vector<char>& part, size_t total) {
+    char temp[] = "/tmp/s3benchXXXXXX";
+    ::close(mkstemp(temp));
+    {
+        std::fstream f(temp, std::ios::in | std::ios::out | std::ios::binary | std::ios::trunc);
+        std::mutex mutex;
+        writeParts(f, mutex, part, total);
+    }
+
+    //what Utils::readFile does
+    std::ifstream f(temp, std::ios::in | std::ios::binary);
+    void* content = malloc(total);
+    f.read(static_cast<char*>(content), static_cast<std::streamsize>(total));
+    f.close();
+    std::remove(temp);
+
+    return content;
+}
+
+void* memoryPath(const std::vector<char>& part, size_t total) {
+    void* content = malloc(total);
+    Stream::MemStreamBuf buf(static_cast<char*>(content), total);
+    std::iostream out(&buf);
+    std::mutex mutex;
+    writeParts(out, mutex, part, total);
+
+    return content;
+}
+
+double run(void* (*path)(const std::vector<char>&, size_t), const std::vector<char>& part, size_t total, size_t iterations) {
+    Stopwatch timer;
+    for (size_t i = 0; i < iterations; ++i) {
+        free(path(part, total));
+    }
+    return static_cast<double>(timer.elapsed()) / iterations;
+}
+
+}
+
+int main(int argc, char** argv) {
+    const size_t iterations = argc > 1 ? static_cast<size_t>(atoi(argv[1])) : 20;
+    const std::vector<char> part(PART_SIZE, 'x');
+    const size_t sizes[] = {512 * 1024, 5 * 1024 * 1024, 50 * 1024 * 1024, 200 * 1024 * 1024};
+
+    std::cout << "size_bytes\ttmp_file_us\tmemory_us\tspeedup" << std::endl;
+    for (size_t total : sizes) {
+        const size_t n = std::max<size_t>(1, iterations * 5 * 1024 * 1024 / std::max(total, PART_SIZE));
+        const double tmp = run(tempFilePath, part, total, n);
+        const double mem = run(memoryPath, part, total, n);
+        std::cout << total << '\t' << tmp << '\t' << mem << '\t' << tmp / mem << std::endl;
+    }
+
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/*
+ * Memory traffic of one S3Direct GET once the bytes are off the wire.
+ * The body arrives in 16 KB chunks, like curl hands it to the SDK.
+ *
+ *  - sdk_stream: the SDK default response stream (a stringstream), then
+ *    copied into the malloc'ed buffer through pubsetbuf
+ *  - direct:     response stream factory writing into the malloc'ed buffer
+ *
+ * Reported per GET: allocations (a realloc counts as one), bytes copied
+ * on top of the write of the body itself, peak resident bytes, time.
+ */
+
+#include "MemStreamBuf.hpp"
+#include "Timer.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+struct Counters {
+    size_t allocations = 0;
+    size_t allocated = 0;
+    size_t largest = 0;
+    size_t live = 0;
+    size_t peak = 0;
+} counters;
+
+bool counting = false;
+
+void track(size_t n) {
+    if (counting) {
+        counters.allocations++;
+        counters.allocated += n;
+        counters.largest = std::max(counters.largest, n);
+        counters.live += n;
+        counters.peak = std::max(counters.peak, counters.live);
+    }
+}
+
+void untrack(size_t n) {
+    if (counting) {
+        counters.live -= std::min(n, counters.live);
+    }
+}
+
+void* countedMalloc(size_t n) {
+    track(n);
+    return malloc(n);
+}
+
+}
+
+//sized header in front of every operator new block, to follow live bytes
+void* operator new(size_t n) {
+    void* p = malloc(n + 16);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    *static_cast<size_t*>(p) = n;
+    track(n);
+    return static_cast<char*>(p) + 16;
+}
+
+void operator delete(void* p) noexcept {
+    if (p != nullptr) {
+        char* base = static_cast<char*>(p) - 16;
+        untrack(*reinterpret_cast<size_t*>(base));
+        free(base);
+    }
+}
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const size_t CHUNK = 16 * 1024;
+const size_t PART_SIZE = 8 * 1024 * 1024;
+
+void receive(std::ostream& out, const std::vector<char>& wire, size_t size) {
+    for (size_t offset = 0; offset < size; offset += CHUNK) {
+        out.write(wire.data(), static_cast<std::streamsize>(std::min(CHUNK, size - offset)));
+    }
+}
+
+//bytes copied besides the one write of the body by the network layer
+size_t sdkStream(const std::vector<char>& wire, size_t size) {
+    std::stringstream* body = new std::stringstream();
+    receive(*body, wire, size);
+
+    void* content = countedMalloc(size);
+    std::ostringstream buf;
+    buf.rdbuf()->pubsetbuf(static_cast<char*>(content), static_cast<std::streamsize>(size));
+    buf << body->rdbuf();
+    delete body;
+
+    untrack(size);
+    free(content);
+
+    //every growth of the stringstream copies what it held so far
+    return size + (counters.allocated - counters.largest - size);
+}
+
+size_t direct(const std::vector<char>& wire, size_t size) {
+    //a part sized block is mmap'ed by the allocator, only the pages the
+    //body lands on ever become resident, so that's what is counted
+    char* data = static_cast<char*>(malloc(PART_SIZE));
+    track(std::min(size, PART_SIZE));
+    {
+        Stream::MemStreamBuf buf(data, std::min(size, PART_SIZE));
+        std::iostream body(&buf);
+        receive(body, wire, std::min(size, PART_SIZE));
+    }
+    data = static_cast<char*>(realloc(data, size));
+    if (size > PART_SIZE) {
+        untrack(PART_SIZE);
+        track(size);
+        //remaining parts go to their offsets, no copy either
+        Stream::MemStreamBuf buf(data + PART_SIZE, size - PART_SIZE);
+        std::iostream body(&buf);
+        receive(body, wire, size - PART_SIZE);
+    }
+
+    untrack(size);
+    free(data);
+
+    return 0;
+}
+
+void run(const char* name, size_t (*get)(const std::vector<char>&, size_t), const std::vector<char>& wire, size_t size) {
+    const size_t iterations = std::max<size_t>(1, 64 * 1024 * 1024 / size);
+    size_t copied = 0;
+    double us = 0;
+    Counters total;
+
+    for (size_t i = 0; i < iterations; ++i) {
+        counters = Counters();
+        counting = true;
+        Stopwatch timer;
+        copied += get(wire, size);
+        us += timer.elapsed();
+        counting = false;
+        total.allocations += counters.allocations;
+        total.peak = std::max(total.peak, counters.peak);
+    }
+
+    std::cout << name << '\t' << size << '\t'
+              << total.allocations / iterations << '\t'
+              << copied / iterations << '\t'
+              << total.peak << '\t'
+              << us / iterations << std::endl;
+}
+
+}
+
+int main() {
+    const std::vector<char> wire(CHUNK, 'x');
+    const size_t sizes[] = {16 * 1024, 512 * 1024, 5 * 1024 * 1024, 50 * 1024 * 1024};
+
+    std::cout << "path\tsize_bytes\tallocations\tbytes_copied\tpeak_bytes\ttime_us" << std::endl;
+    for (size_t size : sizes) {
+        run("sdk_stream", sdkStream, wire, size);
+        run("direct", direct, wire, size);
+    }
+
+    return 0;
+}
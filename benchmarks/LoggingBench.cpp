@@ -0,0 +1,142 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/*
+ * Logging cost on the calling thread of one storage callback, which
+ * logs twice (begin and finished), against a stub Orthanc context.
+ *
+ *  - sync:        what the callbacks did, two stringstreams and a
+ *                 synchronous OrthancPluginLogInfo, even when Orthanc
+ *                 drops info messages
+ *  - async_off:   AsyncLog at warning, the level check only
+ *  - async_on:    AsyncLog at info, records pushed to the ring and
+ *                 formatted by the background thread
+ *  - trace:       async_off plus an OperationTrace with two marks,
+ *                 one operation in 100 traced
+ *
+ * The stub stands in for Orthanc: it formats nothing and only touches
+ * the message, so sync is a lower bound for a real plugin crossing.
+ * Reported is the CPU time of the calling threads per callback. The
+ * loop logs far faster than a real server, so async_on drops most of
+ * its records: the ring is bounded and never blocks the caller.
+ */
+
+#include "AsyncLog.hpp"
+
+#include <atomic>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+std::atomic<uint64_t> emitted(0);
+
+OrthancPluginErrorCode invokeService(OrthancPluginContext*, _OrthancPluginService, const void* params) {
+    emitted.fetch_add(strlen(static_cast<const char*>(params)) > 0 ? 1 : 0, std::memory_order_relaxed);
+    return OrthancPluginErrorCode_Success;
+}
+
+OrthancPluginContext context = {nullptr, "1.4.0", nullptr, invokeService};
+
+//CPU time of the calling thread, the background thread is not counted
+uint64_t threadCpuNs() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+}
+
+const char* UUID = "8b5e5d2e-3e12-4c8d-9a2b-0d5d1f3c4b6a";
+
+void sync(AsyncLog*, uint64_t duration) {
+    {
+        std::stringstream ss;
+        ss << "[S3] GET: " << UUID;
+        OrthancPluginLogInfo(&context, ss.str().c_str());
+    }
+    {
+        std::stringstream ss;
+        ss << "[S3] GET " << UUID << " finished in " << duration << "us";
+        OrthancPluginLogInfo(&context, ss.str().c_str());
+    }
+}
+
+void async(AsyncLog* log, uint64_t duration) {
+    log->Log(LogLevel::INFO, "[S3] GET: ", UUID);
+    log->Log(LogLevel::INFO, "[S3] GET ", UUID, " finished in ", static_cast<int64_t>(duration), "us");
+}
+
+void traced(AsyncLog* log, uint64_t duration) {
+    OperationTrace trace(log, "read", UUID, OrthancPluginContentType_Dicom);
+    log->Log(LogLevel::INFO, "[S3] GET: ", UUID);
+    trace.Mark("caches");
+    trace.SetSource("s3");
+    trace.Mark("downloaded");
+    trace.SetSize(static_cast<int64_t>(duration));
+    log->Log(LogLevel::INFO, "[S3] GET ", UUID, " finished in ", static_cast<int64_t>(trace.Finish(true)), "us");
+}
+
+void run(const char* name, void (*callback)(AsyncLog*, uint64_t), LogLevel level, uint64_t traceEvery, unsigned int threads) {
+    const size_t iterations = 200000;
+    AsyncLog log(&context, level, traceEvery, 0);
+    log.Start();
+    emitted = 0;
+
+    std::atomic<uint64_t> totalNs(0);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            const uint64_t start = threadCpuNs();
+            for (size_t i = 0; i < iterations; ++i) {
+                callback(&log, i);
+            }
+            totalNs += threadCpuNs() - start;
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    log.Stop();
+
+    std::cout << name << '\t' << threads << '\t'
+              << static_cast<double>(totalNs) / (iterations * threads) << '\t'
+              << emitted << '\t'
+              << log.GetDropped() << std::endl;
+}
+
+}
+
+int main() {
+    std::cout << "mode\tthreads\tns_per_callback\temitted\tdropped" << std::endl;
+    for (unsigned int threads : {1u, 8u}) {
+        run("sync", sync, LogLevel::WARNING, 0, threads);
+        run("async_off", async, LogLevel::WARNING, 0, threads);
+        run("async_on", async, LogLevel::INFO, 0, threads);
+        run("trace", traced, LogLevel::WARNING, 100, threads);
+    }
+    return 0;
+}
@@ -0,0 +1,557 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/*
+ * s3bench: drives S3Direct and S3TransferManager outside Orthanc, against
+ * any S3 endpoint (e.g. the MinIO of compose.yml), and prints the results
+ * as JSON on stdout.
+ *
+ *   s3bench --endpoint=http://localhost:9000 --bucket=s3bench \
+ *           --access-key=minio --secret-key=minioadmin \
+ *           --method=direct,transfer_manager --mix=ct --concurrency=16 \
+ *           --duration=30 --read=70 --write=25 --delete=5
+ *
+ * Every worker draws an operation from the read/write/delete ratios and,
+ * for writes, a size from the mix. Reads and deletes pick a random live
+ * object, prefilled before the clock starts. Objects left at the end are
+ * deleted unless --keep is given.
+ *
+ * --mock replaces the endpoint with tests/MockS3Server in the same process,
+ * with optional injected latency, bandwidth limit, 503 SlowDown and stall
+ * rates, so the client side can be measured without a storage server:
+ *
+ *   s3bench --mock --mock-latency=5 --mock-bandwidth=100M --mix=mr
+ *
+ * --targets=N spreads the objects over N buckets, <bucket>-0 to <bucket>-N-1,
+ * like s3_targets in the plugin; with --mock each one has a server of its own.
+ *
+ * --endpoint=URL,URL,... balances the requests over equivalent endpoints of
+ * the same buckets, like a list in s3_endpoint.
+ *
+ * Peak RSS is the process high-water mark: run one method per process
+ * when comparing memory.
+ */
+
+#include "S3ops.hpp"
+#include "AsyncLog.hpp"
+#include "LatencyHistogram.hpp"
+#include "MockS3Server.hpp"
+#include "Timer.hpp"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+bool verbose = false;
+
+OrthancPluginErrorCode invokeService(OrthancPluginContext*, _OrthancPluginService service, const void* params) {
+    switch (service) {
+    case _OrthancPluginService_LogError:
+    case _OrthancPluginService_LogWarning:
+        std::cerr << static_cast<const char*>(params) << std::endl;
+        return OrthancPluginErrorCode_Success;
+    case _OrthancPluginService_LogInfo:
+        if (verbose) {
+            std::cerr << static_cast<const char*>(params) << std::endl;
+        }
+        return OrthancPluginErrorCode_Success;
+    default:
+        return OrthancPluginErrorCode_NotImplemented;
+    }
+}
+
+OrthancPluginContext benchContext = {nullptr, "1.4.0", free, invokeService};
+
+}
+
+namespace OrthancPlugins {
+    //declared in Utils.hpp, defined by Plugin.cpp in the plugin
+    OrthancPluginContext* context = &benchContext;
+}
+
+namespace {
+
+using namespace OrthancPlugins;
+
+struct SizeClass {
+    double weight;
+    uint64_t min;
+    uint64_t max;
+};
+
+const uint64_t KB = 1024;
+const uint64_t MB = 1024 * 1024;
+
+//sizes of single instances, log-uniform within a class
+const std::map<std::string, std::vector<SizeClass> > MIXES = {
+    {"ct", {{1, 500 * KB, 530 * KB}}},                //512x512x16 bit slice
+    {"mr", {{1, 100 * KB, 350 * KB}}},                //256x256 to 384x384
+    {"cr", {{1, 6 * MB, 30 * MB}}},                   //2k to 4k detectors
+    {"wsi", {{1, 20 * MB, 250 * MB}}},                //tiled multi-frame pyramid levels
+    {"json", {{1, 8 * KB, 64 * KB}}},                 //DicomAsJson
+    {"mixed", {{0.55, 500 * KB, 530 * KB}, {0.25, 100 * KB, 350 * KB},
+               {0.15, 8 * KB, 64 * KB}, {0.05, 6 * MB, 30 * MB}}}
+};
+
+struct Options {
+    std::string endpoint;
+    std::string bucket = "s3bench";
+    unsigned int targets = 1;
+    std::vector<S3Target> stripes; //from bucket and targets
+    std::string region = "us-east-1";
+    std::string accessKey;
+    std::string secretKey;
+    std::vector<std::string> methods = {"direct"};
+    std::string mixName = "ct";
+    std::vector<SizeClass> mix;
+    unsigned int concurrency = 8;
+    double duration = 30;
+    unsigned int readRatio = 70;
+    unsigned int writeRatio = 25;
+    unsigned int deleteRatio = 5;
+    unsigned int prefill = 100;
+    bool keep = false;
+    bool mock = false;
+    MockS3Server::Faults faults;
+    S3Options s3;
+};
+
+uint64_t parseSize(const std::string& value) {
+    char* end = nullptr;
+    const double n = strtod(value.c_str(), &end);
+    switch (end != nullptr ? *end : '\0') {
+    case 'k': case 'K': return static_cast<uint64_t>(n * KB);
+    case 'm': case 'M': return static_cast<uint64_t>(n * MB);
+    case 'g': case 'G': return static_cast<uint64_t>(n * 1024 * MB);
+    default: return static_cast<uint64_t>(n);
+    }
+}
+
+std::vector<std::string> split(const std::string& value) {
+    std::vector<std::string> items;
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) {
+            items.push_back(item);
+        }
+    }
+    return items;
+}
+
+void usage() {
+    std::cerr << "usage: s3bench --endpoint=URL[,URL...]|--mock [--bucket=NAME] [--targets=N] [--region=REGION]\n"
+                 "               [--access-key=KEY --secret-key=SECRET]\n"
+                 "               [--method=direct,transfer_manager] [--mix=ct|mr|cr|wsi|json|mixed|fixed:SIZE]\n"
+                 "               [--concurrency=N] [--duration=SECONDS] [--read=R --write=W --delete=D]\n"
+                 "               [--prefill=N] [--part-size=SIZE] [--download-concurrency=N]\n"
+                 "               [--max-connections=N] [--transfer-threads=N] [--keep] [--verbose]\n"
+                 "               [--mock-latency=MS] [--mock-jitter=MS] [--mock-bandwidth=SIZE]\n"
+                 "               [--mock-slow-down=RATE] [--mock-stall=RATE] [--mock-stall-ms=MS]\n";
+}
+
+bool parseArguments(int argc, char** argv, Options& o) {
+    //MinIO credentials of compose.yml / docker.env
+    if (getenv("MINIO_ROOT_USER") != nullptr && getenv("MINIO_ROOT_PASSWORD") != nullptr) {
+        o.accessKey = getenv("MINIO_ROOT_USER");
+        o.secretKey = getenv("MINIO_ROOT_PASSWORD");
+    }
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t eq = arg.find('=');
+        const std::string key = arg.substr(0, eq);
+        const std::string value = eq == std::string::npos ? "" : arg.substr(eq + 1);
+
+        if (key == "--endpoint") o.endpoint = value;
+        else if (key == "--bucket") o.bucket = value;
+        else if (key == "--targets") o.targets = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--region") o.region = value;
+        else if (key == "--access-key") o.accessKey = value;
+        else if (key == "--secret-key") o.secretKey = value;
+        else if (key == "--method") o.methods = split(value);
+        else if (key == "--mix") o.mixName = value;
+        else if (key == "--concurrency") o.concurrency = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--duration") o.duration = std::stod(value);
+        else if (key == "--read") o.readRatio = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--write") o.writeRatio = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--delete") o.deleteRatio = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--prefill") o.prefill = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--part-size") o.s3.download_part_size = parseSize(value);
+        else if (key == "--download-concurrency") o.s3.download_concurrency = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--max-connections") o.s3.max_connections = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--transfer-threads") o.s3.transfer_threads = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--keep") o.keep = true;
+        else if (key == "--verbose") verbose = true;
+        else if (key == "--mock") o.mock = true;
+        else if (key == "--mock-latency") o.faults.latency_ms = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--mock-jitter") o.faults.jitter_ms = static_cast<unsigned int>(std::stoul(value));
+        else if (key == "--mock-bandwidth") o.faults.bandwidth = parseSize(value);
+        else if (key == "--mock-slow-down") o.faults.slow_down_rate = std::stod(value);
+        else if (key == "--mock-stall") o.faults.stall_rate = std::stod(value);
+        else if (key == "--mock-stall-ms") o.faults.stall_ms = static_cast<unsigned int>(std::stoul(value));
+        else {
+            std::cerr << "unknown argument: " << arg << std::endl;
+            return false;
+        }
+    }
+
+    if (o.mixName.compare(0, 6, "fixed:") == 0) {
+        const uint64_t size = parseSize(o.mixName.substr(6));
+        o.mix = {{1, size, size}};
+    } else if (MIXES.count(o.mixName) > 0) {
+        o.mix = MIXES.at(o.mixName);
+    } else {
+        std::cerr << "unknown mix: " << o.mixName << std::endl;
+        return false;
+    }
+
+    for (const auto& method : o.methods) {
+        if (method != "direct" && method != "transfer_manager") {
+            std::cerr << "unknown method: " << method << std::endl;
+            return false;
+        }
+    }
+
+    if (o.mock) {
+        if (!o.endpoint.empty()) {
+            std::cerr << "--mock and --endpoint are exclusive" << std::endl;
+            return false;
+        }
+        //the mock does not check signatures, the SDK still wants credentials
+        if (o.accessKey.empty()) o.accessKey = "mock";
+        if (o.secretKey.empty()) o.secretKey = "mock";
+    } else if (o.endpoint.empty()) {
+        return false;
+    }
+    if (o.concurrency == 0 || o.targets == 0 || o.readRatio + o.writeRatio + o.deleteRatio == 0) {
+        return false;
+    }
+    o.s3.aws_log_level = Aws::Utils::Logging::LogLevel::Warn;
+    return true;
+}
+
+class SizeSampler
+{
+    const std::vector<SizeClass>& _mix;
+    std::discrete_distribution<size_t> _class;
+    std::uniform_real_distribution<double> _unit;
+
+public:
+    explicit SizeSampler(const std::vector<SizeClass>& mix):
+        _mix(mix),
+        _class([&mix]() {
+            std::vector<double> weights;
+            for (const auto& c : mix) {
+                weights.push_back(c.weight);
+            }
+            return std::discrete_distribution<size_t>(weights.begin(), weights.end());
+        }()),
+        _unit(0, 1) {};
+
+    uint64_t operator()(std::mt19937_64& rng) {
+        const SizeClass& c = _mix[_class(rng)];
+        if (c.min == c.max) {
+            return c.min;
+        }
+        const double logMin = std::log(static_cast<double>(c.min));
+        const double logMax = std::log(static_cast<double>(c.max));
+        return static_cast<uint64_t>(std::exp(logMin + (logMax - logMin) * _unit(rng)));
+    }
+};
+
+//objects that can be read or deleted
+class KeyPool
+{
+    std::mutex _mutex;
+    std::vector<std::string> _keys;
+
+public:
+    void Add(const std::string& key) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _keys.push_back(key);
+    }
+
+    bool Pick(std::mt19937_64& rng, std::string& key, bool take) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_keys.empty()) {
+            return false;
+        }
+        const size_t i = std::uniform_int_distribution<size_t>(0, _keys.size() - 1)(rng);
+        key = _keys[i];
+        if (take) {
+            _keys[i] = _keys.back();
+            _keys.pop_back();
+        }
+        return true;
+    }
+
+    std::vector<std::string> TakeAll() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        std::vector<std::string> keys;
+        keys.swap(_keys);
+        return keys;
+    }
+};
+
+struct OperationStats {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> errors;
+    std::atomic<uint64_t> bytes;
+    LatencyHistogram latency;
+    OperationStats(): count(0), errors(0), bytes(0) {};
+};
+
+struct CpuUsage {
+    double user;
+    double system;
+    long peakRssKb;
+};
+
+CpuUsage cpuUsage() {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return {usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6,
+            usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6,
+            usage.ru_maxrss};
+}
+
+void writeOperation(std::ostream& out, const char* name, OperationStats& stats, double seconds) {
+    const auto snapshot = stats.latency.GetSnapshot();
+    out << "    \"" << name << "\": {"
+        << "\"count\": " << stats.count
+        << ", \"errors\": " << stats.errors
+        << ", \"bytes\": " << stats.bytes
+        << ", \"ops_per_s\": " << stats.count / seconds
+        << ", \"mb_per_s\": " << stats.bytes / seconds / MB
+        << ", \"latency_us\": {\"p50\": " << snapshot.GetPercentile(50)
+        << ", \"p99\": " << snapshot.GetPercentile(99)
+        << ", \"p999\": " << snapshot.GetPercentile(99.9)
+        << ", \"max\": " << snapshot.GetMax()
+        << ", \"mean\": " << snapshot.GetMean() << "}}";
+}
+
+bool runMethod(const Options& o, const std::string& method, const std::vector<char>& payload,
+               std::shared_ptr<AsyncLog> log, std::ostream& out) {
+    std::unique_ptr<S3Impl> s3;
+    if (method == "transfer_manager") {
+        s3.reset(new S3TransferManager(context));
+    } else {
+        s3.reset(new S3Direct(context));
+    }
+    s3->SetOptions(o.s3);
+    s3->SetLog(log);
+    if (!s3->ConfigureAwsSdk(o.accessKey, o.secretKey, o.stripes, o.region)) {
+        std::cerr << "could not configure " << method << " against " << o.endpoint << std::endl;
+        return false;
+    }
+
+    const std::string prefix = "s3bench/" + method + "/" + std::to_string(time(nullptr)) + "/";
+    KeyPool pool;
+    std::atomic<uint64_t> sequence(0);
+    std::mt19937_64 seedRng(42);
+
+    //objects to read from the start, not timed
+    {
+        SizeSampler sampler(o.mix);
+        for (unsigned int i = 0; i < o.prefill; ++i) {
+            const std::string key = prefix + "prefill-" + std::to_string(i);
+            if (s3->UploadFileToS3(key, payload.data(), static_cast<int64_t>(sampler(seedRng)))) {
+                pool.Add(key);
+            }
+        }
+    }
+
+    OperationStats puts, gets, deletes;
+    std::atomic<bool> running(true);
+    const unsigned int total = o.readRatio + o.writeRatio + o.deleteRatio;
+
+    const CpuUsage before = cpuUsage();
+    Stopwatch wall;
+
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < o.concurrency; ++t) {
+        const uint64_t seed = seedRng();
+        workers.emplace_back([&, seed]() {
+            std::mt19937_64 rng(seed);
+            SizeSampler sampler(o.mix);
+            std::uniform_int_distribution<unsigned int> draw(0, total - 1);
+
+            while (running) {
+                const unsigned int d = draw(rng);
+                std::string key;
+
+                if (d < o.writeRatio) {
+                    key = prefix + std::to_string(sequence++);
+                    const uint64_t size = sampler(rng);
+                    Stopwatch timer;
+                    const bool ok = s3->UploadFileToS3(key, payload.data(), static_cast<int64_t>(size));
+                    puts.latency.Record(static_cast<uint64_t>(timer.elapsed()));
+                    puts.count++;
+                    if (ok) {
+                        puts.bytes += size;
+                        pool.Add(key);
+                    } else {
+                        puts.errors++;
+                    }
+                } else if (d < o.writeRatio + o.readRatio) {
+                    if (!pool.Pick(rng, key, false)) {
+                        continue;
+                    }
+                    void* content = nullptr;
+                    int64_t size = 0;
+                    Stopwatch timer;
+                    const bool ok = s3->DownloadFileFromS3(key, &content, &size);
+                    gets.latency.Record(static_cast<uint64_t>(timer.elapsed()));
+                    gets.count++;
+                    if (ok) {
+                        gets.bytes += static_cast<uint64_t>(size);
+                        free(content);
+                    } else {
+                        gets.errors++;
+                    }
+                } else {
+                    if (!pool.Pick(rng, key, true)) {
+                        continue;
+                    }
+                    Stopwatch timer;
+                    const bool ok = s3->DeleteFileFromS3(key);
+                    deletes.latency.Record(static_cast<uint64_t>(timer.elapsed()));
+                    deletes.count++;
+                    if (!ok) {
+                        deletes.errors++;
+                    }
+                }
+            }
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int64_t>(o.duration * 1000)));
+    running = false;
+    for (auto& w : workers) {
+        w.join();
+    }
+
+    const double seconds = wall.elapsed() / 1e6;
+    const CpuUsage after = cpuUsage();
+    const uint64_t operations = puts.count + gets.count + deletes.count;
+
+    out << "  {\n"
+        << "    \"method\": \"" << method << "\",\n"
+        << "    \"endpoint\": \"" << o.endpoint << "\",\n"
+        << "    \"targets\": " << o.stripes.size() << ",\n"
+        << "    \"mix\": \"" << o.mixName << "\",\n"
+        << "    \"concurrency\": " << o.concurrency << ",\n"
+        << "    \"ratios\": {\"read\": " << o.readRatio << ", \"write\": " << o.writeRatio
+        << ", \"delete\": " << o.deleteRatio << "},\n"
+        << "    \"duration_s\": " << seconds << ",\n";
+    writeOperation(out, "put", puts, seconds);
+    out << ",\n";
+    writeOperation(out, "get", gets, seconds);
+    out << ",\n";
+    writeOperation(out, "delete", deletes, seconds);
+    out << ",\n"
+        << "    \"ops_per_s\": " << operations / seconds << ",\n"
+        << "    \"mb_per_s\": " << (puts.bytes + gets.bytes) / seconds / MB << ",\n"
+        << "    \"cpu_user_s\": " << after.user - before.user << ",\n"
+        << "    \"cpu_system_s\": " << after.system - before.system << ",\n"
+        << "    \"cpu_us_per_op\": "
+        << (operations > 0 ? (after.user - before.user + after.system - before.system) * 1e6 / operations : 0) << ",\n"
+        << "    \"peak_rss_kb\": " << after.peakRssKb << "\n"
+        << "  }";
+
+    if (!o.keep) {
+        for (const auto& key : pool.TakeAll()) {
+            s3->DeleteFileFromS3(key);
+        }
+    }
+    return true;
+}
+
+}
+
+int main(int argc, char** argv) {
+    Options o;
+    if (!parseArguments(argc, argv, o)) {
+        usage();
+        return 1;
+    }
+
+    uint64_t largest = 0;
+    for (const auto& c : o.mix) {
+        largest = std::max(largest, c.max);
+    }
+    //one random buffer, every object is a prefix of it
+    std::vector<char> payload(static_cast<size_t>(largest));
+    std::mt19937 rng(7);
+    for (auto& c : payload) {
+        c = static_cast<char>(rng());
+    }
+
+    std::vector<std::unique_ptr<MockS3Server> > mocks;
+    for (unsigned int i = 0; i < o.targets; ++i) {
+        const std::string bucket = o.targets == 1 ? o.bucket : o.bucket + "-" + std::to_string(i);
+        if (o.mock) {
+            mocks.emplace_back(new MockS3Server());
+            if (!mocks.back()->Start()) {
+                std::cerr << "could not start the mock S3 server" << std::endl;
+                return 1;
+            }
+            mocks.back()->CreateBucket(bucket);
+            mocks.back()->SetFaults(o.faults);
+            o.endpoint = mocks.back()->GetEndpoint();
+        }
+        o.stripes.push_back(S3Target{bucket, split(o.endpoint)});
+    }
+
+    //the SDK logs to stderr through the stub context, stdout is for the results
+    auto log = std::make_shared<AsyncLog>(context, verbose ? LogLevel::INFO : LogLevel::WARNING, 0, 0);
+    log->Start();
+
+    bool ok = true;
+    std::cout << "[\n";
+    for (size_t i = 0; i < o.methods.size() && ok; ++i) {
+        ok = runMethod(o, o.methods[i], payload, log, std::cout);
+        std::cout << (i + 1 < o.methods.size() && ok ? ",\n" : "\n");
+    }
+    std::cout << "]" << std::endl;
+
+    log->Stop();
+    for (auto& mock : mocks) {
+        mock->Stop();
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,254 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "AsyncLog.hpp"
+
+#include <boost/algorithm/string.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <sstream>
+
+namespace {
+    std::atomic<int> globalLevel(static_cast<int>(OrthancPlugins::LogLevel::WARNING));
+
+    const char* typeName(OrthancPluginContentType type) {
+        switch (type) {
+        case OrthancPluginContentType_Dicom: return "dicom";
+        case OrthancPluginContentType_DicomAsJson: return "dicom_as_json";
+        default: return "unknown";
+        }
+    }
+}
+
+namespace OrthancPlugins {
+
+const size_t AsyncLog::CAPACITY;
+const size_t AsyncLog::MAX_MARKS;
+
+bool parseLogLevel(const std::string &name, LogLevel &level) {
+    if (boost::iequals(name, "error")) {
+        level = LogLevel::ERROR;
+    } else if (boost::iequals(name, "warning") || boost::iequals(name, "warn")) {
+        level = LogLevel::WARNING;
+    } else if (boost::iequals(name, "info")) {
+        level = LogLevel::INFO;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool isLogEnabled(LogLevel level) {
+    return static_cast<int>(level) <= globalLevel.load(std::memory_order_relaxed);
+}
+
+AsyncLog::AsyncLog(OrthancPluginContext *context, LogLevel level, uint64_t traceEvery, uint64_t slowMicros):
+    _context(context),
+    _level(level),
+    _traceEvery(traceEvery),
+    _slowMicros(slowMicros),
+    _slots(new Slot[CAPACITY]),
+    _head(0),
+    _tail(0),
+    _dropped(0),
+    _stopping(false)
+{
+    static_assert((CAPACITY & (CAPACITY - 1)) == 0, "CAPACITY must be a power of two");
+    for (size_t i = 0; i < CAPACITY; ++i) {
+        _slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    globalLevel = static_cast<int>(level);
+}
+
+AsyncLog::~AsyncLog() {
+    Stop();
+}
+
+void AsyncLog::Start() {
+    _stopping = false;
+    _thread = std::thread(&AsyncLog::Loop, this);
+}
+
+void AsyncLog::Stop() {
+    _stopping = true;
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+//bounded MPMC queue (D. Vyukov), only one consumer here
+bool AsyncLog::Push(Record &record) {
+    size_t pos = _head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for (;;) {
+        slot = &_slots[pos & (CAPACITY - 1)];
+        const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        const intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+        if (diff == 0) {
+            if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            //full
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = _head.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->record = std::move(record);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool AsyncLog::Pop(Record &record) {
+    Slot& slot = _slots[_tail & (CAPACITY - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != _tail + 1) {
+        return false;
+    }
+    record = std::move(slot.record);
+    slot.sequence.store(_tail + CAPACITY, std::memory_order_release);
+    _tail++;
+    return true;
+}
+
+void AsyncLog::Log(LogLevel level, const char *text, const char *uuid, const char *suffix, int64_t value, const char *unit) {
+    if (!IsEnabled(level)) {
+        return;
+    }
+    Record record;
+    record.level = level;
+    record.text = text;
+    strncpy(record.uuid, uuid, sizeof(record.uuid) - 1);
+    record.suffix = suffix;
+    record.value = value;
+    record.unit = unit;
+    Push(record);
+}
+
+void AsyncLog::Log(LogLevel level, std::string message) {
+    if (IsEnabled(level)) {
+        Forward(level, std::move(message));
+    }
+}
+
+void AsyncLog::Forward(LogLevel level, std::string message) {
+    Record record;
+    record.level = level;
+    record.message = std::move(message);
+    Push(record);
+}
+
+void AsyncLog::Submit(const OperationTrace &trace, bool ok, uint64_t total) {
+    const bool slow = _slowMicros > 0 && total >= _slowMicros;
+    //per thread count, a shared one would bounce between the cores
+    static thread_local uint64_t counter = 0;
+    const bool sampled = _traceEvery > 0 && counter++ % _traceEvery == 0;
+    if (!slow && !sampled) {
+        return;
+    }
+
+    //asked for explicitly, not gated by the level
+    Record record;
+    record.level = LogLevel::WARNING;
+    record.trace = true;
+    record.op = trace._op;
+    strncpy(record.uuid, trace._uuid, sizeof(record.uuid) - 1);
+    record.type = trace._type;
+    record.source = trace._source;
+    record.ok = ok;
+    record.slow = slow;
+    record.size = trace._size;
+    record.total = total;
+    record.markCount = trace._markCount;
+    for (size_t i = 0; i < trace._markCount; ++i) {
+        record.markNames[i] = trace._markNames[i];
+        record.marks[i] = trace._marks[i];
+    }
+    Push(record);
+}
+
+std::string AsyncLog::Format(const Record &record) {
+    std::stringstream ss;
+    if (!record.trace) {
+        ss << record.text << record.uuid << record.suffix;
+        if (record.value >= 0) {
+            ss << record.value << record.unit;
+        }
+        ss << record.message;
+        return ss.str();
+    }
+
+    ss << "[S3] " << (record.slow ? "slow " : "") << record.op << " " << record.uuid
+       << " (" << typeName(record.type) << ") " << (record.ok ? "ok" : "failed");
+    if (record.size >= 0) {
+        ss << ", " << record.size << " bytes";
+    }
+    if (record.source[0] != '\0') {
+        ss << " from " << record.source;
+    }
+    ss << " in " << record.total << "us";
+    for (size_t i = 0; i < record.markCount; ++i) {
+        ss << (i == 0 ? ": " : ", ") << record.markNames[i] << " at " << record.marks[i] << "us";
+    }
+    return ss.str();
+}
+
+void AsyncLog::Emit(const Record &record) {
+    const std::string line = Format(record);
+    switch (record.level) {
+    case LogLevel::ERROR: OrthancPluginLogError(_context, line.c_str()); break;
+    case LogLevel::WARNING: OrthancPluginLogWarning(_context, line.c_str()); break;
+    default: OrthancPluginLogInfo(_context, line.c_str()); break;
+    }
+}
+
+void AsyncLog::Loop() {
+    uint64_t reported = 0;
+    Record record;
+    for (;;) {
+        const bool stopping = _stopping;
+        bool any = false;
+        while (Pop(record)) {
+            Emit(record);
+            any = true;
+        }
+
+        const uint64_t dropped = _dropped;
+        if (dropped != reported) {
+            std::stringstream ss;
+            ss << "[S3] " << dropped - reported << " log records dropped, the log ring was full";
+            OrthancPluginLogWarning(_context, ss.str().c_str());
+            reported = dropped;
+        }
+
+        if (stopping) {
+            break;
+        }
+        if (!any) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+    }
+}
+
+}
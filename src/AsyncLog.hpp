@@ -0,0 +1,180 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef ASYNCLOG_HPP
+#define ASYNCLOG_HPP
+
+#include "Timer.hpp"
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace OrthancPlugins {
+
+enum class LogLevel {
+    ERROR = 0,
+    WARNING,
+    INFO
+};
+
+bool parseLogLevel(const std::string& name, LogLevel& level);
+
+//process wide gate, checked before anything gets formatted
+bool isLogEnabled(LogLevel level);
+
+class OperationTrace;
+
+/*
+ * Logging off the storage callbacks. The caller checks the level and
+ * pushes a record into a bounded lock-free ring (no formatting, no
+ * allocation for static text); a background thread formats the records
+ * and hands them to Orthanc. When the ring is full records are dropped
+ * and counted rather than blocking the caller.
+ */
+class AsyncLog
+{
+public:
+    static const size_t CAPACITY = 4096; //power of two
+    static const size_t MAX_MARKS = 4;
+
+    struct Record {
+        LogLevel level = LogLevel::INFO;
+        bool trace = false;
+        //message: text + uuid + suffix [+ value + unit], pieces are static strings
+        const char* text = "";
+        char uuid[40] = {0};
+        const char* suffix = "";
+        int64_t value = -1;
+        const char* unit = "";
+        std::string message; //dynamic text, appended
+        //trace
+        const char* op = "";
+        OrthancPluginContentType type = OrthancPluginContentType_Unknown;
+        const char* source = "";
+        bool ok = true;
+        bool slow = false;
+        int64_t size = -1;
+        uint64_t total = 0;
+        const char* markNames[MAX_MARKS];
+        uint64_t marks[MAX_MARKS];
+        size_t markCount = 0;
+    };
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Record record;
+    };
+
+    OrthancPluginContext* _context;
+    LogLevel _level;
+    uint64_t _traceEvery;
+    uint64_t _slowMicros;
+
+    std::unique_ptr<Slot[]> _slots;
+    std::atomic<size_t> _head;
+    size_t _tail;
+    std::atomic<uint64_t> _dropped;
+
+    std::thread _thread;
+    std::atomic<bool> _stopping;
+
+    bool Push(Record& record);
+    bool Pop(Record& record);
+    void Emit(const Record& record);
+    void Loop();
+
+public:
+    //traceEvery: trace one operation in that many (0 = off), slowMicros: trace anything slower (0 = off)
+    AsyncLog(OrthancPluginContext* context, LogLevel level, uint64_t traceEvery, uint64_t slowMicros);
+    ~AsyncLog();
+
+    void Start();
+    //drains what's left
+    void Stop();
+
+    bool IsEnabled(LogLevel level) const { return level <= _level; };
+
+    //text, suffix and unit must outlive the record: string literals
+    void Log(LogLevel level, const char* text, const char* uuid, const char* suffix = "",
+             int64_t value = -1, const char* unit = "");
+    //for text that has been formatted anyway
+    void Log(LogLevel level, std::string message);
+    //same, already filtered by the caller (the AWS SDK has its own level)
+    void Forward(LogLevel level, std::string message);
+
+    void Submit(const OperationTrace& trace, bool ok, uint64_t total);
+
+    uint64_t GetDropped() const { return _dropped; };
+
+    static std::string Format(const Record& record);
+};
+
+/*
+ * Timing of one storage callback. Marking phases costs a clock read;
+ * the record only reaches the log when sampled or slower than the
+ * threshold, see AsyncLog.
+ */
+class OperationTrace
+{
+    friend class AsyncLog;
+
+    AsyncLog* _log;
+    const char* _op;
+    const char* _uuid;
+    OrthancPluginContentType _type;
+    Stopwatch _timer;
+    const char* _source;
+    int64_t _size;
+    const char* _markNames[AsyncLog::MAX_MARKS];
+    uint64_t _marks[AsyncLog::MAX_MARKS];
+    size_t _markCount;
+
+public:
+    OperationTrace(AsyncLog* log, const char* op, const char* uuid, OrthancPluginContentType type):
+        _log(log), _op(op), _uuid(uuid), _type(type), _source(""), _size(-1), _markCount(0) {};
+
+    //time since the start, under a static name
+    void Mark(const char* phase) {
+        if (_markCount < AsyncLog::MAX_MARKS) {
+            _markNames[_markCount] = phase;
+            _marks[_markCount++] = static_cast<uint64_t>(_timer.elapsed());
+        }
+    };
+    void SetSource(const char* source) { _source = source; };
+    void SetSize(int64_t size) { _size = size; };
+
+    //total time in microseconds
+    uint64_t Finish(bool ok) {
+        const uint64_t total = static_cast<uint64_t>(_timer.elapsed());
+        if (_log != nullptr) {
+            _log->Submit(*this, ok, total);
+        }
+        return total;
+    };
+};
+
+}
+#endif // ASYNCLOG_HPP
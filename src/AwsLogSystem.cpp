@@ -0,0 +1,90 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "AwsLogSystem.hpp"
+
+#include <boost/algorithm/string.hpp>
+
+#include <cstdarg>
+#include <cstdio>
+
+namespace OrthancPlugins {
+
+namespace AwsLogging = Aws::Utils::Logging;
+
+bool parseAwsLogLevel(const std::string &name, AwsLogging::LogLevel &level) {
+    const std::pair<const char*, AwsLogging::LogLevel> levels[] = {
+        {"off", AwsLogging::LogLevel::Off}, {"fatal", AwsLogging::LogLevel::Fatal},
+        {"error", AwsLogging::LogLevel::Error}, {"warn", AwsLogging::LogLevel::Warn},
+        {"warning", AwsLogging::LogLevel::Warn}, {"info", AwsLogging::LogLevel::Info},
+        {"debug", AwsLogging::LogLevel::Debug}, {"trace", AwsLogging::LogLevel::Trace}
+    };
+    for (const auto& l : levels) {
+        if (boost::iequals(name, l.first)) {
+            level = l.second;
+            return true;
+        }
+    }
+    return false;
+}
+
+void AwsLogSystem::Forward(AwsLogging::LogLevel level, const char *tag, const char *message) {
+    LogLevel target = LogLevel::INFO;
+    if (level <= AwsLogging::LogLevel::Error) {
+        target = LogLevel::ERROR;
+    } else if (level == AwsLogging::LogLevel::Warn) {
+        target = LogLevel::WARNING;
+    }
+
+    std::string line = "[S3] [aws] ";
+    line += tag;
+    line += ": ";
+    line += message;
+    //the SDK level was checked by the caller
+    _log->Forward(target, std::move(line));
+}
+
+void AwsLogSystem::Log(AwsLogging::LogLevel logLevel, const char *tag, const char *formatStr, ...) {
+    va_list args;
+    va_start(args, formatStr);
+    vaLog(logLevel, tag, formatStr, args);
+    va_end(args);
+}
+
+void AwsLogSystem::vaLog(AwsLogging::LogLevel logLevel, const char *tag, const char *formatStr, va_list args) {
+    if (logLevel > _level) {
+        return;
+    }
+
+    char buffer[1024];
+    vsnprintf(buffer, sizeof(buffer), formatStr, args);
+
+    Forward(logLevel, tag, buffer);
+}
+
+void AwsLogSystem::LogStream(AwsLogging::LogLevel logLevel, const char *tag, const Aws::OStringStream &messageStream) {
+    if (logLevel > _level) {
+        return;
+    }
+    Forward(logLevel, tag, messageStream.str().c_str());
+}
+
+}
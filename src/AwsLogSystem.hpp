@@ -0,0 +1,64 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef AWSLOGSYSTEM_HPP
+#define AWSLOGSYSTEM_HPP
+
+#include "AsyncLog.hpp"
+
+#include <aws/core/utils/logging/LogSystemInterface.h>
+#include <aws/core/utils/logging/LogLevel.h>
+
+#include <cstdarg>
+#include <memory>
+#include <string>
+
+namespace OrthancPlugins {
+
+bool parseAwsLogLevel(const std::string& name, Aws::Utils::Logging::LogLevel& level);
+
+/*
+ * AWS SDK log system writing to the Orthanc log through AsyncLog, so the
+ * SDK threads only format their message and push it to the ring.
+ * Fatal and Error go to the Orthanc error log, Warn to warnings and
+ * everything more verbose to info.
+ */
+class AwsLogSystem : public Aws::Utils::Logging::LogSystemInterface
+{
+    std::shared_ptr<AsyncLog> _log;
+    Aws::Utils::Logging::LogLevel _level;
+
+    void Forward(Aws::Utils::Logging::LogLevel level, const char* tag, const char* message);
+
+public:
+    AwsLogSystem(std::shared_ptr<AsyncLog> log, Aws::Utils::Logging::LogLevel level):
+        _log(log), _level(level) {};
+
+    Aws::Utils::Logging::LogLevel GetLogLevel() const override { return _level; };
+    void Log(Aws::Utils::Logging::LogLevel logLevel, const char* tag, const char* formatStr, ...) override;
+    void vaLog(Aws::Utils::Logging::LogLevel logLevel, const char* tag, const char* formatStr, va_list args) override;
+    void LogStream(Aws::Utils::Logging::LogLevel logLevel, const char* tag, const Aws::OStringStream& messageStream) override;
+    //nothing is buffered here, the ring is drained by AsyncLog
+    void Flush() override {};
+};
+
+}
+#endif // AWSLOGSYSTEM_HPP
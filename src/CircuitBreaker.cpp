@@ -0,0 +1,87 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "CircuitBreaker.hpp"
+
+#include <algorithm>
+
+namespace {
+  uint64_t micros(OrthancPlugins::CircuitBreaker::Clock::duration d) {
+      return static_cast<uint64_t>(std::max<int64_t>(std::chrono::duration_cast<std::chrono::microseconds>(d).count(), 0));
+  }
+}
+
+namespace OrthancPlugins {
+
+CircuitBreaker::CircuitBreaker(unsigned int threshold):
+    _threshold(std::max(threshold, 1u)),
+    _open(false),
+    _failures(0),
+    _trips(0),
+    _rejected(0),
+    _lastTimeToTrip(0),
+    _lastTimeToRecover(0) {
+}
+
+bool CircuitBreaker::Allow() {
+    if (_open.load(std::memory_order_relaxed)) {
+        _rejected++;
+        return false;
+    }
+    return true;
+}
+
+void CircuitBreaker::RecordSuccess(Clock::time_point now) {
+    //the common case, no lock
+    if (!_open.load(std::memory_order_relaxed) && _failures.load(std::memory_order_relaxed) == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _failures = 0;
+    if (_open) {
+        _lastTimeToRecover = micros(now - _openedAt);
+        _open = false;
+    }
+}
+
+void CircuitBreaker::RecordFailure(Clock::time_point now) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_open) {
+        return;
+    }
+    if (_failures++ == 0) {
+        _firstFailure = now;
+    }
+    if (_failures >= _threshold) {
+        _lastTimeToTrip = micros(now - _firstFailure);
+        _openedAt = now;
+        _trips++;
+        _open = true;
+    }
+}
+
+uint64_t CircuitBreaker::GetOpenTime() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _open ? micros(Clock::now() - _openedAt) : 0;
+}
+
+}
@@ -0,0 +1,82 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef CIRCUITBREAKER_HPP
+#define CIRCUITBREAKER_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace OrthancPlugins {
+
+/*
+ * Circuit breaker in front of S3.
+ * Every answer from the endpoint counts, errors included (a NoSuchKey or a
+ * SlowDown is an answer); only requests without a usable answer (network
+ * errors, timeouts, 5xx other than throttling) are failures. After `threshold` failures in a row the
+ * breaker opens and requests fail at once, until any request or a probe
+ * gets an answer again.
+ * Time to trip is measured from the first failure of the streak, time to
+ * recover from the trip.
+ */
+class CircuitBreaker
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    const unsigned int _threshold;
+
+    std::atomic<bool> _open;
+    std::mutex _mutex;
+    std::atomic<unsigned int> _failures; //in a row
+    Clock::time_point _firstFailure;
+    Clock::time_point _openedAt;
+
+    std::atomic<uint64_t> _trips;
+    std::atomic<uint64_t> _rejected;
+    std::atomic<uint64_t> _lastTimeToTrip; //us
+    std::atomic<uint64_t> _lastTimeToRecover; //us
+
+public:
+    explicit CircuitBreaker(unsigned int threshold);
+
+    //false while open, counted as rejected
+    bool Allow();
+    bool IsOpen() const { return _open; };
+
+    void RecordSuccess() { RecordSuccess(Clock::now()); };
+    void RecordSuccess(Clock::time_point now);
+    void RecordFailure() { RecordFailure(Clock::now()); };
+    void RecordFailure(Clock::time_point now);
+
+    uint64_t GetTrips() const { return _trips; };
+    uint64_t GetRejected() const { return _rejected; };
+    uint64_t GetLastTimeToTrip() const { return _lastTimeToTrip; };
+    uint64_t GetLastTimeToRecover() const { return _lastTimeToRecover; };
+    //us since the trip, 0 when closed
+    uint64_t GetOpenTime();
+};
+
+}
+#endif // CIRCUITBREAKER_HPP
@@ -0,0 +1,398 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Compression.hpp"
+
+#include <zlib.h>
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+namespace {
+    const char MAGIC[8] = {'\x89', 'S', '3', 'C', 'M', 'P', '\r', '\n'};
+    const uint8_t VERSION = 1;
+    const size_t HEADER_SIZE = 32;
+
+    /*
+     * Header, host byte order:
+     *  0 char[8] magic   8 uint8 codec   9 uint8 version
+     * 12 uint32 chunks  16 uint64 original size  24 uint64 chunk size
+     * followed by a uint32 compressed size per chunk, then the chunks
+     */
+    struct Header {
+        OrthancPlugins::CompressionCodec codec;
+        uint32_t chunks;
+        uint64_t size;
+        uint64_t chunkSize;
+    };
+
+    bool decodeHeader(const char* data, size_t size, Header& h) {
+        if (size < HEADER_SIZE || memcmp(data, MAGIC, sizeof(MAGIC)) != 0 || static_cast<uint8_t>(data[9]) != VERSION) {
+            return false;
+        }
+        h.codec = static_cast<OrthancPlugins::CompressionCodec>(data[8]);
+        memcpy(&h.chunks, data + 12, 4);
+        memcpy(&h.size, data + 16, 8);
+        memcpy(&h.chunkSize, data + 24, 8);
+        return h.chunkSize > 0 && h.chunks == (h.size + h.chunkSize - 1) / h.chunkSize;
+    }
+
+    size_t compressBound(OrthancPlugins::CompressionCodec codec, size_t size) {
+        switch (codec) {
+#if HAVE_ZSTD
+        case OrthancPlugins::CompressionCodec::ZSTD: return ZSTD_compressBound(size);
+#endif
+#if HAVE_LZ4
+        case OrthancPlugins::CompressionCodec::LZ4: return static_cast<size_t>(LZ4_compressBound(static_cast<int>(size)));
+#endif
+        default: return ::compressBound(static_cast<uLong>(size));
+        }
+    }
+
+    //0 on failure
+    size_t compressChunk(OrthancPlugins::CompressionCodec codec, int level,
+                         const char* src, size_t size, char* dst, size_t capacity) {
+        switch (codec) {
+        case OrthancPlugins::CompressionCodec::ZLIB: {
+            uLongf length = static_cast<uLongf>(capacity);
+            return compress2(reinterpret_cast<Bytef*>(dst), &length, reinterpret_cast<const Bytef*>(src),
+                             static_cast<uLong>(size), level) == Z_OK ? length : 0;
+        }
+#if HAVE_ZSTD
+        case OrthancPlugins::CompressionCodec::ZSTD: {
+            const size_t length = ZSTD_compress(dst, capacity, src, size, level);
+            return ZSTD_isError(length) ? 0 : length;
+        }
+#endif
+#if HAVE_LZ4
+        case OrthancPlugins::CompressionCodec::LZ4: {
+            //lz4 trades ratio for speed with acceleration, the lower the level the faster
+            const int length = LZ4_compress_fast(src, dst, static_cast<int>(size), static_cast<int>(capacity),
+                                                 std::max(1, 10 - level));
+            return length > 0 ? static_cast<size_t>(length) : 0;
+        }
+#endif
+        default:
+            return 0;
+        }
+    }
+
+    bool decompressChunk(OrthancPlugins::CompressionCodec codec,
+                         const char* src, size_t size, char* dst, size_t expected) {
+        switch (codec) {
+        case OrthancPlugins::CompressionCodec::ZLIB: {
+            uLongf length = static_cast<uLongf>(expected);
+            return uncompress(reinterpret_cast<Bytef*>(dst), &length, reinterpret_cast<const Bytef*>(src),
+                              static_cast<uLong>(size)) == Z_OK && length == expected;
+        }
+#if HAVE_ZSTD
+        case OrthancPlugins::CompressionCodec::ZSTD:
+            return ZSTD_decompress(dst, expected, src, size) == expected;
+#endif
+#if HAVE_LZ4
+        case OrthancPlugins::CompressionCodec::LZ4:
+            return LZ4_decompress_safe(src, dst, static_cast<int>(size), static_cast<int>(expected)) == static_cast<int>(expected);
+#endif
+        default:
+            return false;
+        }
+    }
+
+    int defaultLevel(OrthancPlugins::CompressionCodec codec) {
+        switch (codec) {
+        case OrthancPlugins::CompressionCodec::ZSTD: return 3;
+        case OrthancPlugins::CompressionCodec::LZ4: return 9; //acceleration 1
+        default: return 6;
+        }
+    }
+
+    //runs f(chunk) for every chunk on up to threads threads
+    template <typename F>
+    bool forEachChunk(uint32_t chunks, unsigned int threads, F f) {
+        std::atomic<uint32_t> next(0);
+        std::atomic<bool> ok(true);
+        auto worker = [&]() {
+            for (uint32_t i = next++; i < chunks && ok; i = next++) {
+                if (!f(i)) {
+                    ok = false;
+                }
+            }
+        };
+
+        std::vector<std::thread> pool;
+        const unsigned int count = std::min<unsigned int>(std::max(threads, 1u), chunks);
+        for (unsigned int i = 1; i < count; ++i) {
+            pool.push_back(std::thread(worker));
+        }
+        worker();
+        for (auto& t : pool) {
+            t.join();
+        }
+        return ok;
+    }
+
+    uint16_t readUint16(const unsigned char* p) {
+        return static_cast<uint16_t>(p[0] | (p[1] << 8));
+    }
+
+    uint32_t readUint32(const unsigned char* p) {
+        return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+               (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+}
+
+namespace OrthancPlugins {
+
+bool parseCompressionCodec(const std::string &name, CompressionCodec &codec) {
+    if (name == "none") {
+        codec = CompressionCodec::NONE;
+    } else if (name == "zlib") {
+        codec = CompressionCodec::ZLIB;
+#if HAVE_ZSTD
+    } else if (name == "zstd") {
+        codec = CompressionCodec::ZSTD;
+#endif
+#if HAVE_LZ4
+    } else if (name == "lz4") {
+        codec = CompressionCodec::LZ4;
+#endif
+    } else {
+        return false;
+    }
+    return true;
+}
+
+std::string getTransferSyntax(const void *dicom, size_t size) {
+    //128 bytes preamble, "DICM", then the group 0002 in explicit VR little endian
+    const unsigned char* data = static_cast<const unsigned char*>(dicom);
+    if (size < 132 || memcmp(data + 128, "DICM", 4) != 0) {
+        return "";
+    }
+
+    size_t pos = 132;
+    while (pos + 8 <= size) {
+        const uint16_t group = readUint16(data + pos);
+        const uint16_t element = readUint16(data + pos + 2);
+        if (group != 0x0002) {
+            break;
+        }
+
+        const char vr[2] = {static_cast<char>(data[pos + 4]), static_cast<char>(data[pos + 5])};
+        const bool longLength = (vr[0] == 'O' && (vr[1] == 'B' || vr[1] == 'W' || vr[1] == 'F')) ||
+                (vr[0] == 'S' && vr[1] == 'Q') || (vr[0] == 'U' && (vr[1] == 'T' || vr[1] == 'N'));
+        uint64_t length;
+        if (longLength) {
+            if (pos + 12 > size) {
+                break;
+            }
+            length = readUint32(data + pos + 8);
+            pos += 12;
+        } else {
+            length = readUint16(data + pos + 6);
+            pos += 8;
+        }
+        if (pos + length > size) {
+            break;
+        }
+
+        if (element == 0x0010) {
+            std::string uid(reinterpret_cast<const char*>(data + pos), static_cast<size_t>(length));
+            //UIDs are padded with NUL to an even length
+            while (!uid.empty() && (uid.back() == '\0' || uid.back() == ' ')) {
+                uid.pop_back();
+            }
+            return uid;
+        }
+        pos += length;
+    }
+    return "";
+}
+
+bool isCompressedTransferSyntax(const std::string &uid) {
+    return uid.compare(0, 20, "1.2.840.10008.1.2.4.") == 0 ||  //JPEG, JPEG-LS, JPEG 2000, MPEG, HEVC
+           uid == "1.2.840.10008.1.2.5" ||                     //RLE
+           uid == "1.2.840.10008.1.2.1.99";                    //deflated
+}
+
+Compressor::Compressor(const std::map<OrthancPluginContentType, CompressionCodec> &codecs,
+                       uint64_t threshold,
+                       uint64_t chunkSize,
+                       unsigned int threads,
+                       int level,
+                       bool adaptive):
+    _codecs(codecs),
+    _threshold(threshold),
+    _chunkSize(std::min<uint64_t>(std::max<uint64_t>(chunkSize, 64 * 1024), 64 * 1024 * 1024)),
+    _threads(std::max(threads, 1u)),
+    _level(level),
+    _adaptive(adaptive),
+    _active(0),
+    _bytesIn(0),
+    _bytesOut(0),
+    _skipped(0)
+{
+}
+
+int Compressor::GetLevel(CompressionCodec codec) {
+    const int level = _level > 0 ? _level : defaultLevel(codec);
+    if (!_adaptive) {
+        return level;
+    }
+
+    //the compression threads of all the requests against the CPU budget
+    const double load = static_cast<double>(_active) / _threads;
+    if (load >= 2.0) {
+        return 0;
+    } else if (load >= 1.0) {
+        return 1;
+    } else if (load >= 0.5) {
+        return std::max(1, level / 2);
+    }
+    return level;
+}
+
+bool Compressor::Compress(const void *content, int64_t size, OrthancPluginContentType type, std::string &compressed) {
+    auto it = _codecs.find(type);
+    if (it == _codecs.end() || it->second == CompressionCodec::NONE || static_cast<uint64_t>(size) < _threshold) {
+        return false;
+    }
+    const CompressionCodec codec = it->second;
+
+    if (type == OrthancPluginContentType_Dicom &&
+            isCompressedTransferSyntax(getTransferSyntax(content, static_cast<size_t>(size)))) {
+        return false;
+    }
+
+    const int level = GetLevel(codec);
+    if (level == 0) {
+        _skipped++;
+        return false;
+    }
+
+    const char* src = static_cast<const char*>(content);
+    const uint64_t total = static_cast<uint64_t>(size);
+    const uint32_t chunks = static_cast<uint32_t>((total + _chunkSize - 1) / _chunkSize);
+
+    //every chunk gets its worst case slot, the result is compacted afterwards
+    const size_t slot = compressBound(codec, static_cast<size_t>(std::min(_chunkSize, total)));
+    std::vector<char> buffer(slot * chunks);
+    std::vector<uint32_t> sizes(chunks);
+
+    const unsigned int threads = std::min<unsigned int>(_threads, chunks);
+    _active += threads;
+    const bool ok = forEachChunk(chunks, threads, [&](uint32_t i) {
+        const uint64_t begin = i * _chunkSize;
+        const size_t length = static_cast<size_t>(std::min(_chunkSize, total - begin));
+        const size_t n = compressChunk(codec, level, src + begin, length, buffer.data() + i * slot, slot);
+        sizes[i] = static_cast<uint32_t>(n);
+        return n > 0;
+    });
+    _active -= threads;
+
+    uint64_t payload = 0;
+    for (uint32_t n : sizes) {
+        payload += n;
+    }
+
+    //not worth it
+    const uint64_t result = HEADER_SIZE + 4ULL * chunks + payload;
+    if (!ok || result >= total - total / 20) {
+        return false;
+    }
+
+    compressed.resize(static_cast<size_t>(result));
+    char* out = &compressed[0];
+    memset(out, 0, HEADER_SIZE);
+    memcpy(out, MAGIC, sizeof(MAGIC));
+    out[8] = static_cast<char>(codec);
+    out[9] = static_cast<char>(VERSION);
+    memcpy(out + 12, &chunks, 4);
+    memcpy(out + 16, &total, 8);
+    memcpy(out + 24, &_chunkSize, 8);
+    memcpy(out + HEADER_SIZE, sizes.data(), 4 * chunks);
+
+    char* p = out + HEADER_SIZE + 4 * chunks;
+    for (uint32_t i = 0; i < chunks; ++i) {
+        memcpy(p, buffer.data() + i * slot, sizes[i]);
+        p += sizes[i];
+    }
+
+    _bytesIn += total;
+    _bytesOut += result;
+    return true;
+}
+
+bool Compressor::IsCompressed(const void *content, int64_t size) {
+    return size >= static_cast<int64_t>(HEADER_SIZE) && memcmp(content, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+bool Compressor::Decompress(const void *content, int64_t size, void **result, int64_t *resultSize, unsigned int threads) {
+    const char* data = static_cast<const char*>(content);
+    Header h;
+    if (!decodeHeader(data, static_cast<size_t>(size), h) || HEADER_SIZE + 4ULL * h.chunks > static_cast<uint64_t>(size)) {
+        return false;
+    }
+
+    //chunk offsets, and a check that they add up to the object
+    std::vector<uint64_t> offsets(h.chunks + 1);
+    offsets[0] = HEADER_SIZE + 4ULL * h.chunks;
+    for (uint32_t i = 0; i < h.chunks; ++i) {
+        uint32_t n;
+        memcpy(&n, data + HEADER_SIZE + 4 * i, 4);
+        offsets[i + 1] = offsets[i] + n;
+    }
+    if (offsets[h.chunks] != static_cast<uint64_t>(size)) {
+        return false;
+    }
+
+    //malloc because it's freed by ::free()
+    char* out = static_cast<char*>(malloc(h.size == 0 ? 1 : static_cast<size_t>(h.size)));
+    if (out == nullptr) {
+        return false;
+    }
+
+    const bool ok = forEachChunk(h.chunks, threads, [&](uint32_t i) {
+        const uint64_t begin = i * h.chunkSize;
+        const size_t expected = static_cast<size_t>(std::min(h.chunkSize, h.size - begin));
+        return decompressChunk(h.codec, data + offsets[i], static_cast<size_t>(offsets[i + 1] - offsets[i]),
+                               out + begin, expected);
+    });
+
+    if (!ok) {
+        free(out);
+        return false;
+    }
+
+    *result = out;
+    *resultSize = static_cast<int64_t>(h.size);
+    return true;
+}
+
+}
@@ -0,0 +1,98 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+
+namespace OrthancPlugins {
+
+enum class CompressionCodec : uint8_t {
+    NONE = 0,
+    ZLIB = 1,
+    ZSTD = 2,
+    LZ4 = 3
+};
+
+//none, zlib, zstd or lz4; false if unknown or not built in
+bool parseCompressionCodec(const std::string& name, CompressionCodec& codec);
+
+//the transfer syntax of a DICOM file, empty if there is no file meta header
+std::string getTransferSyntax(const void* dicom, size_t size);
+//JPEG, JPEG-LS, JPEG 2000, RLE, MPEG, HEVC and deflated transfer syntaxes
+bool isCompressedTransferSyntax(const std::string& uid);
+
+/*
+ * Compression of attachments on their way to S3.
+ *
+ * Compressed objects start with a small header naming the codec and the
+ * size of each chunk, so they can be read back whatever the current
+ * configuration; anything without the header is returned as is.
+ * Objects larger than one chunk are (de)compressed in parallel.
+ * With adaptive levels the level drops, and finally compression is
+ * skipped, as the machine runs out of CPU.
+ */
+class Compressor
+{
+    std::map<OrthancPluginContentType, CompressionCodec> _codecs;
+    uint64_t _threshold;
+    uint64_t _chunkSize;
+    unsigned int _threads;
+    int _level;
+    bool _adaptive;
+
+    std::atomic<unsigned int> _active; //threads compressing right now
+    std::atomic<uint64_t> _bytesIn;
+    std::atomic<uint64_t> _bytesOut;
+    std::atomic<uint64_t> _skipped;
+
+    //0: skip compression
+    int GetLevel(CompressionCodec codec);
+
+public:
+    //level 0: codec default; threads: per object, also the CPU budget of adaptive levels
+    Compressor(const std::map<OrthancPluginContentType, CompressionCodec>& codecs,
+               uint64_t threshold,
+               uint64_t chunkSize,
+               unsigned int threads,
+               int level,
+               bool adaptive);
+
+    //false: store the content as is (codec none, too small, already compressed, busy)
+    bool Compress(const void* content, int64_t size, OrthancPluginContentType type, std::string& compressed);
+
+    static bool IsCompressed(const void* content, int64_t size);
+    //result is malloc'ed, false on a corrupted object
+    static bool Decompress(const void* content, int64_t size, void** result, int64_t* resultSize, unsigned int threads);
+
+    unsigned int GetThreads() const { return _threads; };
+    uint64_t GetBytesIn() const { return _bytesIn; };
+    uint64_t GetBytesOut() const { return _bytesOut; };
+    uint64_t GetSkipped() const { return _skipped; };
+};
+
+}
+#endif // COMPRESSION_HPP
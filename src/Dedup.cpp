@@ -0,0 +1,170 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Dedup.hpp"
+
+#include <openssl/evp.h>
+
+#include <sstream>
+
+namespace OrthancPlugins {
+
+std::string hashContent(const void *content, int64_t size) {
+    //OpenSSL picks the SHA extensions or AVX2 code path of the CPU
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int length = 0;
+    if (EVP_Digest(content, static_cast<size_t>(size), digest, &length, EVP_sha256(), nullptr) != 1) {
+        return "";
+    }
+
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(2 * length, '0');
+    for (unsigned int i = 0; i < length; ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    return hex;
+}
+
+Dedup::Dedup(OrthancPluginContext *c,
+             const std::string &indexPath,
+             ObjectFunction deleteObject):
+    _context(c),
+    _index(indexPath, true),
+    _delete(deleteObject)
+{
+}
+
+std::string Dedup::GetKey(const std::string &hash) {
+    return "cas/" + hash;
+}
+
+bool Dedup::Load() {
+    if (!_index.Load()) {
+        LogError(_context, "[S3] Could not open the deduplication index");
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _refs.clear();
+    _index.ForEach([this](const std::string&, const std::string& hash) {
+        _refs[hash]++;
+    });
+
+    std::stringstream ss;
+    ss << "[S3] Deduplication index: " << _index.GetCount() << " attachments in " << _refs.size() << " objects";
+    LogInfo(_context, ss.str().c_str());
+    return true;
+}
+
+bool Dedup::Store(const std::string &uuid, const void *content, int64_t size, ObjectFunction upload) {
+    const std::string hash = hashContent(content, size);
+    if (hash.empty()) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this, &hash] { return _busy.count(hash) == 0; });
+
+    //stored again by a journal replay or a spool drain: already counted
+    std::string current;
+    if (_index.Get(uuid, current) && current == hash) {
+        return true;
+    }
+
+    //already in S3: only a reference to add
+    auto it = _refs.find(hash);
+    const bool stored = it != _refs.end() && it->second > 0;
+
+    //the index syncs to disk, writers of other content don't wait for it
+    _busy.insert(hash);
+    lock.unlock();
+
+    //the object is only reachable once indexed, a crash before leaves an orphan
+    const bool ok = (stored || upload(GetKey(hash))) && _index.Set(uuid, hash);
+
+    lock.lock();
+    if (ok) {
+        _refs[hash]++;
+        if (stored) {
+            _hits++;
+            _savedBytes += static_cast<uint64_t>(size);
+        }
+    }
+    _busy.erase(hash);
+    _cv.notify_all();
+    return ok;
+}
+
+bool Dedup::Lookup(const std::string &uuid, std::string &key) {
+    std::string hash;
+    if (!_index.Get(uuid, hash)) {
+        return false;
+    }
+    key = GetKey(hash);
+    return true;
+}
+
+bool Dedup::Remove(const std::string &uuid, bool &ok) {
+    std::string hash;
+    if (!_index.Get(uuid, hash)) {
+        return false;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _cv.wait(lock, [this, &hash] { return _busy.count(hash) == 0; });
+    std::string current;
+    if (!_index.Get(uuid, current) || current != hash) {
+        //removed meanwhile
+        return false;
+    }
+
+    //writers of the same content are held back until the last reference is
+    //deleted: a queued delete could hit an object uploaded again in the meantime
+    _busy.insert(hash);
+    lock.unlock();
+
+    ok = _index.Remove(uuid);
+
+    lock.lock();
+    auto it = _refs.find(hash);
+    if (it != _refs.end() && --it->second == 0) {
+        _refs.erase(it);
+        lock.unlock();
+        ok = _delete(GetKey(hash)) && ok;
+        lock.lock();
+    }
+    _busy.erase(hash);
+    _cv.notify_all();
+    return true;
+}
+
+uint64_t Dedup::GetHits() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _hits;
+}
+
+uint64_t Dedup::GetSavedBytes() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _savedBytes;
+}
+
+}
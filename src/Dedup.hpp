@@ -0,0 +1,88 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef DEDUP_HPP
+#define DEDUP_HPP
+
+#include "OrthancPluginCppWrapper.h"
+#include "PersistentMap.hpp"
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace OrthancPlugins {
+
+//hex SHA-256 of the content
+std::string hashContent(const void* content, int64_t size);
+
+/*
+ * Content-addressed storage of attachments.
+ *
+ * Attachments are stored once under "cas/<sha256>"; a local index maps
+ * every uuid to its hash and the references to an object are counted,
+ * so identical content is uploaded once and the object is deleted with
+ * its last reference. While a reference to an object is being added or
+ * removed (with its upload or delete), other writers of the same content
+ * wait for it; writers of other content don't.
+ */
+class Dedup
+{
+public:
+    typedef std::function<bool(const std::string& key)> ObjectFunction;
+
+private:
+    OrthancPluginContext* _context;
+    PersistentMap _index;
+    ObjectFunction _delete;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::unordered_map<std::string, size_t> _refs;
+    std::unordered_set<std::string> _busy; //hashes being uploaded, indexed or deleted
+
+    uint64_t _hits = 0;
+    uint64_t _savedBytes = 0;
+
+    static std::string GetKey(const std::string& hash);
+
+public:
+    Dedup(OrthancPluginContext* c,
+          const std::string& indexPath,
+          ObjectFunction deleteObject);
+
+    bool Load();
+
+    //upload is only called if no other attachment has the same content
+    bool Store(const std::string& uuid, const void* content, int64_t size, ObjectFunction upload);
+    bool Lookup(const std::string& uuid, std::string& key);
+    //false if the uuid is not deduplicated; ok tells if a last reference could be deleted
+    bool Remove(const std::string& uuid, bool& ok);
+
+    uint64_t GetHits();
+    uint64_t GetSavedBytes();
+};
+
+}
+#endif // DEDUP_HPP
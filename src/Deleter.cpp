@@ -0,0 +1,150 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Deleter.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <sstream>
+#include <unordered_set>
+
+namespace {
+    const std::chrono::milliseconds RETRY_MIN_DELAY(500);
+    const std::chrono::milliseconds RETRY_MAX_DELAY(30000);
+}
+
+namespace OrthancPlugins {
+
+Deleter::Deleter(OrthancPluginContext *c,
+                 const std::string &queuePath,
+                 size_t batchSize,
+                 BatchFunction f):
+    _context(c),
+    _queueFile(queuePath, false),
+    _batchSize(std::max<size_t>(batchSize, 1)),
+    _delete(f)
+{
+}
+
+Deleter::~Deleter() {
+    Stop();
+}
+
+bool Deleter::Start() {
+    if (!_queueFile.Load()) {
+        LogError(_context, "[S3] Could not open the delete queue");
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queueFile.ForEach([this](const std::string& path, const std::string&) {
+            _queue.push_back(path);
+        });
+    }
+
+    if (!_queue.empty()) {
+        std::stringstream ss;
+        ss << "[S3] Resuming " << _queue.size() << " queued deletes";
+        LogWarning(_context, ss.str().c_str());
+    }
+
+    _thread = std::thread(&Deleter::Loop, this);
+    return true;
+}
+
+void Deleter::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+bool Deleter::Enqueue(const std::string &path) {
+    //the page cache is enough: a delete lost in an OS crash leaks an object, nothing more
+    if (!_queueFile.Set(path, "")) {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _queue.push_back(path);
+    }
+    _cv.notify_one();
+    return true;
+}
+
+size_t Deleter::GetPendingCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _queue.size();
+}
+
+void Deleter::Loop() {
+    std::chrono::milliseconds delay(0);
+    std::vector<std::string> batch;
+    std::vector<std::string> failed;
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        if (delay.count() > 0) {
+            _cv.wait_for(lock, delay, [this] { return _stop; });
+        }
+        _cv.wait(lock, [this] { return _stop || !_queue.empty(); });
+        if (_stop) {
+            break;
+        }
+
+        batch.clear();
+        while (!_queue.empty() && batch.size() < _batchSize) {
+            batch.push_back(_queue.front());
+            _queue.pop_front();
+        }
+
+        lock.unlock();
+        _delete(batch, failed);
+        const std::unordered_set<std::string> retry(failed.begin(), failed.end());
+        for (const auto& path : batch) {
+            if (retry.count(path) == 0) {
+                _queueFile.Remove(path);
+            }
+        }
+        lock.lock();
+
+        if (failed.empty()) {
+            delay = std::chrono::milliseconds(0);
+        } else {
+            //to the back, so a poisoned key doesn't block the others
+            _queue.insert(_queue.end(), failed.begin(), failed.end());
+            delay = std::min(std::max(delay * 2, RETRY_MIN_DELAY), RETRY_MAX_DELAY);
+
+            std::stringstream ss;
+            ss << "[S3] " << failed.size() << " deletes failed, retrying in " << delay.count() << " ms";
+            LogWarning(_context, ss.str().c_str());
+        }
+    }
+}
+
+}
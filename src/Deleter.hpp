@@ -0,0 +1,84 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef DELETER_HPP
+#define DELETER_HPP
+
+#include "OrthancPluginCppWrapper.h"
+#include "PersistentMap.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * Background deleter for StorageRemove.
+ *
+ * Object keys are appended to a queue file under IndexDirectory and
+ * removed from S3 by a background thread, in batches of up to
+ * batchSize keys per request. Failed keys are retried with backoff,
+ * and keys still queued at shutdown are picked up on the next start.
+ */
+class Deleter
+{
+public:
+    //deletes paths, the ones that failed go to failed
+    typedef std::function<bool(const std::vector<std::string>& paths, std::vector<std::string>& failed)> BatchFunction;
+
+private:
+    OrthancPluginContext* _context;
+    PersistentMap _queueFile;
+    size_t _batchSize;
+    BatchFunction _delete;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::string> _queue;
+    bool _stop = false;
+    std::thread _thread;
+
+    void Loop();
+
+public:
+    Deleter(OrthancPluginContext* c,
+            const std::string& queuePath,
+            size_t batchSize,
+            BatchFunction f);
+    ~Deleter();
+
+    //loads the keys left by a previous run and starts the thread
+    bool Start();
+    void Stop();
+
+    //returns once the key is in the queue file
+    bool Enqueue(const std::string& path);
+
+    size_t GetPendingCount();
+};
+
+}
+#endif // DELETER_HPP
@@ -0,0 +1,203 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "DiskCache.hpp"
+#include "Utils.hpp"
+#include "Core/OrthancException.h"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <ctime>
+#include <sstream>
+#include <tuple>
+
+namespace {
+    bool isCacheDirectory(const boost::filesystem::path& p) {
+        const std::string name = p.filename().string();
+        return name.size() == 2 && std::all_of(name.begin(), name.end(), ::isxdigit);
+    }
+}
+
+namespace OrthancPlugins {
+
+DiskCache::DiskCache(OrthancPluginContext *c,
+                     const std::string &root,
+                     uint64_t capacity,
+                     PathFunction path):
+    _context(c),
+    _root(root),
+    _path(path),
+    _index(capacity)
+{
+}
+
+void DiskCache::Load() {
+    namespace fs = boost::filesystem;
+
+    //files are replayed oldest first, so the LRU order survives a restart
+    std::vector<std::tuple<std::time_t, std::string, uint64_t> > found;
+
+    try {
+        if (!fs::is_directory(_root)) {
+            return;
+        }
+
+        for (fs::directory_iterator l1(_root); l1 != fs::directory_iterator(); ++l1) {
+            if (!fs::is_directory(l1->path()) || !isCacheDirectory(l1->path())) {
+                continue;
+            }
+            for (fs::directory_iterator l2(l1->path()); l2 != fs::directory_iterator(); ++l2) {
+                if (!fs::is_directory(l2->path()) || !isCacheDirectory(l2->path())) {
+                    continue;
+                }
+                for (fs::directory_iterator f(l2->path()); f != fs::directory_iterator(); ++f) {
+                    if (!fs::is_regular_file(f->path())) {
+                        continue;
+                    }
+                    if (f->path().extension() == ".tmp") {
+                        //leftover of an interrupted insert
+                        fs::remove(f->path());
+                        continue;
+                    }
+                    found.push_back(std::make_tuple(fs::last_write_time(f->path()),
+                                                    f->path().filename().string(),
+                                                    static_cast<uint64_t>(fs::file_size(f->path()))));
+                }
+            }
+        }
+    } catch (fs::filesystem_error& e) {
+        std::stringstream err;
+        err << "[S3] Cache: could not scan " << _root << ", " << e.what();
+        LogError(_context, err.str());
+    }
+
+    std::sort(found.begin(), found.end());
+
+    std::vector<LruCache<uint64_t>::Item> evicted;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (const auto& f : found) {
+            if (!_index.Put(std::get<1>(f), std::get<2>(f), std::get<2>(f), evicted)) {
+                evicted.push_back(LruCache<uint64_t>::Item(std::get<1>(f), std::get<2>(f)));
+            }
+        }
+    }
+    RemoveFiles(evicted);
+
+    std::stringstream ss;
+    ss << "[S3] Cache: " << _index.GetCount() << " files, " << _index.GetCost()
+       << " of " << _index.GetCapacity() << " bytes in use";
+    LogInfo(_context, ss.str());
+}
+
+bool DiskCache::Read(const std::string &uuid, void **content, int64_t *size) {
+    uint64_t expected = 0;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (!_index.Get(uuid, expected)) {
+            return false;
+        }
+    }
+
+    try {
+        *content = nullptr;
+        Utils::readFile(content, size, _path(uuid.c_str()));
+        if (static_cast<uint64_t>(*size) == expected) {
+            return true;
+        }
+        free(*content);
+        *content = nullptr;
+    } catch (Orthanc::OrthancException&) {
+    }
+
+    //the file went away or got truncated behind our back
+    Remove(uuid);
+    return false;
+}
+
+void DiskCache::Insert(const std::string &uuid, const void *content, int64_t size) {
+    const uint64_t cost = static_cast<uint64_t>(size);
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (cost > _index.GetCapacity() || _index.Contains(uuid)) {
+            return;
+        }
+    }
+
+    const std::string path = _path(uuid.c_str());
+    const std::string temp = path + ".tmp";
+
+    try {
+        //write aside and rename, so a crash never leaves a partial entry
+        Utils::removeFile(temp);
+        Utils::writeFile(content, size, temp);
+        boost::filesystem::rename(temp, path);
+    } catch (Orthanc::OrthancException& e) {
+        std::stringstream err;
+        err << "[S3] Cache: could not write " << path << ", " << e.What();
+        LogWarning(_context, err.str());
+        return;
+    } catch (boost::filesystem::filesystem_error& e) {
+        std::stringstream err;
+        err << "[S3] Cache: could not write " << path << ", " << e.what();
+        LogWarning(_context, err.str());
+        return;
+    }
+
+    std::vector<LruCache<uint64_t>::Item> evicted;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _index.Put(uuid, cost, cost, evicted);
+    }
+    RemoveFiles(evicted);
+}
+
+void DiskCache::Remove(const std::string &uuid) {
+    bool found = false;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        found = _index.Remove(uuid);
+    }
+
+    if (found) {
+        RemoveFiles({LruCache<uint64_t>::Item(uuid, 0)});
+    }
+}
+
+uint64_t DiskCache::GetSize() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _index.GetCost();
+}
+
+void DiskCache::RemoveFiles(const std::vector<LruCache<uint64_t>::Item> &evicted) {
+    for (const auto& e : evicted) {
+        try {
+            Utils::removeFile(_path(e.first.c_str()));
+        } catch (Orthanc::OrthancException& ex) {
+            std::stringstream err;
+            err << "[S3] Cache: could not evict " << e.first << ", " << ex.What();
+            LogWarning(_context, err.str());
+        }
+    }
+}
+
+}
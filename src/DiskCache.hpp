@@ -0,0 +1,70 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef DISKCACHE_HPP
+#define DISKCACHE_HPP
+
+#include "OrthancPluginCppWrapper.h"
+#include "LruCache.hpp"
+
+#include <mutex>
+#include <string>
+
+namespace OrthancPlugins {
+
+/*
+ * Read-through cache of attachments on local disk.
+ * Attachments are immutable, so entries never need revalidation,
+ * they only go away on eviction or StorageRemove.
+ */
+class DiskCache
+{
+public:
+    typedef std::string (*PathFunction)(const char* uuid);
+
+private:
+    OrthancPluginContext* _context;
+    std::string _root;
+    PathFunction _path;
+
+    std::mutex _mutex;
+    LruCache<uint64_t> _index;
+
+    void RemoveFiles(const std::vector<LruCache<uint64_t>::Item>& evicted);
+
+public:
+    DiskCache(OrthancPluginContext* c,
+              const std::string& root,
+              uint64_t capacity,
+              PathFunction path);
+
+    //rebuilds the index from the files left by a previous run
+    void Load();
+
+    bool Read(const std::string& uuid, void** content, int64_t* size);
+    void Insert(const std::string& uuid, const void* content, int64_t size);
+    void Remove(const std::string& uuid);
+
+    uint64_t GetSize();
+};
+
+}
+#endif // DISKCACHE_HPP
@@ -0,0 +1,181 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "EndpointBalancer.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <sstream>
+
+namespace OrthancPlugins {
+
+const unsigned int EndpointBalancer::EWMA_SHIFT;
+
+EndpointBalancer::EndpointBalancer(OrthancPluginContext *c,
+                                   const std::vector<std::string>& names,
+                                   unsigned int ejectFailures):
+    _context(c),
+    _ejectFailures(std::max(ejectFailures, 1u)),
+    _next(0),
+    _checkInterval(0)
+{
+    for (const auto& name : names) {
+        _endpoints.emplace_back(new Endpoint());
+        _endpoints.back()->name = name;
+    }
+}
+
+EndpointBalancer::~EndpointBalancer() {
+    Stop();
+}
+
+void EndpointBalancer::Start(CheckFunction check, std::chrono::milliseconds interval) {
+    _check = check;
+    _checkInterval = interval;
+    _stop = false;
+    _thread = std::thread(&EndpointBalancer::Loop, this);
+}
+
+void EndpointBalancer::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+size_t EndpointBalancer::Acquire(size_t busy) {
+    const size_t count = _endpoints.size();
+    size_t best = busy < count ? (busy + 1) % count : 0;
+    if (count > 1) {
+        //endpoints without a request yet count as the fastest one
+        uint64_t fastest = std::numeric_limits<uint64_t>::max();
+        bool healthy = false;
+        for (size_t i = 0; i < count; ++i) {
+            const uint64_t latency = _endpoints[i]->latency;
+            if (latency > 0) {
+                fastest = std::min(fastest, latency);
+            }
+            healthy = healthy || (i != busy && !_endpoints[i]->ejected);
+        }
+        if (fastest == std::numeric_limits<uint64_t>::max()) {
+            fastest = 1;
+        }
+
+        const size_t first = _next++;
+        uint64_t bestScore = std::numeric_limits<uint64_t>::max();
+        for (size_t i = 0; i < count; ++i) {
+            const size_t index = (first + i) % count;
+            const Endpoint& e = *_endpoints[index];
+            if (index == busy || (healthy && e.ejected)) {
+                continue;
+            }
+            const uint64_t latency = e.latency;
+            const uint64_t score = static_cast<uint64_t>(std::max<int64_t>(e.outstanding, 0) + 1) *
+                    std::max<uint64_t>(latency > 0 ? latency : fastest, 1);
+            if (score < bestScore) {
+                bestScore = score;
+                best = index;
+            }
+        }
+    }
+
+    _endpoints[best]->outstanding++;
+    _endpoints[best]->requests++;
+    return best;
+}
+
+void EndpointBalancer::Release(size_t endpoint, uint64_t latency) {
+    Endpoint& e = *_endpoints[endpoint];
+    e.outstanding--;
+
+    //concurrent updates may lose one, the average doesn't need to be exact
+    const uint64_t average = e.latency;
+    if (average == 0) {
+        e.latency = std::max<uint64_t>(latency, 1);
+    } else {
+        const int64_t delta = static_cast<int64_t>(latency) - static_cast<int64_t>(average);
+        e.latency = static_cast<uint64_t>(std::max<int64_t>(static_cast<int64_t>(average) + delta / (1 << EWMA_SHIFT), 1));
+    }
+}
+
+void EndpointBalancer::RecordAnswer(size_t endpoint) {
+    Endpoint& e = *_endpoints[endpoint];
+    e.failures = 0;
+    if (e.ejected.exchange(false)) {
+        std::stringstream ss;
+        ss << "[S3] Endpoint " << e.name << " answers again";
+        LogWarning(_context, ss.str().c_str());
+    }
+}
+
+void EndpointBalancer::RecordFailure(size_t endpoint) {
+    if (++_endpoints[endpoint]->failures >= _ejectFailures) {
+        Eject(endpoint, "failed requests");
+    }
+}
+
+void EndpointBalancer::Eject(size_t endpoint, const char* reason) {
+    Endpoint& e = *_endpoints[endpoint];
+    if (_endpoints.size() == 1 || e.ejected.exchange(true)) {
+        return;
+    }
+    e.ejections++;
+
+    std::stringstream ss;
+    ss << "[S3] Endpoint " << e.name << " ejected after " << reason;
+    LogWarning(_context, ss.str().c_str());
+}
+
+size_t EndpointBalancer::GetEjectedCount() const {
+    size_t count = 0;
+    for (const auto& e : _endpoints) {
+        if (e->ejected) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void EndpointBalancer::Loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stop) {
+        _cv.wait_for(lock, _checkInterval, [this]() { return _stop; });
+        if (_stop) {
+            return;
+        }
+
+        lock.unlock();
+        for (size_t i = 0; i < _endpoints.size(); ++i) {
+            if (_check(i)) {
+                RecordAnswer(i);
+            } else {
+                Eject(i, "a failed health check");
+            }
+        }
+        lock.lock();
+    }
+}
+
+}
@@ -0,0 +1,119 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef ENDPOINTBALANCER_HPP
+#define ENDPOINTBALANCER_HPP
+
+#include "OrthancPluginCppWrapper.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * Spreads the requests to one bucket over equivalent endpoints, e.g.
+ * several MinIO gateways in front of the same data.
+ *
+ * Every request goes to the endpoint with the lowest outstanding requests
+ * (itself included) times the moving average of its latency, ties going
+ * round robin. Requests without a usable answer (network errors, timeouts,
+ * 5xx other than throttling) are failures; after `ejectFailures` in a row, or a failed
+ * health check, an endpoint gets no requests until it answers a health
+ * check again. When all of them are ejected, all of them are used.
+ */
+class EndpointBalancer
+{
+public:
+    //true if the endpoint answered
+    typedef std::function<bool(size_t endpoint)> CheckFunction;
+
+    //the latency average moves by 1/2^EWMA_SHIFT of the difference to each request
+    static const unsigned int EWMA_SHIFT = 3;
+
+private:
+    struct Endpoint {
+        std::string name;
+        std::atomic<int64_t> outstanding{0};
+        std::atomic<uint64_t> latency{0}; //us, 0 until the first request
+        std::atomic<unsigned int> failures{0}; //in a row
+        std::atomic<bool> ejected{false};
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> ejections{0};
+    };
+
+    OrthancPluginContext* _context;
+    std::vector<std::unique_ptr<Endpoint> > _endpoints;
+    const unsigned int _ejectFailures;
+    std::atomic<size_t> _next; //first endpoint looked at, for the ties
+
+    CheckFunction _check;
+    std::chrono::milliseconds _checkInterval;
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    bool _stop = false;
+    std::thread _thread;
+
+    void Eject(size_t endpoint, const char* reason);
+    void Loop();
+
+public:
+    EndpointBalancer(OrthancPluginContext* c,
+                     const std::vector<std::string>& names,
+                     unsigned int ejectFailures);
+    ~EndpointBalancer();
+
+    //health checks of every endpoint, each interval
+    void Start(CheckFunction check, std::chrono::milliseconds interval);
+    void Stop();
+
+    size_t GetSize() const { return _endpoints.size(); };
+
+    //the endpoint of a request, outstanding until Release
+    size_t Acquire() { return Acquire(_endpoints.size()); };
+    //the same, but not busy when there is another one (e.g. for a hedged request)
+    size_t Acquire(size_t busy);
+    //latency: us from Acquire to the end of the request
+    void Release(size_t endpoint, uint64_t latency);
+
+    //every answer or failure of an endpoint, retries included
+    void RecordAnswer(size_t endpoint);
+    void RecordFailure(size_t endpoint);
+
+    const std::string& GetName(size_t endpoint) const { return _endpoints[endpoint]->name; };
+    bool IsEjected(size_t endpoint) const { return _endpoints[endpoint]->ejected; };
+    int64_t GetOutstanding(size_t endpoint) const { return _endpoints[endpoint]->outstanding; };
+    uint64_t GetLatency(size_t endpoint) const { return _endpoints[endpoint]->latency; };
+    uint64_t GetRequests(size_t endpoint) const { return _endpoints[endpoint]->requests; };
+    uint64_t GetEjections(size_t endpoint) const { return _endpoints[endpoint]->ejections; };
+    size_t GetEjectedCount() const;
+};
+
+}
+#endif // ENDPOINTBALANCER_HPP
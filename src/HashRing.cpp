@@ -0,0 +1,85 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "HashRing.hpp"
+
+#include <algorithm>
+
+namespace OrthancPlugins {
+
+const unsigned int HashRing::VNODES;
+
+HashRing::HashRing(const std::vector<std::string>& names):
+    _size(names.size())
+{
+    _points.reserve(names.size() * VNODES);
+    for (size_t i = 0; i < names.size(); ++i) {
+        for (unsigned int v = 0; v < VNODES; ++v) {
+            _points.push_back(std::make_pair(Hash(names[i] + "#" + std::to_string(v)), i));
+        }
+    }
+    std::sort(_points.begin(), _points.end());
+}
+
+uint64_t HashRing::Hash(const std::string& s) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    //FNV-1a alone clusters keys differing in their last chars
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+size_t HashRing::GetOwner(const std::string& key) const {
+    if (_points.empty()) {
+        return 0;
+    }
+    auto it = std::lower_bound(_points.begin(), _points.end(), std::make_pair(Hash(key), size_t(0)));
+    if (it == _points.end()) {
+        it = _points.begin();
+    }
+    return it->second;
+}
+
+std::vector<size_t> HashRing::GetOwners(const std::string& key, size_t count) const {
+    std::vector<size_t> owners;
+    count = std::min(count, _size);
+    if (count == 0) {
+        return owners;
+    }
+
+    size_t i = std::lower_bound(_points.begin(), _points.end(), std::make_pair(Hash(key), size_t(0))) - _points.begin();
+    for (size_t n = 0; n < _points.size() && owners.size() < count; ++n, ++i) {
+        const size_t target = _points[i % _points.size()].second;
+        if (std::find(owners.begin(), owners.end(), target) == owners.end()) {
+            owners.push_back(target);
+        }
+    }
+    return owners;
+}
+
+}
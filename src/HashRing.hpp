@@ -0,0 +1,66 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef HASHRING_HPP
+#define HASHRING_HPP
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * Consistent hashing of object keys onto the S3 targets.
+ *
+ * Every target is placed at VNODES points of a 64-bit ring, derived from its
+ * name only, and a key belongs to the first point at or after its hash.
+ * Adding a target takes over the keys right before its points, about 1/n of
+ * them, and no other key changes hands. The order of the targets in the
+ * configuration doesn't matter.
+ */
+class HashRing
+{
+    std::vector<std::pair<uint64_t, size_t> > _points; //sorted, target index
+    size_t _size;
+
+public:
+    static const unsigned int VNODES = 160;
+
+    //names must be unique, the index of a name is its target
+    explicit HashRing(const std::vector<std::string>& names = std::vector<std::string>());
+
+    size_t GetSize() const { return _size; };
+
+    //0 for an empty ring
+    size_t GetOwner(const std::string& key) const;
+
+    //the owner, then the next distinct targets clockwise; the second one
+    //owned the key before the owner was added
+    std::vector<size_t> GetOwners(const std::string& key, size_t count) const;
+
+    //FNV-1a with a final mix, stable across builds and platforms
+    static uint64_t Hash(const std::string& s);
+};
+
+}
+#endif // HASHRING_HPP
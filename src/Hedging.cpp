@@ -0,0 +1,103 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Hedging.hpp"
+
+#include <algorithm>
+
+namespace OrthancPlugins {
+
+const uint64_t HedgePolicy::MIN_SAMPLES;
+const int64_t HedgePolicy::MAX_HEDGES;
+const int64_t HedgePolicy::TOKEN;
+const int64_t HedgePolicy::REFRESH_MS;
+
+HedgePolicy::HedgePolicy(double percentile, double budgetPercent, uint64_t minDelayMicros):
+    _percentile(std::min(std::max(percentile, 0.0), 100.0)),
+    _minDelay(minDelayMicros),
+    _earned(static_cast<int64_t>(std::max(budgetPercent, 0.0) * TOKEN / 100)),
+    _tokens(0),
+    _delay(0),
+    _nextRefresh(0),
+    _requests(0),
+    _hedges(0),
+    _wins(0),
+    _running(0) {
+}
+
+void HedgePolicy::Refresh(Clock::time_point now) {
+    HistogramSnapshot snapshot = _firstByte.GetSnapshot(HistogramWindow::ONE_MINUTE, now);
+    if (snapshot.GetCount() < MIN_SAMPLES) {
+        snapshot = _firstByte.GetSnapshot(HistogramWindow::ALL, now);
+    }
+    if (snapshot.GetCount() < MIN_SAMPLES) {
+        _delay = 0;
+    } else {
+        _delay = std::max(snapshot.GetPercentile(_percentile), std::max<uint64_t>(_minDelay, 1));
+    }
+}
+
+uint64_t HedgePolicy::OnRequest(Clock::time_point now) {
+    _requests++;
+
+    int64_t tokens = _tokens.load(std::memory_order_relaxed);
+    while (tokens < MAX_HEDGES * TOKEN &&
+           !_tokens.compare_exchange_weak(tokens, std::min(tokens + _earned, MAX_HEDGES * TOKEN))) {
+    }
+
+    //one caller per second refreshes the delay
+    const int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+    int64_t next = _nextRefresh.load(std::memory_order_relaxed);
+    if (nowMs >= next && _nextRefresh.compare_exchange_strong(next, nowMs + REFRESH_MS)) {
+        Refresh(now);
+    }
+    return _delay;
+}
+
+bool HedgePolicy::TryHedge() {
+    int64_t tokens = _tokens.load(std::memory_order_relaxed);
+    while (tokens >= TOKEN) {
+        if (_tokens.compare_exchange_weak(tokens, tokens - TOKEN)) {
+            _hedges++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void HedgePolicy::BeginRequest() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _running++;
+}
+
+void HedgePolicy::EndRequest() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (--_running == 0) {
+        _idle.notify_all();
+    }
+}
+
+void HedgePolicy::WaitIdle() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _idle.wait(lock, [this]() { return _running == 0; });
+}
+
+}
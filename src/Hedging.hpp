@@ -0,0 +1,102 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef HEDGING_HPP
+#define HEDGING_HPP
+
+#include "LatencyHistogram.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace OrthancPlugins {
+
+/*
+ * When to hedge a GET, i.e. send it a second time while the first one is
+ * still waiting for its first byte.
+ * The delay is the given percentile of the first byte latencies of the last
+ * minute (all of them while the minute has too few), refreshed every second,
+ * and never below the minimum delay. No hedging before MIN_SAMPLES.
+ * The extra GETs are capped by a token bucket: every GET earns the budget
+ * percentage of a hedge, up to a burst of MAX_HEDGES hedges.
+ */
+class HedgePolicy
+{
+public:
+    typedef LatencyHistogram::Clock Clock;
+
+    static const uint64_t MIN_SAMPLES = 100;
+    static const int64_t MAX_HEDGES = 10;
+
+private:
+    static const int64_t TOKEN = 1000; //one hedge
+    static const int64_t REFRESH_MS = 1000;
+
+    LatencyHistogram _firstByte;
+    const double _percentile;
+    const uint64_t _minDelay; //us
+    const int64_t _earned; //tokens per GET
+
+    std::atomic<int64_t> _tokens;
+    std::atomic<uint64_t> _delay; //us, 0: not hedging yet
+    std::atomic<int64_t> _nextRefresh; //ms on Clock
+
+    std::atomic<uint64_t> _requests;
+    std::atomic<uint64_t> _hedges;
+    std::atomic<uint64_t> _wins;
+
+    //requests still running, the losers finish after their GET returned
+    std::mutex _mutex;
+    std::condition_variable _idle;
+    uint64_t _running;
+
+    void Refresh(Clock::time_point now);
+
+public:
+    //percentile in ]0, 100], budgetPercent of extra GETs
+    HedgePolicy(double percentile, double budgetPercent, uint64_t minDelayMicros);
+
+    void RecordFirstByte(uint64_t micros) { _firstByte.Record(micros); };
+
+    //a new GET: hedge it if it has no first byte after the returned delay, 0: don't
+    uint64_t OnRequest() { return OnRequest(Clock::now()); };
+    uint64_t OnRequest(Clock::time_point now);
+
+    //takes a hedge from the budget
+    bool TryHedge();
+    //the hedge answered before the first request
+    void RecordWin() { _wins++; };
+
+    void BeginRequest();
+    void EndRequest();
+    //until every request started has ended
+    void WaitIdle();
+
+    uint64_t GetRequests() const { return _requests; };
+    uint64_t GetHedges() const { return _hedges; };
+    uint64_t GetWins() const { return _wins; };
+    uint64_t GetDelay() const { return _delay; };
+};
+
+}
+#endif // HEDGING_HPP
@@ -0,0 +1,76 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "HttpClientFactory.hpp"
+
+#include <aws/core/http/curl/CurlHttpClient.h>
+#include <aws/core/http/standard/StandardHttpRequest.h>
+
+#include <curl/curl.h>
+
+#define ALLOCATION_TAG "Orthanc_S3_Storage"
+
+namespace {
+    class TunedCurlHttpClient : public Aws::Http::CurlHttpClient
+    {
+        bool _tcp_nodelay;
+
+    public:
+        TunedCurlHttpClient(const Aws::Client::ClientConfiguration& clientConfiguration, bool tcp_nodelay):
+            Aws::Http::CurlHttpClient(clientConfiguration),
+            _tcp_nodelay(tcp_nodelay) {};
+
+    protected:
+        void OverrideOptionsOnConnectionHandle(CURL* handle) const override {
+            curl_easy_setopt(handle, CURLOPT_TCP_NODELAY, _tcp_nodelay ? 1L : 0L);
+        };
+    };
+}
+
+namespace OrthancPlugins {
+
+std::shared_ptr<Aws::Http::HttpClient> TunedHttpClientFactory::CreateHttpClient(const Aws::Client::ClientConfiguration &clientConfiguration) const {
+    return Aws::MakeShared<TunedCurlHttpClient>(ALLOCATION_TAG, clientConfiguration, _tcp_nodelay);
+}
+
+std::shared_ptr<Aws::Http::HttpRequest> TunedHttpClientFactory::CreateHttpRequest(const Aws::String &uri,
+                                                                                  Aws::Http::HttpMethod method,
+                                                                                  const Aws::IOStreamFactory &streamFactory) const {
+    return CreateHttpRequest(Aws::Http::URI(uri), method, streamFactory);
+}
+
+std::shared_ptr<Aws::Http::HttpRequest> TunedHttpClientFactory::CreateHttpRequest(const Aws::Http::URI &uri,
+                                                                                  Aws::Http::HttpMethod method,
+                                                                                  const Aws::IOStreamFactory &streamFactory) const {
+    auto request = Aws::MakeShared<Aws::Http::Standard::StandardHttpRequest>(ALLOCATION_TAG, uri, method);
+    request->SetResponseStreamFactory(streamFactory);
+    return request;
+}
+
+void TunedHttpClientFactory::InitStaticState() {
+    Aws::Http::CurlHttpClient::InitGlobalState();
+}
+
+void TunedHttpClientFactory::CleanupStaticState() {
+    Aws::Http::CurlHttpClient::CleanupGlobalState();
+}
+
+}
@@ -0,0 +1,53 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef HTTPCLIENTFACTORY_HPP
+#define HTTPCLIENTFACTORY_HPP
+
+#include <aws/core/http/HttpClientFactory.h>
+
+namespace OrthancPlugins {
+
+/*
+ * Curl based HTTP client factory, for the socket options
+ * ClientConfiguration does not expose (TCP_NODELAY).
+ */
+class TunedHttpClientFactory : public Aws::Http::HttpClientFactory
+{
+    bool _tcp_nodelay;
+
+public:
+    explicit TunedHttpClientFactory(bool tcp_nodelay): _tcp_nodelay(tcp_nodelay) {};
+
+    std::shared_ptr<Aws::Http::HttpClient> CreateHttpClient(const Aws::Client::ClientConfiguration& clientConfiguration) const override;
+    std::shared_ptr<Aws::Http::HttpRequest> CreateHttpRequest(const Aws::String& uri,
+                                                              Aws::Http::HttpMethod method,
+                                                              const Aws::IOStreamFactory& streamFactory) const override;
+    std::shared_ptr<Aws::Http::HttpRequest> CreateHttpRequest(const Aws::Http::URI& uri,
+                                                              Aws::Http::HttpMethod method,
+                                                              const Aws::IOStreamFactory& streamFactory) const override;
+
+    void InitStaticState() override;
+    void CleanupStaticState() override;
+};
+
+}
+#endif // HTTPCLIENTFACTORY_HPP
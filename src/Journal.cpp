@@ -0,0 +1,570 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Journal.hpp"
+#include "Utils.hpp"
+#include "Core/OrthancException.h"
+
+#include <boost/crc.hpp>
+#include <boost/filesystem.hpp>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#if defined(__APPLE__)
+#define fdatasync fsync
+#endif
+
+namespace {
+    const uint32_t RECORD_MAGIC = 0x4a523353; // "S3RJ"
+    const uint8_t RECORD_PUT = 1;
+    const uint8_t RECORD_REMOVE = 2;
+    const size_t HEADER_SIZE = 32;
+    const std::chrono::seconds RETRY_DELAY(1);
+
+    /*
+     * Record layout, host byte order:
+     *  0 uint32 magic     4 uint8 kind    8 int32 content type
+     * 12 uint32 uuid size 16 uint64 payload size
+     * 24 uint32 crc32 of uuid and payload
+     */
+    struct RecordHeader {
+        uint8_t kind;
+        int32_t type;
+        uint32_t uuidSize;
+        uint64_t payloadSize;
+        uint32_t crc;
+    };
+
+    void encodeHeader(const RecordHeader& h, char* buf) {
+        memset(buf, 0, HEADER_SIZE);
+        memcpy(buf, &RECORD_MAGIC, 4);
+        memcpy(buf + 4, &h.kind, 1);
+        memcpy(buf + 8, &h.type, 4);
+        memcpy(buf + 12, &h.uuidSize, 4);
+        memcpy(buf + 16, &h.payloadSize, 8);
+        memcpy(buf + 24, &h.crc, 4);
+    }
+
+    bool decodeHeader(const char* buf, RecordHeader& h) {
+        uint32_t magic = 0;
+        memcpy(&magic, buf, 4);
+        if (magic != RECORD_MAGIC) {
+            return false;
+        }
+        memcpy(&h.kind, buf + 4, 1);
+        memcpy(&h.type, buf + 8, 4);
+        memcpy(&h.uuidSize, buf + 12, 4);
+        memcpy(&h.payloadSize, buf + 16, 8);
+        memcpy(&h.crc, buf + 24, 4);
+        return (h.kind == RECORD_PUT || h.kind == RECORD_REMOVE) && h.uuidSize > 0 && h.uuidSize < 256;
+    }
+
+    bool writeAll(int fd, struct iovec* iov, int count) {
+        while (count > 0) {
+            ssize_t n = ::writev(fd, iov, count);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            while (count > 0 && static_cast<size_t>(n) >= iov->iov_len) {
+                n -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count > 0) {
+                iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+                iov->iov_len -= n;
+            }
+        }
+        return true;
+    }
+
+    bool readAll(int fd, char* buf, size_t size, uint64_t offset) {
+        while (size > 0) {
+            ssize_t n = ::pread(fd, buf, size, static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            buf += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    void syncDirectory(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+}
+
+namespace OrthancPlugins {
+
+Journal::Journal(OrthancPluginContext *c,
+                 const std::string &directory,
+                 uint64_t segmentSize,
+                 UploadFunction upload,
+                 RemoveFunction remove):
+    _context(c),
+    _directory(directory),
+    _segmentSize(segmentSize),
+    _upload(upload),
+    _remove(remove)
+{
+}
+
+Journal::~Journal() {
+    Stop();
+}
+
+std::string Journal::GetSegmentPath(uint64_t segment) const {
+    char name[32];
+    snprintf(name, sizeof(name), "segment-%016llu.log", static_cast<unsigned long long>(segment));
+    return _directory + "/" + name;
+}
+
+bool Journal::OpenSegment(uint64_t segment) {
+    const std::string path = GetSegmentPath(segment);
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        std::stringstream err;
+        err << "[S3] Journal: could not create " << path << ", " << strerror(errno);
+        LogError(_context, err.str());
+        return false;
+    }
+    syncDirectory(_directory);
+
+    if (_fd >= 0) {
+        _retired.push_back(_fd);
+    }
+    _fd = fd;
+    _segment = segment;
+    _segmentOffset = 0;
+    _live[segment];
+
+    return true;
+}
+
+bool Journal::Start(size_t uploaders) {
+    namespace fs = boost::filesystem;
+
+    try {
+        Utils::makeDirectory(_directory);
+    } catch (Orthanc::OrthancException& e) {
+        std::stringstream err;
+        err << "[S3] Journal: could not create " << _directory << ", " << e.What();
+        LogError(_context, err.str());
+        return false;
+    }
+
+    std::vector<uint64_t> segments;
+    for (fs::directory_iterator it(_directory); it != fs::directory_iterator(); ++it) {
+        unsigned long long segment = 0;
+        if (sscanf(it->path().filename().string().c_str(), "segment-%llu.log", &segment) == 1) {
+            segments.push_back(segment);
+        }
+    }
+    std::sort(segments.begin(), segments.end());
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    for (uint64_t segment : segments) {
+        ReplaySegment(segment);
+    }
+
+    if (!OpenSegment(segments.empty() ? 1 : segments.back() + 1)) {
+        return false;
+    }
+    ReleaseSegments();
+
+    for (const auto& p : _pending) {
+        _queue.push_back(p.first);
+    }
+
+    if (!_pending.empty()) {
+        std::stringstream ss;
+        ss << "[S3] Journal: replayed " << _pending.size() << " attachments not yet uploaded";
+        LogWarning(_context, ss.str());
+    }
+
+    lock.unlock();
+
+    _committer = std::thread(&Journal::CommitterLoop, this);
+    for (size_t i = 0; i < std::max<size_t>(uploaders, 1); ++i) {
+        _uploaders.push_back(std::thread(&Journal::UploaderLoop, this));
+    }
+
+    return true;
+}
+
+void Journal::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_stop) {
+            return;
+        }
+        _stop = true;
+    }
+    _written_cv.notify_all();
+    _queue_cv.notify_all();
+    _synced_cv.notify_all();
+
+    if (_committer.joinable()) {
+        _committer.join();
+    }
+    for (auto& t : _uploaders) {
+        t.join();
+    }
+    _uploaders.clear();
+
+    //anything not uploaded yet stays on disk and is replayed on the next start
+    for (int fd : _retired) {
+        ::fdatasync(fd);
+        ::close(fd);
+    }
+    _retired.clear();
+    if (_fd >= 0) {
+        ::fdatasync(_fd);
+        ::close(_fd);
+        _fd = -1;
+    }
+}
+
+void Journal::ReplaySegment(uint64_t segment) {
+    const std::string path = GetSegmentPath(segment);
+    std::ifstream f(path.c_str(), std::ios::in | std::ios::binary);
+    _live[segment];
+
+    uint64_t offset = 0;
+    std::vector<char> chunk(1024 * 1024);
+
+    while (f.good()) {
+        char buf[HEADER_SIZE];
+        RecordHeader h;
+        if (!f.read(buf, HEADER_SIZE) || !decodeHeader(buf, h)) {
+            break;
+        }
+
+        std::string uuid(h.uuidSize, '\0');
+        if (!f.read(&uuid[0], h.uuidSize)) {
+            break;
+        }
+
+        //verify the payload, a torn tail after a crash is expected
+        boost::crc_32_type crc;
+        crc.process_bytes(uuid.data(), uuid.size());
+        uint64_t left = h.payloadSize;
+        while (left > 0 && f.good()) {
+            const size_t n = static_cast<size_t>(std::min<uint64_t>(left, chunk.size()));
+            if (f.read(chunk.data(), n)) {
+                crc.process_bytes(chunk.data(), n);
+                left -= n;
+            }
+        }
+        if (left > 0 || crc.checksum() != h.crc) {
+            std::stringstream ss;
+            ss << "[S3] Journal: ignoring torn record in " << path << " at " << offset;
+            LogWarning(_context, ss.str());
+            break;
+        }
+
+        const uint64_t payloadOffset = offset + HEADER_SIZE + h.uuidSize;
+        if (h.kind == RECORD_PUT) {
+            _pending[uuid] = Location{segment, payloadOffset, static_cast<int64_t>(h.payloadSize),
+                                      static_cast<OrthancPluginContentType>(h.type), false, false};
+            _live[segment]++;
+        } else {
+            auto it = _pending.find(uuid);
+            if (it != _pending.end()) {
+                _live[it->second.segment]--;
+                _pending.erase(it);
+            }
+        }
+
+        offset = payloadOffset + h.payloadSize;
+    }
+}
+
+bool Journal::AppendRecord(uint8_t kind,
+                           const std::string &uuid,
+                           const void *content,
+                           int64_t size,
+                           OrthancPluginContentType type,
+                           std::unique_lock<std::mutex>& lock) {
+    //checksum before taking the lock
+    lock.unlock();
+    boost::crc_32_type crc;
+    crc.process_bytes(uuid.data(), uuid.size());
+    if (size > 0) {
+        crc.process_bytes(content, static_cast<size_t>(size));
+    }
+
+    RecordHeader h;
+    h.kind = kind;
+    h.type = static_cast<int32_t>(type);
+    h.uuidSize = static_cast<uint32_t>(uuid.size());
+    h.payloadSize = static_cast<uint64_t>(size);
+    h.crc = crc.checksum();
+
+    char header[HEADER_SIZE];
+    encodeHeader(h, header);
+    lock.lock();
+
+    if (_stop || _syncFailed) {
+        return false;
+    }
+
+    const uint64_t total = HEADER_SIZE + uuid.size() + h.payloadSize;
+    if (_segmentOffset > 0 && _segmentOffset + total > _segmentSize) {
+        if (!OpenSegment(_segment + 1)) {
+            return false;
+        }
+    }
+
+    struct iovec iov[3];
+    iov[0].iov_base = header;
+    iov[0].iov_len = HEADER_SIZE;
+    iov[1].iov_base = const_cast<char*>(uuid.data());
+    iov[1].iov_len = uuid.size();
+    iov[2].iov_base = const_cast<void*>(content);
+    iov[2].iov_len = static_cast<size_t>(size);
+
+    if (!writeAll(_fd, iov, size > 0 ? 3 : 2)) {
+        std::stringstream err;
+        err << "[S3] Journal: write failed, " << strerror(errno);
+        LogError(_context, err.str());
+        //don't append after a partial record, start a fresh segment
+        OpenSegment(_segment + 1);
+        return false;
+    }
+
+    if (kind == RECORD_PUT) {
+        _pending[uuid] = Location{_segment, _segmentOffset + HEADER_SIZE + uuid.size(), size, type, false, false};
+        _live[_segment]++;
+    }
+    _segmentOffset += total;
+
+    //group commit: wait for the committer to fsync this and everything before
+    const uint64_t seq = ++_written;
+    _written_cv.notify_one();
+    _synced_cv.wait(lock, [&]{ return _synced >= seq || _syncFailed || _stop; });
+
+    return _synced >= seq;
+}
+
+bool Journal::Append(const std::string &uuid, const void *content, int64_t size, OrthancPluginContentType type) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!AppendRecord(RECORD_PUT, uuid, content, size, type, lock)) {
+        auto it = _pending.find(uuid);
+        if (it != _pending.end() && !it->second.uploading) {
+            //the caller falls back to a synchronous upload
+            _live[it->second.segment]--;
+            _pending.erase(it);
+        }
+        return false;
+    }
+
+    _queue.push_back(uuid);
+    _queue_cv.notify_one();
+    return true;
+}
+
+bool Journal::Read(const std::string &uuid, void **content, int64_t *size) {
+    Location loc;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _pending.find(uuid);
+        if (it == _pending.end()) {
+            return false;
+        }
+        loc = it->second;
+    }
+
+    //the segment may be released meanwhile, the caller then goes to S3
+    int fd = ::open(GetSegmentPath(loc.segment).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    //malloc because it's freed by ::free()
+    *content = malloc(loc.size > 0 ? static_cast<size_t>(loc.size) : 1);
+    bool ok = *content != nullptr && readAll(fd, static_cast<char*>(*content), static_cast<size_t>(loc.size), loc.offset);
+    ::close(fd);
+
+    if (!ok) {
+        free(*content);
+        *content = nullptr;
+        return false;
+    }
+
+    *size = loc.size;
+    return true;
+}
+
+bool Journal::Remove(const std::string &uuid) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto it = _pending.find(uuid);
+    if (it == _pending.end()) {
+        return false;
+    }
+
+    if (it->second.uploading) {
+        //the uploader deletes it from S3 once the upload is over
+        it->second.removed = true;
+    } else {
+        _live[it->second.segment]--;
+        _pending.erase(it);
+        ReleaseSegments();
+    }
+
+    //so that a replay does not resurrect it
+    AppendRecord(RECORD_REMOVE, uuid, nullptr, 0, OrthancPluginContentType_Unknown, lock);
+
+    //a delete of our own now would race the PUT
+    return true;
+}
+
+size_t Journal::GetPendingCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _pending.size();
+}
+
+uint64_t Journal::GetCommitCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _commits;
+}
+
+void Journal::ReleaseSegments() {
+    //oldest first only, so a remove record never outlives the segment it cancels
+    while (!_live.empty() && _live.begin()->first != _segment && _live.begin()->second == 0) {
+        std::remove(GetSegmentPath(_live.begin()->first).c_str());
+        _live.erase(_live.begin());
+    }
+}
+
+void Journal::CommitterLoop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (!_stop) {
+        _written_cv.wait(lock, [&]{ return _written > _synced || _stop; });
+        if (_stop) {
+            break;
+        }
+
+        //everything written so far goes into this fsync
+        const uint64_t target = _written;
+        const int fd = _fd;
+        std::vector<int> retired;
+        retired.swap(_retired);
+        lock.unlock();
+
+        bool ok = true;
+        for (int r : retired) {
+            ok = (::fdatasync(r) == 0) && ok;
+            ::close(r);
+        }
+        ok = (::fdatasync(fd) == 0) && ok;
+
+        lock.lock();
+        if (ok) {
+            _synced = target;
+            _commits++;
+        } else {
+            std::stringstream err;
+            err << "[S3] Journal: fsync failed, " << strerror(errno) << ", write-back disabled";
+            LogError(_context, err.str());
+            _syncFailed = true;
+        }
+        _synced_cv.notify_all();
+    }
+}
+
+void Journal::UploaderLoop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    while (true) {
+        _queue_cv.wait(lock, [&]{ return !_queue.empty() || _stop; });
+        if (_stop) {
+            return;
+        }
+
+        const std::string uuid = _queue.front();
+        _queue.pop_front();
+
+        auto it = _pending.find(uuid);
+        if (it == _pending.end() || it->second.uploading) {
+            continue;
+        }
+        it->second.uploading = true;
+        const Location loc = it->second;
+        lock.unlock();
+
+        void* content = nullptr;
+        int64_t size = 0;
+        bool ok = Read(uuid, &content, &size) && _upload(uuid, content, size, loc.type);
+        free(content);
+
+        lock.lock();
+        it = _pending.find(uuid);
+        if (it == _pending.end()) {
+            continue;
+        }
+
+        if (!ok && !it->second.removed) {
+            it->second.uploading = false;
+            _queue.push_back(uuid);
+            _queue_cv.wait_for(lock, RETRY_DELAY, [&]{ return _stop; });
+            continue;
+        }
+
+        if (ok && it->second.removed) {
+            lock.unlock();
+            _remove(uuid, loc.type);
+            lock.lock();
+            it = _pending.find(uuid);
+        }
+
+        if (it != _pending.end()) {
+            _live[it->second.segment]--;
+            _pending.erase(it);
+            ReleaseSegments();
+        }
+    }
+}
+
+}
@@ -0,0 +1,130 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef JOURNAL_HPP
+#define JOURNAL_HPP
+
+#include "OrthancPluginCppWrapper.h"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * Write-back journal for StorageCreate.
+ *
+ * Attachments are appended to segment files under IndexDirectory and
+ * acknowledged once they are on disk; a pool of uploaders drains them
+ * to S3 in the background. Concurrent appends share a single fsync
+ * (group commit). Segments are deleted oldest first once everything
+ * in them has been uploaded, and whatever is left on disk is replayed
+ * on the next start.
+ */
+class Journal
+{
+public:
+    typedef std::function<bool(const std::string& uuid, const void* content, int64_t size, OrthancPluginContentType type)> UploadFunction;
+    typedef std::function<bool(const std::string& uuid, OrthancPluginContentType type)> RemoveFunction;
+
+private:
+    struct Location {
+        uint64_t segment;
+        uint64_t offset; //of the payload
+        int64_t size;
+        OrthancPluginContentType type;
+        bool uploading;
+        bool removed;    //while uploading
+    };
+
+    OrthancPluginContext* _context;
+    std::string _directory;
+    uint64_t _segmentSize;
+    UploadFunction _upload;
+    RemoveFunction _remove;
+
+    std::mutex _mutex;
+    std::condition_variable _synced_cv;
+    std::condition_variable _written_cv;
+    std::condition_variable _queue_cv;
+
+    //active segment
+    int _fd = -1;
+    uint64_t _segment = 0;
+    uint64_t _segmentOffset = 0;
+    std::vector<int> _retired; //rotated, waiting for the last fsync
+
+    //group commit
+    uint64_t _written = 0;
+    uint64_t _synced = 0;
+    uint64_t _commits = 0; //fsyncs, each one for any number of records
+    bool _syncFailed = false;
+
+    std::unordered_map<std::string, Location> _pending;
+    std::map<uint64_t, size_t> _live; //segment -> pending entries
+    std::deque<std::string> _queue;
+
+    bool _stop = false;
+    std::thread _committer;
+    std::vector<std::thread> _uploaders;
+
+    std::string GetSegmentPath(uint64_t segment) const;
+    bool OpenSegment(uint64_t segment);
+    bool AppendRecord(uint8_t kind, const std::string& uuid, const void* content, int64_t size,
+                      OrthancPluginContentType type, std::unique_lock<std::mutex>& lock);
+    void ReplaySegment(uint64_t segment);
+    void ReleaseSegments();
+
+    void CommitterLoop();
+    void UploaderLoop();
+
+public:
+    Journal(OrthancPluginContext* c,
+            const std::string& directory,
+            uint64_t segmentSize,
+            UploadFunction upload,
+            RemoveFunction remove);
+    ~Journal();
+
+    //replays leftovers of a previous run and starts the background threads
+    bool Start(size_t uploaders);
+    void Stop();
+
+    //returns once the content is durable on local disk
+    bool Append(const std::string& uuid, const void* content, int64_t size, OrthancPluginContentType type);
+    bool Read(const std::string& uuid, void** content, int64_t* size);
+    //returns true if the journal owns the uuid: it never left it, or it
+    //is being uploaded and gets deleted from S3 once the upload is over
+    bool Remove(const std::string& uuid);
+
+    size_t GetPendingCount();
+    uint64_t GetCommitCount();
+};
+
+}
+#endif // JOURNAL_HPP
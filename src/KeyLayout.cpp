@@ -0,0 +1,148 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "KeyLayout.hpp"
+
+#include <algorithm>
+#include <ctime>
+
+namespace {
+    //FNV-1a, stable across builds and platforms unlike std::hash
+    uint64_t hashUuid(const std::string& uuid) {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : uuid) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    std::string toHex(uint64_t v, unsigned int length) {
+        static const char digits[] = "0123456789abcdef";
+        std::string s(16, '0');
+        for (int i = 15; i >= 0; --i) {
+            s[i] = digits[v & 0xf];
+            v >>= 4;
+        }
+        return s.substr(0, length);
+    }
+
+    const char* contentTypePrefix(OrthancPluginContentType type) {
+        switch (type) {
+        case OrthancPluginContentType_Dicom: return "dicom";
+        case OrthancPluginContentType_DicomAsJson: return "json";
+        default: return "unknown";
+        }
+    }
+}
+
+namespace OrthancPlugins {
+
+bool FlatLayout::CreateKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    key = uuid;
+    return true;
+}
+
+bool FlatLayout::GetKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    return CreateKey(uuid, type, key);
+}
+
+HashPrefixLayout::HashPrefixLayout(unsigned int prefixLength):
+    _prefixLength(std::min(std::max(prefixLength, 1u), 16u))
+{
+}
+
+bool HashPrefixLayout::CreateKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    key = toHex(hashUuid(uuid), _prefixLength) + "/" + uuid;
+    return true;
+}
+
+bool HashPrefixLayout::GetKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    return CreateKey(uuid, type, key);
+}
+
+bool ContentTypeLayout::CreateKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    key = std::string(contentTypePrefix(type)) + "/" + uuid;
+    return true;
+}
+
+bool ContentTypeLayout::GetKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    return CreateKey(uuid, type, key);
+}
+
+DateLayout::DateLayout(const std::string &indexPath):
+    _index(indexPath, true)
+{
+}
+
+bool DateLayout::Load() {
+    return _index.Load();
+}
+
+bool DateLayout::CreateKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    const time_t now = time(nullptr);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+
+    char date[16];
+    strftime(date, sizeof(date), "%Y/%m/%d", &utc);
+
+    //recorded before the upload, a stale entry is overwritten on retry
+    if (!_index.Set(uuid, date)) {
+        return false;
+    }
+    key = std::string(date) + "/" + uuid;
+    return true;
+}
+
+bool DateLayout::GetKey(const std::string &uuid, OrthancPluginContentType type, std::string &key) {
+    std::string date;
+    if (!_index.Get(uuid, date)) {
+        return false;
+    }
+    key = date + "/" + uuid;
+    return true;
+}
+
+void DateLayout::Forget(const std::string &uuid) {
+    _index.Remove(uuid);
+}
+
+std::unique_ptr<KeyLayout> createKeyLayout(const std::string &name,
+                                           unsigned int prefixLength,
+                                           const std::string &indexPath) {
+    if (name == "flat") {
+        return std::unique_ptr<KeyLayout>(new FlatLayout());
+    } else if (name == "hash_prefix") {
+        return std::unique_ptr<KeyLayout>(new HashPrefixLayout(prefixLength));
+    } else if (name == "content_type") {
+        return std::unique_ptr<KeyLayout>(new ContentTypeLayout());
+    } else if (name == "date") {
+        std::unique_ptr<DateLayout> layout(new DateLayout(indexPath));
+        if (!layout->Load()) {
+            return nullptr;
+        }
+        return std::unique_ptr<KeyLayout>(layout.release());
+    }
+    return nullptr;
+}
+
+}
@@ -0,0 +1,102 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef KEYLAYOUT_HPP
+#define KEYLAYOUT_HPP
+
+#include "PersistentMap.hpp"
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <memory>
+#include <string>
+
+namespace OrthancPlugins {
+
+/*
+ * Maps attachment uuids to S3 object keys.
+ * S3 partitions a bucket by key prefix, spreading keys over many
+ * prefixes raises the request rate a bucket sustains before SlowDown.
+ */
+class KeyLayout
+{
+public:
+    virtual ~KeyLayout() {};
+
+    //key of a new object
+    virtual bool CreateKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) = 0;
+    //key of a stored object, false if the layout can't tell
+    virtual bool GetKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) = 0;
+    //the object was removed
+    virtual void Forget(const std::string& uuid) {};
+};
+
+//uuid
+class FlatLayout : public KeyLayout
+{
+public:
+    bool CreateKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+    bool GetKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+};
+
+//"3fa1/uuid", the first prefixLength hex chars of a hash of the uuid
+class HashPrefixLayout : public KeyLayout
+{
+    unsigned int _prefixLength;
+
+public:
+    explicit HashPrefixLayout(unsigned int prefixLength);
+
+    bool CreateKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+    bool GetKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+};
+
+//"dicom/uuid", "json/uuid", "unknown/uuid"
+class ContentTypeLayout : public KeyLayout
+{
+public:
+    bool CreateKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+    bool GetKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+};
+
+//"2018/11/23/uuid", UTC date of the upload. Reads only get the uuid,
+//so the date of every object is kept in a local index.
+class DateLayout : public KeyLayout
+{
+    PersistentMap _index;
+
+public:
+    explicit DateLayout(const std::string& indexPath);
+
+    bool Load();
+
+    bool CreateKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+    bool GetKey(const std::string& uuid, OrthancPluginContentType type, std::string& key) override;
+    void Forget(const std::string& uuid) override;
+};
+
+//name: flat, hash_prefix, content_type or date; nullptr if unknown
+std::unique_ptr<KeyLayout> createKeyLayout(const std::string& name,
+                                           unsigned int prefixLength,
+                                           const std::string& indexPath);
+
+}
+#endif // KEYLAYOUT_HPP
@@ -0,0 +1,237 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "LatencyHistogram.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    //threads are spread over the shards in the order they first record
+    std::atomic<size_t> nextShard(0);
+
+    size_t threadShard() {
+        static thread_local size_t shard = nextShard++ % OrthancPlugins::LatencyHistogram::SHARDS;
+        return shard;
+    }
+
+    int highestBit(uint64_t value) {
+        return 63 - __builtin_clzll(value);
+    }
+}
+
+namespace OrthancPlugins {
+
+const unsigned int LatencyHistogram::SUB_BITS;
+const size_t LatencyHistogram::BINS;
+const uint64_t LatencyHistogram::MAX_VALUE;
+const size_t LatencyHistogram::SHARDS;
+const int64_t LatencyHistogram::TICK_MS;
+const size_t LatencyHistogram::TICKS;
+
+static const uint64_t SUB_COUNT = 1ULL << LatencyHistogram::SUB_BITS;
+static const uint64_t HALF_COUNT = SUB_COUNT / 2;
+
+static_assert(LatencyHistogram::BINS == SUB_COUNT + (35 - (LatencyHistogram::SUB_BITS - 1)) * HALF_COUNT,
+              "BINS must cover MAX_VALUE");
+
+size_t LatencyHistogram::BinIndex(uint64_t value) {
+    value = std::min(value, MAX_VALUE);
+    if (value < SUB_COUNT) {
+        return static_cast<size_t>(value);
+    }
+    const int shift = highestBit(value) - static_cast<int>(SUB_BITS - 1);
+    return static_cast<size_t>(SUB_COUNT + (shift - 1) * HALF_COUNT + (value >> shift) - HALF_COUNT);
+}
+
+uint64_t LatencyHistogram::BinLowest(size_t index) {
+    if (index < SUB_COUNT) {
+        return index;
+    }
+    const uint64_t k = index - SUB_COUNT;
+    const uint64_t shift = k / HALF_COUNT + 1;
+    return (k % HALF_COUNT + HALF_COUNT) << shift;
+}
+
+uint64_t LatencyHistogram::BinHighest(size_t index) {
+    return index + 1 < BINS ? BinLowest(index + 1) - 1 : MAX_VALUE;
+}
+
+HistogramSnapshot::HistogramSnapshot():
+    _counts(LatencyHistogram::BINS, 0),
+    _count(0),
+    _sum(0),
+    _max(0)
+{
+}
+
+uint64_t HistogramSnapshot::GetPercentile(double p) const {
+    if (_count == 0) {
+        return 0;
+    }
+    const double rank = std::ceil(std::max(0.0, std::min(p, 100.0)) / 100.0 * _count);
+    const uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(rank));
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < _counts.size(); ++i) {
+        seen += _counts[i];
+        if (seen >= target) {
+            return std::min(LatencyHistogram::BinHighest(i), _max);
+        }
+    }
+    return _max;
+}
+
+uint64_t HistogramSnapshot::CountAtOrBelow(uint64_t value) const {
+    const size_t last = LatencyHistogram::BinIndex(value);
+    uint64_t count = 0;
+    for (size_t i = 0; i <= last; ++i) {
+        count += _counts[i];
+    }
+    return count;
+}
+
+LatencyHistogram::Shard::Shard():
+    sum(0),
+    max(0)
+{
+    for (auto& c : counts) {
+        c.store(0, std::memory_order_relaxed);
+    }
+}
+
+LatencyHistogram::LatencyHistogram():
+    _nextTick(ToMs(Clock::now()) + TICK_MS),
+    _lastCounts(BINS, 0),
+    _lastSum(0)
+{
+}
+
+int64_t LatencyHistogram::ToMs(Clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(t.time_since_epoch()).count();
+}
+
+void LatencyHistogram::Record(uint64_t micros, Clock::time_point now) {
+    const int64_t nowMs = ToMs(now);
+    if (nowMs >= _nextTick.load(std::memory_order_relaxed)) {
+        //whoever gets the lock rotates, the others don't wait for it
+        std::unique_lock<std::mutex> lock(_rotateMutex, std::try_to_lock);
+        if (lock.owns_lock()) {
+            Rotate(nowMs);
+        }
+    }
+
+    Shard& shard = _shards[threadShard()];
+    shard.counts[BinIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+    shard.sum.fetch_add(micros, std::memory_order_relaxed);
+
+    uint64_t max = shard.max.load(std::memory_order_relaxed);
+    while (micros > max && !shard.max.compare_exchange_weak(max, micros, std::memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::Merge(HistogramSnapshot &snapshot) {
+    for (const auto& shard : _shards) {
+        for (size_t i = 0; i < BINS; ++i) {
+            snapshot._counts[i] += shard.counts[i].load(std::memory_order_relaxed);
+        }
+        snapshot._sum += shard.sum.load(std::memory_order_relaxed);
+        snapshot._max = std::max(snapshot._max, shard.max.load(std::memory_order_relaxed));
+    }
+    snapshot._count = 0;
+    for (auto c : snapshot._counts) {
+        snapshot._count += c;
+    }
+}
+
+void LatencyHistogram::Rotate(int64_t nowMs) {
+    const int64_t next = _nextTick.load(std::memory_order_relaxed);
+    if (nowMs < next) {
+        return;
+    }
+
+    HistogramSnapshot current;
+    Merge(current);
+
+    Delta delta;
+    for (size_t i = 0; i < BINS; ++i) {
+        if (current._counts[i] != _lastCounts[i]) {
+            delta.push_back(std::make_pair(static_cast<uint32_t>(i), current._counts[i] - _lastCounts[i]));
+        }
+    }
+    _ticks.push_front(std::make_pair(std::move(delta), current._sum - _lastSum));
+
+    //idle ticks, nothing recorded since the first one
+    const int64_t elapsed = (nowMs - next) / TICK_MS + 1;
+    for (int64_t i = 1; i < elapsed && i <= static_cast<int64_t>(TICKS); ++i) {
+        _ticks.push_front(std::make_pair(Delta(), 0));
+    }
+    while (_ticks.size() > TICKS) {
+        _ticks.pop_back();
+    }
+
+    _lastCounts.swap(current._counts);
+    _lastSum = current._sum;
+    _nextTick.store(next + elapsed * TICK_MS, std::memory_order_relaxed);
+}
+
+HistogramSnapshot LatencyHistogram::GetSnapshot(HistogramWindow window, Clock::time_point now) {
+    HistogramSnapshot snapshot;
+    std::lock_guard<std::mutex> lock(_rotateMutex);
+    Rotate(ToMs(now));
+    Merge(snapshot);
+
+    if (window == HistogramWindow::ALL) {
+        return snapshot;
+    }
+
+    size_t ticks = 0;
+    switch (window) {
+    case HistogramWindow::ONE_MINUTE: ticks = 6; break;
+    case HistogramWindow::FIVE_MINUTES: ticks = 30; break;
+    default: ticks = TICKS; break;
+    }
+
+    //the current, partial tick plus the last complete ones
+    const uint64_t allTimeMax = snapshot._max;
+    for (size_t i = 0; i < BINS; ++i) {
+        snapshot._counts[i] -= _lastCounts[i];
+    }
+    snapshot._sum -= _lastSum;
+    for (size_t t = 0; t < ticks && t < _ticks.size(); ++t) {
+        for (const auto& bin : _ticks[t].first) {
+            snapshot._counts[bin.first] += bin.second;
+        }
+        snapshot._sum += _ticks[t].second;
+    }
+
+    snapshot._count = 0;
+    snapshot._max = 0;
+    for (size_t i = 0; i < BINS; ++i) {
+        snapshot._count += snapshot._counts[i];
+        if (snapshot._counts[i] > 0) {
+            snapshot._max = std::min(BinHighest(i), allTimeMax);
+        }
+    }
+    return snapshot;
+}
+
+}
@@ -0,0 +1,141 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef LATENCYHISTOGRAM_HPP
+#define LATENCYHISTOGRAM_HPP
+
+#include "Timer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace OrthancPlugins {
+
+enum class HistogramWindow {
+    ONE_MINUTE = 0,
+    FIVE_MINUTES,
+    ONE_HOUR,
+    ALL
+};
+
+/*
+ * Merged view of a LatencyHistogram, values in microseconds.
+ * Percentiles are reported as the upper bound of their bin, so they are
+ * at most ~3% above the recorded value.
+ */
+class HistogramSnapshot
+{
+    friend class LatencyHistogram;
+
+    std::vector<uint64_t> _counts;
+    uint64_t _count;
+    uint64_t _sum;
+    uint64_t _max;
+
+public:
+    HistogramSnapshot();
+
+    uint64_t GetCount() const { return _count; };
+    uint64_t GetSum() const { return _sum; };
+    uint64_t GetMax() const { return _max; };
+    double GetMean() const { return _count > 0 ? static_cast<double>(_sum) / _count : 0; };
+
+    //p in [0, 100]
+    uint64_t GetPercentile(double p) const;
+    //observations not above value, within bin precision
+    uint64_t CountAtOrBelow(uint64_t value) const;
+};
+
+/*
+ * HDR-style log-linear histogram of latencies in microseconds: 32 linear
+ * bins per power of two, values up to ~19 hours.
+ * Record is wait-free: every thread adds to its own shard with relaxed
+ * atomics, readers merge the shards. Time windows are kept as a ring of
+ * 10 second deltas, rotated by the first Record or read after a tick.
+ */
+class LatencyHistogram
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    static const unsigned int SUB_BITS = 6;
+    static const size_t BINS = 1024;
+    static const uint64_t MAX_VALUE = (1ULL << 36) - 1;
+    static const size_t SHARDS = 8;
+
+    static size_t BinIndex(uint64_t value);
+    static uint64_t BinLowest(size_t index);
+    static uint64_t BinHighest(size_t index);
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[BINS];
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        Shard();
+    };
+
+    typedef std::vector<std::pair<uint32_t, uint64_t> > Delta; //bin, count
+
+    static const int64_t TICK_MS = 10000;
+    static const size_t TICKS = 360; //one hour
+
+    Shard _shards[SHARDS];
+
+    std::mutex _rotateMutex;
+    std::atomic<int64_t> _nextTick; //ms on Clock
+    std::vector<uint64_t> _lastCounts; //cumulative at the last tick
+    uint64_t _lastSum;
+    std::deque<std::pair<Delta, uint64_t> > _ticks; //newest first, with their sum
+
+    static int64_t ToMs(Clock::time_point t);
+
+    void Merge(HistogramSnapshot& snapshot);
+    void Rotate(int64_t nowMs);
+
+public:
+    LatencyHistogram();
+
+    void Record(uint64_t micros) { Record(micros, Clock::now()); };
+    void Record(uint64_t micros, Clock::time_point now);
+
+    HistogramSnapshot GetSnapshot(HistogramWindow window = HistogramWindow::ALL) {
+        return GetSnapshot(window, Clock::now());
+    };
+    HistogramSnapshot GetSnapshot(HistogramWindow window, Clock::time_point now);
+
+    //records the lifetime of the scope
+    class Scope
+    {
+        LatencyHistogram& _histogram;
+        Stopwatch _timer;
+    public:
+        explicit Scope(LatencyHistogram& histogram): _histogram(histogram) {};
+        ~Scope() { _histogram.Record(static_cast<uint64_t>(_timer.elapsed())); };
+    };
+};
+
+}
+#endif // LATENCYHISTOGRAM_HPP
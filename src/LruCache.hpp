@@ -0,0 +1,120 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef LRUCACHE_HPP
+#define LRUCACHE_HPP
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * Cost bounded LRU index keyed by attachment uuid.
+ * Not thread safe, owners are expected to hold their own lock.
+ */
+template <typename Value>
+class LruCache
+{
+public:
+    typedef std::pair<std::string, Value> Item;
+
+private:
+    struct Entry {
+        std::string key;
+        Value value;
+        uint64_t cost;
+    };
+
+    typedef std::list<Entry> List;
+
+    List _list; //front is the most recently used
+    std::unordered_map<std::string, typename List::iterator> _map;
+    uint64_t _capacity;
+    uint64_t _cost = 0;
+
+public:
+    explicit LruCache(uint64_t capacity): _capacity(capacity) {};
+
+    bool Get(const std::string& key, Value& value) {
+        auto it = _map.find(key);
+        if (it == _map.end()) {
+            return false;
+        }
+
+        _list.splice(_list.begin(), _list, it->second);
+        value = it->second->value;
+        return true;
+    };
+
+    bool Contains(const std::string& key) const {
+        return _map.find(key) != _map.end();
+    };
+
+    //entries more expensive than the whole capacity are rejected
+    bool Put(const std::string& key, const Value& value, uint64_t cost, std::vector<Item>& evicted) {
+        if (cost > _capacity) {
+            return false;
+        }
+
+        Remove(key);
+
+        _list.push_front(Entry{key, value, cost});
+        _map[key] = _list.begin();
+        _cost += cost;
+
+        while (_cost > _capacity && !_list.empty()) {
+            Entry& last = _list.back();
+            evicted.push_back(Item(last.key, last.value));
+            _cost -= last.cost;
+            _map.erase(last.key);
+            _list.pop_back();
+        }
+
+        return true;
+    };
+
+    bool Remove(const std::string& key, Value* value = nullptr) {
+        auto it = _map.find(key);
+        if (it == _map.end()) {
+            return false;
+        }
+
+        if (value != nullptr) {
+            *value = it->second->value;
+        }
+        _cost -= it->second->cost;
+        _list.erase(it->second);
+        _map.erase(it);
+        return true;
+    };
+
+    uint64_t GetCost() const { return _cost; };
+    uint64_t GetCapacity() const { return _capacity; };
+    size_t GetCount() const { return _map.size(); };
+};
+
+}
+#endif // LRUCACHE_HPP
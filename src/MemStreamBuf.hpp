@@ -0,0 +1,122 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MEMSTREAMBUF_HPP
+#define MEMSTREAMBUF_HPP
+
+#include <algorithm>
+#include <cstring>
+#include <streambuf>
+
+namespace OrthancPlugins {
+namespace Stream {
+
+/*
+ * Seekable stream buffer over a fixed, externally owned memory block.
+ * Lets the SDK write a download straight into the buffer handed over
+ * to Orthanc, at any offset. Writes past the end fail instead of growing.
+ */
+class MemStreamBuf : public std::streambuf
+{
+    char* _data;
+    size_t _size;
+    size_t _high; //highest offset written so far, reads stop there
+
+    void Track() {
+        _high = std::max(_high, static_cast<size_t>(pptr() - _data));
+    }
+
+public:
+    //filled: the block already holds data to be read back
+    MemStreamBuf(char* data, size_t size, bool filled = false):
+        _data(data),
+        _size(size),
+        _high(filled ? size : 0) {
+        setp(_data, _data + _size);
+        setg(_data, _data, _data + _high);
+    };
+
+    char* get() const { return _data; };
+    size_t allocsize() const { return _size; };
+    size_t size() const { return std::max(_high, static_cast<size_t>(pptr() - _data)); };
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        const std::streamsize room = epptr() - pptr();
+        const std::streamsize count = std::min(n, room);
+        if (count > 0) {
+            memcpy(pptr(), s, static_cast<size_t>(count));
+            //pbump takes an int, re-anchor instead for multi-GB offsets
+            setp(pptr() + count, epptr());
+            Track();
+        }
+        return count;
+    };
+
+    int_type underflow() override {
+        Track();
+        if (gptr() < _data + _high) {
+            setg(_data, gptr(), _data + _high);
+            return traits_type::to_int_type(*gptr());
+        }
+        return traits_type::eof();
+    };
+
+    int_type overflow(int_type c) override {
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            return traits_type::not_eof(c);
+        }
+        return traits_type::eof();
+    };
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override {
+        off_type base = 0;
+        if (dir == std::ios_base::cur) {
+            base = (which & std::ios_base::out) ? pptr() - _data : gptr() - _data;
+        } else if (dir == std::ios_base::end) {
+            base = static_cast<off_type>((which & std::ios_base::out) ? _size : size());
+        }
+        return seekpos(pos_type(base + off), which);
+    };
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override {
+        const off_type off = pos;
+        if (off < 0 || off > static_cast<off_type>(_size)) {
+            return pos_type(off_type(-1));
+        }
+        if (which & std::ios_base::out) {
+            Track();
+            setp(_data + off, _data + _size);
+        }
+        if (which & std::ios_base::in) {
+            Track();
+            if (off > static_cast<off_type>(_high)) {
+                return pos_type(off_type(-1));
+            }
+            setg(_data, _data + off, _data + _high);
+        }
+        return pos;
+    };
+};
+
+}
+}
+#endif // MEMSTREAMBUF_HPP
@@ -0,0 +1,104 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "MemoryCache.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+namespace OrthancPlugins {
+
+MemoryCache::MemoryCache(uint64_t capacity,
+                         size_t shards,
+                         const std::set<OrthancPluginContentType> &types):
+    _types(types),
+    _hits(0),
+    _misses(0)
+{
+    if (shards == 0) {
+        shards = 1;
+    }
+
+    for (size_t i = 0; i < shards; ++i) {
+        _shards.push_back(std::unique_ptr<Shard>(new Shard(capacity / shards)));
+    }
+}
+
+MemoryCache::Shard& MemoryCache::GetShard(const std::string &uuid) {
+    return *_shards[std::hash<std::string>()(uuid) % _shards.size()];
+}
+
+bool MemoryCache::Read(const std::string &uuid, void **content, int64_t *size) {
+    Blob blob;
+    {
+        Shard& shard = GetShard(uuid);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (!shard.lru.Get(uuid, blob)) {
+            _misses++;
+            return false;
+        }
+    }
+    _hits++;
+
+    //malloc because it's freed by ::free()
+    *size = static_cast<int64_t>(blob->size());
+    *content = malloc(blob->empty() ? 1 : blob->size());
+    if (*content == nullptr) {
+        return false;
+    }
+    memcpy(*content, blob->data(), blob->size());
+
+    return true;
+}
+
+void MemoryCache::Insert(const std::string &uuid, const void *content, int64_t size) {
+    //copy outside of the lock, the shard is only held for the LRU update
+    Blob blob = std::make_shared<const std::string>(static_cast<const char*>(content), static_cast<size_t>(size));
+    std::vector<LruCache<Blob>::Item> evicted;
+
+    Shard& shard = GetShard(uuid);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.lru.Put(uuid, blob, blob->size() + uuid.size(), evicted);
+}
+
+void MemoryCache::Remove(const std::string &uuid) {
+    Shard& shard = GetShard(uuid);
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.lru.Remove(uuid);
+}
+
+uint64_t MemoryCache::GetSize() {
+    uint64_t size = 0;
+    for (auto& shard : _shards) {
+        std::lock_guard<std::mutex> lock(shard->mutex);
+        size += shard->lru.GetCost();
+    }
+    return size;
+}
+
+double MemoryCache::GetHitRatio() const {
+    const uint64_t hits = _hits;
+    const uint64_t total = hits + _misses;
+    return total == 0 ? 0.0 : static_cast<double>(hits) / static_cast<double>(total);
+}
+
+}
@@ -0,0 +1,82 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MEMORYCACHE_HPP
+#define MEMORYCACHE_HPP
+
+#include "LruCache.hpp"
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * In-memory cache for small, hot attachments (DicomAsJson).
+ * Entries are spread over shards by uuid hash, so concurrent
+ * storage callbacks rarely contend on the same lock.
+ */
+class MemoryCache
+{
+    typedef std::shared_ptr<const std::string> Blob;
+
+    struct Shard {
+        std::mutex mutex;
+        LruCache<Blob> lru;
+
+        explicit Shard(uint64_t capacity): lru(capacity) {};
+    };
+
+    std::vector<std::unique_ptr<Shard> > _shards;
+    std::set<OrthancPluginContentType> _types;
+
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+
+    Shard& GetShard(const std::string& uuid);
+
+public:
+    MemoryCache(uint64_t capacity,
+                size_t shards,
+                const std::set<OrthancPluginContentType>& types);
+
+    bool IsEnabled(OrthancPluginContentType type) const {
+        return _types.find(type) != _types.end();
+    };
+
+    bool Read(const std::string& uuid, void** content, int64_t* size);
+    void Insert(const std::string& uuid, const void* content, int64_t size);
+    void Remove(const std::string& uuid);
+
+    uint64_t GetSize();
+    uint64_t GetHits() const { return _hits; };
+    uint64_t GetMisses() const { return _misses; };
+    double GetHitRatio() const;
+};
+
+}
+#endif // MEMORYCACHE_HPP
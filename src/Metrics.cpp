@@ -0,0 +1,237 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Metrics.hpp"
+
+#include <cctype>
+#include <limits>
+#include <sstream>
+
+namespace {
+    const char* OP_NAMES[] = {"create", "read", "remove"};
+    const char* TYPE_NAMES[] = {"unknown", "dicom", "dicom_as_json"};
+    const char* CALL_NAMES[] = {"get", "put", "delete", "delete_batch", "head"};
+
+    void writeHeader(std::stringstream& ss, const char* name, const char* help, const char* type) {
+        ss << "# HELP " << name << " " << help << "\n";
+        ss << "# TYPE " << name << " " << type << "\n";
+    }
+
+    const char* WINDOW_NAMES[] = {"1m", "5m", "1h"};
+    const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+
+    void writeHistogram(std::stringstream& ss, const char* name, const std::string& labels,
+                        const OrthancPlugins::HistogramSnapshot& h) {
+        using OrthancPlugins::Metrics;
+        for (size_t i = 0; i < Metrics::BUCKETS; ++i) {
+            ss << name << "_bucket{" << labels << ",le=\"";
+            if (i + 1 == Metrics::BUCKETS) {
+                ss << "+Inf\"} " << h.GetCount() << "\n";
+            } else {
+                ss << Metrics::BOUNDS[i] << "\"} "
+                   << h.CountAtOrBelow(static_cast<uint64_t>(Metrics::BOUNDS[i] * 1e6)) << "\n";
+            }
+        }
+        ss << name << "_sum{" << labels << "} " << static_cast<double>(h.GetSum()) / 1e6 << "\n";
+        ss << name << "_count{" << labels << "} " << h.GetCount() << "\n";
+    }
+
+    //percentiles over the recent windows, only for what was ever recorded
+    void writeQuantiles(std::stringstream& ss, const char* name, const std::string& labels,
+                        OrthancPlugins::LatencyHistogram& h) {
+        using OrthancPlugins::HistogramWindow;
+        for (size_t w = 0; w < 3; ++w) {
+            const auto snapshot = h.GetSnapshot(static_cast<HistogramWindow>(w));
+            for (auto q : QUANTILES) {
+                ss << name << "{" << labels << ",window=\"" << WINDOW_NAMES[w] << "\",quantile=\"" << q << "\"} "
+                   << static_cast<double>(snapshot.GetPercentile(q * 100)) / 1e6 << "\n";
+            }
+            ss << name << "{" << labels << ",window=\"" << WINDOW_NAMES[w] << "\",quantile=\"1\"} "
+               << static_cast<double>(snapshot.GetMax()) / 1e6 << "\n";
+        }
+    }
+}
+
+namespace OrthancPlugins {
+
+const size_t Metrics::BUCKETS;
+const double Metrics::BOUNDS[Metrics::BUCKETS] = {
+    0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 10,
+    std::numeric_limits<double>::infinity()
+};
+
+Metrics::Metrics() {
+    for (auto& g : _inFlight) {
+        g = 0;
+    }
+}
+
+size_t Metrics::TypeIndex(OrthancPluginContentType type) {
+    switch (type) {
+    case OrthancPluginContentType_Dicom: return 1;
+    case OrthancPluginContentType_DicomAsJson: return 2;
+    default: return 0;
+    }
+}
+
+void Metrics::RecordStorage(StorageOperation op, OrthancPluginContentType type, bool ok, uint64_t bytes, uint64_t micros) {
+    Slot& slot = _storage[static_cast<size_t>(op)][TypeIndex(type)];
+    (ok ? slot.ok : slot.errors).fetch_add(1, std::memory_order_relaxed);
+    slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    slot.latency.Record(micros);
+}
+
+void Metrics::RecordS3(S3Call call, bool ok, uint64_t bytes, uint64_t micros) {
+    Slot& slot = _calls[static_cast<size_t>(call)];
+    (ok ? slot.ok : slot.errors).fetch_add(1, std::memory_order_relaxed);
+    slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    slot.latency.Record(micros);
+}
+
+HistogramSnapshot Metrics::GetStorageLatency(StorageOperation op, OrthancPluginContentType type, HistogramWindow window) {
+    return _storage[static_cast<size_t>(op)][TypeIndex(type)].latency.GetSnapshot(window);
+}
+
+HistogramSnapshot Metrics::GetS3Latency(S3Call call, HistogramWindow window) {
+    return _calls[static_cast<size_t>(call)].latency.GetSnapshot(window);
+}
+
+void Metrics::RecordS3Error(S3Call call, const std::string &error) {
+    //used as a label value
+    std::string name = error.empty() ? std::string("unknown") : error;
+    for (auto& c : name) {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '.' && c != ':' && c != '-') {
+            c = '_';
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _s3Errors[std::make_pair(call, name)]++;
+}
+
+void Metrics::AddGauge(const std::string &name, const std::string &help, std::function<double ()> value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _gauges.push_back(std::make_pair(name + " " + help, value));
+}
+
+void Metrics::ClearGauges() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _gauges.clear();
+}
+
+std::string Metrics::FormatPrometheus() {
+    std::stringstream ss;
+
+    writeHeader(ss, "orthanc_s3_storage_operations_total", "Storage area callbacks.", "counter");
+    for (size_t op = 0; op < OPS; ++op) {
+        for (size_t t = 0; t < TYPES; ++t) {
+            const Slot& slot = _storage[op][t];
+            ss << "orthanc_s3_storage_operations_total{op=\"" << OP_NAMES[op] << "\",type=\"" << TYPE_NAMES[t]
+               << "\",result=\"ok\"} " << slot.ok << "\n";
+            ss << "orthanc_s3_storage_operations_total{op=\"" << OP_NAMES[op] << "\",type=\"" << TYPE_NAMES[t]
+               << "\",result=\"error\"} " << slot.errors << "\n";
+        }
+    }
+
+    writeHeader(ss, "orthanc_s3_storage_bytes_total", "Attachment bytes written and read.", "counter");
+    for (size_t op = 0; op < OPS; ++op) {
+        for (size_t t = 0; t < TYPES; ++t) {
+            ss << "orthanc_s3_storage_bytes_total{op=\"" << OP_NAMES[op] << "\",type=\"" << TYPE_NAMES[t]
+               << "\"} " << _storage[op][t].bytes << "\n";
+        }
+    }
+
+    writeHeader(ss, "orthanc_s3_storage_in_flight", "Storage area callbacks running.", "gauge");
+    for (size_t op = 0; op < OPS; ++op) {
+        ss << "orthanc_s3_storage_in_flight{op=\"" << OP_NAMES[op] << "\"} " << _inFlight[op] << "\n";
+    }
+
+    writeHeader(ss, "orthanc_s3_storage_duration_seconds", "Latency of the storage area callbacks.", "histogram");
+    for (size_t op = 0; op < OPS; ++op) {
+        for (size_t t = 0; t < TYPES; ++t) {
+            std::stringstream labels;
+            labels << "op=\"" << OP_NAMES[op] << "\",type=\"" << TYPE_NAMES[t] << "\"";
+            writeHistogram(ss, "orthanc_s3_storage_duration_seconds", labels.str(), _storage[op][t].latency.GetSnapshot());
+        }
+    }
+
+    writeHeader(ss, "orthanc_s3_storage_latency_seconds", "Latency percentiles of the storage area callbacks.", "gauge");
+    for (size_t op = 0; op < OPS; ++op) {
+        for (size_t t = 0; t < TYPES; ++t) {
+            if (_storage[op][t].ok + _storage[op][t].errors == 0) {
+                continue;
+            }
+            std::stringstream labels;
+            labels << "op=\"" << OP_NAMES[op] << "\",type=\"" << TYPE_NAMES[t] << "\"";
+            writeQuantiles(ss, "orthanc_s3_storage_latency_seconds", labels.str(), _storage[op][t].latency);
+        }
+    }
+
+    writeHeader(ss, "orthanc_s3_requests_total", "Requests sent to S3.", "counter");
+    for (size_t c = 0; c < CALLS; ++c) {
+        ss << "orthanc_s3_requests_total{call=\"" << CALL_NAMES[c] << "\",result=\"ok\"} " << _calls[c].ok << "\n";
+        ss << "orthanc_s3_requests_total{call=\"" << CALL_NAMES[c] << "\",result=\"error\"} " << _calls[c].errors << "\n";
+    }
+
+    writeHeader(ss, "orthanc_s3_request_bytes_total", "Object bytes sent to and received from S3.", "counter");
+    for (size_t c = 0; c < CALLS; ++c) {
+        ss << "orthanc_s3_request_bytes_total{call=\"" << CALL_NAMES[c] << "\"} " << _calls[c].bytes << "\n";
+    }
+
+    writeHeader(ss, "orthanc_s3_request_duration_seconds", "Latency of the requests sent to S3.", "histogram");
+    for (size_t c = 0; c < CALLS; ++c) {
+        writeHistogram(ss, "orthanc_s3_request_duration_seconds",
+                       std::string("call=\"") + CALL_NAMES[c] + "\"", _calls[c].latency.GetSnapshot());
+    }
+
+    writeHeader(ss, "orthanc_s3_request_latency_seconds", "Latency percentiles of the requests sent to S3.", "gauge");
+    for (size_t c = 0; c < CALLS; ++c) {
+        if (_calls[c].ok + _calls[c].errors == 0) {
+            continue;
+        }
+        writeQuantiles(ss, "orthanc_s3_request_latency_seconds",
+                       std::string("call=\"") + CALL_NAMES[c] + "\"", _calls[c].latency);
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    writeHeader(ss, "orthanc_s3_errors_total", "S3 errors by exception name.", "counter");
+    for (const auto& e : _s3Errors) {
+        ss << "orthanc_s3_errors_total{call=\"" << CALL_NAMES[static_cast<size_t>(e.first.first)]
+           << "\",error=\"" << e.first.second << "\"} " << e.second << "\n";
+    }
+
+    for (const auto& g : _gauges) {
+        const size_t space = g.first.find(' ');
+        const std::string name = g.first.substr(0, space);
+        ss << "# HELP " << g.first << "\n";
+        ss << "# TYPE " << name << " gauge\n";
+        ss << name << " " << g.second() << "\n";
+    }
+
+    return ss.str();
+}
+
+Metrics& getMetrics() {
+    static Metrics metrics;
+    return metrics;
+}
+
+}
@@ -0,0 +1,120 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "LatencyHistogram.hpp"
+
+#include <orthanc/OrthancCPlugin.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace OrthancPlugins {
+
+enum class StorageOperation {
+    CREATE = 0,
+    READ,
+    REMOVE,
+    COUNT
+};
+
+enum class S3Call {
+    GET = 0,
+    PUT,
+    DELETE,
+    DELETE_BATCH,
+    HEAD,
+    COUNT
+};
+
+/*
+ * Process wide metrics, served in the Prometheus text format.
+ * Storage callbacks and S3 calls record into fixed slots with atomics and
+ * lock-free latency histograms; S3 errors are keyed by exception name,
+ * which is rare enough for a lock.
+ */
+class Metrics
+{
+    static const size_t TYPES = 3; //unknown, dicom, dicom_as_json
+    static const size_t OPS = static_cast<size_t>(StorageOperation::COUNT);
+    static const size_t CALLS = static_cast<size_t>(S3Call::COUNT);
+
+    struct Slot {
+        std::atomic<uint64_t> ok;
+        std::atomic<uint64_t> errors;
+        std::atomic<uint64_t> bytes;
+        LatencyHistogram latency;
+        Slot(): ok(0), errors(0), bytes(0) {};
+    };
+
+    Slot _storage[OPS][TYPES];
+    std::atomic<int64_t> _inFlight[OPS];
+    Slot _calls[CALLS];
+
+    std::mutex _mutex;
+    std::map<std::pair<S3Call, std::string>, uint64_t> _s3Errors;
+    std::vector<std::pair<std::string, std::function<double()> > > _gauges;
+
+    static size_t TypeIndex(OrthancPluginContentType type);
+
+public:
+    //Prometheus buckets in seconds, the last is +Inf
+    static const size_t BUCKETS = 14;
+    static const double BOUNDS[BUCKETS];
+
+public:
+    Metrics();
+
+    void RecordStorage(StorageOperation op, OrthancPluginContentType type, bool ok, uint64_t bytes, uint64_t micros);
+    void RecordS3(S3Call call, bool ok, uint64_t bytes, uint64_t micros);
+    void RecordS3Error(S3Call call, const std::string& error);
+
+    HistogramSnapshot GetStorageLatency(StorageOperation op, OrthancPluginContentType type,
+                                        HistogramWindow window = HistogramWindow::ALL);
+    HistogramSnapshot GetS3Latency(S3Call call, HistogramWindow window = HistogramWindow::ALL);
+
+    //sampled on every scrape: name, help and a function returning the value
+    void AddGauge(const std::string& name, const std::string& help, std::function<double()> value);
+    void ClearGauges();
+
+    std::string FormatPrometheus();
+
+    //counts a storage callback as in flight for its lifetime
+    class InFlight
+    {
+        std::atomic<int64_t>& _gauge;
+    public:
+        InFlight(Metrics& m, StorageOperation op): _gauge(m._inFlight[static_cast<size_t>(op)]) { _gauge++; };
+        ~InFlight() { _gauge--; };
+    };
+};
+
+Metrics& getMetrics();
+
+}
+#endif // METRICS_HPP
@@ -0,0 +1,86 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef MONITOREDEXECUTOR_HPP
+#define MONITOREDEXECUTOR_HPP
+
+#include <aws/core/utils/threading/Executor.h>
+
+#include <atomic>
+#include <functional>
+#include <memory>
+
+namespace OrthancPlugins {
+
+/*
+ * PooledThreadExecutor that keeps count of the tasks waiting for a thread
+ * and the tasks running, so the pool can be sized from data.
+ */
+class MonitoredExecutor : public Aws::Utils::Threading::Executor
+{
+    size_t _threads;
+    std::atomic<size_t> _queued;
+    std::atomic<size_t> _active;
+    std::atomic<size_t> _peakQueued;
+    std::atomic<uint64_t> _completed;
+    //last member: joins the workers before the counters go away
+    std::unique_ptr<Aws::Utils::Threading::PooledThreadExecutor> _pool;
+
+public:
+    explicit MonitoredExecutor(size_t threads):
+        _threads(threads),
+        _queued(0),
+        _active(0),
+        _peakQueued(0),
+        _completed(0),
+        _pool(new Aws::Utils::Threading::PooledThreadExecutor(threads)) {};
+
+    size_t GetThreads() const { return _threads; };
+    size_t GetQueued() const { return _queued; };
+    size_t GetActive() const { return _active; };
+    size_t GetPeakQueued() const { return _peakQueued; };
+    uint64_t GetCompleted() const { return _completed; };
+
+protected:
+    bool SubmitToThread(std::function<void()>&& fn) override {
+        const size_t queued = ++_queued;
+        size_t peak = _peakQueued;
+        while (queued > peak && !_peakQueued.compare_exchange_weak(peak, queued)) {
+        }
+
+        std::function<void()> task(std::move(fn));
+        const bool submitted = _pool->Submit([this, task]() {
+            _queued--;
+            _active++;
+            task();
+            _active--;
+            _completed++;
+        });
+
+        if (!submitted) {
+            _queued--;
+        }
+        return submitted;
+    };
+};
+
+}
+#endif // MONITOREDEXECUTOR_HPP
@@ -0,0 +1,218 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Packer.hpp"
+
+#include <cstdlib>
+#include <random>
+#include <sstream>
+
+namespace {
+    //"<pack key> <offset> <size>"
+    std::string formatLocation(const std::string& pack, uint64_t offset, uint64_t size) {
+        std::stringstream ss;
+        ss << pack << " " << offset << " " << size;
+        return ss.str();
+    }
+
+    bool parseLocation(const std::string& value, OrthancPlugins::Packer::Location& location) {
+        std::stringstream ss(value);
+        return static_cast<bool>(ss >> location.pack >> location.offset >> location.size);
+    }
+}
+
+namespace OrthancPlugins {
+
+Packer::Packer(OrthancPluginContext *c,
+               const std::string &indexPath,
+               uint64_t maxPackSize,
+               std::chrono::milliseconds window,
+               UploadFunction upload):
+    _context(c),
+    _index(indexPath, true),
+    _maxPackSize(maxPackSize),
+    _window(window),
+    _upload(upload)
+{
+}
+
+Packer::~Packer() {
+    Stop();
+}
+
+bool Packer::Start(size_t flushers) {
+    if (!_index.Load()) {
+        LogError(_context, "[S3] Could not open the pack index");
+        return false;
+    }
+
+    _index.ForEach([this](const std::string&, const std::string& value) {
+        Location location;
+        if (parseLocation(value, location)) {
+            _live[location.pack]++;
+        }
+    });
+
+    std::stringstream ss;
+    ss << "[S3] Pack index: " << _index.GetCount() << " attachments in " << _live.size() << " packs";
+    LogInfo(_context, ss.str().c_str());
+
+    for (size_t i = 0; i < std::max<size_t>(flushers, 1); ++i) {
+        _flushers.push_back(std::thread(&Packer::FlusherLoop, this));
+    }
+    return true;
+}
+
+void Packer::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _flush_cv.notify_all();
+
+    for (auto& t : _flushers) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+    _flushers.clear();
+}
+
+std::string Packer::CreatePackKey() {
+    static std::mutex m;
+    static std::mt19937_64 rng(std::random_device{}());
+
+    std::lock_guard<std::mutex> lock(m);
+    std::stringstream ss;
+    ss << "packs/" << std::hex << rng() << rng();
+    return ss.str();
+}
+
+bool Packer::Add(const std::string &uuid, const void *content, int64_t size) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_stop) {
+        return false;
+    }
+
+    //a full pack is handed over to the flushers as is
+    if (_open && _open->data.size() + static_cast<uint64_t>(size) > _maxPackSize) {
+        _sealed.push_back(_open);
+        _open.reset();
+        _flush_cv.notify_one();
+    }
+
+    if (!_open) {
+        _open = std::make_shared<Pack>();
+        _open->key = CreatePackKey();
+        _open->opened = std::chrono::steady_clock::now();
+        _flush_cv.notify_one();
+    }
+
+    std::shared_ptr<Pack> pack = _open;
+    pack->entries.push_back(Entry{uuid, pack->data.size(), static_cast<uint64_t>(size)});
+    pack->data.append(static_cast<const char*>(content), static_cast<size_t>(size));
+
+    _done_cv.wait(lock, [&pack] { return pack->done; });
+    return pack->ok;
+}
+
+void Packer::Flush(const std::shared_ptr<Pack>& pack) {
+    bool ok = _upload(pack->key, pack->data.data(), static_cast<int64_t>(pack->data.size()));
+
+    //the pack is only reachable once indexed, a crash before leaves an orphan
+    if (ok) {
+        std::vector<std::pair<std::string, std::string> > locations;
+        for (const auto& e : pack->entries) {
+            locations.push_back(std::make_pair(e.uuid, formatLocation(pack->key, e.offset, e.size)));
+        }
+        ok = _index.Set(locations);
+    }
+
+    std::stringstream ss;
+    ss << "[S3] Pack " << pack->key << ": " << pack->entries.size() << " attachments, "
+       << pack->data.size() << " bytes" << (ok ? "" : ", upload failed");
+    LogInfo(_context, ss.str().c_str());
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (ok) {
+        _live[pack->key] += pack->entries.size();
+    }
+    pack->ok = ok;
+    pack->done = true;
+    pack->data.clear();
+    pack->data.shrink_to_fit();
+    _done_cv.notify_all();
+}
+
+void Packer::FlusherLoop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        std::shared_ptr<Pack> pack;
+
+        if (!_sealed.empty()) {
+            pack = _sealed.front();
+            _sealed.pop_front();
+        } else if (_open && (_stop || std::chrono::steady_clock::now() >= _open->opened + _window)) {
+            pack.swap(_open);
+        } else if (_stop) {
+            break;
+        } else if (_open) {
+            _flush_cv.wait_until(lock, _open->opened + _window);
+            continue;
+        } else {
+            _flush_cv.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+        Flush(pack);
+        lock.lock();
+    }
+}
+
+bool Packer::Lookup(const std::string &uuid, Location &location) {
+    std::string value;
+    return _index.Get(uuid, value) && parseLocation(value, location);
+}
+
+bool Packer::Remove(const std::string &uuid, std::string &emptyPack) {
+    Location location;
+    if (!Lookup(uuid, location)) {
+        return false;
+    }
+    _index.Remove(uuid);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    emptyPack.clear();
+    auto it = _live.find(location.pack);
+    if (it != _live.end() && --it->second == 0) {
+        emptyPack = location.pack;
+        _live.erase(it);
+    }
+    return true;
+}
+
+size_t Packer::GetPackCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _live.size();
+}
+
+}
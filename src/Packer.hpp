@@ -0,0 +1,120 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef PACKER_HPP
+#define PACKER_HPP
+
+#include "OrthancPluginCppWrapper.h"
+#include "PersistentMap.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * Packs small attachments into shared S3 objects.
+ *
+ * Attachments written within a short window are concatenated into one
+ * pack object and uploaded with a single PUT; the callers block until
+ * the pack and its index entries are durable. A local index maps every
+ * uuid to (pack key, offset, length), so a read is one range GET.
+ * A pack is deleted once the last attachment in it has been removed.
+ */
+class Packer
+{
+public:
+    typedef std::function<bool(const std::string& path, const void* content, int64_t size)> UploadFunction;
+
+    struct Location {
+        std::string pack;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+private:
+    struct Entry {
+        std::string uuid;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct Pack {
+        std::string key;
+        std::string data;
+        std::vector<Entry> entries;
+        std::chrono::steady_clock::time_point opened;
+        bool done = false;
+        bool ok = false;
+    };
+
+    OrthancPluginContext* _context;
+    PersistentMap _index;
+    uint64_t _maxPackSize;
+    std::chrono::milliseconds _window;
+    UploadFunction _upload;
+
+    std::mutex _mutex;
+    std::condition_variable _flush_cv;
+    std::condition_variable _done_cv;
+    std::shared_ptr<Pack> _open;
+    std::deque<std::shared_ptr<Pack> > _sealed;
+    std::unordered_map<std::string, size_t> _live; //pack -> attachments left
+
+    bool _stop = false;
+    std::vector<std::thread> _flushers;
+
+    std::string CreatePackKey();
+    void Flush(const std::shared_ptr<Pack>& pack);
+    void FlusherLoop();
+
+public:
+    Packer(OrthancPluginContext* c,
+           const std::string& indexPath,
+           uint64_t maxPackSize,
+           std::chrono::milliseconds window,
+           UploadFunction upload);
+    ~Packer();
+
+    bool Start(size_t flushers);
+    //uploads what is still open
+    void Stop();
+
+    //returns once the pack holding the attachment is in S3
+    bool Add(const std::string& uuid, const void* content, int64_t size);
+    bool Lookup(const std::string& uuid, Location& location);
+    //false if the uuid is not packed; emptyPack is set when the
+    //last attachment of a pack is gone and the pack can be deleted
+    bool Remove(const std::string& uuid, std::string& emptyPack);
+
+    size_t GetPackCount();
+};
+
+}
+#endif // PACKER_HPP
@@ -0,0 +1,367 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "PersistentMap.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+#if defined(__APPLE__)
+#define fdatasync fsync
+#endif
+
+namespace {
+    const char RECORD_SET = '+';
+    const char RECORD_REMOVE = '-';
+    const size_t COMPACT_MIN_RECORDS = 1024;
+
+    //all or nothing: a partial line left behind would glue the next record onto it
+    bool writeAll(int fd, const char* data, size_t size) {
+        //the fd is O_APPEND, the end is where the write goes
+        const off_t start = ::lseek(fd, 0, SEEK_END);
+        while (size > 0) {
+            const ssize_t n = ::write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                //cut back what made it to disk
+                if (start >= 0 && ::ftruncate(fd, start) != 0) {
+                    //nothing more to do, the load stops at the torn line
+                }
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    //a rename is only durable once the directory entry is
+    void syncDirectory(const std::string& path) {
+        const size_t slash = path.rfind('/');
+        const std::string directory = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        int fd = ::open(directory.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+}
+
+namespace OrthancPlugins {
+
+PersistentMap::PersistentMap(const std::string &path, bool sync):
+    _path(path),
+    _sync(sync)
+{
+}
+
+PersistentMap::~PersistentMap() {
+    if (_compactor.joinable()) {
+        _compactor.join();
+    }
+    for (int fd : _retired) {
+        ::close(fd);
+    }
+    if (_fd >= 0) {
+        ::close(_fd);
+    }
+}
+
+bool PersistentMap::Load() {
+    if (_compactor.joinable()) {
+        _compactor.join();
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    _map.clear();
+    _records = 0;
+
+    std::ifstream f(_path.c_str(), std::ios::in | std::ios::binary);
+    std::string line;
+    while (std::getline(f, line)) {
+        //a record torn by a crash has no newline, so it is the last one: skip it
+        if (f.eof()) {
+            break;
+        }
+        if (line.empty()) {
+            continue;
+        }
+        const size_t tab = line.find('\t');
+        if (line[0] == RECORD_SET && tab != std::string::npos) {
+            _map[line.substr(1, tab - 1)] = line.substr(tab + 1);
+        } else if (line[0] == RECORD_REMOVE) {
+            _map.erase(line.substr(1));
+        }
+        _records++;
+    }
+    f.close();
+
+    const int fd = CreateCompacted(_map);
+    if (fd < 0 || !InstallCompacted(fd)) {
+        return false;
+    }
+    _records = _map.size();
+    return true;
+}
+
+int PersistentMap::CreateCompacted(const std::unordered_map<std::string, std::string> &entries) {
+    const int fd = ::open((_path + ".tmp").c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    std::string buf;
+    bool ok = true;
+    for (const auto& kv : entries) {
+        buf += RECORD_SET;
+        buf += kv.first;
+        buf += '\t';
+        buf += kv.second;
+        buf += '\n';
+        if (buf.size() > 64 * 1024) {
+            ok = ok && writeAll(fd, buf.data(), buf.size());
+            buf.clear();
+        }
+    }
+    ok = ok && writeAll(fd, buf.data(), buf.size());
+    ok = ok && ::fdatasync(fd) == 0;
+
+    if (!ok) {
+        ::close(fd);
+        ::unlink((_path + ".tmp").c_str());
+        return -1;
+    }
+    return fd;
+}
+
+bool PersistentMap::InstallCompacted(int fd) {
+    //the fd follows the file, it is the new log once renamed
+    if (::rename((_path + ".tmp").c_str(), _path.c_str()) != 0) {
+        ::close(fd);
+        ::unlink((_path + ".tmp").c_str());
+        return false;
+    }
+    syncDirectory(_path);
+    if (_fd >= 0) {
+        //a sync may be going on with it
+        _retired.push_back(_fd);
+    }
+    _fd = fd;
+    return true;
+}
+
+void PersistentMap::MaybeCompact() {
+    if (_compacting || _records <= COMPACT_MIN_RECORDS || _records <= 2 * _map.size()) {
+        return;
+    }
+    //the previous one is over, it cleared _compacting
+    if (_compactor.joinable()) {
+        _compactor.join();
+    }
+    _compacting = true;
+    _tail.clear();
+    _tailRecords = 0;
+    _compactor = std::thread(&PersistentMap::CompactInBackground, this, _map);
+}
+
+void PersistentMap::CompactInBackground(std::unordered_map<std::string, std::string> snapshot) {
+    //written and synced while the log goes on, only the tail is under the lock
+    const int fd = CreateCompacted(snapshot);
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _compacting = false;
+    if (fd < 0) {
+        //the records are in the current log, a failed compaction only costs space
+        return;
+    }
+    if (!_tail.empty() && (!writeAll(fd, _tail.data(), _tail.size()) || ::fdatasync(fd) != 0)) {
+        ::close(fd);
+        ::unlink((_path + ".tmp").c_str());
+        return;
+    }
+    if (InstallCompacted(fd)) {
+        _records = snapshot.size() + _tailRecords;
+    }
+    _tail.clear();
+}
+
+uint64_t PersistentMap::AppendRecord(const std::string &record, size_t count) {
+    if (_fd < 0 || !writeAll(_fd, record.data(), record.size())) {
+        return 0;
+    }
+    if (_compacting) {
+        _tail += record;
+        _tailRecords += count;
+    }
+
+    _records += count;
+    MaybeCompact();
+    return ++_written;
+}
+
+bool PersistentMap::Sync(uint64_t seq) {
+    std::unique_lock<std::mutex> lock(_syncMutex);
+    while (_synced < seq) {
+        if (_failed >= seq) {
+            return false;
+        }
+        if (_syncing) {
+            _synced_cv.wait(lock);
+            continue;
+        }
+
+        //everything written so far goes into this fdatasync
+        _syncing = true;
+        lock.unlock();
+
+        uint64_t target;
+        int fd;
+        std::vector<int> retired;
+        {
+            std::lock_guard<std::mutex> mapLock(_mutex);
+            target = _written;
+            fd = _fd;
+            retired.swap(_retired);
+        }
+        //a compaction synced what they held into the current log
+        for (int r : retired) {
+            ::close(r);
+        }
+        const bool ok = ::fdatasync(fd) == 0;
+
+        lock.lock();
+        _syncing = false;
+        if (ok) {
+            _synced = std::max(_synced, target);
+        } else {
+            _failed = std::max(_failed, target);
+        }
+        _synced_cv.notify_all();
+    }
+    return true;
+}
+
+bool PersistentMap::Get(const std::string &key, std::string &value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _map.find(key);
+    if (it == _map.end()) {
+        return false;
+    }
+    value = it->second;
+    return true;
+}
+
+bool PersistentMap::Set(const std::string &key, const std::string &value) {
+    return Set(std::vector<std::pair<std::string, std::string> >(1, std::make_pair(key, value)));
+}
+
+bool PersistentMap::Set(const std::vector<std::pair<std::string, std::string> > &entries) {
+    std::string record;
+    for (const auto& kv : entries) {
+        record += RECORD_SET;
+        record += kv.first;
+        record += '\t';
+        record += kv.second;
+        record += '\n';
+    }
+
+    //rolled back if the write or the sync fails
+    std::unordered_map<std::string, std::string> previous;
+    auto rollback = [&]() {
+        for (const auto& kv : entries) {
+            auto current = _map.find(kv.first);
+            if (current == _map.end() || current->second != kv.second) {
+                continue; //changed again since
+            }
+            auto it = previous.find(kv.first);
+            if (it != previous.end()) {
+                current->second = it->second;
+            } else {
+                _map.erase(current);
+            }
+        }
+    };
+
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (const auto& kv : entries) {
+            auto it = _map.find(kv.first);
+            if (it != _map.end() && previous.count(kv.first) == 0) {
+                previous[kv.first] = it->second;
+            }
+        }
+        for (const auto& kv : entries) {
+            _map[kv.first] = kv.second;
+        }
+
+        seq = AppendRecord(record, entries.size());
+        if (seq == 0) {
+            rollback();
+            return false;
+        }
+    }
+
+    //not under _mutex, readers don't wait for the disk
+    if (_sync && !Sync(seq)) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        rollback();
+        return false;
+    }
+    return true;
+}
+
+bool PersistentMap::Remove(const std::string &key) {
+    uint64_t seq;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_map.erase(key) == 0) {
+            return true;
+        }
+        seq = AppendRecord(std::string(1, RECORD_REMOVE) + key + '\n', 1);
+        if (seq == 0) {
+            return false;
+        }
+    }
+    return !_sync || Sync(seq);
+}
+
+size_t PersistentMap::GetCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _map.size();
+}
+
+void PersistentMap::ForEach(const std::function<void(const std::string&, const std::string&)>& f) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto& kv : _map) {
+        f(kv.first, kv.second);
+    }
+}
+
+}
@@ -0,0 +1,99 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef PERSISTENTMAP_HPP
+#define PERSISTENTMAP_HPP
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * String map kept in memory and persisted as an append-only log of
+ * set/remove records, one per line. The log is compacted on Load and,
+ * in the background, whenever dead records outnumber the live ones.
+ * With sync, concurrent writers share one fdatasync (group commit) and
+ * reads never wait for the disk.
+ * Keys and values must not contain tabs or newlines.
+ */
+class PersistentMap
+{
+    std::string _path;
+    bool _sync;
+
+    //the map and the log
+    std::mutex _mutex;
+    std::unordered_map<std::string, std::string> _map;
+    int _fd = -1;
+    std::vector<int> _retired; //replaced by a compaction, closed by the next sync
+    size_t _records = 0; //in the log, live or not
+    uint64_t _written = 0;
+
+    //group commit: the first writer to wait syncs for everybody written so far
+    std::mutex _syncMutex;
+    std::condition_variable _synced_cv;
+    uint64_t _synced = 0;
+    uint64_t _failed = 0; //highest record covered by a failed sync
+    bool _syncing = false;
+
+    //background compaction, records appended meanwhile go to the new log too
+    std::thread _compactor;
+    bool _compacting = false;
+    std::string _tail;
+    size_t _tailRecords = 0;
+
+    //under _mutex, the sequence number of the record to sync, 0 on error
+    uint64_t AppendRecord(const std::string& record, size_t count);
+    bool Sync(uint64_t seq);
+    //entries into a fresh log next to the current one, synced; its fd or -1
+    int CreateCompacted(const std::unordered_map<std::string, std::string>& entries);
+    //the fresh log replaces the current one
+    bool InstallCompacted(int fd);
+    void MaybeCompact();
+    void CompactInBackground(std::unordered_map<std::string, std::string> snapshot);
+
+public:
+    //sync: fdatasync every record before returning
+    PersistentMap(const std::string& path, bool sync);
+    ~PersistentMap();
+
+    bool Load();
+
+    bool Get(const std::string& key, std::string& value);
+    bool Set(const std::string& key, const std::string& value);
+    //all entries with a single write (and sync)
+    bool Set(const std::vector<std::pair<std::string, std::string> >& entries);
+    bool Remove(const std::string& key);
+
+    size_t GetCount();
+    void ForEach(const std::function<void(const std::string& key, const std::string& value)>& f);
+};
+
+}
+#endif // PERSISTENTMAP_HPP
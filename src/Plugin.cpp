@@ -24,6 +24,19 @@
 #include "Timer.hpp"
 #include "Utils.hpp"
 #include "S3ops.hpp"
+#include "DiskCache.hpp"
+#include "MemoryCache.hpp"
+#include "Journal.hpp"
+#include "KeyLayout.hpp"
+#include "Deleter.hpp"
+#include "Spool.hpp"
+#include "Rebalancer.hpp"
+#include "Packer.hpp"
+#include "Compression.hpp"
+#include "Dedup.hpp"
+#include "Metrics.hpp"
+#include "AsyncLog.hpp"
+#include "AwsLogSystem.hpp"
 
 #include <boost/algorithm/string.hpp>
 
@@ -33,6 +46,9 @@
 #include <sstream>
 #include <iostream>
 #include <algorithm>
+#include <list>
+#include <map>
+#include <set>
 
 #define AWS_DEFAULT_REGION "eu-central-1"
 #define AWS_DEFAULT_BUCKET_MAME "delme-test-bucket"
@@ -46,22 +62,78 @@ struct S3PluginContext {
     std::string s3_region;
     std::string s3_bucket_name;
 
-    std::string s3_endpoint;
+    //equivalent endpoints in front of s3_bucket, a string or a list
+    std::vector<std::string> s3_endpoints;
+
+    //s3_targets, objects spread over the buckets; empty: s3_bucket on s3_endpoint
+    std::vector<S3Target> s3_targets;
+    unsigned int rebalance_threads = 4;
 
     S3Method s3_method = S3Method::DIRECT;
+    S3Options s3_options;
+
+    uint64_t disk_cache_size = 0;
+
+    uint64_t memory_cache_size = 0;
+    unsigned int memory_cache_shards = 16;
+    std::set<OrthancPluginContentType> memory_cache_types;
+
+    bool write_back = false;
+    unsigned int write_back_uploaders = 4;
+    uint64_t write_back_segment_size = 64 * 1024 * 1024;
+
+    std::string key_layout = "flat";
+    unsigned int key_prefix_length = 4;
+    std::string key_layout_fallback;
+
+    bool background_delete = false;
+
+    //S3 probes while the circuit breaker is open
+    unsigned int breaker_probe_ms = 1000;
+
+    uint64_t pack_threshold = 0;
+    uint64_t pack_max_size = 16 * 1024 * 1024;
+    unsigned int pack_window_ms = 50;
+    unsigned int pack_uploaders = 2;
+
+    std::map<OrthancPluginContentType, CompressionCodec> compression_codecs;
+    uint64_t compression_threshold = 4 * 1024;
+    uint64_t compression_chunk_size = 4 * 1024 * 1024;
+    unsigned int compression_threads = 0;
+    int compression_level = 0;
+    bool compression_adaptive = true;
+
+    bool deduplication = false;
+    std::set<OrthancPluginContentType> deduplication_types;
+
+    bool metrics = true;
+
+    LogLevel log_level = LogLevel::WARNING;
+    unsigned int trace_sample_every = 0;
+    unsigned int slow_request_ms = 0;
 };
 
 OrthancPluginContext* context = nullptr;
 
 //std::unique_ptr<S3Facade> s3;
 static std::unique_ptr<S3Impl> s3;
+static std::shared_ptr<AsyncLog> logger;
+static std::unique_ptr<DiskCache> diskCache;
+static std::unique_ptr<MemoryCache> memoryCache;
+static std::unique_ptr<Journal> journal;
+static std::unique_ptr<KeyLayout> keyLayout;
+static std::unique_ptr<KeyLayout> legacyLayout;
+static std::unique_ptr<Deleter> deleter;
+static std::unique_ptr<Spool> spool;
+static std::unique_ptr<Rebalancer> rebalancer;
+static std::unique_ptr<Packer> packer;
+static uint64_t packThreshold = 0;
+static std::unique_ptr<Compressor> compressor;
+static unsigned int decompressionThreads = 1;
+static std::unique_ptr<Dedup> dedup;
+static std::set<OrthancPluginContentType> dedupTypes;
 static std::string indexDir = "";
 
-static std::string GetPathStorage(const char* uuid)
-{
-  return uuid;
-}
-
 static std::string GetPathInstance(const char* uuid)
 {
     std::string level_1 (uuid, 0, 2);
@@ -71,38 +143,212 @@ static std::string GetPathInstance(const char* uuid)
 }
 
 
-static OrthancPluginErrorCode StorageCreate(const char* uuid,
-                                            const void* content,
-                                            int64_t size,
-                                            OrthancPluginContentType type)
+static bool UploadAttachment(const std::string& uuid,
+                             const void* content,
+                             int64_t size,
+                             OrthancPluginContentType type)
 {
-    Stopwatch timer;
-    bool ok = false;
     std::string path;
 
-    {
-        std::stringstream ss;
-        ss << "[S3] PUT: " << uuid << " begin";
-        LogInfo(context, ss.str().c_str());
+    //content-addressed: a duplicate only adds a reference, nothing is uploaded
+    if (dedup && dedupTypes.count(type) > 0) {
+        try {
+            return dedup->Store(uuid, content, size, [&](const std::string& key) -> bool {
+                std::string compressed;
+                if (compressor && compressor->Compress(content, size, type, compressed)) {
+                    return s3->UploadFileToS3(key, compressed.data(), static_cast<int64_t>(compressed.size()));
+                }
+                return s3->UploadFileToS3(key, content, size);
+            });
+        } catch (Orthanc::OrthancException &e) {
+            std::stringstream err;
+            err << "[S3] Could not store uuid: " << uuid << ", " << e.What();
+            LogError(context, err.str().c_str());
+            return false;
+        }
+    }
+
+    //compressed before packing, so more attachments fit under the threshold
+    std::string compressed;
+    if (compressor && compressor->Compress(content, size, type, compressed)) {
+        content = compressed.data();
+        size = static_cast<int64_t>(compressed.size());
+    }
+
+    //small attachments share a pack object
+    if (packer && static_cast<uint64_t>(size) <= packThreshold) {
+        return packer->Add(uuid, content, size);
     }
 
     try {
-        path = GetPathStorage(uuid);
-        ok = s3->UploadFileToS3(path, content, size);
+        if (!keyLayout->CreateKey(uuid, type, path)) {
+            std::stringstream err;
+            err << "[S3] Could not create key for uuid: " << uuid;
+            LogError(context, err.str().c_str());
+            return false;
+        }
+        return s3->UploadFileToS3(path, content, size);
     } catch (Orthanc::OrthancException &e) {
         std::stringstream err;
         err << "[S3] Could not open uuid: " << path << ", " << e.What();
         LogError(context, err.str().c_str());
-        ok = false;
     }
 
-    {
-        auto executionDuration = timer.elapsed();
+    return false;
+}
+
+
+static bool DeleteKey(const std::string& path)
+{
+    //background deleter: a local append, S3 catches up in batches
+    if (deleter) {
+        return deleter->Enqueue(path);
+    }
+    return s3->DeleteFileFromS3(path);
+}
+
+
+static bool RemoveAttachment(const std::string& uuid,
+                             OrthancPluginContentType type)
+{
+    std::string path;
+    bool ok = false;
+
+    if (dedup && dedup->Remove(uuid, ok)) {
+        return ok;
+    }
+
+    std::string emptyPack;
+    if (packer && packer->Remove(uuid, emptyPack)) {
+        return emptyPack.empty() || DeleteKey(emptyPack);
+    }
+
+    try {
+        if (keyLayout->GetKey(uuid, type, path)) {
+            ok = DeleteKey(path);
+        }
+        //S3 answers deletes of missing keys with success, so both are removed
+        std::string legacy;
+        if (legacyLayout && legacyLayout->GetKey(uuid, type, legacy) && legacy != path) {
+            path = legacy;
+            ok = DeleteKey(path) || ok;
+        }
+        if (ok) {
+            keyLayout->Forget(uuid);
+        }
+        return ok;
+    } catch (Orthanc::OrthancException &e) {
+        std::stringstream err;
+        err <<"[S3] Could not remove file: " << path << ", " << e.What();
+        LogError(context, err.str().c_str());
+    }
+
+    return false;
+}
+
+
+static bool FetchAttachment(const std::string& uuid,
+                            OrthancPluginContentType type,
+                            void** content,
+                            int64_t* size)
+{
+    std::string path;
+    if (dedup && dedup->Lookup(uuid, path)) {
+        return s3->DownloadFileFromS3(path, content, size);
+    }
+
+    Packer::Location location;
+    if (packer && packer->Lookup(uuid, location)) {
+        *size = static_cast<int64_t>(location.size);
+        return s3->DownloadRangeFromS3(location.pack, location.offset, location.size, content);
+    }
+
+    if (keyLayout->GetKey(uuid, type, path) && s3->DownloadFileFromS3(path, content, size)) {
+        return true;
+    }
+
+    //objects written before the layout was changed
+    std::string legacy;
+    if (legacyLayout && legacyLayout->GetKey(uuid, type, legacy) && legacy != path) {
         std::stringstream ss;
-        ss << "[S3] PUT " << uuid << " finished in " << executionDuration << "us";
+        ss << "[S3] GET " << uuid << " falling back to legacy key: " << legacy;
         LogInfo(context, ss.str().c_str());
+        return s3->DownloadFileFromS3(legacy, content, size);
+    }
+
+    return false;
+}
+
+
+static bool DownloadAttachment(const std::string& uuid,
+                               OrthancPluginContentType type,
+                               void** content,
+                               int64_t* size)
+{
+    if (!FetchAttachment(uuid, type, content, size)) {
+        return false;
     }
 
+    //whatever the current configuration, compressed objects carry a header
+    if (Compressor::IsCompressed(*content, *size)) {
+        void* plain = nullptr;
+        int64_t plainSize = 0;
+        const bool ok = Compressor::Decompress(*content, *size, &plain, &plainSize, decompressionThreads);
+        free(*content);
+        *content = nullptr;
+        if (!ok) {
+            std::stringstream err;
+            err << "[S3] Could not decompress uuid: " << uuid;
+            LogError(context, err.str().c_str());
+            return false;
+        }
+        *content = plain;
+        *size = plainSize;
+    }
+
+    return true;
+}
+
+
+static OrthancPluginErrorCode StorageCreate(const char* uuid,
+                                            const void* content,
+                                            int64_t size,
+                                            OrthancPluginContentType type)
+{
+    Metrics::InFlight inFlight(getMetrics(), StorageOperation::CREATE);
+    OperationTrace trace(logger.get(), "create", uuid, type);
+    trace.SetSize(size);
+    bool ok = false;
+
+    logger->Log(LogLevel::INFO, "[S3] PUT: ", uuid, " begin");
+
+    //write-back: durable in the local journal, uploaded in the background
+    ok = journal && journal->Append(uuid, content, size, type);
+    if (ok) {
+        trace.SetSource("journal");
+    } else if (spool && s3->GetCircuitBreaker()->IsOpen()) {
+        //S3 is down, don't wait for it
+        trace.SetSource("spool");
+        ok = spool->Write(uuid, content, size, type);
+    } else {
+        trace.SetSource("s3");
+        ok = UploadAttachment(uuid, content, size, type);
+        //the breaker tripped on the way
+        if (!ok && spool && s3->GetCircuitBreaker()->IsOpen()) {
+            trace.SetSource("spool");
+            ok = spool->Write(uuid, content, size, type);
+        }
+    }
+    trace.Mark("stored");
+
+    if (ok && memoryCache && memoryCache->IsEnabled(type)) {
+        memoryCache->Insert(uuid, content, size);
+    }
+
+    const uint64_t executionDuration = trace.Finish(ok);
+    logger->Log(LogLevel::INFO, "[S3] PUT ", uuid, " finished in ", executionDuration, "us");
+    getMetrics().RecordStorage(StorageOperation::CREATE, type, ok, static_cast<uint64_t>(size), executionDuration);
+
     return ok ? OrthancPluginErrorCode_Success : OrthancPluginErrorCode_StorageAreaPlugin;
 }
 
@@ -112,19 +358,59 @@ static OrthancPluginErrorCode StorageRead(void** content,
                                           const char* uuid,
                                           OrthancPluginContentType type)
 {
-    Stopwatch timer;
+    Metrics::InFlight inFlight(getMetrics(), StorageOperation::READ);
+    OperationTrace trace(logger.get(), "read", uuid, type);
     bool ok = false;
     std::string path;
 
-    {
-        std::stringstream ss;
-        ss << "[S3] GET: " << uuid;
-        LogInfo(context, ss.str().c_str());
+    logger->Log(LogLevel::INFO, "[S3] GET: ", uuid);
+
+    const bool memoryCached = memoryCache && memoryCache->IsEnabled(type);
+
+    bool cached = memoryCached && memoryCache->Read(uuid, content, size);
+    if (cached) {
+        trace.SetSource("memory");
+    } else if (diskCache && diskCache->Read(uuid, content, size)) {
+        trace.SetSource("disk");
+        cached = true;
+        if (memoryCached) {
+            memoryCache->Insert(uuid, *content, *size);
+        }
+    }
+
+    if (!cached && journal && journal->Read(uuid, content, size)) {
+        //not uploaded yet
+        trace.SetSource("journal");
+        cached = true;
+    }
+
+    if (!cached && spool && spool->Read(uuid, content, size)) {
+        //written while S3 was down
+        trace.SetSource("spool");
+        cached = true;
+    }
+
+    if (cached) {
+        trace.SetSize(*size);
+        const uint64_t executionDuration = trace.Finish(true);
+        logger->Log(LogLevel::INFO, "[S3] GET ", uuid, " served from cache in ", executionDuration, "us");
+        getMetrics().RecordStorage(StorageOperation::READ, type, true, static_cast<uint64_t>(*size), executionDuration);
+
+        return OrthancPluginErrorCode_Success;
     }
+    trace.Mark("caches");
 
     try {
-        path = GetPathStorage(uuid);
-        ok = s3->DownloadFileFromS3(path, content, size);
+        path = uuid;
+        trace.SetSource("s3");
+        ok = DownloadAttachment(uuid, type, content, size);
+        trace.Mark("downloaded");
+        if (ok && memoryCached) {
+            memoryCache->Insert(uuid, *content, *size);
+        }
+        if (ok && diskCache) {
+            diskCache->Insert(uuid, *content, *size);
+        }
     } catch (Orthanc::OrthancException &e) {
         std::stringstream err;
         err << "[S3] Could not read file: " << path << ", " << e.What();
@@ -132,13 +418,12 @@ static OrthancPluginErrorCode StorageRead(void** content,
         ok = false;
     }
 
-
-    {
-        auto executionDuration = timer.elapsed();
-        std::stringstream ss;
-        ss << "[S3] GET " << uuid << " finished in " << executionDuration << "us";
-        LogInfo(context, ss.str().c_str());
+    if (ok) {
+        trace.SetSize(*size);
     }
+    const uint64_t executionDuration = trace.Finish(ok);
+    logger->Log(LogLevel::INFO, "[S3] GET ", uuid, " finished in ", executionDuration, "us");
+    getMetrics().RecordStorage(StorageOperation::READ, type, ok, ok ? static_cast<uint64_t>(*size) : 0, executionDuration);
 
     return ok ? OrthancPluginErrorCode_Success : OrthancPluginErrorCode_StorageAreaPlugin;
 }
@@ -147,36 +432,227 @@ static OrthancPluginErrorCode StorageRead(void** content,
 static OrthancPluginErrorCode StorageRemove(const char* uuid,
                                             OrthancPluginContentType type)
 {
+    Metrics::InFlight inFlight(getMetrics(), StorageOperation::REMOVE);
+    OperationTrace trace(logger.get(), "remove", uuid, type);
     bool ok = false;
-    std::string path;
-    Stopwatch timer;
 
-    {
-        std::stringstream ss;
-        ss << "[S3] DELETE: " << uuid;
-        LogInfo(context, ss.str().c_str());
-    }
+    logger->Log(LogLevel::INFO, "[S3] DELETE: ", uuid);
 
-    try {
-        path = GetPathStorage(uuid);
-        ok = s3->DeleteFileFromS3(path);
-    } catch (Orthanc::OrthancException &e) {
-        std::stringstream err;
-        err <<"[S3] Could not remove file: " << path << ", " << e.What();
-        LogError(context, err.str().c_str());
-        ok = false;
+    if (memoryCache) {
+        memoryCache->Remove(uuid);
+    }
+    if (diskCache) {
+        diskCache->Remove(uuid);
     }
 
-    {
-        auto executionDuration = timer.elapsed();
-        std::stringstream ss;
-        ss << "[S3] DELETE; " << uuid << " finished in " << executionDuration << "us";
-        LogInfo(context, ss.str().c_str());
+    if (journal && journal->Remove(uuid)) {
+        //never made it to S3, or its uploader deletes it once the PUT is over
+        trace.SetSource("journal");
+        ok = true;
+    } else if (spool && spool->Remove(uuid)) {
+        trace.SetSource("spool");
+        ok = true;
+    } else {
+        trace.SetSource("s3");
+        ok = RemoveAttachment(uuid, type);
     }
 
+    const uint64_t executionDuration = trace.Finish(ok);
+    logger->Log(LogLevel::INFO, "[S3] DELETE; ", uuid, " finished in ", executionDuration, "us");
+    getMetrics().RecordStorage(StorageOperation::REMOVE, type, ok, 0, executionDuration);
+
     return ok ? OrthancPluginErrorCode_Success: OrthancPluginErrorCode_StorageAreaPlugin;
 }
 
+static OrthancPluginErrorCode ServeMetrics(OrthancPluginRestOutput* output,
+                                           const char* /*url*/,
+                                           const OrthancPluginHttpRequest* request)
+{
+    if (request->method != OrthancPluginHttpMethod_Get) {
+        OrthancPluginSendMethodNotAllowed(context, output, "GET");
+        return OrthancPluginErrorCode_Success;
+    }
+
+    const std::string body = getMetrics().FormatPrometheus();
+    OrthancPluginAnswerBuffer(context, output, body.c_str(), static_cast<uint32_t>(body.size()),
+                              "text/plain; version=0.0.4");
+    return OrthancPluginErrorCode_Success;
+}
+
+//GET: progress of the last rebalance, POST: starts one
+static OrthancPluginErrorCode ServeRebalance(OrthancPluginRestOutput* output,
+                                             const char* /*url*/,
+                                             const OrthancPluginHttpRequest* request)
+{
+    if (request->method == OrthancPluginHttpMethod_Post) {
+        rebalancer->Start();
+    } else if (request->method != OrthancPluginHttpMethod_Get) {
+        OrthancPluginSendMethodNotAllowed(context, output, "GET,POST");
+        return OrthancPluginErrorCode_Success;
+    }
+
+    std::stringstream body;
+    body << "{\"running\": " << (rebalancer->IsRunning() ? "true" : "false")
+         << ", \"scanned\": " << rebalancer->GetScannedCount()
+         << ", \"moved\": " << rebalancer->GetMovedCount()
+         << ", \"failed\": " << rebalancer->GetFailedCount() << "}\n";
+    const std::string answer = body.str();
+    OrthancPluginAnswerBuffer(context, output, answer.c_str(), static_cast<uint32_t>(answer.size()), "application/json");
+    return OrthancPluginErrorCode_Success;
+}
+
+static void registerGauges() {
+    Metrics& m = getMetrics();
+    if (s3 && s3->GetRetryPolicy()) {
+        std::shared_ptr<RetryPolicy> retry = s3->GetRetryPolicy();
+        m.AddGauge("orthanc_s3_retries_throttling", "Requests retried after a throttling error",
+                   [retry]() { return static_cast<double>(retry->GetRetries(RetryClass::THROTTLING)); });
+        m.AddGauge("orthanc_s3_retries_transient", "Requests retried after a transient error",
+                   [retry]() { return static_cast<double>(retry->GetRetries(RetryClass::TRANSIENT)); });
+        m.AddGauge("orthanc_s3_retries_denied", "Retries refused by the retry budget",
+                   [retry]() { return static_cast<double>(retry->GetDenied()); });
+        m.AddGauge("orthanc_s3_retries_exhausted", "Requests failed after their last retry",
+                   [retry]() { return static_cast<double>(retry->GetExhausted()); });
+        m.AddGauge("orthanc_s3_retry_budget", "Retries the budget allows right now",
+                   [retry]() { return retry->GetBudget(); });
+    }
+    if (s3 && s3->GetCircuitBreaker()) {
+        std::shared_ptr<CircuitBreaker> breaker = s3->GetCircuitBreaker();
+        m.AddGauge("orthanc_s3_breaker_open", "1 while S3 is considered down",
+                   [breaker]() { return breaker->IsOpen() ? 1.0 : 0.0; });
+        m.AddGauge("orthanc_s3_breaker_trips", "Times the circuit breaker opened",
+                   [breaker]() { return static_cast<double>(breaker->GetTrips()); });
+        m.AddGauge("orthanc_s3_breaker_rejected", "Requests failed at once by the open breaker",
+                   [breaker]() { return static_cast<double>(breaker->GetRejected()); });
+        m.AddGauge("orthanc_s3_breaker_time_to_trip_seconds", "From the first failure to the last trip",
+                   [breaker]() { return breaker->GetLastTimeToTrip() / 1e6; });
+        m.AddGauge("orthanc_s3_breaker_time_to_recover_seconds", "From the last trip to the first answer of S3",
+                   [breaker]() { return breaker->GetLastTimeToRecover() / 1e6; });
+        m.AddGauge("orthanc_s3_breaker_open_seconds", "Time since the breaker opened, 0 when closed",
+                   [breaker]() { return breaker->GetOpenTime() / 1e6; });
+    }
+    if (s3) {
+        //summed over the buckets, only those with several endpoints count
+        std::vector<std::shared_ptr<EndpointBalancer> > balancers;
+        for (size_t i = 0; i < s3->GetTargetCount(); ++i) {
+            if (s3->GetEndpointBalancer(i)->GetSize() > 1) {
+                balancers.push_back(s3->GetEndpointBalancer(i));
+            }
+        }
+        if (!balancers.empty()) {
+            m.AddGauge("orthanc_s3_endpoints_ejected", "Endpoints getting no requests after failing",
+                       [balancers]() {
+                size_t ejected = 0;
+                for (const auto& b : balancers) {
+                    ejected += b->GetEjectedCount();
+                }
+                return static_cast<double>(ejected);
+            });
+            m.AddGauge("orthanc_s3_endpoint_ejections", "Times an endpoint was ejected",
+                       [balancers]() {
+                uint64_t ejections = 0;
+                for (const auto& b : balancers) {
+                    for (size_t i = 0; i < b->GetSize(); ++i) {
+                        ejections += b->GetEjections(i);
+                    }
+                }
+                return static_cast<double>(ejections);
+            });
+        }
+    }
+    if (spool) {
+        m.AddGauge("orthanc_s3_spool_pending", "Attachments in the spool, waiting for S3",
+                   []() { return static_cast<double>(spool->GetPendingCount()); });
+    }
+    if (s3 && s3->GetHedgePolicy()) {
+        std::shared_ptr<HedgePolicy> hedge = s3->GetHedgePolicy();
+        m.AddGauge("orthanc_s3_hedged_gets", "GETs sent a second time after a slow first byte",
+                   [hedge]() { return static_cast<double>(hedge->GetHedges()); });
+        m.AddGauge("orthanc_s3_hedge_wins", "Hedged GETs answered first by the second request",
+                   [hedge]() { return static_cast<double>(hedge->GetWins()); });
+        m.AddGauge("orthanc_s3_hedge_delay_seconds", "Current first byte delay before hedging a GET",
+                   [hedge]() { return hedge->GetDelay() / 1e6; });
+    }
+    if (s3 && s3->GetExecutor()) {
+        std::shared_ptr<MonitoredExecutor> executor = s3->GetExecutor();
+        m.AddGauge("orthanc_s3_transfer_executor_active", "TransferManager tasks running",
+                   [executor]() { return static_cast<double>(executor->GetActive()); });
+        m.AddGauge("orthanc_s3_transfer_executor_queued", "TransferManager tasks waiting for a thread",
+                   [executor]() { return static_cast<double>(executor->GetQueued()); });
+        m.AddGauge("orthanc_s3_transfer_executor_peak_queued", "Most TransferManager tasks waiting at once",
+                   [executor]() { return static_cast<double>(executor->GetPeakQueued()); });
+    }
+    if (journal) {
+        m.AddGauge("orthanc_s3_journal_pending", "Attachments waiting in the write-back journal",
+                   []() { return static_cast<double>(journal->GetPendingCount()); });
+    }
+    if (deleter) {
+        m.AddGauge("orthanc_s3_delete_queue_pending", "Keys waiting for a background delete",
+                   []() { return static_cast<double>(deleter->GetPendingCount()); });
+    }
+    if (memoryCache) {
+        m.AddGauge("orthanc_s3_memory_cache_bytes", "Bytes held in the memory cache",
+                   []() { return static_cast<double>(memoryCache->GetSize()); });
+        m.AddGauge("orthanc_s3_memory_cache_hit_ratio", "Memory cache hit ratio since start",
+                   []() { return memoryCache->GetHitRatio(); });
+    }
+    if (diskCache) {
+        m.AddGauge("orthanc_s3_disk_cache_bytes", "Bytes held in the disk cache",
+                   []() { return static_cast<double>(diskCache->GetSize()); });
+    }
+    if (packer) {
+        m.AddGauge("orthanc_s3_packs", "Pack objects in the pack index",
+                   []() { return static_cast<double>(packer->GetPackCount()); });
+    }
+    if (dedup) {
+        m.AddGauge("orthanc_s3_dedup_saved_bytes", "Bytes not uploaded thanks to deduplication",
+                   []() { return static_cast<double>(dedup->GetSavedBytes()); });
+    }
+    if (compressor) {
+        m.AddGauge("orthanc_s3_compression_bytes_in", "Bytes given to the compressor",
+                   []() { return static_cast<double>(compressor->GetBytesIn()); });
+        m.AddGauge("orthanc_s3_compression_bytes_out", "Bytes produced by the compressor",
+                   []() { return static_cast<double>(compressor->GetBytesOut()); });
+    }
+}
+
+//an endpoint or a list of equivalent ones
+static bool parseEndpoints(const Json::Value& value, std::vector<std::string>& endpoints) {
+    endpoints.clear();
+    if (value.isNull()) {
+        return true;
+    }
+    if (value.isString()) {
+        if (!value.asString().empty()) {
+            endpoints.push_back(value.asString());
+        }
+        return true;
+    }
+    if (!value.isArray()) {
+        return false;
+    }
+    for (const auto& endpoint : value) {
+        if (!endpoint.isString() || endpoint.asString().empty()) {
+            return false;
+        }
+        endpoints.push_back(endpoint.asString());
+    }
+    return true;
+}
+
+static bool parseContentType(const std::string& name, OrthancPluginContentType& type) {
+    if (boost::iequals(name, "dicom")) {
+        type = OrthancPluginContentType_Dicom;
+    } else if (boost::iequals(name, "dicom_as_json")) {
+        type = OrthancPluginContentType_DicomAsJson;
+    } else if (boost::iequals(name, "unknown")) {
+        type = OrthancPluginContentType_Unknown;
+    } else {
+        return false;
+    }
+    return true;
+}
+
 bool readS3Configuration(OrthancPluginContext* context, S3PluginContext& c) {
 
     OrthancPlugins::OrthancConfiguration configuration(context);
@@ -205,7 +681,34 @@ bool readS3Configuration(OrthancPluginContext* context, S3PluginContext& c) {
 
     c.s3_region = s3_configuration.GetStringValue("aws_region", AWS_DEFAULT_REGION).c_str();
     c.s3_bucket_name = s3_configuration.GetStringValue("s3_bucket", AWS_DEFAULT_BUCKET_MAME).c_str();
-    c.s3_endpoint = s3_configuration.GetStringValue("s3_endpoint", "").c_str();
+    if (!parseEndpoints(s3_configuration.GetJson()["s3_endpoint"], c.s3_endpoints)) {
+        LogError(context, "[S3] s3_endpoint must be a URL or a list of URLs");
+        return false;
+    }
+
+    //several buckets, possibly on several endpoints, instead of s3_bucket
+    const Json::Value& targets = s3_configuration.GetJson()["s3_targets"];
+    if (!targets.isNull()) {
+        if (!targets.isArray()) {
+            LogError(context, "[S3] s3_targets must be a list of {\"bucket\": ..., \"endpoint\": ...}");
+            return false;
+        }
+        for (const auto& target : targets) {
+            S3Target t;
+            if (!target.isObject() || !target["bucket"].isString() ||
+                    !parseEndpoints(target["endpoint"], t.endpoints)) {
+                LogError(context, "[S3] s3_targets must be a list of {\"bucket\": ..., \"endpoint\": ...}");
+                return false;
+            }
+            t.bucket = target["bucket"].asString();
+            c.s3_targets.push_back(t);
+        }
+    }
+    c.rebalance_threads = s3_configuration.GetUnsignedIntegerValue("rebalance_threads", c.rebalance_threads);
+
+    //several endpoints of a bucket: ejection of the failing ones, health checks
+    c.s3_options.eject_failures = s3_configuration.GetUnsignedIntegerValue("endpoint_eject_failures", c.s3_options.eject_failures);
+    c.s3_options.health_check_ms = s3_configuration.GetUnsignedIntegerValue("endpoint_health_check_ms", c.s3_options.health_check_ms);
 
     std::string method;
     s3_configuration.LookupStringValue(method, "implementation");
@@ -215,6 +718,149 @@ bool readS3Configuration(OrthancPluginContext* context, S3PluginContext& c) {
         c.s3_method = S3Method::TRANSFER_MANAGER;
     } // else default is DIRECT
 
+    c.s3_options.download_part_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("download_part_size_mb", static_cast<unsigned int>(c.s3_options.download_part_size / (1024 * 1024)))) * 1024 * 1024;
+    c.s3_options.download_concurrency = s3_configuration.GetUnsignedIntegerValue("download_concurrency", c.s3_options.download_concurrency);
+
+    //retries of every request, instead of the SDK ones
+    c.s3_options.max_retries = s3_configuration.GetUnsignedIntegerValue("max_retries", c.s3_options.max_retries);
+    c.s3_options.retry_base_delay_ms = s3_configuration.GetUnsignedIntegerValue("retry_base_delay_ms", c.s3_options.retry_base_delay_ms);
+    c.s3_options.retry_max_delay_ms = s3_configuration.GetUnsignedIntegerValue("retry_max_delay_ms", c.s3_options.retry_max_delay_ms);
+    c.s3_options.retry_budget_percent = s3_configuration.GetUnsignedIntegerValue("retry_budget_percent", c.s3_options.retry_budget_percent);
+
+    //circuit breaker and local spool while S3 is down, disabled by default
+    c.s3_options.breaker_failures = s3_configuration.GetUnsignedIntegerValue("circuit_breaker_failures", c.s3_options.breaker_failures);
+    c.breaker_probe_ms = s3_configuration.GetUnsignedIntegerValue("circuit_breaker_probe_ms", c.breaker_probe_ms);
+
+    //slow GETs sent a second time, disabled by default
+    c.s3_options.hedge_reads = s3_configuration.GetBooleanValue("hedge_reads", c.s3_options.hedge_reads);
+    c.s3_options.hedge_percentile = s3_configuration.GetUnsignedIntegerValue("hedge_percentile", c.s3_options.hedge_percentile);
+    c.s3_options.hedge_budget_percent = s3_configuration.GetUnsignedIntegerValue("hedge_budget_percent", c.s3_options.hedge_budget_percent);
+    c.s3_options.hedge_min_delay_ms = s3_configuration.GetUnsignedIntegerValue("hedge_min_delay_ms", c.s3_options.hedge_min_delay_ms);
+
+    //HTTP client tuning
+    c.s3_options.max_connections = s3_configuration.GetUnsignedIntegerValue("max_connections", c.s3_options.max_connections);
+    c.s3_options.connect_timeout_ms = s3_configuration.GetUnsignedIntegerValue("connect_timeout_ms", c.s3_options.connect_timeout_ms);
+    c.s3_options.request_timeout_ms = s3_configuration.GetUnsignedIntegerValue("request_timeout_ms", c.s3_options.request_timeout_ms);
+    c.s3_options.low_speed_limit = s3_configuration.GetUnsignedIntegerValue("low_speed_limit", c.s3_options.low_speed_limit);
+    c.s3_options.tcp_keep_alive = s3_configuration.GetBooleanValue("tcp_keep_alive", c.s3_options.tcp_keep_alive);
+    c.s3_options.tcp_keep_alive_interval_ms = s3_configuration.GetUnsignedIntegerValue("tcp_keep_alive_interval_ms", c.s3_options.tcp_keep_alive_interval_ms);
+    c.s3_options.tcp_nodelay = s3_configuration.GetBooleanValue("tcp_nodelay", c.s3_options.tcp_nodelay);
+    c.s3_options.executor_threads = s3_configuration.GetUnsignedIntegerValue("executor_threads", c.s3_options.executor_threads);
+    c.s3_options.prewarm_connections = s3_configuration.GetUnsignedIntegerValue("prewarm_connections", c.s3_options.prewarm_connections);
+
+    //TransferManager pool, sized from the available cores by default
+    c.s3_options.transfer_threads = s3_configuration.GetUnsignedIntegerValue("transfer_threads", c.s3_options.transfer_threads);
+    c.s3_options.transfer_buffer_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("transfer_buffer_size_mb", static_cast<unsigned int>(c.s3_options.transfer_buffer_size / (1024 * 1024)))) * 1024 * 1024;
+    c.s3_options.transfer_max_heap_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("transfer_max_heap_size_mb", static_cast<unsigned int>(c.s3_options.transfer_max_heap_size / (1024 * 1024)))) * 1024 * 1024;
+
+    //local read-through cache, disabled by default
+    c.disk_cache_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("disk_cache_size_mb", 0)) * 1024 * 1024;
+
+    //write-back ingest through a local journal, disabled by default
+    c.write_back = s3_configuration.GetBooleanValue("write_back", c.write_back);
+    c.write_back_uploaders = s3_configuration.GetUnsignedIntegerValue("write_back_uploaders", c.write_back_uploaders);
+    c.write_back_segment_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("write_back_segment_size_mb", 64)) * 1024 * 1024;
+
+    //object keys, existing buckets keep working with a legacy fallback
+    s3_configuration.LookupStringValue(c.key_layout, "key_layout");
+    c.key_prefix_length = s3_configuration.GetUnsignedIntegerValue("key_prefix_length", c.key_prefix_length);
+    s3_configuration.LookupStringValue(c.key_layout_fallback, "key_layout_fallback");
+
+    //StorageRemove only queues the keys, batched DeleteObjects in the background
+    c.background_delete = s3_configuration.GetBooleanValue("background_delete", c.background_delete);
+
+    //small attachments packed into shared objects, disabled by default
+    c.pack_threshold = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("pack_threshold_kb", 0)) * 1024;
+    c.pack_max_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("pack_max_size_mb", 16)) * 1024 * 1024;
+    c.pack_window_ms = s3_configuration.GetUnsignedIntegerValue("pack_window_ms", c.pack_window_ms);
+    c.pack_uploaders = s3_configuration.GetUnsignedIntegerValue("pack_uploaders", c.pack_uploaders);
+
+    //compression per content type, disabled by default
+    const std::pair<const char*, OrthancPluginContentType> compressionKeys[] = {
+        {"compression_dicom", OrthancPluginContentType_Dicom},
+        {"compression_dicom_as_json", OrthancPluginContentType_DicomAsJson},
+        {"compression_unknown", OrthancPluginContentType_Unknown}
+    };
+    for (const auto& key : compressionKeys) {
+        std::string name = "none";
+        s3_configuration.LookupStringValue(name, key.first);
+        CompressionCodec codec;
+        if (!parseCompressionCodec(name, codec)) {
+            std::stringstream ss;
+            ss << "[S3] Unknown or unavailable codec in " << key.first << ": " << name;
+            LogError(context, ss.str().c_str());
+            return false;
+        }
+        if (codec != CompressionCodec::NONE) {
+            c.compression_codecs[key.second] = codec;
+        }
+    }
+    c.compression_threshold = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("compression_threshold_kb", 4)) * 1024;
+    c.compression_chunk_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("compression_chunk_size_mb", 4)) * 1024 * 1024;
+    c.compression_threads = s3_configuration.GetUnsignedIntegerValue("compression_threads", c.compression_threads);
+    c.compression_level = static_cast<int>(s3_configuration.GetUnsignedIntegerValue("compression_level", 0));
+    c.compression_adaptive = s3_configuration.GetBooleanValue("compression_adaptive", c.compression_adaptive);
+
+    //content-addressed storage, disabled by default
+    c.deduplication = s3_configuration.GetBooleanValue("deduplication", c.deduplication);
+
+    std::list<std::string> dedupTypeNames;
+    if (!s3_configuration.LookupListOfStrings(dedupTypeNames, "deduplication_content_types", true)) {
+        dedupTypeNames.push_back("dicom");
+    }
+    for (const auto& name : dedupTypeNames) {
+        OrthancPluginContentType type;
+        if (parseContentType(name, type)) {
+            c.deduplication_types.insert(type);
+        } else {
+            std::stringstream ss;
+            ss << "[S3] Unknown content type in deduplication_content_types: " << name;
+            LogWarning(context, ss.str().c_str());
+        }
+    }
+
+    //hot path logging, info needs Orthanc --verbose as well
+    std::string logLevel = "warning";
+    s3_configuration.LookupStringValue(logLevel, "log_level");
+    if (!parseLogLevel(logLevel, c.log_level)) {
+        std::stringstream ss;
+        ss << "[S3] Unknown log_level: " << logLevel;
+        LogError(context, ss.str().c_str());
+        return false;
+    }
+    std::string awsLogLevel = "warn";
+    s3_configuration.LookupStringValue(awsLogLevel, "aws_log_level");
+    if (!parseAwsLogLevel(awsLogLevel, c.s3_options.aws_log_level)) {
+        std::stringstream ss;
+        ss << "[S3] Unknown aws_log_level: " << awsLogLevel;
+        LogError(context, ss.str().c_str());
+        return false;
+    }
+    c.trace_sample_every = s3_configuration.GetUnsignedIntegerValue("trace_sample_every", c.trace_sample_every);
+    c.slow_request_ms = s3_configuration.GetUnsignedIntegerValue("slow_request_ms", c.slow_request_ms);
+
+    //Prometheus endpoint at /s3/metrics
+    c.metrics = s3_configuration.GetBooleanValue("metrics", c.metrics);
+
+    //in-memory cache of small hot attachments, disabled by default
+    c.memory_cache_size = static_cast<uint64_t>(s3_configuration.GetUnsignedIntegerValue("memory_cache_size_mb", 0)) * 1024 * 1024;
+    c.memory_cache_shards = s3_configuration.GetUnsignedIntegerValue("memory_cache_shards", c.memory_cache_shards);
+
+    std::list<std::string> types;
+    if (!s3_configuration.LookupListOfStrings(types, "memory_cache_content_types", true)) {
+        types.push_back("dicom_as_json");
+    }
+    for (const auto& name : types) {
+        OrthancPluginContentType type;
+        if (parseContentType(name, type)) {
+            c.memory_cache_types.insert(type);
+        } else {
+            std::stringstream ss;
+            ss << "[S3] Unknown content type in memory_cache_content_types: " << name;
+            LogWarning(context, ss.str().c_str());
+        }
+    }
+
 
     // Log stuff
     if (!c.s3_access_key.empty())
@@ -227,9 +873,38 @@ bool readS3Configuration(OrthancPluginContext* context, S3PluginContext& c) {
     LogInfo(context, log_region.str().c_str());
 
     std::stringstream log_bucket;
-    log_bucket << "[S3] Aws bucket: " << c.s3_bucket_name;
+    if (c.s3_targets.empty()) {
+        log_bucket << "[S3] Aws bucket: " << c.s3_bucket_name;
+    } else {
+        log_bucket << "[S3] Aws buckets:";
+        for (const auto& target : c.s3_targets) {
+            log_bucket << " " << target.bucket;
+            for (size_t i = 0; i < target.endpoints.size(); ++i) {
+                log_bucket << (i == 0 ? "@" : ",") << target.endpoints[i];
+            }
+        }
+    }
     LogInfo(context, log_bucket.str().c_str());
 
+    if (c.disk_cache_size > 0) {
+        std::stringstream log_cache;
+        log_cache << "[S3] Disk cache: " << c.disk_cache_size << " bytes in " << indexDir;
+        LogInfo(context, log_cache.str().c_str());
+    }
+
+    if (c.write_back) {
+        std::stringstream log_journal;
+        log_journal << "[S3] Write-back enabled, " << c.write_back_uploaders << " uploaders";
+        LogInfo(context, log_journal.str().c_str());
+    }
+
+    if (c.memory_cache_size > 0) {
+        std::stringstream log_cache;
+        log_cache << "[S3] Memory cache: " << c.memory_cache_size << " bytes in "
+                  << c.memory_cache_shards << " shards";
+        LogInfo(context, log_cache.str().c_str());
+    }
+
     return true;
 }
 
@@ -261,6 +936,10 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext* plugin
         return EXIT_FAILURE;
     }
 
+    logger = std::make_shared<AsyncLog>(context, c.log_level, c.trace_sample_every,
+                                        static_cast<uint64_t>(c.slow_request_ms) * 1000);
+    logger->Start();
+
     //Initialization of AWS SDK
     //s3 = std::unique_ptr<S3Facade>(new S3Facade(c.s3_method, context));
     if (c.s3_method == S3Method::DIRECT) {
@@ -269,20 +948,229 @@ ORTHANC_PLUGINS_API int32_t OrthancPluginInitialize(OrthancPluginContext* plugin
         s3 = std::unique_ptr<S3Impl>(new S3TransferManager(context));
     }
 
-    if (!s3->ConfigureAwsSdk(c.s3_access_key, c.s3_secret_key, c.s3_bucket_name, c.s3_region, c.s3_endpoint)) {
+    keyLayout = createKeyLayout(c.key_layout, c.key_prefix_length, indexDir + "/s3-keys.log");
+    if (!keyLayout) {
+        std::stringstream ss;
+        ss << "[S3] Invalid key_layout: " << c.key_layout;
+        LogError(context, ss.str().c_str());
+        return EXIT_FAILURE;
+    }
+    if (!c.key_layout_fallback.empty() && c.key_layout_fallback != c.key_layout) {
+        legacyLayout = createKeyLayout(c.key_layout_fallback, c.key_prefix_length, indexDir + "/s3-keys.log");
+        if (!legacyLayout) {
+            std::stringstream ss;
+            ss << "[S3] Invalid key_layout_fallback: " << c.key_layout_fallback;
+            LogError(context, ss.str().c_str());
+            return EXIT_FAILURE;
+        }
+    }
+
+    s3->SetOptions(c.s3_options);
+    s3->SetLog(logger);
+    if (c.s3_targets.empty()) {
+        c.s3_targets.push_back(S3Target{c.s3_bucket_name, c.s3_endpoints});
+    }
+    if (!s3->ConfigureAwsSdk(c.s3_access_key, c.s3_secret_key, c.s3_targets, c.s3_region)) {
+        return EXIT_FAILURE;
+    }
+
+    if (c.disk_cache_size > 0) {
+        diskCache = std::unique_ptr<DiskCache>(new DiskCache(context, indexDir, c.disk_cache_size, GetPathInstance));
+        diskCache->Load();
+    }
+
+    if (c.memory_cache_size > 0) {
+        memoryCache = std::unique_ptr<MemoryCache>(new MemoryCache(c.memory_cache_size, c.memory_cache_shards, c.memory_cache_types));
+    }
+
+    if (c.background_delete) {
+        deleter = std::unique_ptr<Deleter>(new Deleter(context, indexDir + "/s3-delete-queue.log", S3Impl::MAX_DELETE_BATCH,
+                                                       [](const std::vector<std::string>& paths, std::vector<std::string>& failed) {
+            return s3->DeleteFilesFromS3(paths, failed);
+        }));
+        if (!deleter->Start()) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (s3->GetCircuitBreaker()) {
+        spool = std::unique_ptr<Spool>(new Spool(context, indexDir + "/s3-spool", s3->GetCircuitBreaker(),
+                                                 UploadAttachment, RemoveAttachment,
+                                                 []() { return s3->Probe(); },
+                                                 std::chrono::milliseconds(c.breaker_probe_ms)));
+    }
+
+    decompressionThreads = c.compression_threads > 0 ? c.compression_threads : Utils::getAvailableCores();
+    if (!c.compression_codecs.empty()) {
+        compressor = std::unique_ptr<Compressor>(new Compressor(c.compression_codecs, c.compression_threshold,
+                                                                c.compression_chunk_size, decompressionThreads,
+                                                                c.compression_level, c.compression_adaptive));
+    }
+
+    if (c.deduplication) {
+        dedupTypes = c.deduplication_types;
+        //the last reference deletes synchronously, see Dedup::Remove
+        dedup = std::unique_ptr<Dedup>(new Dedup(context, indexDir + "/s3-dedup.log", [](const std::string& key) {
+            return s3->DeleteFileFromS3(key);
+        }));
+        if (!dedup->Load()) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (c.pack_threshold > 0) {
+        packThreshold = std::min(c.pack_threshold, c.pack_max_size);
+        packer = std::unique_ptr<Packer>(new Packer(context, indexDir + "/s3-packs.log", c.pack_max_size,
+                                                    std::chrono::milliseconds(c.pack_window_ms),
+                                                    [](const std::string& path, const void* content, int64_t size) {
+            return s3->UploadFileToS3(path, content, size);
+        }));
+        if (!packer->Start(c.pack_uploaders)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (c.write_back) {
+        journal = std::unique_ptr<Journal>(new Journal(context, indexDir + "/s3-journal", c.write_back_segment_size,
+                                                       UploadAttachment, RemoveAttachment));
+        if (!journal->Start(c.write_back_uploaders)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (spool && !spool->Start()) {
         return EXIT_FAILURE;
     }
 
     OrthancPluginRegisterStorageArea(context, StorageCreate, StorageRead, StorageRemove);
 
+    if (c.metrics) {
+        registerGauges();
+        OrthancPluginRegisterRestCallback(context, "/s3/metrics", ServeMetrics);
+    }
+
+    //moves objects to the bucket added last, on demand
+    if (s3->GetTargetCount() > 1) {
+        rebalancer = std::unique_ptr<Rebalancer>(new Rebalancer(context, s3->GetTargetCount(),
+                                                                [](size_t target, const std::function<bool(const std::string&)>& visit) {
+            return s3->ListObjects(target, visit);
+        }, [](const std::string& key) {
+            return s3->GetOwner(key);
+        }, [](const std::string& key, size_t from) {
+            return s3->MoveObject(key, from);
+        }, c.rebalance_threads));
+        OrthancPluginRegisterRestCallback(context, "/s3/rebalance", ServeRebalance);
+    }
+
     return 0;
 }
 
 
 ORTHANC_PLUGINS_API void OrthancPluginFinalize()
 {
+    if (memoryCache) {
+        std::stringstream ss;
+        ss << "[S3] Memory cache hit ratio: " << memoryCache->GetHitRatio()
+           << " (" << memoryCache->GetHits() << " hits, " << memoryCache->GetMisses() << " misses)";
+        LogWarning(context, ss.str().c_str());
+    }
+
+    if (rebalancer) {
+        rebalancer->Stop();
+    }
+    if (journal) {
+        journal->Stop();
+    }
+    if (spool) {
+        spool->Stop();
+    }
+
+    for (size_t t = 0; s3 && t < s3->GetTargetCount(); ++t) {
+        std::shared_ptr<EndpointBalancer> balancer = s3->GetEndpointBalancer(t);
+        if (balancer->GetSize() < 2) {
+            continue;
+        }
+        for (size_t i = 0; i < balancer->GetSize(); ++i) {
+            std::stringstream ss;
+            ss << "[S3] Endpoint " << balancer->GetName(i) << ": " << balancer->GetRequests(i)
+               << " requests, latency " << balancer->GetLatency(i) << "us, "
+               << balancer->GetEjections(i) << " ejections";
+            LogWarning(context, ss.str().c_str());
+        }
+    }
+
+    const std::pair<S3Call, const char*> latencyCalls[] = {{S3Call::GET, "GET"}, {S3Call::PUT, "PUT"}};
+    for (const auto& call : latencyCalls) {
+        const auto latency = getMetrics().GetS3Latency(call.first);
+        if (latency.GetCount() > 0) {
+            std::stringstream ss;
+            ss << "[S3] " << call.second << " latency: p50 " << latency.GetPercentile(50)
+               << "us, p99 " << latency.GetPercentile(99) << "us, p999 " << latency.GetPercentile(99.9)
+               << "us, max " << latency.GetMax() << "us (" << latency.GetCount() << " requests)";
+            LogWarning(context, ss.str().c_str());
+        }
+    }
+
+    if (s3 && s3->GetExecutor()) {
+        std::shared_ptr<MonitoredExecutor> executor = s3->GetExecutor();
+        std::stringstream ss;
+        ss << "[S3] TransferManager executor: " << executor->GetThreads() << " threads, "
+           << executor->GetCompleted() << " tasks, peak waiting: " << executor->GetPeakQueued();
+        LogWarning(context, ss.str().c_str());
+
+        if (executor->GetPeakQueued() > executor->GetThreads()) {
+            LogWarning(context, "[S3] TransferManager executor was saturated, consider raising transfer_threads");
+        }
+    }
+
+    if (dedup) {
+        std::stringstream ss;
+        ss << "[S3] Deduplication: " << dedup->GetHits() << " duplicates, "
+           << dedup->GetSavedBytes() << " bytes not uploaded";
+        LogWarning(context, ss.str().c_str());
+    }
+
+    if (compressor && compressor->GetBytesIn() > 0) {
+        std::stringstream ss;
+        ss << "[S3] Compression ratio: " << static_cast<double>(compressor->GetBytesIn()) / compressor->GetBytesOut()
+           << " (" << compressor->GetBytesIn() << " -> " << compressor->GetBytesOut() << " bytes, "
+           << compressor->GetSkipped() << " skipped under load)";
+        LogWarning(context, ss.str().c_str());
+    }
+
+    if (packer) {
+        packer->Stop();
+    }
+    if (deleter) {
+        deleter->Stop();
+    }
+
+    //gauges capture the globals below
+    getMetrics().ClearGauges();
+
+    rebalancer.reset();
+    journal.reset();
+    spool.reset();
+    packer.reset();
+    compressor.reset();
+    dedup.reset();
+    deleter.reset();
+    legacyLayout.reset();
+    keyLayout.reset();
+    memoryCache.reset();
+    diskCache.reset();
+    //no health check or hedged GET may outlive the context
+    if (s3) {
+        s3->Shutdown();
+    }
     s3.release();
 
+    //the SDK log system keeps its reference, s3 is never shut down
+    if (logger) {
+        logger->Stop();
+        logger.reset();
+    }
+
     LogWarning(context, "[S3] Storage plugin is finalizing");
 }
 
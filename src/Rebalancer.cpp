@@ -0,0 +1,151 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Rebalancer.hpp"
+#include "Timer.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+namespace OrthancPlugins {
+
+const size_t Rebalancer::MAX_QUEUED;
+
+Rebalancer::Rebalancer(OrthancPluginContext *c,
+                       size_t targets,
+                       ListFunction list,
+                       OwnerFunction owner,
+                       MoveFunction move,
+                       unsigned int threads):
+    _context(c),
+    _targets(targets),
+    _list(list),
+    _owner(owner),
+    _move(move),
+    _threads(std::max(threads, 1u)),
+    _running(false),
+    _scanned(0),
+    _moved(0),
+    _failed(0)
+{
+}
+
+Rebalancer::~Rebalancer() {
+    Stop();
+}
+
+bool Rebalancer::Start() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_running) {
+        return false;
+    }
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+
+    _queue.clear();
+    _listed = false;
+    _stop = false;
+    _scanned = 0;
+    _moved = 0;
+    _failed = 0;
+    _running = true;
+    _thread = std::thread(&Rebalancer::Run, this);
+    return true;
+}
+
+void Rebalancer::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void Rebalancer::Run() {
+    Stopwatch timer;
+    LogWarning(_context, "[S3] Rebalance started");
+
+    std::vector<std::thread> movers;
+    for (unsigned int i = 0; i < _threads; ++i) {
+        movers.emplace_back(&Rebalancer::Mover, this);
+    }
+
+    bool listed = true;
+    for (size_t target = 0; target < _targets; ++target) {
+        listed = _list(target, [this, target](const std::string& key) {
+            _scanned++;
+            if (_owner(key) == target) {
+                return true;
+            }
+            std::unique_lock<std::mutex> lock(_mutex);
+            _cv.wait(lock, [this]() { return _stop || _queue.size() < MAX_QUEUED; });
+            if (_stop) {
+                return false;
+            }
+            _queue.push_back(std::make_pair(key, target));
+            _cv.notify_all();
+            return true;
+        }) && listed;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _listed = true;
+        listed = listed && !_stop;
+    }
+    _cv.notify_all();
+    for (auto& m : movers) {
+        m.join();
+    }
+
+    std::stringstream ss;
+    ss << "[S3] Rebalance " << (listed ? "done" : "interrupted") << " in " << timer.elapsed() / 1000000 << " s: "
+       << _scanned << " objects, " << _moved << " moved, " << _failed << " failed";
+    LogWarning(_context, ss.str().c_str());
+    _running = false;
+}
+
+void Rebalancer::Mover() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+        _cv.wait(lock, [this]() { return _stop || _listed || !_queue.empty(); });
+        if (_stop || _queue.empty()) {
+            return;
+        }
+        const std::pair<std::string, size_t> item = _queue.front();
+        _queue.pop_front();
+        _cv.notify_all();
+
+        lock.unlock();
+        if (_move(item.first, item.second)) {
+            _moved++;
+        } else {
+            _failed++;
+        }
+        lock.lock();
+    }
+}
+
+}
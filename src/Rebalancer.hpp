@@ -0,0 +1,105 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef REBALANCER_HPP
+#define REBALANCER_HPP
+
+#include "OrthancPluginCppWrapper.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * Moves the objects the HashRing places on another target, after a
+ * target was added.
+ *
+ * Every target is listed in turn and only the keys it doesn't own any more
+ * are queued, so what moves is the share of the new target and nothing
+ * else. A pool of threads copies each of them to its owner and deletes the
+ * original. Until then reads fall back to the previous owner, so the
+ * plugin keeps serving while a rebalance runs.
+ */
+class Rebalancer
+{
+public:
+    //calls visit with every key of a target until it returns false
+    typedef std::function<bool(size_t target, const std::function<bool(const std::string& key)>& visit)> ListFunction;
+    typedef std::function<size_t(const std::string& key)> OwnerFunction;
+    //copies the key from a target to its owner, deletes the original
+    typedef std::function<bool(const std::string& key, size_t from)> MoveFunction;
+
+    //keys listed ahead of the movers
+    static const size_t MAX_QUEUED = 10000;
+
+private:
+    OrthancPluginContext* _context;
+    size_t _targets;
+    ListFunction _list;
+    OwnerFunction _owner;
+    MoveFunction _move;
+    unsigned int _threads;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::deque<std::pair<std::string, size_t> > _queue;
+    bool _listed = false;
+    bool _stop = false;
+    std::thread _thread;
+    std::atomic<bool> _running;
+
+    std::atomic<uint64_t> _scanned;
+    std::atomic<uint64_t> _moved;
+    std::atomic<uint64_t> _failed;
+
+    void Run();
+    void Mover();
+
+public:
+    Rebalancer(OrthancPluginContext* c,
+               size_t targets,
+               ListFunction list,
+               OwnerFunction owner,
+               MoveFunction move,
+               unsigned int threads);
+    ~Rebalancer();
+
+    //false if a rebalance is running already
+    bool Start();
+    //waits for the objects being moved
+    void Stop();
+    bool IsRunning() const { return _running; };
+
+    uint64_t GetScannedCount() const { return _scanned; };
+    uint64_t GetMovedCount() const { return _moved; };
+    uint64_t GetFailedCount() const { return _failed; };
+};
+
+}
+#endif // REBALANCER_HPP
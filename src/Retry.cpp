@@ -0,0 +1,125 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Retry.hpp"
+
+#include <algorithm>
+#include <random>
+
+namespace {
+  const char* THROTTLING_CODES[] = {
+      "SlowDown",
+      "Throttling",
+      "ThrottlingException",
+      "ThrottledException",
+      "RequestThrottled",
+      "RequestThrottledException",
+      "TooManyRequestsException",
+      "RequestLimitExceeded",
+      "BandwidthLimitExceeded",
+      "ProvisionedThroughputExceededException"
+  };
+
+  const char* TRANSIENT_CODES[] = {
+      "RequestTimeout",
+      "RequestTimeoutException",
+      "InternalError",
+      "ServiceUnavailable",
+      "PriorRequestNotComplete"
+  };
+
+  template <size_t N>
+  bool contains(const char* (&codes)[N], const std::string& code) {
+      return std::find(codes, codes + N, code) != codes + N;
+  }
+
+  uint64_t uniform(uint64_t max) {
+      thread_local std::minstd_rand rng(std::random_device{}());
+      return std::uniform_int_distribution<uint64_t>(0, max)(rng);
+  }
+}
+
+namespace OrthancPlugins {
+
+const int64_t RetryPolicy::MAX_BURST;
+const uint64_t RetryPolicy::THROTTLE_FACTOR;
+const int64_t RetryPolicy::TOKEN;
+
+RetryPolicy::RetryPolicy(unsigned int maxRetries, uint64_t baseDelayMs, uint64_t maxDelayMs, double budgetPercent):
+    _maxRetries(maxRetries),
+    _baseDelay(std::max<uint64_t>(baseDelayMs, 1)),
+    _maxDelay(std::max<uint64_t>(maxDelayMs, 1)),
+    _earned(static_cast<int64_t>(std::max(budgetPercent, 0.0) * TOKEN / 100)),
+    _tokens(MAX_BURST * TOKEN),
+    _denied(0),
+    _exhausted(0) {
+    for (auto& r : _retries) {
+        r = 0;
+    }
+}
+
+RetryClass RetryPolicy::Classify(int status, const std::string& code, bool retryable) {
+    if (status == 429 || contains(THROTTLING_CODES, code)) {
+        return RetryClass::THROTTLING;
+    }
+    if (retryable || contains(TRANSIENT_CODES, code) || status == 408 || (status >= 500 && status != 501)) {
+        return RetryClass::TRANSIENT;
+    }
+    return RetryClass::FATAL;
+}
+
+void RetryPolicy::OnRequest() {
+    int64_t tokens = _tokens.load(std::memory_order_relaxed);
+    while (tokens < MAX_BURST * TOKEN &&
+           !_tokens.compare_exchange_weak(tokens, std::min(tokens + _earned, MAX_BURST * TOKEN))) {
+    }
+}
+
+bool RetryPolicy::ShouldRetry(RetryClass error, unsigned int retries) {
+    if (error == RetryClass::FATAL) {
+        return false;
+    }
+    if (retries >= _maxRetries) {
+        _exhausted++;
+        return false;
+    }
+
+    int64_t tokens = _tokens.load(std::memory_order_relaxed);
+    while (tokens >= TOKEN) {
+        if (_tokens.compare_exchange_weak(tokens, tokens - TOKEN)) {
+            _retries[static_cast<size_t>(error)]++;
+            return true;
+        }
+    }
+    _denied++;
+    return false;
+}
+
+uint64_t RetryPolicy::GetDelay(RetryClass error, unsigned int retries) const {
+    uint64_t ceiling = error == RetryClass::THROTTLING ? _baseDelay * THROTTLE_FACTOR : _baseDelay;
+    //doubles until the cap, without overflowing
+    for (unsigned int i = 0; i < retries && ceiling < _maxDelay; ++i) {
+        ceiling *= 2;
+    }
+    return uniform(std::min(ceiling, _maxDelay));
+}
+
+}
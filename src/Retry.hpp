@@ -0,0 +1,92 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef RETRY_HPP
+#define RETRY_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace OrthancPlugins {
+
+enum class RetryClass {
+    THROTTLING = 0, //SlowDown, 429: back off harder
+    TRANSIENT,      //network, timeouts, 5xx
+    FATAL,          //anything else, retrying won't help
+    COUNT
+};
+
+/*
+ * Retries of every S3 request, for both implementations.
+ * Delays are exponential with full jitter: uniform in [0, base * 2^retry],
+ * capped, with a base THROTTLE_FACTOR times larger for throttling.
+ * The budget is a token bucket shared by the whole process: every request
+ * earns budgetPercent of a retry, every retry takes one, and at most
+ * MAX_BURST retries can be saved up. It starts full, so a quiet plugin can
+ * still retry a few errors.
+ */
+class RetryPolicy
+{
+public:
+    static const int64_t MAX_BURST = 10;
+    static const uint64_t THROTTLE_FACTOR = 4;
+
+private:
+    static const int64_t TOKEN = 1000; //one retry
+
+    const unsigned int _maxRetries;
+    const uint64_t _baseDelay; //ms
+    const uint64_t _maxDelay; //ms
+    const int64_t _earned; //tokens per request
+
+    std::atomic<int64_t> _tokens;
+    std::atomic<uint64_t> _retries[static_cast<size_t>(RetryClass::COUNT)];
+    std::atomic<uint64_t> _denied;
+    std::atomic<uint64_t> _exhausted;
+
+public:
+    RetryPolicy(unsigned int maxRetries, uint64_t baseDelayMs, uint64_t maxDelayMs, double budgetPercent);
+
+    //status: HTTP status, 0 or less without an answer; code: S3 error code;
+    //retryable: what the SDK thinks of it
+    static RetryClass Classify(int status, const std::string& code, bool retryable);
+
+    //a request was sent, not a retry
+    void OnRequest();
+
+    //retry number `retries` (from 0) of a failed request, takes it from the budget
+    bool ShouldRetry(RetryClass error, unsigned int retries);
+    //ms to wait before that retry
+    uint64_t GetDelay(RetryClass error, unsigned int retries) const;
+
+    unsigned int GetMaxRetries() const { return _maxRetries; };
+    uint64_t GetRetries(RetryClass error) const { return _retries[static_cast<size_t>(error)]; };
+    //retries refused by the budget
+    uint64_t GetDenied() const { return _denied; };
+    //requests failed after the last retry
+    uint64_t GetExhausted() const { return _exhausted; };
+    //retries available right now
+    double GetBudget() const { return static_cast<double>(_tokens.load()) / TOKEN; };
+};
+
+}
+#endif // RETRY_HPP
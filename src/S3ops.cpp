@@ -21,25 +21,300 @@
 
 #include "S3ops.hpp"
 #include "Utils.hpp"
-//#include "MemStreamBuf.hpp"
+#include "MemStreamBuf.hpp"
+#include "HttpClientFactory.hpp"
+#include "Metrics.hpp"
+#include "AsyncLog.hpp"
+#include "AwsLogSystem.hpp"
+#include "Timer.hpp"
 
 #include <aws/core/auth/AWSCredentialsProvider.h>
+#include <aws/core/client/RetryStrategy.h>
+#include <aws/core/http/HttpResponse.h>
 #include <aws/s3/model/PutObjectRequest.h>
 #include <aws/s3/model/DeleteObjectRequest.h>
+#include <aws/s3/model/DeleteObjectsRequest.h>
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/CreateBucketRequest.h>
 #include <aws/s3/model/GetBucketLocationRequest.h>
+#include <aws/s3/model/HeadBucketRequest.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
+#include <aws/core/utils/threading/Executor.h>
 
 #include <aws/core/utils/logging/DefaultLogSystem.h>
 #include <aws/core/utils/logging/ConsoleLogSystem.h>
 #include <aws/core/utils/FileSystemUtils.h>
 
-#include <boost/filesystem.hpp>
 #include <boost/interprocess/streams/bufferstream.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
 #define ALLOCATION_TAG "Orthanc_S3_Storage"
 
 namespace {
+  //destination of a TransferManager download, kept alive by the stream callback
+  struct DownloadTarget {
+      std::mutex mutex;
+      char* data = nullptr;
+      uint64_t size = 0;
+      std::unique_ptr<OrthancPlugins::Stream::MemStreamBuf> buf;
+
+      ~DownloadTarget() {
+          free(data);
+      }
+  };
+
+  struct HedgedGet;
+
+  //response stream of one attempt of a request of a hedged GET: once closed
+  //(the other request won) writes fail and abort the transfer
+  class GatedStreamBuf : public OrthancPlugins::Stream::MemStreamBuf {
+      HedgedGet& _get;
+      const int _index;
+
+  public:
+      GatedStreamBuf(HedgedGet& get, int index, char* data, size_t size):
+          MemStreamBuf(data, size),
+          _get(get),
+          _index(index) {
+      };
+
+  protected:
+      std::streamsize xsputn(const char* s, std::streamsize n) override;
+  };
+
+  //a GET and its hedge, shared with the SDK callbacks: the losing request
+  //goes on until it notices the cancellation, after the GET has returned
+  struct HedgedGet {
+      struct Request {
+          char* data = nullptr;
+          bool owned = false; //the hedge downloads into a buffer of its own
+          //one per SDK attempt, the last one holds the answer
+          std::vector<std::unique_ptr<GatedStreamBuf> > bufs;
+          std::chrono::steady_clock::time_point start;
+          std::atomic<bool> cancelled{false};
+          bool firstByte = false;
+          bool closed = false;
+          bool done = false;
+          uint64_t written = 0;
+          Aws::S3::Model::GetObjectOutcome outcome;
+
+          ~Request() {
+              if (owned) {
+                  free(data);
+              }
+          }
+      };
+
+      std::shared_ptr<OrthancPlugins::HedgePolicy> policy;
+      std::mutex mutex;
+      std::condition_variable changed;
+      Request requests[2];
+      int started = 0;
+      int winner = -1; //first request complete and successful
+
+      explicit HedgedGet(std::shared_ptr<OrthancPlugins::HedgePolicy> p):
+          policy(p) {
+      };
+
+      bool Finished() const {
+          if (winner >= 0) {
+              return true;
+          }
+          for (int i = 0; i < started; ++i) {
+              if (!requests[i].done) {
+                  return false;
+              }
+          }
+          return true;
+      }
+  };
+
+  std::streamsize GatedStreamBuf::xsputn(const char* s, std::streamsize n) {
+      std::lock_guard<std::mutex> lock(_get.mutex);
+      HedgedGet::Request& r = _get.requests[_index];
+      if (r.closed) {
+          return 0;
+      }
+      return MemStreamBuf::xsputn(s, n);
+  }
+
+  //request index of get, written into data
+  void sendHedgedGet(const std::shared_ptr<HedgedGet>& get, int index, const Aws::S3::S3Client& client,
+                     Aws::S3::Model::GetObjectRequest request, char* data, uint64_t length) {
+      {
+          std::lock_guard<std::mutex> lock(get->mutex);
+          HedgedGet::Request& r = get->requests[index];
+          r.data = data;
+          r.owned = index > 0;
+          r.start = std::chrono::steady_clock::now();
+          get->started = index + 1;
+      }
+      get->policy->BeginRequest();
+
+      //every attempt writes from offset 0, the body of a failed one is dropped
+      request.SetResponseStreamFactory([get, index, data, length]() {
+          std::lock_guard<std::mutex> lock(get->mutex);
+          HedgedGet::Request& r = get->requests[index];
+          r.bufs.emplace_back(new GatedStreamBuf(*get, index, data, static_cast<size_t>(length)));
+          r.start = std::chrono::steady_clock::now();
+          return Aws::New<Aws::IOStream>(ALLOCATION_TAG, r.bufs.back().get());
+      });
+      //the first byte of a successful attempt, the latency of errors says nothing about a stall
+      request.SetHeadersReceivedEventHandler([get, index](const Aws::Http::HttpRequest*, Aws::Http::HttpResponse* response) {
+          const int code = static_cast<int>(response->GetResponseCode());
+          if (code < 200 || code >= 300) {
+              return;
+          }
+          std::lock_guard<std::mutex> lock(get->mutex);
+          HedgedGet::Request& r = get->requests[index];
+          if (!r.firstByte) {
+              r.firstByte = true;
+              get->policy->RecordFirstByte(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                                               std::chrono::steady_clock::now() - r.start).count()));
+              get->changed.notify_all();
+          }
+      });
+      request.SetContinueRequestHandler([get, index](const Aws::Http::HttpRequest*) {
+          return !get->requests[index].cancelled;
+      });
+
+      //not under the lock, the SDK may answer right away
+      client.GetObjectAsync(request, [get, index](const Aws::S3::S3Client*,
+                                                  const Aws::S3::Model::GetObjectRequest&,
+                                                  Aws::S3::Model::GetObjectOutcome outcome,
+                                                  const std::shared_ptr<const Aws::Client::AsyncCallerContext>&) {
+          {
+              std::lock_guard<std::mutex> lock(get->mutex);
+              HedgedGet::Request& r = get->requests[index];
+              r.written = r.bufs.empty() ? 0 : r.bufs.back()->size();
+              const bool ok = outcome.IsSuccess() && !r.closed &&
+                      r.written == static_cast<uint64_t>(outcome.GetResult().GetContentLength());
+              r.outcome = std::move(outcome);
+              r.done = true;
+              if (ok && get->winner < 0) {
+                  get->winner = index;
+              }
+              get->changed.notify_all();
+          }
+          get->policy->EndRequest();
+      });
+  }
+
+  template <typename E>
+  OrthancPlugins::RetryClass classifyError(const Aws::Client::AWSError<E>& e) {
+      return OrthancPlugins::RetryPolicy::Classify(static_cast<int>(e.GetResponseCode()), e.GetExceptionName().c_str(),
+                                                   e.ShouldRetry());
+  }
+
+  //set on the thread of a probe, which must get through an open breaker
+  thread_local bool probing = false;
+
+  //the retry loop of the SDK, driven by the RetryPolicy of the plugin;
+  //every answer also goes to the circuit breaker, when there is one,
+  //and to the balancer of the endpoint of the client
+  class PolicyRetryStrategy : public Aws::Client::RetryStrategy {
+      std::shared_ptr<OrthancPlugins::RetryPolicy> _policy;
+      std::shared_ptr<OrthancPlugins::CircuitBreaker> _breaker;
+      std::shared_ptr<OrthancPlugins::EndpointBalancer> _balancer;
+      const size_t _endpoint;
+
+      void Record(const Aws::Client::HttpResponseOutcome& outcome) {
+          //any answer from S3 means it's up, even an error; throttling too
+          //(a 503 is SlowDown, even without a body), that's for the retry budget
+          const bool answered = outcome.IsSuccess() ||
+                  classifyError(outcome.GetError()) != OrthancPlugins::RetryClass::TRANSIENT ||
+                  outcome.GetError().GetResponseCode() == Aws::Http::HttpResponseCode::SERVICE_UNAVAILABLE;
+          if (_breaker) {
+              if (answered) {
+                  _breaker->RecordSuccess();
+              } else {
+                  _breaker->RecordFailure();
+              }
+          }
+          if (answered) {
+              _balancer->RecordAnswer(_endpoint);
+          } else {
+              _balancer->RecordFailure(_endpoint);
+          }
+      };
+
+  public:
+      PolicyRetryStrategy(std::shared_ptr<OrthancPlugins::RetryPolicy> policy,
+                          std::shared_ptr<OrthancPlugins::CircuitBreaker> breaker,
+                          std::shared_ptr<OrthancPlugins::EndpointBalancer> balancer,
+                          size_t endpoint):
+          _policy(policy),
+          _breaker(breaker),
+          _balancer(balancer),
+          _endpoint(endpoint) {
+      };
+
+      bool ShouldRetry(const Aws::Client::AWSError<Aws::Client::CoreErrors>& error, long attemptedRetries) const override {
+          if (_breaker && _breaker->IsOpen()) {
+              return false;
+          }
+          return _policy->ShouldRetry(classifyError(error), static_cast<unsigned int>(attemptedRetries));
+      };
+
+      long CalculateDelayBeforeNextRetry(const Aws::Client::AWSError<Aws::Client::CoreErrors>& error, long attemptedRetries) const override {
+          return static_cast<long>(_policy->GetDelay(classifyError(error), static_cast<unsigned int>(attemptedRetries)));
+      };
+
+      //an open breaker fails the request before it is sent
+      bool HasSendToken() override {
+          return !_breaker || probing || _breaker->Allow();
+      };
+
+      //the first attempt of a request
+      void RequestBookkeeping(const Aws::Client::HttpResponseOutcome& outcome) override {
+          _policy->OnRequest();
+          Record(outcome);
+      };
+
+      //the retries
+      void RequestBookkeeping(const Aws::Client::HttpResponseOutcome& outcome,
+                              const Aws::Client::AWSError<Aws::Client::CoreErrors>&) override {
+          Record(outcome);
+      };
+  };
+
+  //HTTP range of `length` bytes starting at `begin`
+  std::string formatRange(uint64_t begin, uint64_t length) {
+      std::stringstream ss;
+      ss << "bytes=" << begin << "-" << (begin + length - 1);
+      return ss.str();
+  }
+
+  //"bytes 0-8388607/209715200" -> 209715200
+  bool parseTotalSize(const Aws::String& contentRange, uint64_t& total) {
+      const size_t pos = contentRange.rfind('/');
+      if (pos == Aws::String::npos || pos + 1 >= contentRange.size() || contentRange[pos + 1] == '*') {
+          return false;
+      }
+      total = std::strtoull(contentRange.c_str() + pos + 1, nullptr, 10);
+      return true;
+  }
+
+  //a HeadBucket getting through an open breaker, true if S3 answered, even with an error
+  bool probe(const Aws::S3::S3Client& client, const Aws::String& bucket) {
+      Aws::S3::Model::HeadBucketRequest request;
+      request.SetBucket(bucket);
+      probing = true;
+      auto outcome = client.HeadBucket(request);
+      probing = false;
+      return outcome.IsSuccess() || classifyError(outcome.GetError()) == OrthancPlugins::RetryClass::FATAL;
+  }
+
   std::string extractUrlProtocol(const std::string& url) {
     size_t pos = url.find("://");
     if (pos != std::string::npos) {
@@ -66,17 +341,24 @@ S3Facade::S3Facade(S3Method m, OrthancPluginContext *context)
 
 bool S3Impl::ConfigureAwsSdk(const std::string& s3_access_key,
                              const std::string& s3_secret_key,
-                             const std::string& s3_bucket_name,
-                             const std::string& s3_region,
-                             const std::string& s3_endpoint) {
-
-    //Enable AWS logging
-    //Aws::Utils::Logging::InitializeAWSLogging(
-    //            Aws::MakeShared<Aws::Utils::Logging::DefaultLogSystem>( //TODO: change log system from file to std out
-    //                ALLOCATION_TAG, Aws::Utils::Logging::LogLevel::Info, "aws_sdk_"));
-    aws_api_options.loggingOptions.logLevel = Aws::Utils::Logging::LogLevel::Info;
-    aws_api_options.loggingOptions.logger_create_fn = [] {
-        return Aws::MakeShared<Aws::Utils::Logging::ConsoleLogSystem>(ALLOCATION_TAG, Aws::Utils::Logging::LogLevel::Info);
+                             const std::vector<S3Target>& targets,
+                             const std::string& s3_region) {
+
+    //SDK logging goes to the Orthanc log, off the SDK threads
+    const Aws::Utils::Logging::LogLevel aws_log_level = _options.aws_log_level;
+    std::shared_ptr<AsyncLog> log = _log;
+    aws_api_options.loggingOptions.logLevel = aws_log_level;
+    aws_api_options.loggingOptions.logger_create_fn = [log, aws_log_level]() -> std::shared_ptr<Aws::Utils::Logging::LogSystemInterface> {
+        if (log) {
+            return Aws::MakeShared<AwsLogSystem>(ALLOCATION_TAG, log, aws_log_level);
+        }
+        return Aws::MakeShared<Aws::Utils::Logging::ConsoleLogSystem>(ALLOCATION_TAG, aws_log_level);
+    };
+
+    //curl client with the socket options ClientConfiguration lacks
+    const bool tcp_nodelay = _options.tcp_nodelay;
+    aws_api_options.httpOptions.httpClientFactory_create_fn = [tcp_nodelay] {
+        return Aws::MakeShared<TunedHttpClientFactory>(ALLOCATION_TAG, tcp_nodelay);
     };
 
     Aws::InitAPI(aws_api_options);
@@ -84,47 +366,134 @@ bool S3Impl::ConfigureAwsSdk(const std::string& s3_access_key,
     Aws::Client::ClientConfiguration aws_client_config;
     aws_client_config.region = s3_region.c_str();
     aws_client_config.scheme = Aws::Http::Scheme::HTTPS;
-    aws_client_config.connectTimeoutMs = 30000;
-    aws_client_config.requestTimeoutMs = 600000;
-    aws_client_config.caPath = Aws::String("/etc/ssl/certs/");
-    if (!s3_endpoint.empty()) {
-        aws_client_config.endpointOverride = s3_endpoint;
-        const std::string protocol = extractUrlProtocol(s3_endpoint);
-        if (protocol == "http") {
-            aws_client_config.scheme = Aws::Http::Scheme::HTTP;
-            aws_client_config.verifySSL = false;
-        }
+    aws_client_config.maxConnections = _options.max_connections;
+    aws_client_config.connectTimeoutMs = _options.connect_timeout_ms;
+    aws_client_config.requestTimeoutMs = _options.request_timeout_ms;
+    aws_client_config.lowSpeedLimit = _options.low_speed_limit;
+    aws_client_config.enableTcpKeepAlive = _options.tcp_keep_alive;
+    aws_client_config.tcpKeepAliveIntervalMs = _options.tcp_keep_alive_interval_ms;
+    _retry = std::make_shared<RetryPolicy>(_options.max_retries, _options.retry_base_delay_ms,
+                                           _options.retry_max_delay_ms, _options.retry_budget_percent);
+    if (_options.breaker_failures > 0) {
+        _breaker = std::make_shared<CircuitBreaker>(_options.breaker_failures);
     }
+    if (_options.executor_threads > 0) {
+        aws_client_config.executor = Aws::MakeShared<Aws::Utils::Threading::PooledThreadExecutor>(ALLOCATION_TAG, _options.executor_threads);
+    }
+    aws_client_config.caPath = Aws::String("/etc/ssl/certs/");
 
-    if (!s3_access_key.empty() && !s3_secret_key.empty()) {
+    const bool credentials = !s3_access_key.empty() && !s3_secret_key.empty();
+    if (credentials) {
         LogInfo(_context, "[S3] Using credentials from the config file");
-        s3_client = Aws::MakeShared<Aws::S3::S3Client>(
-                    ALLOCATION_TAG,
-                    Aws::Auth::AWSCredentials(s3_access_key.c_str(), s3_secret_key.c_str()),
-                    aws_client_config,
-                    Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never, //signPayloads
-                    false //useVirtualAdressing
-                    );
-
     } else {
         LogInfo(_context, "No credentials in the config file. Falling back to ~/.aws/credentials or env variables.");
-        s3_client = Aws::MakeShared<Aws::S3::S3Client>(ALLOCATION_TAG,
-                                                       aws_client_config,
-                                                       Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never,
-                                                       false //useVirtualAdressing
-                                                       );
     }
 
-    _bucket_name = s3_bucket_name.c_str();
+    //the ring only knows the targets by name, their order in the config doesn't matter;
+    //the first endpoint names a target, adding more of them moves no object
+    std::vector<std::string> names;
+    for (const auto& t : targets) {
+        const std::string name = (t.endpoints.empty() ? std::string() : t.endpoints[0]) + "/" + t.bucket;
+        if (std::find(names.begin(), names.end(), name) != names.end()) {
+            std::stringstream err;
+            err << "[S3] Bucket configured twice: " << name;
+            LogError(_context, err.str().c_str());
+            return false;
+        }
+        names.push_back(name);
+
+        //no endpoint: AWS
+        std::vector<std::string> endpoints = t.endpoints;
+        if (endpoints.empty()) {
+            endpoints.push_back(std::string());
+        }
+
+        Target target;
+        target.bucket = t.bucket.c_str();
+        target.balancer = std::make_shared<EndpointBalancer>(_context, endpoints, _options.eject_failures);
+
+        //each endpoint has a client, so a connection pool, of its own
+        for (size_t i = 0; i < endpoints.size(); ++i) {
+            Aws::Client::ClientConfiguration client_config = aws_client_config;
+            client_config.retryStrategy = Aws::MakeShared<PolicyRetryStrategy>(ALLOCATION_TAG, _retry, _breaker,
+                                                                               target.balancer, i);
+            if (!endpoints[i].empty()) {
+                client_config.endpointOverride = endpoints[i];
+                const std::string protocol = extractUrlProtocol(endpoints[i]);
+                if (protocol == "http") {
+                    client_config.scheme = Aws::Http::Scheme::HTTP;
+                    client_config.verifySSL = false;
+                }
+            }
+
+            if (credentials) {
+                target.clients.push_back(Aws::MakeShared<Aws::S3::S3Client>(
+                                             ALLOCATION_TAG,
+                                             Aws::Auth::AWSCredentials(s3_access_key.c_str(), s3_secret_key.c_str()),
+                                             client_config,
+                                             Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never, //signPayloads
+                                             false //useVirtualAdressing
+                                             ));
+            } else {
+                target.clients.push_back(Aws::MakeShared<Aws::S3::S3Client>(ALLOCATION_TAG,
+                                                                            client_config,
+                                                                            Aws::Client::AWSAuthV4Signer::PayloadSigningPolicy::Never,
+                                                                            false //useVirtualAdressing
+                                                                            ));
+            }
+        }
+        _targets.push_back(target);
+    }
+    if (_targets.empty()) {
+        LogError(_context, "[S3] No bucket configured");
+        return false;
+    }
+    _ring = HashRing(names);
+
+    if (_options.hedge_reads) {
+        _hedge = std::make_shared<HedgePolicy>(_options.hedge_percentile, _options.hedge_budget_percent,
+                                               static_cast<uint64_t>(_options.hedge_min_delay_ms) * 1000);
+    }
+
+    for (const auto& target : _targets) {
+        if (!CreateBucket(target, s3_region)) {
+            return false;
+        }
+        for (const auto& client : target.clients) {
+            PrewarmConnections(*client, target.bucket);
+        }
+
+        if (target.clients.size() > 1 && _options.health_check_ms > 0) {
+            std::vector<std::shared_ptr<Aws::S3::S3Client> > clients = target.clients;
+            const Aws::String bucket = target.bucket;
+            target.balancer->Start([clients, bucket](size_t endpoint) {
+                return probe(*clients[endpoint], bucket);
+            }, std::chrono::milliseconds(_options.health_check_ms));
+
+            std::stringstream ss;
+            ss << "[S3] Requests to " << target.bucket << " balanced over " << target.clients.size() << " endpoints";
+            LogWarning(_context, ss.str().c_str());
+        }
+    }
+
+    if (_targets.size() > 1) {
+        std::stringstream ss;
+        ss << "[S3] Objects spread over " << _targets.size() << " buckets";
+        LogWarning(_context, ss.str().c_str());
+    }
+
+    return true;
+}
 
+bool S3Impl::CreateBucket(const Target& target, const std::string& s3_region) {
     std::stringstream ss;
-    ss <<  "[S3] Checking bucket: " << _bucket_name;
+    ss <<  "[S3] Checking bucket: " << target.bucket;
     LogInfo(_context, ss.str().c_str());
 
     //Create bucket if it doesn't exist
     //and verify if it exists
     Aws::S3::Model::CreateBucketRequest request;
-    request.SetBucket(_bucket_name);
+    request.SetBucket(target.bucket);
     Aws::S3::Model::CreateBucketConfiguration req_config;
     // Only set location constraint if region is not default region (us-east-1)
     auto regionConstraint = Aws::S3::Model::BucketLocationConstraintMapper::GetBucketLocationConstraintForName(s3_region.c_str());
@@ -134,20 +503,21 @@ bool S3Impl::ConfigureAwsSdk(const std::string& s3_access_key,
     }
     request.SetCreateBucketConfiguration(req_config);
 
-    auto outcome = s3_client->CreateBucket(request);
+    Lease lease(target);
+    auto outcome = lease.GetClient().CreateBucket(request);
 
     if (outcome.GetError().GetErrorType() == Aws::S3::S3Errors::BUCKET_ALREADY_OWNED_BY_YOU ||
             outcome.GetError().GetErrorType() == Aws::S3::S3Errors::BUCKET_ALREADY_EXISTS ) {
         std::stringstream ss;
-        ss << "[S3] Bucket exists: " << _bucket_name;
+        ss << "[S3] Bucket exists: " << target.bucket;
         LogInfo(_context, ss.str().c_str());
     } else if (outcome.IsSuccess()) {
         std::stringstream ss;
-        ss << "[S3] Bucket created: " << _bucket_name;
+        ss << "[S3] Bucket created: " << target.bucket;
         LogInfo(_context, ss.str().c_str());
     } else {
         std::stringstream err;
-        err << "[S3] Create Bucket error: " <<
+        err << "[S3] Create Bucket error: " << target.bucket << " " <<
                outcome.GetError().GetExceptionName() << " " <<
                outcome.GetError().GetMessage();
         LogError(_context, err.str().c_str());
@@ -157,12 +527,90 @@ bool S3Impl::ConfigureAwsSdk(const std::string& s3_access_key,
     return true;
 }
 
-bool S3Direct::UploadFileToS3(const std::string &path, const void *content, const int64_t &size) {
+void S3Impl::PrewarmConnections(const Aws::S3::S3Client& client, const Aws::String& bucket) {
+    const unsigned int count = std::min(_options.prewarm_connections, _options.max_connections);
+    if (count == 0) {
+        return;
+    }
+
+    //concurrent requests, so each one opens its own pooled connection
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<unsigned int> ok(0);
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < count; ++i) {
+        threads.emplace_back([&client, &bucket, &ok]() {
+            Aws::S3::Model::HeadBucketRequest request;
+            request.SetBucket(bucket);
+            Stopwatch timer;
+            const bool success = client.HeadBucket(request).IsSuccess();
+            getMetrics().RecordS3(S3Call::HEAD, success, 0, timer.elapsed());
+            if (success) {
+                ok++;
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    std::stringstream ss;
+    ss << "[S3] Pre-warmed " << ok << "/" << count << " connections to " << bucket << " in " << ms << " ms";
+    LogInfo(_context, ss.str().c_str());
+}
+
+bool S3Impl::UploadFileToS3(const std::string &path, const void *content, const int64_t &size) {
+    return UploadTo(GetOwner(path), path, content, size);
+}
+
+bool S3Impl::DownloadFileFromS3(const std::string &path, void **content, int64_t *size) {
+    for (size_t target : GetTargets(path)) {
+        if (DownloadFrom(target, path, content, size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool S3Impl::DeleteFileFromS3(const std::string &path) {
+    bool ok = true;
+    for (size_t target : GetTargets(path)) {
+        ok = DeleteFrom(target, path) && ok;
+    }
+    return ok;
+}
+
+bool S3Impl::DeleteFrom(size_t target, const std::string &path) {
+    const Aws::String key_name = path.c_str();
+
+    Aws::S3::Model::DeleteObjectRequest object_request;
+    object_request.WithBucket(_targets[target].bucket).WithKey(key_name);
+
+    Stopwatch timer;
+    Lease lease(_targets[target]);
+    auto delete_object_outcome = lease.GetClient().DeleteObject(object_request);
+    getMetrics().RecordS3(S3Call::DELETE, delete_object_outcome.IsSuccess(), 0, timer.elapsed());
+
+    if (!delete_object_outcome.IsSuccess()) {
+        getMetrics().RecordS3Error(S3Call::DELETE, delete_object_outcome.GetError().GetExceptionName().c_str());
+        std::stringstream err;
+        err << "[S3] DELETE error: " <<
+               delete_object_outcome.GetError().GetExceptionName() << " " <<
+               delete_object_outcome.GetError().GetMessage();
+        LogError(_context, err.str().c_str());
+
+        return false;
+    }
+
+    return true;
+}
+
+bool S3Direct::UploadTo(size_t target, const std::string &path, const void *content, int64_t size) {
     const Aws::String key_name = path.c_str();
     const Aws::String file_name = path.c_str();
 
     Aws::S3::Model::PutObjectRequest object_request;
-    object_request.WithBucket(_bucket_name).WithKey(key_name);
+    object_request.WithBucket(_targets[target].bucket).WithKey(key_name);
 
     boost::interprocess::bufferstream buf(const_cast<char*>(static_cast<const char*>(content)), static_cast<size_t>(size));
     auto body = Aws::MakeShared<Aws::IOStream>(ALLOCATION_TAG, buf.rdbuf());
@@ -175,9 +623,13 @@ bool S3Direct::UploadFileToS3(const std::string &path, const void *content, cons
 
     object_request.SetBody(body);
 
-    auto put_object_outcome = s3_client->PutObject(object_request);
+    Stopwatch timer;
+    Lease lease(_targets[target]);
+    auto put_object_outcome = lease.GetClient().PutObject(object_request);
+    getMetrics().RecordS3(S3Call::PUT, put_object_outcome.IsSuccess(), static_cast<uint64_t>(size), timer.elapsed());
 
     if (!put_object_outcome.IsSuccess()) {
+        getMetrics().RecordS3Error(S3Call::PUT, put_object_outcome.GetError().GetExceptionName().c_str());
         std::stringstream err;
         err << "[S3] PUT error: " <<
                put_object_outcome.GetError().GetExceptionName() << " " <<
@@ -191,30 +643,153 @@ bool S3Direct::UploadFileToS3(const std::string &path, const void *content, cons
 
 }
 
-bool S3Direct::DownloadFileFromS3(const std::string &path, void **content, int64_t *size) {
+bool S3Direct::DownloadFrom(size_t target, const std::string &path, void **content, int64_t *size) {
     const Aws::String key_name = path.c_str();
+    const uint64_t part = std::max<uint64_t>(_options.download_part_size, 1);
+    const uint64_t probe = std::min(part, PROBE_SIZE);
+
+    //every range is written by the SDK straight into the buffer handed over to Orthanc
+    //malloc because it's freed by ::free()
+    char* data = static_cast<char*>(malloc(static_cast<size_t>(probe)));
+    if (data == nullptr) {
+        LogError(_context, "[S3] Error allocating memory");
+        return false;
+    }
 
-    Aws::S3::Model::GetObjectRequest object_request;
-    object_request.WithBucket(_bucket_name).WithKey(key_name);
+    //the first range reveals the total size, small objects are done with it
+    uint64_t total = 0;
+    if (!DownloadRange(target, key_name, 0, probe, data, &total)) {
+        free(data);
+        return false;
+    }
 
-    auto get_object_outcome = s3_client->GetObject(object_request);
+    //grown once to the object size; for large blocks the allocator remaps
+    //pages instead of copying them
+    char* resized = static_cast<char*>(realloc(data, total > 0 ? static_cast<size_t>(total) : 1));
+    if (resized == nullptr) {
+        LogError(_context, "[S3] Error allocating memory");
+        free(data);
+        return false;
+    }
+    data = resized;
+
+    //remaining ranges, fetched in parallel at their offsets
+    std::atomic<uint64_t> next(probe);
+    std::atomic<bool> failed(false);
+    auto worker = [&]() {
+        while (!failed) {
+            const uint64_t begin = next.fetch_add(part);
+            if (begin >= total) {
+                return;
+            }
+            const uint64_t length = std::min(part, total - begin);
+            if (!DownloadRange(target, key_name, begin, length, data + begin, nullptr)) {
+                failed = true;
+            }
+        }
+    };
+
+    if (total > probe) {
+        const uint64_t parts = (total - probe + part - 1) / part;
+        const uint64_t threads = std::min<uint64_t>(std::max(_options.download_concurrency, 1u), parts);
+
+        std::vector<std::thread> workers;
+        for (uint64_t i = 1; i < threads; ++i) {
+            workers.push_back(std::thread(worker));
+        }
+        worker();
+        for (auto& w : workers) {
+            w.join();
+        }
+    }
 
-    if (get_object_outcome.IsSuccess()) {
-        *size = get_object_outcome.GetResult().GetContentLength();
+    if (failed) {
+        free(data);
+        return false;
+    }
 
-        Aws::OStringStream buf;
-        //malloc because it's freed by ::free()
-        *content = malloc(static_cast<size_t>(*size));
+    *content = data;
+    *size = static_cast<int64_t>(total);
+    return true;
+}
 
-        if (*content!=nullptr) {
-            buf.rdbuf()->pubsetbuf(static_cast<char*>(*content), *size);
-            buf << get_object_outcome.GetResult().GetBody().rdbuf();
+Aws::S3::Model::GetObjectOutcome S3Impl::GetObjectHedged(const Target &target, const Lease &lease,
+                                                         const Aws::S3::Model::GetObjectRequest &request,
+                                                         char *data, uint64_t length, uint64_t &written) {
+    const uint64_t delay = _hedge->OnRequest();
+    std::shared_ptr<HedgedGet> get = std::make_shared<HedgedGet>(_hedge);
+    sendHedgedGet(get, 0, lease.GetClient(), request, data, length);
+
+    //the endpoint of the hedge, when the slow one is the cause
+    std::unique_ptr<Lease> second;
+
+    std::unique_lock<std::mutex> lock(get->mutex);
+    HedgedGet::Request& first = get->requests[0];
+    if (delay > 0 &&
+            !get->changed.wait_for(lock, std::chrono::microseconds(delay), [&first]() { return first.firstByte || first.done; }) &&
+            _hedge->TryHedge()) {
+        char* copy = static_cast<char*>(malloc(static_cast<size_t>(length)));
+        if (copy != nullptr) {
+            lock.unlock();
+            second.reset(new Lease(target, lease.GetEndpoint()));
+            sendHedgedGet(get, 1, second->GetClient(), request, copy, length);
+            lock.lock();
+        }
+    }
+    get->changed.wait(lock, [&get]() { return get->Finished(); });
 
-            //memcpy(*content, buf.str().c_str(), *size);
-        } else {
-            return false;
+    //the loser can't write into data anymore
+    for (int i = 0; i < get->started; ++i) {
+        if (i != get->winner) {
+            get->requests[i].closed = true;
+            get->requests[i].cancelled = true;
         }
+    }
+
+    //all failed: the error of the first request
+    HedgedGet::Request& r = get->requests[std::max(get->winner, 0)];
+    if (get->winner > 0) {
+        memcpy(data, r.data, static_cast<size_t>(r.written));
+        _hedge->RecordWin();
+    }
+    written = r.written;
+    return std::move(r.outcome);
+}
+
+bool S3Impl::DownloadRange(size_t target, const Aws::String &key_name, uint64_t begin, uint64_t length, char *data, uint64_t *total) {
+    Lease lease(_targets[target]);
+    const Aws::S3::S3Client& client = lease.GetClient();
+    Aws::S3::Model::GetObjectRequest object_request;
+    object_request.WithBucket(_targets[target].bucket).WithKey(key_name).WithRange(formatRange(begin, length).c_str());
+
+    Stopwatch timer;
+    uint64_t written = 0;
+    Aws::S3::Model::GetObjectOutcome get_object_outcome;
+    if (_hedge) {
+        get_object_outcome = GetObjectHedged(_targets[target], lease, object_request, data, length, written);
     } else {
+        //a fresh buffer at offset 0 for every attempt, the body of a failed one
+        //(e.g. a SlowDown) must not end up in front of the retried one; the
+        //earlier ones stay alive as long as the streams of their responses
+        std::vector<std::unique_ptr<Stream::MemStreamBuf> > bufs;
+        object_request.SetResponseStreamFactory([&bufs, data, length]() {
+            bufs.emplace_back(new Stream::MemStreamBuf(data, static_cast<size_t>(length)));
+            return Aws::New<Aws::IOStream>(ALLOCATION_TAG, bufs.back().get());
+        });
+        get_object_outcome = client.GetObject(object_request);
+        written = bufs.empty() ? 0 : bufs.back()->size();
+    }
+
+    if (!get_object_outcome.IsSuccess()) {
+        if (total != nullptr && begin == 0 && get_object_outcome.GetError().GetExceptionName() == "InvalidRange") {
+            //empty object, no range can be satisfied
+            getMetrics().RecordS3(S3Call::GET, true, 0, timer.elapsed());
+            *total = 0;
+            return true;
+        }
+
+        getMetrics().RecordS3(S3Call::GET, false, 0, timer.elapsed());
+        getMetrics().RecordS3Error(S3Call::GET, get_object_outcome.GetError().GetExceptionName().c_str());
         std::stringstream err;
         err << "[S3] GET error: " <<
                get_object_outcome.GetError().GetExceptionName() << " " <<
@@ -224,28 +799,185 @@ bool S3Direct::DownloadFileFromS3(const std::string &path, void **content, int64
         return false;
     }
 
+    const uint64_t received = static_cast<uint64_t>(get_object_outcome.GetResult().GetContentLength());
+    getMetrics().RecordS3(S3Call::GET, written == received, written, timer.elapsed());
+    if (written != received || (total == nullptr && received != length)) {
+        std::stringstream err;
+        err << "[S3] GET error: got " << written << " of " << length << " bytes at " << begin;
+        LogError(_context, err.str().c_str());
+
+        return false;
+    }
+
+    if (total != nullptr && !parseTotalSize(get_object_outcome.GetResult().GetContentRange(), *total)) {
+        //the server ignored the range, but the whole object fitted
+        *total = received;
+    }
+
     return true;
 }
 
-bool S3Direct::DeleteFileFromS3(const std::string &path) {
-    const Aws::String key_name = path.c_str();
+bool S3Impl::DownloadRangeFromS3(const std::string &path, uint64_t offset, uint64_t length, void **content) {
+    //malloc because it's freed by ::free()
+    char* data = static_cast<char*>(malloc(length == 0 ? 1 : static_cast<size_t>(length)));
+    if (data == nullptr) {
+        LogError(_context, "[S3] Error allocating memory");
+        return false;
+    }
 
-    Aws::S3::Model::DeleteObjectRequest object_request;
-    object_request.WithBucket(_bucket_name).WithKey(key_name);
+    if (length > 0) {
+        bool ok = false;
+        for (size_t target : GetTargets(path)) {
+            if (DownloadRange(target, path.c_str(), offset, length, data, nullptr)) {
+                ok = true;
+                break;
+            }
+        }
+        if (!ok) {
+            free(data);
+            return false;
+        }
+    }
+
+    *content = data;
+    return true;
+}
 
-    auto delete_object_outcome = s3_client->DeleteObject(object_request);
+bool S3Impl::Probe() {
+    bool answered = true;
+    for (const auto& target : _targets) {
+        Lease lease(target);
+        answered = probe(lease.GetClient(), target.bucket) && answered;
+    }
 
-    if (!delete_object_outcome.IsSuccess()) {
+    return answered;
+}
+
+const size_t S3Impl::MAX_DELETE_BATCH;
+const uint64_t S3Direct::PROBE_SIZE;
+
+bool S3Impl::DeleteFilesFromS3(const std::vector<std::string> &paths, std::vector<std::string> &failed) {
+    failed.clear();
+    if (paths.empty()) {
+        return true;
+    }
+    if (paths.size() > MAX_DELETE_BATCH) {
+        failed = paths;
+        return false;
+    }
+    if (_targets.size() == 1) {
+        return DeleteBatchFrom(0, paths, failed);
+    }
+
+    //one batch per target, a key failing on any of its targets failed
+    std::vector<std::vector<std::string> > batches(_targets.size());
+    for (const auto& path : paths) {
+        for (size_t target : GetTargets(path)) {
+            batches[target].push_back(path);
+        }
+    }
+    for (size_t target = 0; target < batches.size(); ++target) {
+        std::vector<std::string> failedHere;
+        if (!DeleteBatchFrom(target, batches[target], failedHere)) {
+            for (const auto& path : failedHere) {
+                if (std::find(failed.begin(), failed.end(), path) == failed.end()) {
+                    failed.push_back(path);
+                }
+            }
+        }
+    }
+    return failed.empty();
+}
+
+bool S3Impl::DeleteBatchFrom(size_t target, const std::vector<std::string> &paths, std::vector<std::string> &failed) {
+    failed.clear();
+    if (paths.empty()) {
+        return true;
+    }
+
+    //quiet: the answer only lists the keys that failed
+    Aws::S3::Model::Delete batch;
+    batch.WithQuiet(true);
+    for (const auto& path : paths) {
+        batch.AddObjects(Aws::S3::Model::ObjectIdentifier().WithKey(path.c_str()));
+    }
+
+    Aws::S3::Model::DeleteObjectsRequest request;
+    request.WithBucket(_targets[target].bucket).WithDelete(batch);
+
+    Stopwatch timer;
+    Lease lease(_targets[target]);
+    auto outcome = lease.GetClient().DeleteObjects(request);
+    getMetrics().RecordS3(S3Call::DELETE_BATCH, outcome.IsSuccess() && outcome.GetResult().GetErrors().empty(), 0, timer.elapsed());
+    if (!outcome.IsSuccess()) {
+        getMetrics().RecordS3Error(S3Call::DELETE_BATCH, outcome.GetError().GetExceptionName().c_str());
         std::stringstream err;
-        err << "[S3] DELETE error: " <<
-               delete_object_outcome.GetError().GetExceptionName() << " " <<
-               delete_object_outcome.GetError().GetMessage();
+        err << "[S3] DELETE batch of " << paths.size() << " error: " <<
+               outcome.GetError().GetExceptionName() << " " <<
+               outcome.GetError().GetMessage();
         LogError(_context, err.str().c_str());
 
+        failed = paths;
         return false;
     }
 
-    return true;
+    for (const auto& e : outcome.GetResult().GetErrors()) {
+        getMetrics().RecordS3Error(S3Call::DELETE_BATCH, e.GetCode().c_str());
+        std::stringstream err;
+        err << "[S3] DELETE error: " << e.GetKey() << " " << e.GetCode() << " " << e.GetMessage();
+        LogError(_context, err.str().c_str());
+
+        failed.push_back(e.GetKey().c_str());
+    }
+
+    return failed.empty();
+}
+
+bool S3Impl::ListObjects(size_t target, const std::function<bool(const std::string& path)>& visit) {
+    Aws::S3::Model::ListObjectsV2Request request;
+    request.WithBucket(_targets[target].bucket).WithMaxKeys(1000);
+
+    while (true) {
+        Lease lease(_targets[target]);
+        auto outcome = lease.GetClient().ListObjectsV2(request);
+        if (!outcome.IsSuccess()) {
+            std::stringstream err;
+            err << "[S3] LIST error: " << _targets[target].bucket << " " <<
+                   outcome.GetError().GetExceptionName() << " " <<
+                   outcome.GetError().GetMessage();
+            LogError(_context, err.str().c_str());
+
+            return false;
+        }
+
+        for (const auto& object : outcome.GetResult().GetContents()) {
+            if (!visit(object.GetKey().c_str())) {
+                return true;
+            }
+        }
+        if (!outcome.GetResult().GetIsTruncated()) {
+            return true;
+        }
+        request.SetContinuationToken(outcome.GetResult().GetNextContinuationToken());
+    }
+}
+
+bool S3Impl::MoveObject(const std::string &path, size_t from) {
+    const size_t to = GetOwner(path);
+    if (to == from) {
+        return true;
+    }
+
+    //through the plugin, the targets may be on different endpoints
+    void* content = nullptr;
+    int64_t size = 0;
+    if (!DownloadFrom(from, path, &content, &size)) {
+        return false;
+    }
+    const bool ok = UploadTo(to, path, content, size);
+    free(content);
+
+    return ok && DeleteFrom(from, path);
 }
 
 /*
@@ -253,6 +985,10 @@ bool S3Direct::DeleteFileFromS3(const std::string &path) {
  */
 
 void S3TransferManager::LogDetails(const std::shared_ptr<const Aws::Transfer::TransferHandle>& req) {
+    //every transfer goes through here, don't format what nobody reads
+    if (!isLogEnabled(LogLevel::INFO)) {
+        return;
+    }
     std::stringstream ss;
 
     ss << "Status: ";
@@ -272,17 +1008,46 @@ void S3TransferManager::LogDetails(const std::shared_ptr<const Aws::Transfer::Tr
     ss << ", failed: " << req->GetFailedParts().size();
     ss << ", pending: " << req->GetPendingParts().size();
     ss << ", queued: " << req->GetQueuedParts().size();
+    ss << ". Executor active: " << _executor->GetActive() << "/" << _executor->GetThreads();
+    ss << ", waiting: " << _executor->GetQueued();
 
     LogInfo(_context, ss.str().c_str());
 }
 
-bool S3TransferManager::ConfigureAwsSdk(const std::string &s3_access_key, const std::string &s3_secret_key, const std::string &s3_bucket_name, const std::string &s3_region, const std::string &s3_endpoint) {
+bool S3TransferManager::ConfigureAwsSdk(const std::string &s3_access_key, const std::string &s3_secret_key, const std::vector<S3Target> &targets, const std::string &s3_region) {
 
-    S3Impl::ConfigureAwsSdk(s3_access_key, s3_secret_key, s3_bucket_name, s3_region, s3_endpoint);
+    if (!S3Impl::ConfigureAwsSdk(s3_access_key, s3_secret_key, targets, s3_region)) {
+        return false;
+    }
+
+    //transfers are I/O bound, two threads per core keep the network busy
+    unsigned int threads = _options.transfer_threads;
+    if (threads == 0) {
+        //more would only wait for a connection
+        threads = std::min(std::max(4u, 2 * Utils::getAvailableCores()), _options.max_connections);
+    }
+    if (threads > _options.max_connections) {
+        std::stringstream ss;
+        ss << "[S3] transfer_threads (" << threads << ") exceeds max_connections (" << _options.max_connections
+           << "), threads will wait for a connection";
+        LogWarning(_context, ss.str().c_str());
+    }
+
+    const uint64_t bufferSize = _options.transfer_buffer_size;
+    uint64_t maxHeapSize = _options.transfer_max_heap_size;
+    if (maxHeapSize == 0) {
+        maxHeapSize = bufferSize * threads;
+    }
 
-    _executor = Aws::MakeShared<Aws::Utils::Threading::PooledThreadExecutor>(ALLOCATION_TAG, 4);
+    _executor = Aws::MakeShared<MonitoredExecutor>(ALLOCATION_TAG, threads);
     Aws::Transfer::TransferManagerConfiguration transferConfig(_executor.get());
-    transferConfig.s3Client = s3_client;
+    transferConfig.bufferSize = bufferSize;
+    transferConfig.transferBufferMaxHeapSize = maxHeapSize;
+
+    std::stringstream ss;
+    ss << "[S3] TransferManager: " << threads << " threads, buffer: " << bufferSize
+       << " B, max heap: " << maxHeapSize << " B";
+    LogInfo(_context, ss.str().c_str());
 
     transferConfig.errorCallback = [&](const Aws::Transfer::TransferManager*, const std::shared_ptr<const Aws::Transfer::TransferHandle>& req, const Aws::Client::AWSError<Aws::S3::S3Errors>& e) {
         std::stringstream ss;
@@ -291,157 +1056,115 @@ bool S3TransferManager::ConfigureAwsSdk(const std::string &s3_access_key, const
         LogDetails(req);
     };
 
-    _tm = Aws::Transfer::TransferManager::Create(transferConfig);
+    //the executor is shared, each endpoint has its own client
+    for (const auto& target : _targets) {
+        _tms.emplace_back();
+        for (const auto& client : target.clients) {
+            transferConfig.s3Client = client;
+            _tms.back().push_back(Aws::Transfer::TransferManager::Create(transferConfig));
+        }
+    }
 
     return true;
 }
 
-bool S3TransferManager::UploadFileToS3(const std::string &path, const void *content, const int64_t &size) {
+bool S3TransferManager::UploadTo(size_t target, const std::string &path, const void *content, int64_t size) {
     boost::interprocess::bufferstream buf(const_cast<char*>(static_cast<const char*>(content)), static_cast<size_t>(size));
     auto body = Aws::MakeShared<Aws::IOStream>(ALLOCATION_TAG, buf.rdbuf());
 
-    auto requestPtr = _tm->UploadFile(body,
-                                      _bucket_name,
-                                      path.c_str(),
-                                      "text/plain",
-                                      Aws::Map<Aws::String, Aws::String>());
+    Stopwatch timer;
+    Lease lease(_targets[target]);
+    const auto& tm = _tms[target][lease.GetEndpoint()];
+    auto requestPtr = tm->UploadFile(body,
+                                     _targets[target].bucket,
+                                     path.c_str(),
+                                     "text/plain",
+                                     Aws::Map<Aws::String, Aws::String>());
 
     requestPtr->WaitUntilFinished();
 
-    size_t retries = 0;
-    while (requestPtr->GetStatus() != Aws::Transfer::TransferStatus::COMPLETED && retries++ < 5)
-    {
-        _tm->RetryUpload(body, requestPtr);
+    //the parts were retried by the SDK already, the transfer is retried
+    //like any request: only for errors worth it, backing off, within the budget
+    unsigned int retries = 0;
+    while (requestPtr->GetStatus() != Aws::Transfer::TransferStatus::COMPLETED) {
+        const RetryClass error = classifyError(requestPtr->GetLastError());
+        if (!_retry->ShouldRetry(error, retries)) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(_retry->GetDelay(error, retries++)));
+        tm->RetryUpload(body, requestPtr);
         requestPtr->WaitUntilFinished();
     }
 
     LogDetails(requestPtr);
 
-    return (requestPtr->GetStatus() == Aws::Transfer::TransferStatus::COMPLETED);
-}
-
-bool S3TransferManager::DownloadFileFromS3(const std::string &path, void **content, int64_t *size) {
-
-    boost::filesystem::path temp = "/tmp" / boost::filesystem::unique_path();
-    const std::string tempstr    = temp.native();  // optional
-
-    {
-        std::stringstream ss;
-        ss << "[S3] Using tmp: " << tempstr << '.';
-        LogInfo(_context, ss.str());
-    }
-
-    auto requestPtr = _tm->DownloadFile(_bucket_name,
-                                        path.c_str(),
-                                        tempstr.c_str());
-
-    requestPtr->WaitUntilFinished();
-
-    if (requestPtr->GetStatus() == Aws::Transfer::TransferStatus::COMPLETED) {
-        //read file to memory
-        try {
-            Utils::readFile(content, size, tempstr);
-        } catch (Orthanc::OrthancException &e) {
-            std::remove(tempstr.c_str());
-
-            std::stringstream ss;
-            ss << "[S3] Failed to read file: " << tempstr << ", " << e.What();
-            LogError(_context, ss.str());
-
-            return false;
-        }
-    } else {
-        std::stringstream ss;
-        auto err = requestPtr->GetLastError();
-        ss << "[S3] Failed to get file: " << path << " because of: " << err.GetMessage() <<'.';
-        LogError(_context, ss.str());
+    const bool ok = (requestPtr->GetStatus() == Aws::Transfer::TransferStatus::COMPLETED);
+    getMetrics().RecordS3(S3Call::PUT, ok, static_cast<uint64_t>(size), timer.elapsed());
+    if (!ok) {
+        getMetrics().RecordS3Error(S3Call::PUT, requestPtr->GetLastError().GetExceptionName().c_str());
     }
 
-    std::remove(tempstr.c_str());
-
-    return (requestPtr->GetStatus() == Aws::Transfer::TransferStatus::COMPLETED);
-
-
+    return ok;
 }
 
-/*
- * TODO: fix the memory transfer
-bool S3TransferManager::DownloadFileFromS3(const std::string &path, void **content, int64_t *size) {
-
-    auto buf = Aws::MakeShared<Stream::MemStreamBuf>(ALLOCATION_TAG, nullptr, 0, false);
-    auto oss = std::make_shared<std::istream>(buf.get());
-
-    auto requestPtr = _tm->DownloadFile(_bucket_name,
-                                        path.c_str(),
-                                        [=](){
-        auto* out = Aws::New<Aws::IOStream>(ALLOCATION_TAG, buf.get());
+bool S3TransferManager::DownloadFrom(size_t index, const std::string &path, void **content, int64_t *size) {
+    auto target = std::make_shared<DownloadTarget>();
+    std::promise<std::shared_ptr<Aws::Transfer::TransferHandle> > handlePromise;
+    std::shared_future<std::shared_ptr<Aws::Transfer::TransferHandle> > handleFuture = handlePromise.get_future().share();
+
+    //parts are written at their offsets straight into the buffer handed over to Orthanc
+    Stopwatch timer;
+    Lease lease(_targets[index]);
+    const auto& tm = _tms[index][lease.GetEndpoint()];
+    auto requestPtr = tm->DownloadFile(_targets[index].bucket,
+                                       path.c_str(),
+                                       [target, handleFuture]() -> Aws::IOStream* {
+        //the stream is requested after the HeadObject, the total size is known by now
+        const uint64_t total = handleFuture.get()->GetBytesTotalSize();
+
+        std::lock_guard<std::mutex> lock(target->mutex);
+        if (target->data == nullptr || target->size != total) {
+            free(target->data);
+            //malloc because it's freed by ::free()
+            target->data = static_cast<char*>(malloc(total > 0 ? static_cast<size_t>(total) : 1));
+            target->size = target->data != nullptr ? total : 0;
+        }
+        target->buf.reset(new Stream::MemStreamBuf(target->data, static_cast<size_t>(target->size)));
 
-        LogInfo(_context, "Creating stream");
-        return out;
+        return Aws::New<Aws::IOStream>(ALLOCATION_TAG, target->buf.get());
     });
 
+    handlePromise.set_value(requestPtr);
     requestPtr->WaitUntilFinished();
 
-    LogInfo (_context, "Finished");
-
-    if (requestPtr->GetStatus() == Aws::Transfer::TransferStatus::COMPLETED) {
-        LogDetails (requestPtr);
-
-        //assert(buf->size() == requestPtr->GetBytesTotalSize());
-        size_t s1 = buf->size();
-        size_t s2 = buf->allocsize();
-        size_t s3 = requestPtr->GetBytesTransferred();
-        size_t s4 = requestPtr->GetBytesTotalSize();
-        *size = requestPtr->GetBytesTotalSize();
-
-        //oss->seekp(0, std::ios::end);
-        // *size = oss->tellp();
-        //oss->seekp(0);//, std::ios::beg);
-
+    if (requestPtr->GetStatus() != Aws::Transfer::TransferStatus::COMPLETED) {
+        getMetrics().RecordS3(S3Call::GET, false, 0, timer.elapsed());
         std::stringstream ss;
-        ss << "Size: " << *size << '\n';
-        ss << "s1: " << s1 << '\n';
-        ss << "s2: " << s2 << '\n';
-        ss << "s3: " << s3 << '\n';
-        ss << "s4: " << s4 << '\n';
-        LogInfo(_context, ss.str().c_str());
+        auto err = requestPtr->GetLastError();
+        getMetrics().RecordS3Error(S3Call::GET, err.GetExceptionName().c_str());
+        ss << "[S3] Failed to get file: " << path << " because of: " << err.GetMessage() <<'.';
+        LogError(_context, ss.str());
 
-        *content = buf->get();
+        return false;
+    }
 
-        if (*content == nullptr) {
-            LogError(_context, "Error allocating memory");
+    std::lock_guard<std::mutex> lock(target->mutex);
+    if (target->data == nullptr) {
+        //empty object, the stream was never requested
+        target->data = static_cast<char*>(malloc(1));
+        target->size = 0;
+        if (target->data == nullptr) {
+            LogError(_context, "[S3] Error allocating memory");
             return false;
         }
-
-        //LogInfo(_context, "Copying memory");
-        //oss->rdbuf()->sgetn(static_cast<char*>(*content), *size);
-        LogInfo(_context, "DONE");
     }
 
-    return (requestPtr->GetStatus() == Aws::Transfer::TransferStatus::COMPLETED);
-}
-*/
-
-bool S3TransferManager::DeleteFileFromS3(const std::string &path) {
-    const Aws::String key_name = path.c_str();
-
-    Aws::S3::Model::DeleteObjectRequest object_request;
-    object_request.WithBucket(_bucket_name).WithKey(key_name);
-
-    auto delete_object_outcome = s3_client->DeleteObject(object_request);
-
-    if (!delete_object_outcome.IsSuccess()) {
-        std::stringstream err;
-        err << "[S3] DELETE error: " <<
-               delete_object_outcome.GetError().GetExceptionName() << " " <<
-               delete_object_outcome.GetError().GetMessage();
-        LogError(_context, err.str().c_str());
-
-        return false;
-    }
+    *content = target->data;
+    *size = static_cast<int64_t>(target->size);
+    target->data = nullptr;
+    getMetrics().RecordS3(S3Call::GET, true, static_cast<uint64_t>(*size), timer.elapsed());
 
     return true;
 }
 
-
 }
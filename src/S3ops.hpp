@@ -26,11 +26,24 @@
 
 #include <aws/core/Aws.h>
 #include <aws/s3/S3Client.h>
+#include <aws/s3/model/GetObjectRequest.h>
 #include <aws/core/utils/logging/AWSLogging.h>
 #include <aws/transfer/TransferManager.h>
 
+#include "MonitoredExecutor.hpp"
+#include "AsyncLog.hpp"
+#include "Hedging.hpp"
+#include "Retry.hpp"
+#include "CircuitBreaker.hpp"
+#include "HashRing.hpp"
+#include "EndpointBalancer.hpp"
+#include "Timer.hpp"
+
 #include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
 namespace OrthancPlugins {
 
@@ -39,18 +52,146 @@ enum class S3Method {
     TRANSFER_MANAGER
 };
 
+//a bucket of the store, objects are spread over several by a HashRing
+struct S3Target {
+    std::string bucket;
+    //equivalent endpoints in front of the bucket, the first one names it on
+    //the ring; none: AWS
+    std::vector<std::string> endpoints;
+};
+
+struct S3Options {
+    //S3Direct: objects larger than one part are fetched with parallel ranged GETs,
+    //after a first range of at most PROBE_SIZE revealed their size
+    uint64_t download_part_size = 8 * 1024 * 1024;
+    unsigned int download_concurrency = 4;
+
+    //ranged GETs without a first byte after hedge_percentile of the recent ones
+    //are sent a second time, the first answer wins; the extra GETs are capped
+    //at hedge_budget_percent of all GETs
+    bool hedge_reads = false;
+    unsigned int hedge_percentile = 95;
+    unsigned int hedge_budget_percent = 5;
+    unsigned int hedge_min_delay_ms = 10;
+
+    //HTTP client, see Aws::Client::ClientConfiguration
+    unsigned int max_connections = 25;
+    long connect_timeout_ms = 30000;
+    //curl also aborts a transfer slower than low_speed_limit (bytes/s) for this long
+    long request_timeout_ms = 600000;
+    unsigned long low_speed_limit = 1;
+    bool tcp_keep_alive = true;
+    unsigned long tcp_keep_alive_interval_ms = 30000;
+    bool tcp_nodelay = true;
+    //threads of the executor running async requests, 0: SDK default
+    unsigned int executor_threads = 0;
+    //connections opened at startup, so the first requests skip the TLS handshake
+    unsigned int prewarm_connections = 0;
+
+    //S3TransferManager, 0 threads: derived from the available cores,
+    //0 heap: one buffer per thread
+    unsigned int transfer_threads = 0;
+    uint64_t transfer_buffer_size = 5 * 1024 * 1024;
+    uint64_t transfer_max_heap_size = 0;
+
+    //every request: throttling and transient errors are retried up to max_retries
+    //times after an exponential backoff with full jitter, and retries stay
+    //within retry_budget_percent of the requests
+    unsigned int max_retries = 3;
+    unsigned int retry_base_delay_ms = 50;
+    unsigned int retry_max_delay_ms = 5000;
+    unsigned int retry_budget_percent = 10;
+
+    //after that many failed requests in a row (no answer, 5xx but throttling),
+    //requests fail at once until S3 answers a probe again; 0: disabled
+    unsigned int breaker_failures = 0;
+
+    //several endpoints of a bucket: eject_failures failed requests in a row
+    //eject one until it answers a health check, sent every health_check_ms
+    unsigned int eject_failures = 5;
+    unsigned int health_check_ms = 1000;
+
+    //SDK messages at this level and above go to the Orthanc log
+    Aws::Utils::Logging::LogLevel aws_log_level = Aws::Utils::Logging::LogLevel::Warn;
+};
+
 class S3Impl {
 
 protected:
+    //a bucket and a client per endpoint, each with a connection pool of its own
+    struct Target {
+        Aws::String bucket;
+        std::vector<std::shared_ptr<Aws::S3::S3Client> > clients;
+        std::shared_ptr<EndpointBalancer> balancer;
+    };
+
+    //the endpoint of a target picked for one request
+    class Lease {
+        const Target& _target;
+        const size_t _endpoint;
+        Stopwatch _timer;
+
+    public:
+        explicit Lease(const Target& target):
+            _target(target),
+            _endpoint(target.balancer->Acquire()) {
+        };
+        //another endpoint than busy when the target has one
+        Lease(const Target& target, size_t busy):
+            _target(target),
+            _endpoint(target.balancer->Acquire(busy)) {
+        };
+        ~Lease() {
+            _target.balancer->Release(_endpoint, static_cast<uint64_t>(_timer.elapsed()));
+        };
+
+        size_t GetEndpoint() const { return _endpoint; };
+        Aws::S3::S3Client& GetClient() const { return *_target.clients[_endpoint]; };
+    };
+
     OrthancPluginContext* _context;
-    Aws::String _bucket_name;
     //Aws::String s3_region;
     Aws::SDKOptions aws_api_options;
-    std::shared_ptr<Aws::S3::S3Client> s3_client;
+    std::vector<Target> _targets;
+    //places every object key on one of the targets
+    HashRing _ring;
+    S3Options _options;
+    std::shared_ptr<AsyncLog> _log;
+    //set with hedge_reads, shared with the requests outliving their GET
+    std::shared_ptr<HedgePolicy> _hedge;
+    //replaces the retries of the SDK
+    std::shared_ptr<RetryPolicy> _retry;
+    //with breaker_failures, fed by every answer of the SDK
+    std::shared_ptr<CircuitBreaker> _breaker;
+
+    bool CreateBucket(const Target& target, const std::string& s3_region);
+    void PrewarmConnections(const Aws::S3::S3Client& client, const Aws::String& bucket);
+
+    //the owner of a key first, then the target it had before the last one was added
+    std::vector<size_t> GetTargets(const std::string& path) const {
+        return _targets.size() == 1 ? std::vector<size_t>(1, 0) : _ring.GetOwners(path, 2);
+    };
+
+    //GetObject through lease, sent again past the hedge delay to another
+    //endpoint of target if it has one; written: bytes in data
+    Aws::S3::Model::GetObjectOutcome GetObjectHedged(const Target& target, const Lease& lease,
+                                                     const Aws::S3::Model::GetObjectRequest& request,
+                                                     char* data, uint64_t length, uint64_t& written);
+
+    //total: set from the Content-Range of the answer when not null
+    bool DownloadRange(size_t target, const Aws::String& key_name, uint64_t begin, uint64_t length, char* data, uint64_t* total);
+
+    //the requests to one target, by index in _targets
+    virtual bool UploadTo(size_t target, const std::string& path, const void* content, int64_t size) = 0;
+    virtual bool DownloadFrom(size_t target, const std::string& path, void** content, int64_t* size) = 0;
+    bool DeleteFrom(size_t target, const std::string& path);
+    bool DeleteBatchFrom(size_t target, const std::vector<std::string>& paths, std::vector<std::string>& failed);
 
 public:
     S3Impl(OrthancPluginContext *c): _context(c) {};
     virtual ~S3Impl() {
+        Shutdown();
+
         //Cleanup AWS logging
         Aws::Utils::Logging::ShutdownAWSLogging();
         Aws::ShutdownAPI(aws_api_options);
@@ -58,35 +199,127 @@ public:
         _context = nullptr;
     };
 
+    //one client per target, all with the same credentials and region
     virtual bool ConfigureAwsSdk(const std::string& s3_access_key,
                                  const std::string& s3_secret_key,
-                                 const std::string& _bucket_name,
-                                 const std::string& s3_region,
-                                 const std::string& s3_endpoint);
+                                 const std::vector<S3Target>& targets,
+                                 const std::string& s3_region);
+
+    //a single bucket
+    bool ConfigureAwsSdk(const std::string& s3_access_key,
+                         const std::string& s3_secret_key,
+                         const std::string& s3_bucket_name,
+                         const std::string& s3_region,
+                         const std::string& s3_endpoint) {
+        S3Target target{s3_bucket_name, std::vector<std::string>()};
+        if (!s3_endpoint.empty()) {
+            target.endpoints.push_back(s3_endpoint);
+        }
+        return ConfigureAwsSdk(s3_access_key, s3_secret_key, std::vector<S3Target>(1, target), s3_region);
+    };
+
+    void SetOptions(const S3Options& options) {
+        _options = options;
+    };
+
+    //stops the threads using the clients, the SDK itself stays up; the
+    //plugin calls it on finalize since it never destroys the instance
+    void Shutdown() {
+        //health checks use the clients
+        for (auto& target : _targets) {
+            target.balancer->Stop();
+        }
 
-    virtual bool UploadFileToS3(const std::string & path, const void* content, const int64_t& size) = 0;
-    virtual bool DownloadFileFromS3(const std::string & path, void** content, int64_t* size) = 0;
-    virtual bool DeleteFileFromS3(const std::string & path) = 0;
+        //cancelled hedges still hold the client
+        if (_hedge) {
+            _hedge->WaitIdle();
+        }
+    };
+
+    //the SDK logs through it, set before ConfigureAwsSdk
+    void SetLog(std::shared_ptr<AsyncLog> log) {
+        _log = log;
+    };
+
+    //set by ConfigureAwsSdk
+    std::shared_ptr<RetryPolicy> GetRetryPolicy() const {
+        return _retry;
+    };
+
+    //null without breaker_failures
+    std::shared_ptr<CircuitBreaker> GetCircuitBreaker() const {
+        return _breaker;
+    };
+
+    //a HeadBucket to every target going through an open breaker, true if all answered
+    bool Probe();
+
+    //spreads the requests to a target over its endpoints
+    std::shared_ptr<EndpointBalancer> GetEndpointBalancer(size_t target) const {
+        return _targets[target].balancer;
+    };
+
+    //null without hedge_reads
+    std::shared_ptr<HedgePolicy> GetHedgePolicy() const {
+        return _hedge;
+    };
+
+    //the TransferManager thread pool, null for S3Direct
+    virtual std::shared_ptr<MonitoredExecutor> GetExecutor() const {
+        return nullptr;
+    };
+
+    //on the owner of path; reads fall back to its previous owner and
+    //deletes go to both, so objects not moved yet by a rebalance are found
+    bool UploadFileToS3(const std::string & path, const void* content, const int64_t& size);
+    bool DownloadFileFromS3(const std::string & path, void** content, int64_t* size);
+    bool DeleteFileFromS3(const std::string & path);
+
+    //length bytes at offset of an object, in a malloc'ed buffer
+    bool DownloadRangeFromS3(const std::string& path, uint64_t offset, uint64_t length, void** content);
+
+    //one DeleteObjects request, at most MAX_DELETE_BATCH paths;
+    //the paths that could not be deleted are returned in failed
+    static const size_t MAX_DELETE_BATCH = 1000;
+    bool DeleteFilesFromS3(const std::vector<std::string>& paths, std::vector<std::string>& failed);
+
+    size_t GetTargetCount() const {
+        return _targets.size();
+    };
+
+    size_t GetOwner(const std::string& path) const {
+        return _ring.GetOwner(path);
+    };
+
+    //every key of a target until visit returns false, false if the listing failed
+    bool ListObjects(size_t target, const std::function<bool(const std::string& path)>& visit);
+
+    //copies an object from a target to its owner, then deletes the original
+    bool MoveObject(const std::string& path, size_t from);
 
 };
 
 class S3Direct : public S3Impl
 {
 public:
+    //the first range of a GET, before the size of the object is known
+    static const uint64_t PROBE_SIZE = 1024 * 1024;
+
     S3Direct(OrthancPluginContext *c):
         S3Impl(c) {
         LogInfo(_context, "[S3] S3Direct");
     };
 
-    bool UploadFileToS3(const std::string & path, const void *content, const int64_t &size);
-    bool DownloadFileFromS3(const std::string & path, void** content, int64_t* size);
-    bool DeleteFileFromS3(const std::string & path);
+protected:
+    bool UploadTo(size_t target, const std::string& path, const void* content, int64_t size) override;
+    bool DownloadFrom(size_t target, const std::string& path, void** content, int64_t* size) override;
 };
 
 class S3TransferManager : public S3Impl
 {
-    std::shared_ptr<Aws::Utils::Threading::Executor> _executor;
-    std::shared_ptr<Aws::Transfer::TransferManager> _tm;
+    std::shared_ptr<MonitoredExecutor> _executor;
+    //one per endpoint of every target
+    std::vector<std::vector<std::shared_ptr<Aws::Transfer::TransferManager> > > _tms;
 
     void LogDetails(const std::shared_ptr<const Aws::Transfer::TransferHandle> &h);
 
@@ -96,15 +329,19 @@ public:
         LogInfo(_context, "[S3] S3TransferManager");
     };
 
+    std::shared_ptr<MonitoredExecutor> GetExecutor() const override {
+        return _executor;
+    };
+
+    using S3Impl::ConfigureAwsSdk;
     bool ConfigureAwsSdk(const std::string& s3_access_key,
                          const std::string& s3_secret_key,
-                         const std::string& _bucket_name,
-                         const std::string& s3_region,
-                         const std::string& s3_endpoint);
+                         const std::vector<S3Target>& targets,
+                         const std::string& s3_region) override;
 
-    bool UploadFileToS3(const std::string & path, const void *content, const int64_t& size);
-    bool DownloadFileFromS3(const std::string & path, void** content, int64_t* size);
-    bool DeleteFileFromS3(const std::string & path);
+protected:
+    bool UploadTo(size_t target, const std::string& path, const void* content, int64_t size) override;
+    bool DownloadFrom(size_t target, const std::string& path, void** content, int64_t* size) override;
 };
 
 
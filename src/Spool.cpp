@@ -0,0 +1,331 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "Spool.hpp"
+#include "Utils.hpp"
+#include "Core/OrthancException.h"
+
+#include <boost/filesystem.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <sstream>
+#include <tuple>
+#include <vector>
+
+namespace {
+  //a spooled attachment exists nowhere else, it has to survive a crash
+  void syncPath(const std::string& path) {
+      int fd = ::open(path.c_str(), O_RDONLY);
+      if (fd >= 0) {
+          ::fsync(fd);
+          ::close(fd);
+      }
+  }
+}
+
+namespace OrthancPlugins {
+
+Spool::Spool(OrthancPluginContext *c,
+             const std::string &directory,
+             std::shared_ptr<CircuitBreaker> breaker,
+             UploadFunction upload,
+             RemoveFunction remove,
+             ProbeFunction probe,
+             std::chrono::milliseconds probeInterval):
+    _context(c),
+    _directory(directory),
+    _breaker(breaker),
+    _upload(upload),
+    _remove(remove),
+    _probe(probe),
+    _probeInterval(probeInterval),
+    _spooled(0),
+    _drained(0)
+{
+}
+
+Spool::~Spool() {
+    Stop();
+}
+
+std::string Spool::GetPath(const std::string &uuid, OrthancPluginContentType type) const {
+    std::stringstream ss;
+    ss << _directory << "/" << uuid.substr(0, 2) << "/" << uuid.substr(2, 2) << "/" << uuid << "." << static_cast<int>(type);
+    return ss.str();
+}
+
+void Spool::Load() {
+    namespace fs = boost::filesystem;
+
+    std::vector<std::tuple<std::time_t, std::string, OrthancPluginContentType> > found;
+    try {
+        if (!fs::is_directory(_directory)) {
+            return;
+        }
+        for (fs::recursive_directory_iterator f(_directory); f != fs::recursive_directory_iterator(); ++f) {
+            if (!fs::is_regular_file(f->path())) {
+                continue;
+            }
+            if (f->path().extension() == ".tmp") {
+                //never acknowledged
+                fs::remove(f->path());
+                continue;
+            }
+            const std::string extension = f->path().extension().string();
+            if (extension.size() < 2) {
+                continue;
+            }
+            found.push_back(std::make_tuple(fs::last_write_time(f->path()),
+                                            f->path().stem().string(),
+                                            static_cast<OrthancPluginContentType>(std::atoi(extension.c_str() + 1))));
+        }
+    } catch (fs::filesystem_error& e) {
+        std::stringstream err;
+        err << "[S3] Spool: could not scan " << _directory << ", " << e.what();
+        LogError(_context, err.str());
+    }
+
+    std::sort(found.begin(), found.end());
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto& f : found) {
+        Entry entry;
+        entry.type = std::get<2>(f);
+        entry.uploading = false;
+        entry.removed = false;
+        _entries[std::get<1>(f)] = entry;
+        _order.push_back(std::get<1>(f));
+    }
+
+    if (!_entries.empty()) {
+        std::stringstream ss;
+        ss << "[S3] Spool: " << _entries.size() << " attachments left by the previous run";
+        LogWarning(_context, ss.str().c_str());
+    }
+}
+
+bool Spool::Start() {
+    try {
+        Utils::makeDirectory(_directory);
+    } catch (Orthanc::OrthancException& e) {
+        std::stringstream err;
+        err << "[S3] Spool: could not create " << _directory << ", " << e.What();
+        LogError(_context, err.str());
+        return false;
+    }
+
+    Load();
+    _thread = std::thread(&Spool::Loop, this);
+    return true;
+}
+
+void Spool::Stop() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _cv.notify_all();
+
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+bool Spool::Write(const std::string &uuid, const void *content, int64_t size, OrthancPluginContentType type) {
+    const std::string path = GetPath(uuid, type);
+    const std::string temp = path + ".tmp";
+
+    try {
+        //write aside and rename, so a crash never leaves a partial attachment
+        Utils::removeFile(temp);
+        Utils::writeFile(content, size, temp);
+        syncPath(temp);
+        boost::filesystem::rename(temp, path);
+        syncPath(boost::filesystem::path(path).parent_path().string());
+    } catch (Orthanc::OrthancException& e) {
+        std::stringstream err;
+        err << "[S3] Spool: could not write " << path << ", " << e.What();
+        LogError(_context, err.str());
+        return false;
+    } catch (boost::filesystem::filesystem_error& e) {
+        std::stringstream err;
+        err << "[S3] Spool: could not write " << path << ", " << e.what();
+        LogError(_context, err.str());
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        Entry entry;
+        entry.type = type;
+        entry.uploading = false;
+        entry.removed = false;
+        _entries[uuid] = entry;
+        _order.push_back(uuid);
+    }
+    _spooled++;
+    _cv.notify_all();
+    return true;
+}
+
+bool Spool::Read(const std::string &uuid, void **content, int64_t *size) {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(uuid);
+        if (it == _entries.end()) {
+            return false;
+        }
+        path = GetPath(uuid, it->second.type);
+    }
+
+    try {
+        *content = nullptr;
+        Utils::readFile(content, size, path);
+        return true;
+    } catch (Orthanc::OrthancException&) {
+        //uploaded and removed in the meantime
+        return false;
+    }
+}
+
+bool Spool::Remove(const std::string &uuid) {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it = _entries.find(uuid);
+        if (it == _entries.end()) {
+            return false;
+        }
+        if (it->second.uploading) {
+            //removed from S3 once uploaded
+            it->second.removed = true;
+            return true;
+        }
+        path = GetPath(uuid, it->second.type);
+        _entries.erase(it);
+    }
+
+    try {
+        Utils::removeFile(path);
+    } catch (Orthanc::OrthancException& e) {
+        std::stringstream err;
+        err << "[S3] Spool: could not remove " << path << ", " << e.What();
+        LogWarning(_context, err.str());
+    }
+    return true;
+}
+
+size_t Spool::GetPendingCount() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _entries.size();
+}
+
+bool Spool::DrainOne(std::unique_lock<std::mutex>& lock) {
+    const std::string uuid = _order.front();
+    _order.pop_front();
+    auto it = _entries.find(uuid);
+    if (it == _entries.end()) {
+        return true;
+    }
+    it->second.uploading = true;
+    const OrthancPluginContentType type = it->second.type;
+    const std::string path = GetPath(uuid, type);
+    lock.unlock();
+
+    bool readable = false;
+    bool ok = false;
+    void* content = nullptr;
+    int64_t size = 0;
+    try {
+        Utils::readFile(&content, &size, path);
+        readable = true;
+        ok = _upload(uuid, content, size, type);
+    } catch (Orthanc::OrthancException& e) {
+        std::stringstream err;
+        err << "[S3] Spool: could not upload " << path << ", " << e.What();
+        LogError(_context, err.str());
+    }
+    free(content);
+
+    lock.lock();
+    it = _entries.find(uuid);
+    if (!ok && readable) {
+        it->second.uploading = false;
+        _order.push_front(uuid);
+        return false;
+    }
+    //a file that can't be read is lost, retrying won't bring it back
+    const bool removed = it->second.removed;
+    _entries.erase(it);
+    if (ok) {
+        _drained++;
+    }
+    lock.unlock();
+
+    try {
+        Utils::removeFile(path);
+    } catch (Orthanc::OrthancException& e) {
+        std::stringstream err;
+        err << "[S3] Spool: could not remove " << path << ", " << e.What();
+        LogWarning(_context, err.str());
+    }
+    if (ok && removed) {
+        _remove(uuid, type);
+    }
+
+    lock.lock();
+    return true;
+}
+
+void Spool::Loop() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (!_stop) {
+        if (_breaker->IsOpen()) {
+            lock.unlock();
+            const bool answered = _probe();
+            lock.lock();
+            if (!answered) {
+                _cv.wait_for(lock, _probeInterval, [this]() { return _stop; });
+                continue;
+            }
+
+            _breaker->RecordSuccess();
+            std::stringstream ss;
+            ss << "[S3] S3 answers again after " << _breaker->GetLastTimeToRecover() / 1000
+               << " ms, " << _entries.size() << " attachments to upload from the spool";
+            LogWarning(_context, ss.str().c_str());
+        }
+
+        if (_order.empty()) {
+            _cv.wait_for(lock, _probeInterval, [this]() { return _stop || !_order.empty(); });
+        } else if (!DrainOne(lock)) {
+            _cv.wait_for(lock, _probeInterval, [this]() { return _stop; });
+        }
+    }
+}
+
+}
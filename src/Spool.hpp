@@ -0,0 +1,116 @@
+/**
+ * S3 Storage Plugin - A plugin for Orthanc DICOM Server for storing
+ * DICOM data in Amazon Simple Storage Service (AWS S3).
+ *
+ * Copyright (C) 2018 (Radpoint Sp. z o.o., Poland)
+ * Marek Kwasecki, Bartłomiej Pyciński
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Affero General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Affero General Public License for more details.
+ *
+ * You should have received a copy of the GNU Affero General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef SPOOL_HPP
+#define SPOOL_HPP
+
+#include "OrthancPluginCppWrapper.h"
+#include "CircuitBreaker.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace OrthancPlugins {
+
+/*
+ * Local fallback for StorageCreate while the circuit breaker is open.
+ *
+ * Attachments are written under the spool directory, in the aa/bb/uuid
+ * layout of the storage area with the content type as extension, and
+ * acknowledged once they are on disk. A background thread probes S3 while
+ * the breaker is open and, once it has closed, uploads the spooled
+ * attachments oldest first. Reads and removes look into the spool first,
+ * and whatever is left on disk is drained after the next start.
+ */
+class Spool
+{
+public:
+    typedef std::function<bool(const std::string& uuid, const void* content, int64_t size, OrthancPluginContentType type)> UploadFunction;
+    typedef std::function<bool(const std::string& uuid, OrthancPluginContentType type)> RemoveFunction;
+    //true when S3 answered
+    typedef std::function<bool()> ProbeFunction;
+
+private:
+    struct Entry {
+        OrthancPluginContentType type;
+        bool uploading;
+        bool removed; //while uploading
+    };
+
+    OrthancPluginContext* _context;
+    std::string _directory;
+    std::shared_ptr<CircuitBreaker> _breaker;
+    UploadFunction _upload;
+    RemoveFunction _remove;
+    ProbeFunction _probe;
+    std::chrono::milliseconds _probeInterval;
+
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    std::unordered_map<std::string, Entry> _entries;
+    std::deque<std::string> _order; //oldest first, may hold removed uuids
+    bool _stop = false;
+    std::thread _thread;
+
+    std::atomic<uint64_t> _spooled;
+    std::atomic<uint64_t> _drained;
+
+    std::string GetPath(const std::string& uuid, OrthancPluginContentType type) const;
+    void Load();
+    void Loop();
+    //uploads the oldest attachment, false if it has to wait
+    bool DrainOne(std::unique_lock<std::mutex>& lock);
+
+public:
+    Spool(OrthancPluginContext* c,
+          const std::string& directory,
+          std::shared_ptr<CircuitBreaker> breaker,
+          UploadFunction upload,
+          RemoveFunction remove,
+          ProbeFunction probe,
+          std::chrono::milliseconds probeInterval);
+    ~Spool();
+
+    //picks up the files of a previous run and starts the thread
+    bool Start();
+    void Stop();
+
+    //returns once the attachment is on disk
+    bool Write(const std::string& uuid, const void* content, int64_t size, OrthancPluginContentType type);
+    bool Read(const std::string& uuid, void** content, int64_t* size);
+    //true if the attachment was spooled, it's gone then
+    bool Remove(const std::string& uuid);
+
+    size_t GetPendingCount();
+    uint64_t GetSpooledCount() const { return _spooled; };
+    uint64_t GetDrainedCount() const { return _drained; };
+};
+
+}
+#endif // SPOOL_HPP
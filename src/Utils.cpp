@@ -26,7 +26,15 @@
 #include <boost/filesystem/fstream.hpp>
 #include <boost/date_time/posix_time/posix_time.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
 #include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
 
 namespace OrthancPlugins {
 namespace Utils {
@@ -210,5 +218,63 @@ bool isDirectory(const std::string& path) {
 
 }
 
+namespace {
+    //CPUs allowed by the cgroup CFS quota, 0 when unlimited or unknown
+    double getCgroupCpuLimit() {
+        double quota = -1;
+        double period = 0;
+
+        //cgroup v2: "max 100000" or "200000 100000"
+        std::ifstream v2("/sys/fs/cgroup/cpu.max");
+        if (v2.good()) {
+            std::string q;
+            v2 >> q >> period;
+            if (q != "max") {
+                quota = std::strtod(q.c_str(), nullptr);
+            }
+        } else {
+            //cgroup v1, quota is -1 when unlimited
+            std::ifstream q("/sys/fs/cgroup/cpu/cpu.cfs_quota_us");
+            std::ifstream p("/sys/fs/cgroup/cpu/cpu.cfs_period_us");
+            if (q.good() && p.good()) {
+                q >> quota;
+                p >> period;
+            }
+        }
+
+        if (quota <= 0 || period <= 0) {
+            return 0;
+        }
+        return quota / period;
+    }
+}
+
+unsigned int getAvailableCores() {
+    unsigned int cores = std::thread::hardware_concurrency();
+
+#ifdef __linux__
+    //taskset/cpuset
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        const int count = CPU_COUNT(&set);
+        if (count > 0 && (cores == 0 || static_cast<unsigned int>(count) < cores)) {
+            cores = static_cast<unsigned int>(count);
+        }
+    }
+
+    //docker --cpus, kubernetes limits
+    const double limit = getCgroupCpuLimit();
+    if (limit > 0) {
+        const unsigned int quota = static_cast<unsigned int>(std::ceil(limit));
+        if (cores == 0 || quota < cores) {
+            cores = quota;
+        }
+    }
+#endif
+
+    return std::max(cores, 1u);
+}
+
 }
 }
@@ -55,6 +55,9 @@ bool isRegularFile(const std::string& path);
 bool isExistingFile(const std::string& path);
 bool isDirectory(const std::string& path);
 
+//cores usable by the process: affinity mask and cgroup CPU quota included
+unsigned int getAvailableCores();
+
 
 }
 
@@ -0,0 +1,90 @@
+#include "AllocationCounter.hpp"
+#include "MockS3Server.hpp"
+
+#include <atomic>
+
+#include <malloc.h>
+
+extern "C" {
+void* __libc_malloc(size_t n);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t n);
+void __libc_free(void* p);
+}
+
+namespace {
+
+std::atomic<bool> counting(false);
+std::atomic<uint64_t> allocations(0);
+std::atomic<uint64_t> bytes(0);
+std::atomic<uint64_t> largeBytes(0);
+
+inline bool counted() {
+    return counting.load(std::memory_order_relaxed) && !OrthancPlugins::MockS3Server::IsServerThread();
+}
+
+//block: size of the block, added: what it adds to the heap
+inline void track(size_t block, size_t added) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(added, std::memory_order_relaxed);
+    if (block >= OrthancPlugins::AllocationCounter::LARGE) {
+        largeBytes.fetch_add(added, std::memory_order_relaxed);
+    }
+}
+
+}
+
+extern "C" {
+
+void* malloc(size_t n) {
+    if (counted()) {
+        track(n, n);
+    }
+    return __libc_malloc(n);
+}
+
+void* calloc(size_t n, size_t size) {
+    if (counted()) {
+        track(n * size, n * size);
+    }
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t n) {
+    if (counted()) {
+        const size_t old = p != nullptr ? malloc_usable_size(p) : 0;
+        track(n, n > old ? n - old : 0);
+    }
+    return __libc_realloc(p, n);
+}
+
+void free(void* p) {
+    __libc_free(p);
+}
+
+}
+
+namespace OrthancPlugins {
+
+const size_t AllocationCounter::LARGE;
+
+AllocationCounter::AllocationCounter() {
+    allocations = 0;
+    bytes = 0;
+    largeBytes = 0;
+    counting = true;
+}
+
+AllocationCounter::~AllocationCounter() {
+    counting = false;
+}
+
+AllocationCounter::Stats AllocationCounter::Get() const {
+    Stats stats;
+    stats.allocations = allocations;
+    stats.bytes = bytes;
+    stats.large_bytes = largeBytes;
+    return stats;
+}
+
+}
@@ -0,0 +1,37 @@
+#ifndef ALLOCATIONCOUNTER_HPP
+#define ALLOCATIONCOUNTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+namespace OrthancPlugins {
+
+/*
+ * Counts the heap allocations of the test binary while alive, on every
+ * thread but the mock server's. malloc, calloc and realloc are replaced
+ * for the whole binary (operator new ends up in malloc), so the SDK and
+ * curl are counted too. Only one counter at a time.
+ *
+ * Copies of an object body are not seen directly, but each one needs a
+ * body sized buffer to land in: large_bytes sums the blocks of LARGE
+ * bytes and more, and a realloc counts only what it grows by.
+ */
+class AllocationCounter
+{
+public:
+    static const size_t LARGE = 256 * 1024;
+
+    struct Stats {
+        uint64_t allocations = 0;
+        uint64_t bytes = 0;
+        uint64_t large_bytes = 0;
+    };
+
+    AllocationCounter();
+    ~AllocationCounter();
+
+    Stats Get() const;
+};
+
+}
+#endif // ALLOCATIONCOUNTER_HPP
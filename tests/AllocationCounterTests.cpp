@@ -0,0 +1,72 @@
+#include "gtest/gtest.h"
+
+#include "AllocationCounter.hpp"
+#include "MockS3Server.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+TEST(AllocationCounter, SeesBodySizedCopies) {
+    std::vector<char> body(1024 * 1024, 'x');
+
+    AllocationCounter counter;
+    std::vector<char> copy(body);
+    std::string small(100, 'y');
+    EXPECT_EQ(counter.Get().allocations, 2u);
+    EXPECT_EQ(counter.Get().large_bytes, body.size());
+
+    //only the growth of a realloc is new memory
+    char* data = static_cast<char*>(malloc(AllocationCounter::LARGE));
+    data = static_cast<char*>(realloc(data, 2 * AllocationCounter::LARGE));
+    free(data);
+    EXPECT_LE(counter.Get().large_bytes, body.size() + 2 * AllocationCounter::LARGE);
+    EXPECT_GE(counter.Get().large_bytes, body.size() + 3 * AllocationCounter::LARGE / 2);
+}
+
+TEST(AllocationCounter, CountsOtherThreadsButNotTheMock) {
+    MockS3Server server;
+    ASSERT_TRUE(server.Start());
+    server.CreateBucket("bucket");
+
+    AllocationCounter counter;
+    std::thread([]() {
+        std::vector<char> body(AllocationCounter::LARGE);
+        EXPECT_FALSE(MockS3Server::IsServerThread());
+    }).join();
+    EXPECT_EQ(counter.Get().large_bytes, AllocationCounter::LARGE);
+
+    //the request is built here, the mock receives and stores a copy of it
+    std::string request = "PUT /bucket/key HTTP/1.1\r\nContent-Length: "
+            + std::to_string(AllocationCounter::LARGE) + "\r\nConnection: close\r\n\r\n";
+    request.append(AllocationCounter::LARGE, 'z');
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(server.GetPort());
+    ASSERT_EQ(connect(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)), 0);
+    ASSERT_EQ(send(fd, request.data(), request.size(), MSG_NOSIGNAL), static_cast<ssize_t>(request.size()));
+    char answer[256];
+    EXPECT_GT(recv(fd, answer, sizeof(answer), 0), 0);
+    close(fd);
+
+    EXPECT_EQ(server.GetObjectCount("bucket"), 1u);
+    const uint64_t large = counter.Get().large_bytes;
+    EXPECT_GE(large, 2 * AllocationCounter::LARGE);
+    EXPECT_LT(large, 3 * AllocationCounter::LARGE);
+}
+
+} //namespace
@@ -0,0 +1,104 @@
+#include "gtest/gtest.h"
+
+#include "AsyncLog.hpp"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+std::mutex linesMutex;
+std::vector<std::pair<_OrthancPluginService, std::string> > lines;
+
+OrthancPluginErrorCode invokeService(OrthancPluginContext*, _OrthancPluginService service, const void* params) {
+    std::lock_guard<std::mutex> lock(linesMutex);
+    lines.push_back(std::make_pair(service, std::string(static_cast<const char*>(params))));
+    return OrthancPluginErrorCode_Success;
+}
+
+OrthancPluginContext context = {nullptr, "1.4.0", nullptr, invokeService};
+
+const char* UUID = "8b5e5d2e-3e12-4c8d-9a2b-0d5d1f3c4b6a";
+
+TEST(AsyncLog, LevelGate) {
+    lines.clear();
+    AsyncLog log(&context, LogLevel::WARNING, 0, 0);
+    EXPECT_TRUE(isLogEnabled(LogLevel::WARNING));
+    EXPECT_FALSE(isLogEnabled(LogLevel::INFO));
+
+    log.Start();
+    log.Log(LogLevel::INFO, "[S3] GET: ", UUID);
+    log.Log(LogLevel::WARNING, "[S3] GET ", UUID, " finished in ", 42, "us");
+    log.Log(LogLevel::ERROR, std::string("[S3] formatted"));
+    log.Stop();
+
+    ASSERT_EQ(2u, lines.size());
+    EXPECT_EQ(_OrthancPluginService_LogWarning, lines[0].first);
+    EXPECT_EQ(std::string("[S3] GET ") + UUID + " finished in 42us", lines[0].second);
+    EXPECT_EQ(_OrthancPluginService_LogError, lines[1].first);
+    EXPECT_EQ("[S3] formatted", lines[1].second);
+
+    LogLevel level;
+    EXPECT_TRUE(parseLogLevel("Info", level));
+    EXPECT_EQ(LogLevel::INFO, level);
+    EXPECT_FALSE(parseLogLevel("verbose", level));
+}
+
+TEST(AsyncLog, Traces) {
+    lines.clear();
+    AsyncLog log(&context, LogLevel::ERROR, 0, 1000 * 1000);
+
+    OperationTrace fast(&log, "read", UUID, OrthancPluginContentType_Dicom);
+    fast.Finish(true);
+
+    //anything over the threshold is traced, whatever the level
+    AsyncLog slowLog(&context, LogLevel::ERROR, 0, 1);
+    OperationTrace slow(&slowLog, "read", UUID, OrthancPluginContentType_Dicom);
+    slow.SetSource("s3");
+    slow.SetSize(1024);
+    slow.Mark("downloaded");
+    while (slow.Finish(false) < 1) {
+    }
+
+    log.Start();
+    log.Stop();
+    EXPECT_TRUE(lines.empty());
+
+    slowLog.Start();
+    slowLog.Stop();
+    ASSERT_LE(1u, lines.size());
+    const std::string& line = lines[0].second;
+    EXPECT_EQ(0u, line.find(std::string("[S3] slow read ") + UUID + " (dicom) failed, 1024 bytes from s3 in "));
+    EXPECT_NE(std::string::npos, line.find(": downloaded at "));
+}
+
+TEST(AsyncLog, Sampling) {
+    lines.clear();
+    AsyncLog log(&context, LogLevel::ERROR, 10, 0);
+    for (int i = 0; i < 100; ++i) {
+        OperationTrace trace(&log, "create", UUID, OrthancPluginContentType_DicomAsJson);
+        trace.Finish(true);
+    }
+    log.Start();
+    log.Stop();
+    EXPECT_EQ(10u, lines.size());
+}
+
+TEST(AsyncLog, DropsWhenFull) {
+    lines.clear();
+    AsyncLog log(&context, LogLevel::INFO, 0, 0);
+    for (size_t i = 0; i < AsyncLog::CAPACITY + 10; ++i) {
+        log.Log(LogLevel::INFO, "[S3] GET: ", UUID);
+    }
+    EXPECT_EQ(10u, log.GetDropped());
+
+    log.Start();
+    log.Stop();
+    ASSERT_EQ(AsyncLog::CAPACITY + 1, lines.size());
+    EXPECT_EQ("[S3] 10 log records dropped, the log ring was full", lines.back().second);
+}
+
+}
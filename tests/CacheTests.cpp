@@ -0,0 +1,59 @@
+#include "gtest/gtest.h"
+
+#include "LruCache.hpp"
+#include "MemoryCache.hpp"
+
+#include <cstdlib>
+#include <string>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+TEST(LruCache, EvictsLeastRecentlyUsed) {
+    LruCache<int> lru(10);
+    std::vector<LruCache<int>::Item> evicted;
+
+    EXPECT_TRUE(lru.Put("a", 1, 4, evicted));
+    EXPECT_TRUE(lru.Put("b", 2, 4, evicted));
+
+    int v = 0;
+    EXPECT_TRUE(lru.Get("a", v)); // "b" is now the oldest
+    EXPECT_TRUE(lru.Put("c", 3, 4, evicted));
+
+    ASSERT_EQ(evicted.size(), 1u);
+    EXPECT_EQ(evicted[0].first, "b");
+    EXPECT_EQ(lru.GetCost(), 8u);
+    EXPECT_FALSE(lru.Contains("b"));
+}
+
+TEST(LruCache, RejectsEntriesLargerThanCapacity) {
+    LruCache<int> lru(10);
+    std::vector<LruCache<int>::Item> evicted;
+
+    EXPECT_FALSE(lru.Put("a", 1, 11, evicted));
+    EXPECT_EQ(lru.GetCount(), 0u);
+}
+
+TEST(MemoryCache, HitRatio) {
+    MemoryCache cache(1024 * 1024, 4, {OrthancPluginContentType_DicomAsJson});
+    EXPECT_TRUE(cache.IsEnabled(OrthancPluginContentType_DicomAsJson));
+    EXPECT_FALSE(cache.IsEnabled(OrthancPluginContentType_Dicom));
+
+    const std::string json = "{\"0010,0010\":\"DOE^JOHN\"}";
+    cache.Insert("uuid-1", json.data(), json.size());
+
+    void* content = nullptr;
+    int64_t size = 0;
+    ASSERT_TRUE(cache.Read("uuid-1", &content, &size));
+    EXPECT_EQ(std::string(static_cast<char*>(content), size), json);
+    free(content);
+
+    EXPECT_FALSE(cache.Read("uuid-2", &content, &size));
+    EXPECT_DOUBLE_EQ(cache.GetHitRatio(), 0.5);
+
+    cache.Remove("uuid-1");
+    EXPECT_FALSE(cache.Read("uuid-1", &content, &size));
+}
+
+} //namespace
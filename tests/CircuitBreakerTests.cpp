@@ -0,0 +1,57 @@
+#include "gtest/gtest.h"
+
+#include "CircuitBreaker.hpp"
+
+#include <chrono>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const std::chrono::milliseconds MS(1);
+
+TEST(CircuitBreaker, TripsAfterFailuresInARow) {
+    CircuitBreaker breaker(3);
+    const CircuitBreaker::Clock::time_point now = CircuitBreaker::Clock::now();
+
+    EXPECT_TRUE(breaker.Allow());
+    breaker.RecordFailure(now);
+    breaker.RecordFailure(now + 10 * MS);
+    //an answer breaks the streak
+    breaker.RecordSuccess(now + 20 * MS);
+    breaker.RecordFailure(now + 30 * MS);
+    breaker.RecordFailure(now + 40 * MS);
+    EXPECT_FALSE(breaker.IsOpen());
+
+    breaker.RecordFailure(now + 100 * MS);
+    EXPECT_TRUE(breaker.IsOpen());
+    EXPECT_EQ(breaker.GetTrips(), 1u);
+    //from the first failure of the streak
+    EXPECT_EQ(breaker.GetLastTimeToTrip(), 70000u);
+
+    EXPECT_FALSE(breaker.Allow());
+    EXPECT_FALSE(breaker.Allow());
+    EXPECT_EQ(breaker.GetRejected(), 2u);
+}
+
+TEST(CircuitBreaker, RecoversOnAnAnswer) {
+    CircuitBreaker breaker(1);
+    const CircuitBreaker::Clock::time_point now = CircuitBreaker::Clock::now();
+
+    breaker.RecordFailure(now);
+    EXPECT_TRUE(breaker.IsOpen());
+    //more failures while open change nothing
+    breaker.RecordFailure(now + 100 * MS);
+    EXPECT_EQ(breaker.GetTrips(), 1u);
+
+    breaker.RecordSuccess(now + 250 * MS);
+    EXPECT_FALSE(breaker.IsOpen());
+    EXPECT_TRUE(breaker.Allow());
+    EXPECT_EQ(breaker.GetLastTimeToRecover(), 250000u);
+    EXPECT_EQ(breaker.GetOpenTime(), 0u);
+
+    breaker.RecordFailure(now + 300 * MS);
+    EXPECT_EQ(breaker.GetTrips(), 2u);
+}
+
+} //namespace
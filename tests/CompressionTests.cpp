@@ -0,0 +1,122 @@
+#include "gtest/gtest.h"
+
+#include "Compression.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+std::string makeJson(size_t size) {
+    std::string s;
+    while (s.size() < size) {
+        s += "{\"0010,0010\":{\"Name\":\"PatientName\",\"Type\":\"String\",\"Value\":\"DOE^JOHN\"}},";
+    }
+    s.resize(size);
+    return s;
+}
+
+//preamble, DICM and a group 0002 holding only the transfer syntax
+std::string makeDicom(const std::string& uid, size_t pixels) {
+    std::string s(128, '\0');
+    s += "DICM";
+    std::string value = uid;
+    if (value.size() % 2) {
+        value += '\0';
+    }
+    const char tag[] = {0x02, 0x00, 0x10, 0x00, 'U', 'I'};
+    s.append(tag, sizeof(tag));
+    s += static_cast<char>(value.size() & 0xff);
+    s += static_cast<char>(value.size() >> 8);
+    s += value;
+    s += std::string(pixels, '\x7f');
+    return s;
+}
+
+std::map<OrthancPluginContentType, CompressionCodec> zlibForAll() {
+    return {{OrthancPluginContentType_Dicom, CompressionCodec::ZLIB},
+            {OrthancPluginContentType_DicomAsJson, CompressionCodec::ZLIB}};
+}
+
+std::string roundTrip(const std::string& compressed, unsigned int threads) {
+    void* content = nullptr;
+    int64_t size = 0;
+    EXPECT_TRUE(Compressor::Decompress(compressed.data(), compressed.size(), &content, &size, threads));
+    std::string result(static_cast<char*>(content), static_cast<size_t>(size));
+    free(content);
+    return result;
+}
+
+TEST(Compression, RoundTrip) {
+    Compressor compressor(zlibForAll(), 1024, 4 * 1024 * 1024, 2, 0, false);
+    const std::string json = makeJson(100 * 1024);
+
+    std::string compressed;
+    ASSERT_TRUE(compressor.Compress(json.data(), json.size(), OrthancPluginContentType_DicomAsJson, compressed));
+    EXPECT_LT(compressed.size(), json.size() / 3);
+    EXPECT_TRUE(Compressor::IsCompressed(compressed.data(), compressed.size()));
+    EXPECT_FALSE(Compressor::IsCompressed(json.data(), json.size()));
+
+    EXPECT_EQ(roundTrip(compressed, 1), json);
+}
+
+TEST(Compression, ParallelChunks) {
+    Compressor compressor(zlibForAll(), 0, 64 * 1024, 4, 1, false);
+    const std::string json = makeJson(1000 * 1000 + 7);
+
+    std::string compressed;
+    ASSERT_TRUE(compressor.Compress(json.data(), json.size(), OrthancPluginContentType_DicomAsJson, compressed));
+    EXPECT_EQ(roundTrip(compressed, 4), json);
+    EXPECT_EQ(roundTrip(compressed, 1), json);
+}
+
+TEST(Compression, SkipsWhatDoesNotPay) {
+    Compressor compressor(zlibForAll(), 1024, 4 * 1024 * 1024, 1, 0, false);
+    std::string compressed;
+
+    const std::string tiny = makeJson(100);
+    EXPECT_FALSE(compressor.Compress(tiny.data(), tiny.size(), OrthancPluginContentType_DicomAsJson, compressed));
+
+    std::string noise(64 * 1024, '\0');
+    std::mt19937 rng(42);
+    for (auto& c : noise) {
+        c = static_cast<char>(rng());
+    }
+    EXPECT_FALSE(compressor.Compress(noise.data(), noise.size(), OrthancPluginContentType_DicomAsJson, compressed));
+
+    const std::string json = makeJson(100 * 1024);
+    EXPECT_FALSE(compressor.Compress(json.data(), json.size(), OrthancPluginContentType_Unknown, compressed));
+}
+
+TEST(Compression, SkipsCompressedTransferSyntax) {
+    Compressor compressor(zlibForAll(), 0, 4 * 1024 * 1024, 1, 0, false);
+    std::string compressed;
+
+    const std::string jpeg = makeDicom("1.2.840.10008.1.2.4.50", 64 * 1024);
+    EXPECT_EQ(getTransferSyntax(jpeg.data(), jpeg.size()), "1.2.840.10008.1.2.4.50");
+    EXPECT_FALSE(compressor.Compress(jpeg.data(), jpeg.size(), OrthancPluginContentType_Dicom, compressed));
+
+    const std::string raw = makeDicom("1.2.840.10008.1.2.1", 64 * 1024);
+    EXPECT_EQ(getTransferSyntax(raw.data(), raw.size()), "1.2.840.10008.1.2.1");
+    ASSERT_TRUE(compressor.Compress(raw.data(), raw.size(), OrthancPluginContentType_Dicom, compressed));
+    EXPECT_EQ(roundTrip(compressed, 1), raw);
+}
+
+TEST(Compression, RejectsCorruptedObject) {
+    Compressor compressor(zlibForAll(), 0, 4 * 1024 * 1024, 1, 0, false);
+    const std::string json = makeJson(10 * 1024);
+
+    std::string compressed;
+    ASSERT_TRUE(compressor.Compress(json.data(), json.size(), OrthancPluginContentType_DicomAsJson, compressed));
+    compressed.resize(compressed.size() - 1);
+
+    void* content = nullptr;
+    int64_t size = 0;
+    EXPECT_FALSE(Compressor::Decompress(compressed.data(), compressed.size(), &content, &size, 1));
+}
+
+} //namespace
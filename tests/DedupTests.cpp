@@ -0,0 +1,171 @@
+#include "gtest/gtest.h"
+
+#include "Dedup.hpp"
+#include "TestFixtures.hpp"
+#include "Utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+class DedupTest : public TempDirTest {
+protected:
+    FakeS3 s3;
+
+    std::unique_ptr<Dedup> Create() {
+        std::unique_ptr<Dedup> dedup(new Dedup(context, root + "/dedup-index.log", [this](const std::string& key) {
+            return s3.Remove(key);
+        }));
+        EXPECT_TRUE(dedup->Load());
+        return dedup;
+    }
+
+    bool Store(Dedup& dedup, const std::string& uuid, const std::string& content,
+               std::chrono::milliseconds delay = std::chrono::milliseconds(0)) {
+        return dedup.Store(uuid, content.data(), static_cast<int64_t>(content.size()), [&](const std::string& key) {
+            std::this_thread::sleep_for(delay);
+            return s3.up && s3.Put(key, content.data(), static_cast<int64_t>(content.size()));
+        });
+    }
+};
+
+TEST_F(DedupTest, IdenticalContentIsUploadedOnce) {
+    std::unique_ptr<Dedup> dedup = Create();
+    ASSERT_TRUE(Store(*dedup, "a", "same"));
+    ASSERT_TRUE(Store(*dedup, "b", "same"));
+    ASSERT_TRUE(Store(*dedup, "c", "other"));
+    EXPECT_EQ(s3.uploads, 2);
+    EXPECT_EQ(dedup->GetHits(), 1u);
+    EXPECT_EQ(dedup->GetSavedBytes(), 4u);
+
+    std::string a, b, c;
+    ASSERT_TRUE(dedup->Lookup("a", a));
+    ASSERT_TRUE(dedup->Lookup("b", b));
+    ASSERT_TRUE(dedup->Lookup("c", c));
+    EXPECT_EQ(a, b);
+    EXPECT_NE(a, c);
+    EXPECT_EQ(a, "cas/" + hashContent("same", 4));
+    EXPECT_FALSE(dedup->Lookup("d", a));
+}
+
+TEST_F(DedupTest, LastReferenceDeletesTheObject) {
+    std::unique_ptr<Dedup> dedup = Create();
+    ASSERT_TRUE(Store(*dedup, "a", "same"));
+    ASSERT_TRUE(Store(*dedup, "b", "same"));
+    const std::string key = "cas/" + hashContent("same", 4);
+
+    bool ok = false;
+    ASSERT_TRUE(dedup->Remove("a", ok));
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(s3.removes, 0);
+    EXPECT_EQ(s3.objects.count(key), 1u);
+
+    ASSERT_TRUE(dedup->Remove("b", ok));
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(s3.removes, 1);
+    EXPECT_EQ(s3.objects.count(key), 0u);
+
+    //not deduplicated anymore
+    EXPECT_FALSE(dedup->Remove("b", ok));
+
+    //and uploaded again when it comes back
+    ASSERT_TRUE(Store(*dedup, "c", "same"));
+    EXPECT_EQ(s3.uploads, 2);
+}
+
+TEST_F(DedupTest, StoringTheSameUuidAgainIsNotCounted) {
+    std::unique_ptr<Dedup> dedup = Create();
+    ASSERT_TRUE(Store(*dedup, "a", "same"));
+    //a journal replay or a spool drain of the same attachment
+    ASSERT_TRUE(Store(*dedup, "a", "same"));
+    EXPECT_EQ(s3.uploads, 1);
+    EXPECT_EQ(dedup->GetHits(), 0u);
+
+    //the only reference is gone with it
+    bool ok = false;
+    ASSERT_TRUE(dedup->Remove("a", ok));
+    EXPECT_TRUE(ok);
+    EXPECT_EQ(s3.removes, 1);
+    EXPECT_EQ(s3.objects.count("cas/" + hashContent("same", 4)), 0u);
+}
+
+TEST_F(DedupTest, ReferencesCountedAfterReload) {
+    {
+        std::unique_ptr<Dedup> dedup = Create();
+        ASSERT_TRUE(Store(*dedup, "a", "same"));
+        ASSERT_TRUE(Store(*dedup, "b", "same"));
+        ASSERT_TRUE(Store(*dedup, "c", "same"));
+    }
+
+    std::unique_ptr<Dedup> dedup = Create();
+    ASSERT_TRUE(Store(*dedup, "d", "same"));
+    EXPECT_EQ(s3.uploads, 1);
+
+    bool ok = false;
+    for (const char* uuid : {"a", "b", "c"}) {
+        ASSERT_TRUE(dedup->Remove(uuid, ok));
+        EXPECT_EQ(s3.removes, 0);
+    }
+    ASSERT_TRUE(dedup->Remove("d", ok));
+    EXPECT_EQ(s3.removes, 1);
+}
+
+TEST_F(DedupTest, ConcurrentIdenticalStores) {
+    std::unique_ptr<Dedup> dedup = Create();
+
+    //the first upload is slow, the other writers wait for it
+    const int threads = 8;
+    std::atomic<int> failed(0);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.emplace_back([&, t]() {
+            if (!Store(*dedup, "uuid-" + std::to_string(t), "same", std::chrono::milliseconds(20))) {
+                failed++;
+            }
+        });
+    }
+    for (auto& w : writers) {
+        w.join();
+    }
+    EXPECT_EQ(failed, 0);
+    EXPECT_EQ(s3.uploads, 1);
+    EXPECT_EQ(dedup->GetHits(), static_cast<uint64_t>(threads - 1));
+
+    //removed concurrently too, the object goes with the last one
+    bool ok = false;
+    std::vector<std::thread> removers;
+    for (int t = 0; t < threads; ++t) {
+        removers.emplace_back([&, t]() {
+            bool removed = false;
+            EXPECT_TRUE(dedup->Remove("uuid-" + std::to_string(t), removed));
+            EXPECT_TRUE(removed);
+        });
+    }
+    for (auto& r : removers) {
+        r.join();
+    }
+    EXPECT_EQ(s3.removes, 1);
+    EXPECT_TRUE(s3.objects.empty());
+    EXPECT_FALSE(dedup->Remove("uuid-0", ok));
+}
+
+TEST_F(DedupTest, FailedUploadIsNotIndexed) {
+    std::unique_ptr<Dedup> dedup = Create();
+    s3.up = false;
+    EXPECT_FALSE(Store(*dedup, "a", "same"));
+    std::string key;
+    EXPECT_FALSE(dedup->Lookup("a", key));
+
+    s3.up = true;
+    ASSERT_TRUE(Store(*dedup, "b", "same"));
+    EXPECT_EQ(s3.uploads, 1);
+    EXPECT_EQ(dedup->GetHits(), 0u);
+}
+
+} //namespace
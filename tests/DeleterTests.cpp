@@ -0,0 +1,208 @@
+#include "gtest/gtest.h"
+
+#include "Deleter.hpp"
+#include "MockS3Server.hpp"
+#include "S3ops.hpp"
+#include "Utils.hpp"
+
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Deleter in front of S3Direct and the mock, as set up by the plugin
+ * with background_delete.
+ */
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const char* BUCKET = "s3-deleter";
+
+class DeleterTest : public ::testing::Test {
+protected:
+    MockS3Server server;
+    std::unique_ptr<S3Impl> s3;
+    std::string path;
+
+    std::mutex mutex;
+    std::vector<size_t> batches; //sizes, one per DeleteObjects
+
+    void SetUp() override {
+        //no instance metadata lookups from the SDK
+        setenv("AWS_EC2_METADATA_DISABLED", "true", 1);
+        ASSERT_TRUE(server.Start());
+
+        S3Options options;
+        //a failed batch is the deleter's to retry
+        options.max_retries = 0;
+        options.aws_log_level = Aws::Utils::Logging::LogLevel::Error;
+        s3.reset(new S3Direct(context));
+        s3->SetOptions(options);
+        ASSERT_TRUE(s3->ConfigureAwsSdk("mock", "mock", {S3Target{BUCKET, {server.GetEndpoint()}}}, "us-east-1"));
+
+        char name[] = "/tmp/s3-deleter-XXXXXX";
+        const int fd = mkstemp(name);
+        ASSERT_GE(fd, 0);
+        close(fd);
+        path = name;
+    }
+
+    void TearDown() override {
+        remove(path.c_str());
+        s3.reset();
+        server.Stop();
+    }
+
+    std::unique_ptr<Deleter> Create(size_t batchSize = S3Impl::MAX_DELETE_BATCH) {
+        return std::unique_ptr<Deleter>(new Deleter(context, path, batchSize,
+                                                    [this](const std::vector<std::string>& paths, std::vector<std::string>& failed) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                batches.push_back(paths.size());
+            }
+            return s3->DeleteFilesFromS3(paths, failed);
+        }));
+    }
+
+    void PutObjects(const std::vector<std::string>& keys) {
+        for (const auto& key : keys) {
+            server.PutObject(BUCKET, key, "x");
+        }
+    }
+
+    size_t Batches() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return batches.size();
+    }
+
+    //down: every request answered SlowDown; denied: keys DeleteObjects refuses
+    void SetFaults(bool down, const std::set<std::string>& denied = std::set<std::string>()) {
+        MockS3Server::Faults faults;
+        faults.slow_down_rate = down ? 1 : 0;
+        faults.denied_deletes = denied;
+        server.SetFaults(faults);
+    }
+
+    bool WaitFor(std::function<bool()> condition) {
+        for (int i = 0; i < 500 && !condition(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return condition();
+    }
+};
+
+TEST_F(DeleterTest, DeletesInBatches) {
+    const std::vector<std::string> keys = {"a", "b", "c", "d", "e"};
+    PutObjects(keys);
+
+    std::unique_ptr<Deleter> deleter = Create(2);
+    ASSERT_TRUE(deleter->Start());
+    for (const auto& key : keys) {
+        ASSERT_TRUE(deleter->Enqueue(key));
+    }
+
+    ASSERT_TRUE(WaitFor([this]() { return server.GetObjectCount(BUCKET) == 0; }));
+    ASSERT_TRUE(WaitFor([&deleter]() { return deleter->GetPendingCount() == 0; }));
+    EXPECT_EQ(server.GetStats().deletes, keys.size());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    EXPECT_GE(batches.size(), 3u);
+    for (size_t size : batches) {
+        EXPECT_LE(size, 2u);
+    }
+}
+
+TEST_F(DeleterTest, QueueSurvivesRestart) {
+    const std::vector<std::string> keys = {"a", "b", "c"};
+    PutObjects(keys);
+
+    //S3 down: the keys stay in the queue file
+    SetFaults(true);
+    {
+        std::unique_ptr<Deleter> deleter = Create();
+        ASSERT_TRUE(deleter->Start());
+        for (const auto& key : keys) {
+            ASSERT_TRUE(deleter->Enqueue(key));
+        }
+        ASSERT_TRUE(WaitFor([this]() { return Batches() > 0; }));
+        EXPECT_EQ(deleter->GetPendingCount(), keys.size());
+    }
+    EXPECT_EQ(server.GetObjectCount(BUCKET), keys.size());
+
+    //and the next start deletes them
+    SetFaults(false);
+    std::unique_ptr<Deleter> deleter = Create();
+    ASSERT_TRUE(deleter->Start());
+    ASSERT_TRUE(WaitFor([this]() { return server.GetObjectCount(BUCKET) == 0; }));
+    ASSERT_TRUE(WaitFor([&deleter]() { return deleter->GetPendingCount() == 0; }));
+    deleter.reset();
+
+    //nothing left to resume
+    deleter = Create();
+    ASSERT_TRUE(deleter->Start());
+    EXPECT_EQ(deleter->GetPendingCount(), 0u);
+}
+
+TEST_F(DeleterTest, FailedBatchBacksOff) {
+    PutObjects({"a", "b"});
+    SetFaults(true);
+
+    std::unique_ptr<Deleter> deleter = Create();
+    ASSERT_TRUE(deleter->Start());
+    ASSERT_TRUE(deleter->Enqueue("a"));
+    ASSERT_TRUE(deleter->Enqueue("b"));
+
+    //retried after 0.5 s, then 1 s: no busy loop against a failing S3
+    std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+    EXPECT_GE(Batches(), 2u);
+    EXPECT_LE(Batches(), 4u);
+    EXPECT_EQ(deleter->GetPendingCount(), 2u);
+
+    SetFaults(false);
+    ASSERT_TRUE(WaitFor([this]() { return server.GetObjectCount(BUCKET) == 0; }));
+    ASSERT_TRUE(WaitFor([&deleter]() { return deleter->GetPendingCount() == 0; }));
+}
+
+TEST_F(DeleterTest, PartialFailureRequeued) {
+    PutObjects({"a", "denied", "c"});
+    SetFaults(false, {"denied"});
+
+    std::unique_ptr<Deleter> deleter = Create();
+    ASSERT_TRUE(deleter->Start());
+    ASSERT_TRUE(deleter->Enqueue("a"));
+    ASSERT_TRUE(deleter->Enqueue("denied"));
+    ASSERT_TRUE(deleter->Enqueue("c"));
+
+    //the others of the batch are done, only the failed key is retried
+    ASSERT_TRUE(WaitFor([this]() { return server.GetObjectCount(BUCKET) == 1; }));
+    ASSERT_TRUE(WaitFor([&deleter]() { return deleter->GetPendingCount() == 1; }));
+    std::string content;
+    EXPECT_TRUE(server.GetObject(BUCKET, "denied", content));
+
+    //and it is still queued after a restart
+    deleter.reset();
+    const size_t before = Batches();
+    deleter = Create();
+    ASSERT_TRUE(deleter->Start());
+    ASSERT_TRUE(WaitFor([this, before]() { return Batches() > before; }));
+    EXPECT_EQ(deleter->GetPendingCount(), 1u);
+
+    SetFaults(false);
+    ASSERT_TRUE(WaitFor([this]() { return server.GetObjectCount(BUCKET) == 0; }));
+    ASSERT_TRUE(WaitFor([&deleter]() { return deleter->GetPendingCount() == 0; }));
+    EXPECT_EQ(server.GetStats().deletes, 3u);
+}
+
+} //namespace
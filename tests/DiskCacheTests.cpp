@@ -0,0 +1,130 @@
+#include "gtest/gtest.h"
+
+#include "DiskCache.hpp"
+#include "TestFixtures.hpp"
+#include "Utils.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <ctime>
+#include <memory>
+#include <string>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+//DiskCache takes a plain function, like GetPathInstance of the plugin
+std::string cacheRoot;
+
+std::string cachePath(const char* uuid) {
+    std::string level_1 (uuid, 0, 2);
+    std::string level_2 (uuid, 2, 2);
+    return cacheRoot + "/" + level_1 + "/" + level_2  + "/" + std::string(uuid);
+}
+
+class DiskCacheTest : public TempDirTest {
+protected:
+    void SetUp() override {
+        TempDirTest::SetUp();
+        cacheRoot = root;
+    }
+
+    std::unique_ptr<DiskCache> Create(uint64_t capacity) {
+        std::unique_ptr<DiskCache> cache(new DiskCache(context, root, capacity, cachePath));
+        cache->Load();
+        return cache;
+    }
+
+    void Insert(DiskCache& cache, const std::string& uuid, const std::string& data) {
+        cache.Insert(uuid, data.data(), static_cast<int64_t>(data.size()));
+    }
+
+    bool OnDisk(const std::string& uuid) {
+        return boost::filesystem::exists(cachePath(uuid.c_str()));
+    }
+};
+
+TEST_F(DiskCacheTest, InsertReadRemove) {
+    std::unique_ptr<DiskCache> cache = Create(1024);
+    EXPECT_EQ(Read(*cache, "0a1b2c3d"), "<missing>");
+
+    Insert(*cache, "0a1b2c3d", "dicom");
+    Insert(*cache, "0a1bffff", "json");
+    EXPECT_TRUE(OnDisk("0a1b2c3d"));
+    EXPECT_EQ(cache->GetSize(), 9u);
+    EXPECT_EQ(Read(*cache, "0a1b2c3d"), "dicom");
+    EXPECT_EQ(Read(*cache, "0a1bffff"), "json");
+
+    //attachments are immutable, a second insert changes nothing
+    Insert(*cache, "0a1b2c3d", "other");
+    EXPECT_EQ(Read(*cache, "0a1b2c3d"), "dicom");
+
+    cache->Remove("0a1b2c3d");
+    EXPECT_FALSE(OnDisk("0a1b2c3d"));
+    EXPECT_EQ(Read(*cache, "0a1b2c3d"), "<missing>");
+    EXPECT_EQ(cache->GetSize(), 4u);
+
+    //a file gone behind the cache's back is a miss, and leaves the index
+    boost::filesystem::remove(cachePath("0a1bffff"));
+    EXPECT_EQ(Read(*cache, "0a1bffff"), "<missing>");
+    EXPECT_EQ(cache->GetSize(), 0u);
+}
+
+TEST_F(DiskCacheTest, EvictsOnDisk) {
+    std::unique_ptr<DiskCache> cache = Create(10);
+    Insert(*cache, "aaaa0001", "1111");
+    Insert(*cache, "bbbb0002", "2222");
+
+    //"bbbb0002" is now the oldest
+    EXPECT_EQ(Read(*cache, "aaaa0001"), "1111");
+    Insert(*cache, "cccc0003", "3333");
+
+    EXPECT_FALSE(OnDisk("bbbb0002"));
+    EXPECT_EQ(Read(*cache, "bbbb0002"), "<missing>");
+    EXPECT_TRUE(OnDisk("aaaa0001"));
+    EXPECT_TRUE(OnDisk("cccc0003"));
+    EXPECT_EQ(cache->GetSize(), 8u);
+
+    //larger than the whole cache, never written
+    Insert(*cache, "dddd0004", std::string(11, 'x'));
+    EXPECT_FALSE(OnDisk("dddd0004"));
+    EXPECT_EQ(cache->GetSize(), 8u);
+}
+
+TEST_F(DiskCacheTest, ReloadsExistingDirectory) {
+    {
+        std::unique_ptr<DiskCache> cache = Create(1024);
+        Insert(*cache, "aaaa0001", "old");
+        Insert(*cache, "bbbb0002", "newer");
+        Insert(*cache, "cccc0003", "newest");
+    }
+
+    //the LRU order comes from the modification times
+    const std::time_t now = std::time(nullptr);
+    boost::filesystem::last_write_time(cachePath("aaaa0001"), now - 30);
+    boost::filesystem::last_write_time(cachePath("bbbb0002"), now - 20);
+    boost::filesystem::last_write_time(cachePath("cccc0003"), now - 10);
+    //an insert interrupted by a crash
+    Utils::writeFile(std::string("partial"), cachePath("dddd0004") + ".tmp");
+    //not a cache directory
+    Utils::writeFile(std::string("foreign"), root + "/index/file");
+
+    {
+        std::unique_ptr<DiskCache> cache = Create(1024);
+        EXPECT_EQ(cache->GetSize(), 14u);
+        EXPECT_EQ(Read(*cache, "aaaa0001"), "old");
+        EXPECT_EQ(Read(*cache, "cccc0003"), "newest");
+        EXPECT_FALSE(boost::filesystem::exists(cachePath("dddd0004") + ".tmp"));
+        EXPECT_TRUE(boost::filesystem::exists(root + "/index/file"));
+    }
+
+    //a smaller capacity drops the oldest files
+    std::unique_ptr<DiskCache> cache = Create(12);
+    EXPECT_EQ(cache->GetSize(), 11u);
+    EXPECT_FALSE(OnDisk("aaaa0001"));
+    EXPECT_EQ(Read(*cache, "bbbb0002"), "newer");
+    EXPECT_EQ(Read(*cache, "cccc0003"), "newest");
+}
+
+} //namespace
@@ -0,0 +1,152 @@
+#include "gtest/gtest.h"
+
+#include "EndpointBalancer.hpp"
+#include "Utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+TEST(EndpointBalancer, RoundRobinWhenIdle) {
+    EndpointBalancer balancer(context, {"a", "b", "c"}, 3);
+    std::vector<size_t> counts(3, 0);
+    for (int i = 0; i < 300; ++i) {
+        const size_t e = balancer.Acquire();
+        counts[e]++;
+        balancer.Release(e, 1000);
+    }
+    for (size_t c : counts) {
+        EXPECT_EQ(c, 100u);
+    }
+}
+
+TEST(EndpointBalancer, LeastOutstanding) {
+    EndpointBalancer balancer(context, {"a", "b"}, 3);
+    //same latency, the busy endpoint is avoided
+    for (size_t e = 0; e < 2; ++e) {
+        balancer.Release(balancer.Acquire(), 1000);
+    }
+    const size_t busy = balancer.Acquire();
+    for (int i = 0; i < 10; ++i) {
+        const size_t e = balancer.Acquire();
+        EXPECT_NE(e, busy);
+        balancer.Release(e, 1000);
+    }
+    EXPECT_EQ(balancer.GetOutstanding(busy), 1);
+    balancer.Release(busy, 1000);
+}
+
+TEST(EndpointBalancer, AnotherThanBusy) {
+    EndpointBalancer balancer(context, {"fast", "slow", "other"}, 3);
+    balancer.Release(balancer.Acquire(), 1000);
+    balancer.Release(balancer.Acquire(), 4000);
+    balancer.Release(balancer.Acquire(), 8000);
+
+    //the best one is never the busy one, even while idle
+    for (int i = 0; i < 10; ++i) {
+        const size_t e = balancer.Acquire(0);
+        EXPECT_EQ(e, 1u);
+        balancer.Release(e, 4000);
+    }
+
+    //nor an ejected one while there is another
+    for (int i = 0; i < 3; ++i) {
+        balancer.RecordFailure(1);
+    }
+    const size_t e = balancer.Acquire(0);
+    EXPECT_EQ(e, 2u);
+    balancer.Release(e, 8000);
+
+    //a single endpoint is all there is
+    EndpointBalancer single(context, {"a"}, 3);
+    EXPECT_EQ(single.Acquire(0), 0u);
+    single.Release(0, 1000);
+}
+
+TEST(EndpointBalancer, WeightedByLatency) {
+    EndpointBalancer balancer(context, {"fast", "slow"}, 3);
+    //both tried once, then the fast one wins while idle
+    for (int i = 0; i < 10; ++i) {
+        const size_t e = balancer.Acquire();
+        balancer.Release(e, e == 0 ? 1000 : 4000);
+    }
+    EXPECT_EQ(balancer.GetLatency(0), 1000u);
+    EXPECT_EQ(balancer.GetLatency(1), 4000u);
+    EXPECT_EQ(balancer.GetRequests(1), 1u);
+
+    //four times slower: about a fifth of the concurrent requests
+    std::vector<size_t> held;
+    size_t slow = 0;
+    for (int i = 0; i < 50; ++i) {
+        held.push_back(balancer.Acquire());
+        slow += held.back();
+    }
+    EXPECT_GE(slow, 8u);
+    EXPECT_LE(slow, 12u);
+    for (size_t e : held) {
+        balancer.Release(e, e == 0 ? 1000 : 4000);
+    }
+}
+
+TEST(EndpointBalancer, Ejection) {
+    EndpointBalancer balancer(context, {"a", "b"}, 3);
+    balancer.RecordFailure(0);
+    balancer.RecordFailure(0);
+    //an answer breaks the streak
+    balancer.RecordAnswer(0);
+    balancer.RecordFailure(0);
+    balancer.RecordFailure(0);
+    EXPECT_FALSE(balancer.IsEjected(0));
+    balancer.RecordFailure(0);
+    EXPECT_TRUE(balancer.IsEjected(0));
+    EXPECT_EQ(balancer.GetEjections(0), 1u);
+    EXPECT_EQ(balancer.GetEjectedCount(), 1u);
+
+    for (int i = 0; i < 10; ++i) {
+        const size_t e = balancer.Acquire();
+        EXPECT_EQ(e, 1u);
+        balancer.Release(e, 1000);
+    }
+
+    //all ejected: all used
+    for (int i = 0; i < 3; ++i) {
+        balancer.RecordFailure(1);
+    }
+    std::vector<size_t> counts(2, 0);
+    for (int i = 0; i < 10; ++i) {
+        const size_t e = balancer.Acquire();
+        counts[e]++;
+        balancer.Release(e, 1000);
+    }
+    EXPECT_GT(counts[0], 0u);
+    EXPECT_GT(counts[1], 0u);
+
+    balancer.RecordAnswer(0);
+    EXPECT_FALSE(balancer.IsEjected(0));
+}
+
+TEST(EndpointBalancer, HealthChecks) {
+    EndpointBalancer balancer(context, {"a", "b"}, 100);
+    std::atomic<bool> up(false);
+    balancer.Start([&up](size_t e) { return e == 0 || up; }, std::chrono::milliseconds(5));
+
+    for (int i = 0; i < 500 && !balancer.IsEjected(1); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    EXPECT_TRUE(balancer.IsEjected(1));
+    EXPECT_FALSE(balancer.IsEjected(0));
+
+    up = true;
+    for (int i = 0; i < 500 && balancer.IsEjected(1); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    EXPECT_FALSE(balancer.IsEjected(1));
+    balancer.Stop();
+}
+
+} //namespace
@@ -0,0 +1,70 @@
+#include "gtest/gtest.h"
+
+#include "HashRing.hpp"
+
+#include <string>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const size_t KEYS = 20000;
+
+std::string key(size_t i) {
+    return "0b6b9a2e-34f9-4a5b-8a36-" + std::to_string(100000000000ULL + i);
+}
+
+TEST(HashRing, Balanced) {
+    const HashRing ring({"a", "b", "c", "d"});
+    std::vector<size_t> counts(4, 0);
+    for (size_t i = 0; i < KEYS; ++i) {
+        counts[ring.GetOwner(key(i))]++;
+    }
+    for (size_t c : counts) {
+        EXPECT_GT(c, KEYS / 4 * 8 / 10);
+        EXPECT_LT(c, KEYS / 4 * 12 / 10);
+    }
+}
+
+TEST(HashRing, OrderDoesNotMatter) {
+    const HashRing ring({"a", "b", "c"});
+    const HashRing reversed({"c", "b", "a"});
+    for (size_t i = 0; i < 1000; ++i) {
+        EXPECT_EQ(ring.GetOwner(key(i)), 2 - reversed.GetOwner(key(i)));
+    }
+}
+
+TEST(HashRing, AddingATargetMovesItsShareOnly) {
+    const HashRing before({"a", "b", "c", "d"});
+    const HashRing after({"a", "b", "c", "d", "e"});
+
+    size_t moved = 0;
+    for (size_t i = 0; i < KEYS; ++i) {
+        const size_t owner = after.GetOwner(key(i));
+        if (owner != before.GetOwner(key(i))) {
+            //to the new target only, taken from the next one on the ring
+            EXPECT_EQ(owner, 4u);
+            EXPECT_EQ(after.GetOwners(key(i), 2)[1], before.GetOwner(key(i)));
+            moved++;
+        }
+    }
+    EXPECT_GT(moved, KEYS / 5 * 8 / 10);
+    EXPECT_LT(moved, KEYS / 5 * 12 / 10);
+}
+
+TEST(HashRing, Owners) {
+    const HashRing ring({"a", "b", "c"});
+    const std::vector<size_t> owners = ring.GetOwners("key", 5);
+    ASSERT_EQ(owners.size(), 3u);
+    EXPECT_EQ(owners[0], ring.GetOwner("key"));
+    EXPECT_NE(owners[0], owners[1]);
+    EXPECT_NE(owners[1], owners[2]);
+    EXPECT_NE(owners[0], owners[2]);
+
+    EXPECT_EQ(HashRing().GetOwner("key"), 0u);
+    EXPECT_TRUE(HashRing().GetOwners("key", 2).empty());
+    EXPECT_EQ(HashRing({"a"}).GetOwners("key", 2), std::vector<size_t>({0}));
+}
+
+} //namespace
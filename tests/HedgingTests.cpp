@@ -0,0 +1,112 @@
+#include "gtest/gtest.h"
+
+#include "Hedging.hpp"
+
+#include <chrono>
+#include <thread>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const std::chrono::seconds SECOND(1);
+
+TEST(HedgePolicy, NoDelayBeforeEnoughSamples) {
+    HedgePolicy policy(95, 100, 0);
+    const HedgePolicy::Clock::time_point now = HedgePolicy::Clock::now();
+
+    for (uint64_t i = 1; i < HedgePolicy::MIN_SAMPLES; ++i) {
+        policy.RecordFirstByte(1000);
+    }
+    EXPECT_EQ(policy.OnRequest(now), 0u);
+
+    policy.RecordFirstByte(1000);
+    EXPECT_EQ(policy.OnRequest(now + SECOND), 1000u);
+}
+
+TEST(HedgePolicy, DelayFollowsPercentile) {
+    HedgePolicy policy(95, 5, 0);
+    const HedgePolicy::Clock::time_point now = HedgePolicy::Clock::now();
+
+    //1 ms to 100 ms
+    for (uint64_t v = 1; v <= 100; ++v) {
+        policy.RecordFirstByte(v * 1000);
+    }
+    const uint64_t delay = policy.OnRequest(now);
+    EXPECT_GE(delay, 95000u);
+    EXPECT_LE(delay, 95000u * 103 / 100);
+    EXPECT_EQ(policy.GetDelay(), delay);
+
+    //cached for a second
+    for (int i = 0; i < 1000; ++i) {
+        policy.RecordFirstByte(1000000);
+    }
+    EXPECT_EQ(policy.OnRequest(now + std::chrono::milliseconds(500)), delay);
+    EXPECT_GE(policy.OnRequest(now + SECOND), 1000000u);
+}
+
+TEST(HedgePolicy, MinimumDelay) {
+    HedgePolicy policy(50, 5, 20000);
+    for (uint64_t i = 0; i < HedgePolicy::MIN_SAMPLES; ++i) {
+        policy.RecordFirstByte(100);
+    }
+    EXPECT_EQ(policy.OnRequest(), 20000u);
+}
+
+TEST(HedgePolicy, Budget) {
+    HedgePolicy policy(95, 5, 0);
+
+    //nothing earned yet
+    EXPECT_FALSE(policy.TryHedge());
+
+    //5% of 1000 requests
+    uint64_t hedges = 0;
+    for (int i = 0; i < 1000; ++i) {
+        policy.OnRequest();
+        if (policy.TryHedge()) {
+            hedges++;
+        }
+    }
+    EXPECT_EQ(hedges, 50u);
+    EXPECT_EQ(policy.GetHedges(), 50u);
+    EXPECT_EQ(policy.GetRequests(), 1000u);
+}
+
+TEST(HedgePolicy, BudgetBurst) {
+    HedgePolicy policy(95, 50, 0);
+
+    //unused budget piles up to MAX_HEDGES only
+    for (int i = 0; i < 1000; ++i) {
+        policy.OnRequest();
+    }
+    int64_t hedges = 0;
+    while (policy.TryHedge()) {
+        hedges++;
+    }
+    EXPECT_EQ(hedges, HedgePolicy::MAX_HEDGES);
+}
+
+TEST(HedgePolicy, NoBudget) {
+    HedgePolicy policy(95, 0, 0);
+    for (int i = 0; i < 1000; ++i) {
+        policy.OnRequest();
+    }
+    EXPECT_FALSE(policy.TryHedge());
+}
+
+TEST(HedgePolicy, WaitIdle) {
+    HedgePolicy policy(95, 5, 0);
+    policy.WaitIdle();
+
+    policy.BeginRequest();
+    policy.BeginRequest();
+    std::thread t([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        policy.EndRequest();
+        policy.EndRequest();
+    });
+    policy.WaitIdle();
+    t.join();
+}
+
+} //namespace
@@ -0,0 +1,266 @@
+#include "gtest/gtest.h"
+
+#include "Journal.hpp"
+#include "TestFixtures.hpp"
+#include "Utils.hpp"
+
+#include <boost/filesystem.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+//down unless accepted for some uuids, uploads can be held in flight
+struct JournalS3 : FakeS3 {
+    std::set<std::string> accepted;
+    std::atomic<bool> hold{false};
+    std::atomic<int> started{0};
+};
+
+class JournalTest : public TempDirTest {
+protected:
+    JournalS3 s3;
+
+    void SetUp() override {
+        TempDirTest::SetUp();
+        s3.up = false;
+    }
+
+    std::unique_ptr<Journal> Create(uint64_t segmentSize = 64 * 1024 * 1024) {
+        return std::unique_ptr<Journal>(new Journal(context, root + "/journal", segmentSize,
+                                                    [this](const std::string& uuid, const void* content, int64_t size, OrthancPluginContentType) {
+            s3.started++;
+            while (s3.hold) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return (s3.up || Accepted(uuid)) && s3.Put(uuid, content, size);
+        }, [this](const std::string& uuid, OrthancPluginContentType) {
+            return s3.Remove(uuid);
+        }));
+    }
+
+    void Accept(const std::string& uuid) {
+        std::lock_guard<std::mutex> lock(s3.mutex);
+        s3.accepted.insert(uuid);
+    }
+
+    bool Accepted(const std::string& uuid) {
+        std::lock_guard<std::mutex> lock(s3.mutex);
+        return s3.accepted.count(uuid) > 0;
+    }
+
+    bool Uploaded(const std::string& uuid, std::string& data) {
+        return s3.Get(uuid, data);
+    }
+
+    std::vector<std::string> Segments() {
+        std::vector<std::string> segments;
+        for (boost::filesystem::directory_iterator it(root + "/journal"); it != boost::filesystem::directory_iterator(); ++it) {
+            segments.push_back(it->path().string());
+        }
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+};
+
+TEST_F(JournalTest, ReplayedAfterRestart) {
+    {
+        std::unique_ptr<Journal> journal = Create();
+        ASSERT_TRUE(journal->Start(2));
+        ASSERT_TRUE(journal->Append("a", "dicom", 5, OrthancPluginContentType_Dicom));
+        ASSERT_TRUE(journal->Append("b", "json", 4, OrthancPluginContentType_DicomAsJson));
+        ASSERT_TRUE(journal->Append("empty", "", 0, OrthancPluginContentType_Dicom));
+        EXPECT_EQ(journal->GetPendingCount(), 3u);
+        EXPECT_EQ(Read(*journal, "a"), "dicom");
+    }
+    EXPECT_EQ(s3.uploads, 0);
+
+    s3.up = true;
+    std::unique_ptr<Journal> journal = Create();
+    ASSERT_TRUE(journal->Start(2));
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 0; }));
+
+    std::string data;
+    ASSERT_TRUE(Uploaded("a", data));
+    EXPECT_EQ(data, "dicom");
+    ASSERT_TRUE(Uploaded("b", data));
+    EXPECT_EQ(data, "json");
+    ASSERT_TRUE(Uploaded("empty", data));
+    EXPECT_EQ(data, "");
+    EXPECT_EQ(Read(*journal, "a"), "<missing>");
+}
+
+TEST_F(JournalTest, TornTailIsDropped) {
+    {
+        std::unique_ptr<Journal> journal = Create();
+        ASSERT_TRUE(journal->Start(1));
+        ASSERT_TRUE(journal->Append("kept", "first", 5, OrthancPluginContentType_Dicom));
+        ASSERT_TRUE(journal->Append("torn", "second", 6, OrthancPluginContentType_Dicom));
+    }
+
+    //a crash in the middle of the last record
+    const std::string segment = Segments().front();
+    const uint64_t size = boost::filesystem::file_size(segment);
+    boost::filesystem::resize_file(segment, size - 2);
+
+    std::unique_ptr<Journal> journal = Create();
+    ASSERT_TRUE(journal->Start(1));
+    EXPECT_EQ(journal->GetPendingCount(), 1u);
+    EXPECT_EQ(Read(*journal, "kept"), "first");
+    EXPECT_EQ(Read(*journal, "torn"), "<missing>");
+}
+
+TEST_F(JournalTest, CorruptTailIsDropped) {
+    {
+        std::unique_ptr<Journal> journal = Create();
+        ASSERT_TRUE(journal->Start(1));
+        ASSERT_TRUE(journal->Append("kept", "first", 5, OrthancPluginContentType_Dicom));
+        ASSERT_TRUE(journal->Append("corrupt", "second", 6, OrthancPluginContentType_Dicom));
+    }
+
+    //the last byte of the payload flipped, the CRC doesn't match anymore
+    const std::string segment = Segments().front();
+    {
+        std::fstream f(segment.c_str(), std::ios::in | std::ios::out | std::ios::binary);
+        f.seekg(-1, std::ios::end);
+        char c = 0;
+        f.read(&c, 1);
+        c = static_cast<char>(c ^ 0xff);
+        f.seekp(-1, std::ios::end);
+        f.write(&c, 1);
+    }
+
+    s3.up = true;
+    std::unique_ptr<Journal> journal = Create();
+    ASSERT_TRUE(journal->Start(1));
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 0; }));
+    std::string data;
+    ASSERT_TRUE(Uploaded("kept", data));
+    EXPECT_EQ(data, "first");
+    EXPECT_FALSE(Uploaded("corrupt", data));
+}
+
+TEST_F(JournalTest, RemoveCancelsPendingPut) {
+    {
+        std::unique_ptr<Journal> journal = Create();
+        ASSERT_TRUE(journal->Start(1));
+        ASSERT_TRUE(journal->Append("removed", "gone", 4, OrthancPluginContentType_Dicom));
+        ASSERT_TRUE(journal->Append("kept", "here", 4, OrthancPluginContentType_Dicom));
+
+        //never left the journal
+        EXPECT_TRUE(journal->Remove("removed"));
+        EXPECT_FALSE(journal->Remove("unknown"));
+        EXPECT_EQ(journal->GetPendingCount(), 1u);
+        EXPECT_EQ(Read(*journal, "removed"), "<missing>");
+    }
+
+    //and the remove record keeps a replay from resurrecting it
+    s3.up = true;
+    std::unique_ptr<Journal> journal = Create();
+    ASSERT_TRUE(journal->Start(1));
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 0; }));
+    std::string data;
+    EXPECT_TRUE(Uploaded("kept", data));
+    EXPECT_FALSE(Uploaded("removed", data));
+    EXPECT_EQ(s3.uploads, 1);
+    EXPECT_EQ(s3.removes, 0);
+}
+
+TEST_F(JournalTest, RemoveDuringUploadIsLeftToTheUploader) {
+    s3.up = true;
+    s3.hold = true;
+    std::unique_ptr<Journal> journal = Create();
+    ASSERT_TRUE(journal->Start(1));
+    ASSERT_TRUE(journal->Append("inflight", "data", 4, OrthancPluginContentType_Dicom));
+    ASSERT_TRUE(WaitFor([this]() { return s3.started > 0; }));
+
+    //the journal owns it, the caller must not send a DELETE of its own
+    EXPECT_TRUE(journal->Remove("inflight"));
+    EXPECT_EQ(s3.removes, 0);
+
+    //deleted once the PUT is over
+    s3.hold = false;
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 0; }));
+    std::string data;
+    EXPECT_FALSE(Uploaded("inflight", data));
+    EXPECT_EQ(s3.uploads, 1);
+    EXPECT_EQ(s3.removes, 1);
+}
+
+TEST_F(JournalTest, ConcurrentWritersShareCommits) {
+    s3.up = true;
+    std::unique_ptr<Journal> journal = Create(64 * 1024);
+
+    ASSERT_TRUE(journal->Start(4));
+    const int threads = 8;
+    const int appends = 50;
+    std::atomic<int> failed(0);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t) {
+        writers.emplace_back([&, t]() {
+            for (int i = 0; i < appends; ++i) {
+                const std::string uuid = std::to_string(t) + "-" + std::to_string(i);
+                const std::string data(1000 + t * 10 + i, static_cast<char>('a' + t));
+                if (!journal->Append(uuid, data.data(), static_cast<int64_t>(data.size()), OrthancPluginContentType_Dicom)) {
+                    failed++;
+                }
+            }
+        });
+    }
+    for (auto& w : writers) {
+        w.join();
+    }
+    EXPECT_EQ(failed, 0);
+    //appends waiting for the same fsync go with it
+    EXPECT_LT(journal->GetCommitCount(), static_cast<uint64_t>(threads * appends));
+
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 0; }));
+    EXPECT_EQ(s3.uploads, threads * appends);
+    for (int t = 0; t < threads; ++t) {
+        for (int i = 0; i < appends; ++i) {
+            std::string data;
+            ASSERT_TRUE(Uploaded(std::to_string(t) + "-" + std::to_string(i), data));
+            EXPECT_EQ(data, std::string(1000 + t * 10 + i, static_cast<char>('a' + t)));
+        }
+    }
+    //everything uploaded, only the active segment is left
+    EXPECT_EQ(Segments().size(), 1u);
+}
+
+TEST_F(JournalTest, SegmentsReleasedOnceUploaded) {
+    //one record per segment
+    std::unique_ptr<Journal> journal = Create(1024);
+    ASSERT_TRUE(journal->Start(2));
+    const std::string data(800, 'x');
+    for (const char* uuid : {"first", "second", "third"}) {
+        ASSERT_TRUE(journal->Append(uuid, data.data(), static_cast<int64_t>(data.size()), OrthancPluginContentType_Dicom));
+    }
+    EXPECT_EQ(Segments().size(), 3u);
+
+    //a newer segment done, it waits for the older ones
+    Accept("second");
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 2; }));
+    EXPECT_EQ(Segments().size(), 3u);
+
+    Accept("first");
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 1; }));
+    EXPECT_EQ(Segments().size(), 1u);
+    EXPECT_EQ(Read(*journal, "third"), data);
+
+    //the active segment stays
+    Accept("third");
+    ASSERT_TRUE(WaitFor([&journal]() { return journal->GetPendingCount() == 0; }));
+    EXPECT_EQ(Segments().size(), 1u);
+}
+
+} //namespace
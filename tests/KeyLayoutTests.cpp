@@ -0,0 +1,155 @@
+#include "gtest/gtest.h"
+
+#include "KeyLayout.hpp"
+#include "PersistentMap.hpp"
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const std::string UUID = "0f6bc0a7-5a2b-4c0e-9d3a-1b2c3d4e5f60";
+
+std::string tempPath() {
+    char path[] = "/tmp/s3-keys-XXXXXX";
+    const int fd = mkstemp(path);
+    close(fd);
+    return path;
+}
+
+TEST(KeyLayout, FlatIsTheUuid) {
+    FlatLayout layout;
+    std::string key;
+    ASSERT_TRUE(layout.CreateKey(UUID, OrthancPluginContentType_Dicom, key));
+    EXPECT_EQ(key, UUID);
+}
+
+TEST(KeyLayout, HashPrefixIsStable) {
+    HashPrefixLayout layout(4);
+    std::string key, again;
+    ASSERT_TRUE(layout.CreateKey(UUID, OrthancPluginContentType_Dicom, key));
+    ASSERT_TRUE(layout.GetKey(UUID, OrthancPluginContentType_DicomAsJson, again));
+
+    EXPECT_EQ(key, again);
+    EXPECT_EQ(key.size(), 4 + 1 + UUID.size());
+    EXPECT_EQ(key.substr(4), "/" + UUID);
+    EXPECT_EQ(key.find_first_not_of("0123456789abcdef"), 4u);
+}
+
+TEST(KeyLayout, ContentTypePrefix) {
+    ContentTypeLayout layout;
+    std::string key;
+    ASSERT_TRUE(layout.CreateKey(UUID, OrthancPluginContentType_DicomAsJson, key));
+    EXPECT_EQ(key, "json/" + UUID);
+    ASSERT_TRUE(layout.GetKey(UUID, OrthancPluginContentType_Dicom, key));
+    EXPECT_EQ(key, "dicom/" + UUID);
+}
+
+TEST(KeyLayout, DateIsRememberedAcrossRestarts) {
+    const std::string path = tempPath();
+    std::string key;
+    {
+        DateLayout layout(path);
+        ASSERT_TRUE(layout.Load());
+        EXPECT_FALSE(layout.GetKey(UUID, OrthancPluginContentType_Dicom, key));
+        ASSERT_TRUE(layout.CreateKey(UUID, OrthancPluginContentType_Dicom, key));
+    }
+
+    DateLayout layout(path);
+    ASSERT_TRUE(layout.Load());
+    std::string again;
+    ASSERT_TRUE(layout.GetKey(UUID, OrthancPluginContentType_Dicom, again));
+    EXPECT_EQ(key, again);
+    EXPECT_EQ(key.size(), std::string("2018/11/23/").size() + UUID.size());
+
+    layout.Forget(UUID);
+    EXPECT_FALSE(layout.GetKey(UUID, OrthancPluginContentType_Dicom, again));
+    remove(path.c_str());
+}
+
+TEST(KeyLayout, UnknownName) {
+    EXPECT_TRUE(createKeyLayout("hash_prefix", 2, "") != nullptr);
+    EXPECT_TRUE(createKeyLayout("sharded", 2, "") == nullptr);
+}
+
+TEST(PersistentMap, ReplaysAndSkipsTornRecord) {
+    const std::string path = tempPath();
+    {
+        PersistentMap map(path, false);
+        ASSERT_TRUE(map.Load());
+        EXPECT_TRUE(map.Set("a", "1"));
+        EXPECT_TRUE(map.Set("b", "2"));
+        EXPECT_TRUE(map.Set("a", "3"));
+        EXPECT_TRUE(map.Remove("b"));
+    }
+    {
+        //crash in the middle of a record
+        std::ofstream f(path.c_str(), std::ios::app | std::ios::binary);
+        f << "+c\t4";
+    }
+
+    PersistentMap map(path, false);
+    ASSERT_TRUE(map.Load());
+    std::string value;
+    EXPECT_EQ(map.GetCount(), 1u);
+    ASSERT_TRUE(map.Get("a", value));
+    EXPECT_EQ(value, "3");
+    EXPECT_FALSE(map.Get("b", value));
+    EXPECT_FALSE(map.Get("c", value));
+    remove(path.c_str());
+}
+
+TEST(PersistentMap, ConcurrentSetsSurviveCompaction) {
+    const std::string path = tempPath();
+    const int threads = 8;
+    const int keys = 20;
+    const int rounds = 40;
+    {
+        PersistentMap map(path, true);
+        ASSERT_TRUE(map.Load());
+
+        //overwrites, so compactions run while the writers go on
+        std::vector<std::thread> writers;
+        for (int t = 0; t < threads; ++t) {
+            writers.emplace_back([&map, t]() {
+                for (int r = 0; r < rounds; ++r) {
+                    for (int k = 0; k < keys; ++k) {
+                        EXPECT_TRUE(map.Set(std::to_string(t) + "-" + std::to_string(k), std::to_string(r)));
+                    }
+                }
+                EXPECT_TRUE(map.Remove(std::to_string(t) + "-0"));
+            });
+        }
+        for (auto& w : writers) {
+            w.join();
+        }
+        EXPECT_EQ(map.GetCount(), static_cast<size_t>(threads * (keys - 1)));
+    }
+
+    PersistentMap map(path, true);
+    ASSERT_TRUE(map.Load());
+    EXPECT_EQ(map.GetCount(), static_cast<size_t>(threads * (keys - 1)));
+    std::string value;
+    for (int t = 0; t < threads; ++t) {
+        EXPECT_FALSE(map.Get(std::to_string(t) + "-0", value));
+        for (int k = 1; k < keys; ++k) {
+            ASSERT_TRUE(map.Get(std::to_string(t) + "-" + std::to_string(k), value));
+            EXPECT_EQ(value, std::to_string(rounds - 1));
+        }
+    }
+    //compacted on load
+    std::ifstream f(path.c_str());
+    EXPECT_EQ(std::count(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>(), '\n'), threads * (keys - 1));
+    remove(path.c_str());
+}
+
+} //namespace
@@ -0,0 +1,100 @@
+#include "gtest/gtest.h"
+
+#include "LatencyHistogram.hpp"
+
+#include <chrono>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+TEST(LatencyHistogram, Bins) {
+    //linear up to 64, then 32 bins per power of two
+    EXPECT_EQ(0u, LatencyHistogram::BinIndex(0));
+    EXPECT_EQ(63u, LatencyHistogram::BinIndex(63));
+    EXPECT_EQ(64u, LatencyHistogram::BinIndex(64));
+    EXPECT_EQ(64u, LatencyHistogram::BinIndex(65));
+    EXPECT_EQ(LatencyHistogram::BINS - 1, LatencyHistogram::BinIndex(LatencyHistogram::MAX_VALUE));
+    EXPECT_EQ(LatencyHistogram::BINS - 1, LatencyHistogram::BinIndex(UINT64_MAX));
+
+    for (size_t i = 0; i < LatencyHistogram::BINS; ++i) {
+        const uint64_t low = LatencyHistogram::BinLowest(i);
+        const uint64_t high = LatencyHistogram::BinHighest(i);
+        ASSERT_EQ(i, LatencyHistogram::BinIndex(low));
+        ASSERT_EQ(i, LatencyHistogram::BinIndex(high));
+        if (i + 1 < LatencyHistogram::BINS) {
+            ASSERT_EQ(high + 1, LatencyHistogram::BinLowest(i + 1));
+        }
+        //relative precision
+        ASSERT_LE(static_cast<double>(high - low), low / 31.0 + 1);
+    }
+}
+
+TEST(LatencyHistogram, Percentiles) {
+    LatencyHistogram h;
+    for (uint64_t v = 1; v <= 10000; ++v) {
+        h.Record(v);
+    }
+
+    const auto s = h.GetSnapshot();
+    EXPECT_EQ(10000u, s.GetCount());
+    EXPECT_EQ(10000u, s.GetMax());
+    EXPECT_EQ(50005000u, s.GetSum());
+    EXPECT_NEAR(5000, s.GetPercentile(50), 5000 * 0.035);
+    EXPECT_NEAR(9000, s.GetPercentile(90), 9000 * 0.035);
+    EXPECT_NEAR(9900, s.GetPercentile(99), 9900 * 0.035);
+    EXPECT_NEAR(9990, s.GetPercentile(99.9), 9990 * 0.035);
+    EXPECT_EQ(10000u, s.GetPercentile(100));
+    EXPECT_EQ(63u, s.CountAtOrBelow(63));
+
+    EXPECT_EQ(0u, LatencyHistogram().GetSnapshot().GetPercentile(99));
+}
+
+TEST(LatencyHistogram, ConcurrentRecord) {
+    LatencyHistogram h;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 16; ++t) {
+        threads.emplace_back([&h]() {
+            for (uint64_t i = 0; i < 10000; ++i) {
+                h.Record(i % 2000);
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    const auto s = h.GetSnapshot();
+    EXPECT_EQ(160000u, s.GetCount());
+    EXPECT_EQ(1999u, s.GetMax());
+}
+
+TEST(LatencyHistogram, Windows) {
+    typedef LatencyHistogram::Clock Clock;
+    LatencyHistogram h;
+    const auto start = Clock::now();
+
+    h.Record(100000, start);                                //100ms, two hours ago
+    h.Record(10000, start + std::chrono::minutes(118));     //10ms, 2 minutes ago
+    h.Record(1000, start + std::chrono::seconds(7190));     //1ms, 10 seconds ago
+    const auto now = start + std::chrono::hours(2);
+
+    const auto minute = h.GetSnapshot(HistogramWindow::ONE_MINUTE, now);
+    EXPECT_EQ(1u, minute.GetCount());
+    EXPECT_EQ(1000u, minute.GetSum());
+    EXPECT_NEAR(1000, minute.GetMax(), 1000 * 0.035);
+
+    const auto five = h.GetSnapshot(HistogramWindow::FIVE_MINUTES, now);
+    EXPECT_EQ(2u, five.GetCount());
+    EXPECT_NEAR(10000, five.GetPercentile(99), 10000 * 0.035);
+
+    EXPECT_EQ(2u, h.GetSnapshot(HistogramWindow::ONE_HOUR, now).GetCount());
+
+    const auto all = h.GetSnapshot(HistogramWindow::ALL, now);
+    EXPECT_EQ(3u, all.GetCount());
+    EXPECT_EQ(100000u, all.GetMax());
+}
+
+}
@@ -0,0 +1,48 @@
+#include "gtest/gtest.h"
+
+#include "Metrics.hpp"
+
+#include <string>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+bool contains(const std::string& text, const std::string& line) {
+    return text.find(line + "\n") != std::string::npos;
+}
+
+TEST(Metrics, PrometheusFormat) {
+    Metrics m;
+    m.RecordStorage(StorageOperation::CREATE, OrthancPluginContentType_Dicom, true, 1024, 2000);
+    m.RecordStorage(StorageOperation::READ, OrthancPluginContentType_DicomAsJson, false, 0, 100);
+    m.RecordS3(S3Call::PUT, true, 1024, 1500);
+    m.RecordS3Error(S3Call::GET, "Slow Down");
+    m.AddGauge("orthanc_s3_test_gauge", "A test gauge", []() { return 42.0; });
+
+    {
+        Metrics::InFlight inFlight(m, StorageOperation::REMOVE);
+        EXPECT_TRUE(contains(m.FormatPrometheus(), "orthanc_s3_storage_in_flight{op=\"remove\"} 1"));
+    }
+
+    const std::string text = m.FormatPrometheus();
+    EXPECT_TRUE(contains(text, "orthanc_s3_storage_in_flight{op=\"remove\"} 0"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_storage_operations_total{op=\"create\",type=\"dicom\",result=\"ok\"} 1"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_storage_operations_total{op=\"read\",type=\"dicom_as_json\",result=\"error\"} 1"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_storage_bytes_total{op=\"create\",type=\"dicom\"} 1024"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_requests_total{call=\"put\",result=\"ok\"} 1"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_request_duration_seconds_bucket{call=\"put\",le=\"0.0025\"} 1"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_request_duration_seconds_bucket{call=\"put\",le=\"0.001\"} 0"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_request_duration_seconds_count{call=\"put\"} 1"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_request_duration_seconds_sum{call=\"put\"} 0.0015"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_request_latency_seconds{call=\"put\",window=\"1m\",quantile=\"0.99\"} 0.0015"));
+    EXPECT_EQ(std::string::npos, text.find("orthanc_s3_request_latency_seconds{call=\"get\""));
+    EXPECT_TRUE(contains(text, "orthanc_s3_errors_total{call=\"get\",error=\"Slow_Down\"} 1"));
+    EXPECT_TRUE(contains(text, "# TYPE orthanc_s3_test_gauge gauge"));
+    EXPECT_TRUE(contains(text, "orthanc_s3_test_gauge 42"));
+
+    m.ClearGauges();
+    EXPECT_EQ(std::string::npos, m.FormatPrometheus().find("orthanc_s3_test_gauge"));
+}
+
+}
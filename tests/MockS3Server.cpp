@@ -0,0 +1,905 @@
+#include "MockS3Server.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace OrthancPlugins {
+
+struct MockS3Server::Request {
+    std::string method;
+    std::string bucket;
+    std::string key;
+    std::map<std::string, std::string> query;
+    std::map<std::string, std::string> headers;
+    std::string body;
+    bool close = false;
+
+    bool HasQuery(const char* name) const { return query.find(name) != query.end(); };
+    std::string Query(const char* name) const {
+        auto it = query.find(name);
+        return it == query.end() ? std::string() : it->second;
+    };
+    std::string Header(const char* name) const {
+        auto it = headers.find(name);
+        return it == headers.end() ? std::string() : it->second;
+    };
+};
+
+namespace {
+
+thread_local bool serverThread = false;
+
+const size_t MAX_HEADER = 64 * 1024;
+const size_t SLICE = 64 * 1024;
+const char* XML_HEADER = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+const char* XML_NS = "http://s3.amazonaws.com/doc/2006-03-01/";
+
+std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), ::tolower);
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    size_t b = s.find_first_not_of(" \t");
+    if (b == std::string::npos) return std::string();
+    size_t e = s.find_last_not_of(" \t");
+    return s.substr(b, e - b + 1);
+}
+
+std::string urlDecode(const std::string& s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i + 2 < s.size()) {
+            out += static_cast<char>(strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+std::string xmlEscape(const std::string& s) {
+    std::string out;
+    out.reserve(s.size());
+    for (char c : s) {
+        switch (c) {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        case '"': out += "&quot;"; break;
+        case '\'': out += "&apos;"; break;
+        default: out += c;
+        }
+    }
+    return out;
+}
+
+std::string xmlUnescape(const std::string& s) {
+    static const char* entities[][2] = {
+        {"&lt;", "<"}, {"&gt;", ">"}, {"&quot;", "\""}, {"&apos;", "'"}, {"&amp;", "&"}
+    };
+    std::string out = s;
+    for (auto& e : entities) {
+        size_t pos = 0;
+        const size_t len = strlen(e[0]);
+        while ((pos = out.find(e[0], pos)) != std::string::npos) {
+            out.replace(pos, len, e[1]);
+            pos++;
+        }
+    }
+    return out;
+}
+
+//values of every <tag>...</tag> in a flat xml body
+std::vector<std::string> xmlValues(const std::string& body, const std::string& tag) {
+    std::vector<std::string> values;
+    const std::string open = "<" + tag + ">";
+    const std::string close = "</" + tag + ">";
+    size_t pos = 0;
+    while ((pos = body.find(open, pos)) != std::string::npos) {
+        pos += open.size();
+        size_t end = body.find(close, pos);
+        if (end == std::string::npos) break;
+        values.push_back(xmlUnescape(body.substr(pos, end - pos)));
+        pos = end + close.size();
+    }
+    return values;
+}
+
+std::string formatTime(time_t t, const char* format) {
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char buffer[64];
+    strftime(buffer, sizeof(buffer), format, &tm);
+    return buffer;
+}
+
+std::string httpDate(time_t t) {
+    return formatTime(t, "%a, %d %b %Y %H:%M:%S GMT");
+}
+
+std::string isoDate(time_t t) {
+    return formatTime(t, "%Y-%m-%dT%H:%M:%S.000Z");
+}
+
+//FNV-1a, real S3 would use MD5, clients only compare etags
+std::string etagOf(const std::string& data) {
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char c : data) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    char buffer[40];
+    snprintf(buffer, sizeof(buffer), "\"%016llx%016llx\"",
+             static_cast<unsigned long long>(h), static_cast<unsigned long long>(data.size()));
+    return buffer;
+}
+
+const char* reason(int status) {
+    switch (status) {
+    case 100: return "Continue";
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 400: return "Bad Request";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 416: return "Requested Range Not Satisfiable";
+    case 501: return "Not Implemented";
+    case 503: return "Slow Down";
+    default: return "Unknown";
+    }
+}
+
+bool sendAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool recvMore(int fd, std::string& buffer) {
+    char tmp[SLICE];
+    for (;;) {
+        ssize_t n = recv(fd, tmp, sizeof(tmp), 0);
+        if (n > 0) {
+            buffer.append(tmp, n);
+            return true;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        return false;
+    }
+}
+
+//sleeps until bytes would have been transferred at bandwidth bytes/s since start
+void throttle(std::chrono::steady_clock::time_point start, uint64_t bytes, uint64_t bandwidth) {
+    if (bandwidth == 0) return;
+    std::this_thread::sleep_until(start + std::chrono::microseconds(bytes * 1000000 / bandwidth));
+}
+
+//decodes "size[;extensions]\r\ndata\r\n ... 0\r\n[trailers]\r\n" starting at pos,
+//reading more from fd when needed (fd < 0: everything is already in input)
+bool dechunk(int fd, std::string& input, size_t& pos, std::string& output) {
+    for (;;) {
+        size_t eol;
+        while ((eol = input.find("\r\n", pos)) == std::string::npos) {
+            if (fd < 0 || !recvMore(fd, input)) return false;
+        }
+        const size_t size = strtoull(input.substr(pos, eol - pos).c_str(), nullptr, 16);
+        pos = eol + 2;
+        if (size == 0) {
+            //trailers, up to an empty line
+            for (;;) {
+                while ((eol = input.find("\r\n", pos)) == std::string::npos) {
+                    if (fd < 0) {
+                        pos = input.size();
+                        return true;
+                    }
+                    if (!recvMore(fd, input)) return false;
+                }
+                const bool last = (eol == pos);
+                pos = eol + 2;
+                if (last) return true;
+            }
+        }
+        while (input.size() < pos + size + 2) {
+            if (fd < 0 || !recvMore(fd, input)) return false;
+        }
+        output.append(input, pos, size);
+        pos += size + 2;
+    }
+}
+
+}
+
+MockS3Server::MockS3Server() :
+    _listenFd(-1),
+    _port(0),
+    _stopping(false),
+    _nextUpload(1),
+    _inFlight(0),
+    _rng(42)
+{
+}
+
+MockS3Server::~MockS3Server() {
+    Stop();
+}
+
+bool MockS3Server::Start(uint16_t port) {
+    if (_listenFd >= 0) return false;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return false;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+
+    socklen_t length = sizeof(address);
+    if (bind(fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address)) != 0
+            || listen(fd, 128) != 0
+            || getsockname(fd, reinterpret_cast<struct sockaddr*>(&address), &length) != 0) {
+        close(fd);
+        return false;
+    }
+
+    _listenFd = fd;
+    _port = ntohs(address.sin_port);
+    _stopping = false;
+    _acceptor = std::thread(&MockS3Server::AcceptLoop, this);
+    return true;
+}
+
+void MockS3Server::Stop() {
+    if (_listenFd < 0) return;
+
+    _stopping = true;
+    shutdown(_listenFd, SHUT_RDWR);
+    if (_acceptor.joinable()) {
+        _acceptor.join();
+    }
+    close(_listenFd);
+    _listenFd = -1;
+
+    std::vector<std::thread> connections;
+    {
+        std::lock_guard<std::mutex> lock(_connectionsMutex);
+        for (int fd : _connectionFds) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        connections.swap(_connections);
+    }
+    for (auto& t : connections) {
+        t.join();
+    }
+}
+
+bool MockS3Server::IsServerThread() {
+    return serverThread;
+}
+
+void MockS3Server::AcceptLoop() {
+    serverThread = true;
+    while (!_stopping) {
+        int fd = accept(_listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            if (errno == EINTR && !_stopping) continue;
+            break;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::lock_guard<std::mutex> lock(_connectionsMutex);
+        if (_stopping) {
+            close(fd);
+            break;
+        }
+        _connectionFds.insert(fd);
+        _connections.emplace_back(&MockS3Server::Serve, this, fd);
+    }
+}
+
+void MockS3Server::Pause(unsigned int ms) {
+    const auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+    while (!_stopping && std::chrono::steady_clock::now() < until) {
+        std::this_thread::sleep_for(std::min(std::chrono::nanoseconds(until - std::chrono::steady_clock::now()),
+                                             std::chrono::nanoseconds(std::chrono::milliseconds(10))));
+    }
+}
+
+void MockS3Server::Serve(int fd) {
+    serverThread = true;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.connections++;
+    }
+
+    std::string buffer;
+    while (!_stopping) {
+        Faults faults;
+        Request request;
+        if (!ReadRequest(fd, buffer, request, faults)) break;
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stats.requests++;
+            _stats.bytes_in += request.body.size();
+            _inFlight++;
+            _stats.peak_in_flight = std::max(_stats.peak_in_flight, _inFlight);
+        }
+        const bool keep = Handle(fd, request, faults);
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _inFlight--;
+        }
+        if (!keep || request.close) break;
+    }
+
+    std::lock_guard<std::mutex> lock(_connectionsMutex);
+    _connectionFds.erase(fd);
+    close(fd);
+}
+
+bool MockS3Server::ReadRequest(int fd, std::string& buffer, Request& request, Faults& faults) {
+    size_t end;
+    while ((end = buffer.find("\r\n\r\n")) == std::string::npos) {
+        if (buffer.size() > MAX_HEADER || !recvMore(fd, buffer)) return false;
+    }
+
+    //request line
+    size_t eol = buffer.find("\r\n");
+    const std::string line = buffer.substr(0, eol);
+    size_t sp1 = line.find(' ');
+    size_t sp2 = line.find(' ', sp1 + 1);
+    if (sp1 == std::string::npos || sp2 == std::string::npos) return false;
+    request.method = line.substr(0, sp1);
+    const std::string target = line.substr(sp1 + 1, sp2 - sp1 - 1);
+
+    //headers
+    size_t pos = eol + 2;
+    while (pos < end) {
+        eol = buffer.find("\r\n", pos);
+        const std::string header = buffer.substr(pos, eol - pos);
+        size_t colon = header.find(':');
+        if (colon != std::string::npos) {
+            request.headers[lower(trim(header.substr(0, colon)))] = trim(header.substr(colon + 1));
+        }
+        pos = eol + 2;
+    }
+    pos = end + 4;
+
+    //faults in place when the request arrives apply to all of it
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        faults = _faults;
+    }
+
+    if (lower(request.Header("expect")) == "100-continue") {
+        static const char* CONTINUE = "HTTP/1.1 100 Continue\r\n\r\n";
+        if (!sendAll(fd, CONTINUE, strlen(CONTINUE))) return false;
+    }
+
+    //body
+    const auto start = std::chrono::steady_clock::now();
+    if (lower(request.Header("transfer-encoding")).find("chunked") != std::string::npos) {
+        if (!dechunk(fd, buffer, pos, request.body)) return false;
+    } else {
+        const size_t length = strtoull(request.Header("content-length").c_str(), nullptr, 10);
+        while (buffer.size() < pos + length) {
+            if (!recvMore(fd, buffer)) return false;
+        }
+        request.body.assign(buffer, pos, length);
+        pos += length;
+    }
+    buffer.erase(0, pos);
+    throttle(start, request.body.size(), faults.bandwidth);
+
+    //signed streaming uploads wrap the payload once more
+    if (request.Header("content-encoding").find("aws-chunked") != std::string::npos
+            || request.Header("x-amz-content-sha256").compare(0, 10, "STREAMING-") == 0) {
+        std::string decoded;
+        size_t p = 0;
+        if (!dechunk(-1, request.body, p, decoded)) return false;
+        request.body.swap(decoded);
+    }
+
+    //target
+    const size_t q = target.find('?');
+    const std::string path = urlDecode(target.substr(0, q));
+    if (q != std::string::npos) {
+        std::string query = target.substr(q + 1);
+        size_t p = 0;
+        while (p <= query.size()) {
+            size_t amp = query.find('&', p);
+            if (amp == std::string::npos) amp = query.size();
+            const std::string item = query.substr(p, amp - p);
+            if (!item.empty()) {
+                size_t eq = item.find('=');
+                if (eq == std::string::npos) {
+                    request.query[urlDecode(item)] = "";
+                } else {
+                    request.query[urlDecode(item.substr(0, eq))] = urlDecode(item.substr(eq + 1));
+                }
+            }
+            p = amp + 1;
+        }
+    }
+    const size_t first = path.find_first_not_of('/');
+    if (first != std::string::npos) {
+        const size_t slash = path.find('/', first);
+        request.bucket = path.substr(first, slash == std::string::npos ? std::string::npos : slash - first);
+        if (slash != std::string::npos) {
+            request.key = path.substr(slash + 1);
+        }
+    }
+
+    request.close = lower(request.Header("connection")) == "close";
+    return true;
+}
+
+bool MockS3Server::Send(int fd, int status, const char* body, size_t size, const std::vector<std::string>& headers,
+                        const Faults& faults, bool sendBody) {
+    std::string head = "HTTP/1.1 " + std::to_string(status) + " " + reason(status) + "\r\n";
+    head += "Date: " + httpDate(time(nullptr)) + "\r\n";
+    head += "Server: MockS3\r\n";
+    head += "x-amz-request-id: mock\r\n";
+    head += "Content-Length: " + std::to_string(size) + "\r\n";
+    for (const auto& h : headers) {
+        head += h + "\r\n";
+    }
+    head += "\r\n";
+
+    if (!sendAll(fd, head.data(), head.size())) return false;
+    if (!sendBody) return true;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t sent = 0; sent < size; ) {
+        const size_t n = std::min(SLICE, size - sent);
+        throttle(start, sent + n, faults.bandwidth);
+        if (!sendAll(fd, body + sent, n)) return false;
+        sent += n;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats.bytes_out += size;
+    return true;
+}
+
+bool MockS3Server::Send(int fd, int status, const std::string& body, const std::vector<std::string>& headers,
+                        const Faults& faults) {
+    return Send(fd, status, body.data(), body.size(), headers, faults);
+}
+
+bool MockS3Server::SendError(int fd, int status, const std::string& code, const std::string& message,
+                             const Faults& faults, std::vector<std::string> headers) {
+    const std::string body = std::string(XML_HEADER) + "<Error><Code>" + code + "</Code><Message>"
+            + xmlEscape(message) + "</Message><RequestId>mock</RequestId></Error>";
+    headers.push_back("Content-Type: application/xml");
+    return Send(fd, status, body, headers, faults);
+}
+
+bool MockS3Server::Handle(int fd, Request& request, const Faults& faults) {
+    unsigned int jitter = 0;
+    double stall = 1, slowDown = 1;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (faults.jitter_ms > 0) {
+            jitter = std::uniform_int_distribution<unsigned int>(0, faults.jitter_ms)(_rng);
+        }
+        std::uniform_real_distribution<double> uniform(0, 1);
+        stall = uniform(_rng);
+        slowDown = uniform(_rng);
+    }
+
+    if (faults.latency_ms + jitter > 0) {
+        Pause(faults.latency_ms + jitter);
+    }
+
+    if (stall < faults.stall_rate) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stats.stalls++;
+        }
+        Pause(faults.stall_ms);
+        return false;
+    }
+
+    if (slowDown < faults.slow_down_rate) {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stats.slow_downs++;
+        }
+        if (request.method == "HEAD") {
+            return Send(fd, 503, nullptr, 0, {}, faults, false);
+        }
+        return SendError(fd, 503, "SlowDown", "Please reduce your request rate.", faults);
+    }
+
+    if (request.bucket.empty()) {
+        return SendError(fd, 501, "NotImplemented", "ListBuckets is not supported", faults);
+    }
+    if (request.key.empty()) {
+        return HandleBucket(fd, request, faults);
+    }
+    if (request.HasQuery("uploads") || request.HasQuery("uploadId")) {
+        return HandleMultipart(fd, request, faults);
+    }
+    return HandleObject(fd, request, faults);
+}
+
+bool MockS3Server::HandleBucket(int fd, Request& request, const Faults& faults) {
+    if (request.method == "POST" && request.HasQuery("delete")) {
+        return HandleDeleteObjects(fd, request, faults);
+    }
+    if (request.method == "GET" && request.HasQuery("list-type")) {
+        return HandleList(fd, request, faults);
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    const bool exists = _buckets.find(request.bucket) != _buckets.end();
+
+    if (request.method == "PUT") {
+        if (exists) {
+            lock.unlock();
+            return SendError(fd, 409, "BucketAlreadyOwnedByYou", "Your previous request to create the named bucket succeeded", faults);
+        }
+        _buckets[request.bucket];
+        lock.unlock();
+        return Send(fd, 200, "", {"Location: /" + request.bucket}, faults);
+    }
+    if (request.method == "HEAD") {
+        lock.unlock();
+        return Send(fd, exists ? 200 : 404, nullptr, 0, {}, faults, false);
+    }
+    if (request.method == "DELETE") {
+        _buckets.erase(request.bucket);
+        lock.unlock();
+        return exists ? Send(fd, 204, "", {}, faults)
+                      : SendError(fd, 404, "NoSuchBucket", "The specified bucket does not exist", faults);
+    }
+    lock.unlock();
+    return SendError(fd, 405, "MethodNotAllowed", "The specified method is not allowed against this resource", faults);
+}
+
+bool MockS3Server::HandleObject(int fd, Request& request, const Faults& faults) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto bucket = _buckets.find(request.bucket);
+    if (bucket == _buckets.end()) {
+        lock.unlock();
+        if (request.method == "HEAD") {
+            return Send(fd, 404, nullptr, 0, {}, faults, false);
+        }
+        return SendError(fd, 404, "NoSuchBucket", "The specified bucket does not exist", faults);
+    }
+
+    if (request.method == "PUT") {
+        Object& object = bucket->second[request.key];
+        object.etag = etagOf(request.body);
+        object.modified = time(nullptr);
+        object.data = std::make_shared<const std::string>(std::move(request.body));
+        _stats.puts++;
+        const std::string etag = object.etag;
+        lock.unlock();
+        return Send(fd, 200, "", {"ETag: " + etag}, faults);
+    }
+
+    if (request.method == "DELETE") {
+        bucket->second.erase(request.key);
+        _stats.deletes++;
+        lock.unlock();
+        return Send(fd, 204, "", {}, faults);
+    }
+
+    if (request.method != "GET" && request.method != "HEAD") {
+        lock.unlock();
+        return SendError(fd, 405, "MethodNotAllowed", "The specified method is not allowed against this resource", faults);
+    }
+
+    const bool head = request.method == "HEAD";
+    if (head) {
+        _stats.heads++;
+    } else {
+        _stats.gets++;
+    }
+
+    auto it = bucket->second.find(request.key);
+    if (it == bucket->second.end()) {
+        lock.unlock();
+        if (head) {
+            return Send(fd, 404, nullptr, 0, {}, faults, false);
+        }
+        return SendError(fd, 404, "NoSuchKey", "The specified key does not exist.", faults);
+    }
+    //the data is immutable, send it without holding the lock
+    const Object object = it->second;
+    lock.unlock();
+
+    const uint64_t size = object.data->size();
+    std::vector<std::string> headers = {
+        "ETag: " + object.etag,
+        "Last-Modified: " + httpDate(object.modified),
+        "Accept-Ranges: bytes",
+        "Content-Type: binary/octet-stream"
+    };
+
+    const std::string range = request.Header("range");
+    if (head || range.compare(0, 6, "bytes=") != 0) {
+        return Send(fd, 200, object.data->data(), size, headers, faults, !head);
+    }
+
+    //bytes=first-last, bytes=first-, bytes=-suffix
+    const std::string spec = range.substr(6);
+    const size_t dash = spec.find('-');
+    if (dash == std::string::npos) {
+        return SendError(fd, 416, "InvalidRange", "The requested range is not satisfiable", faults);
+    }
+    uint64_t first, last;
+    if (dash == 0) {
+        const uint64_t suffix = strtoull(spec.c_str() + 1, nullptr, 10);
+        first = suffix >= size ? 0 : size - suffix;
+        last = size - 1;
+        if (suffix == 0) first = size;
+    } else {
+        first = strtoull(spec.substr(0, dash).c_str(), nullptr, 10);
+        last = dash + 1 < spec.size() ? strtoull(spec.c_str() + dash + 1, nullptr, 10) : size - 1;
+        last = std::min(last, size - 1);
+    }
+    if (first >= size || last < first) {
+        return SendError(fd, 416, "InvalidRange", "The requested range is not satisfiable", faults,
+                         {"Content-Range: bytes */" + std::to_string(size)});
+    }
+
+    headers.push_back("Content-Range: bytes " + std::to_string(first) + "-" + std::to_string(last)
+                      + "/" + std::to_string(size));
+    return Send(fd, 206, object.data->data() + first, last - first + 1, headers, faults);
+}
+
+bool MockS3Server::HandleDeleteObjects(int fd, Request& request, const Faults& faults) {
+    const std::vector<std::string> keys = xmlValues(request.body, "Key");
+    const bool quiet = request.body.find("<Quiet>true</Quiet>") != std::string::npos;
+
+    std::string body = std::string(XML_HEADER) + "<DeleteResult xmlns=\"" + XML_NS + "\">";
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto bucket = _buckets.find(request.bucket);
+        for (const auto& key : keys) {
+            //errors are listed in quiet mode too
+            if (faults.denied_deletes.count(key) > 0) {
+                body += "<Error><Key>" + xmlEscape(key) + "</Key><Code>AccessDenied</Code>"
+                        "<Message>Access Denied</Message></Error>";
+                continue;
+            }
+            if (bucket != _buckets.end()) {
+                bucket->second.erase(key);
+            }
+            if (!quiet) {
+                body += "<Deleted><Key>" + xmlEscape(key) + "</Key></Deleted>";
+            }
+            _stats.deletes++;
+        }
+    }
+    body += "</DeleteResult>";
+    return Send(fd, 200, body, {"Content-Type: application/xml"}, faults);
+}
+
+bool MockS3Server::HandleList(int fd, Request& request, const Faults& faults) {
+    const std::string prefix = request.Query("prefix");
+    const std::string token = request.Query("continuation-token");
+    const std::string startAfter = request.Query("start-after");
+    size_t maxKeys = 1000;
+    if (request.HasQuery("max-keys")) {
+        maxKeys = std::min<size_t>(1000, strtoul(request.Query("max-keys").c_str(), nullptr, 10));
+    }
+
+    std::string contents;
+    size_t count = 0;
+    bool truncated = false;
+    std::string last;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stats.lists++;
+        auto bucket = _buckets.find(request.bucket);
+        if (bucket == _buckets.end()) {
+            return SendError(fd, 404, "NoSuchBucket", "The specified bucket does not exist", faults);
+        }
+
+        //the continuation token is the last key of the previous page
+        const std::string after = std::max(token, startAfter);
+        auto it = after.empty() ? bucket->second.begin() : bucket->second.upper_bound(after);
+        if (!prefix.empty() && (it == bucket->second.end() || it->first < prefix)) {
+            it = bucket->second.lower_bound(prefix);
+        }
+        for (; it != bucket->second.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            if (count == maxKeys) {
+                truncated = true;
+                break;
+            }
+            contents += "<Contents><Key>" + xmlEscape(it->first) + "</Key>"
+                    + "<LastModified>" + isoDate(it->second.modified) + "</LastModified>"
+                    + "<ETag>" + xmlEscape(it->second.etag) + "</ETag>"
+                    + "<Size>" + std::to_string(it->second.data->size()) + "</Size>"
+                    + "<StorageClass>STANDARD</StorageClass></Contents>";
+            last = it->first;
+            count++;
+        }
+    }
+
+    std::string body = std::string(XML_HEADER) + "<ListBucketResult xmlns=\"" + XML_NS + "\">"
+            + "<Name>" + xmlEscape(request.bucket) + "</Name>"
+            + "<Prefix>" + xmlEscape(prefix) + "</Prefix>"
+            + "<KeyCount>" + std::to_string(count) + "</KeyCount>"
+            + "<MaxKeys>" + std::to_string(maxKeys) + "</MaxKeys>"
+            + "<IsTruncated>" + (truncated ? "true" : "false") + "</IsTruncated>";
+    if (!token.empty()) {
+        body += "<ContinuationToken>" + xmlEscape(token) + "</ContinuationToken>";
+    }
+    if (truncated) {
+        body += "<NextContinuationToken>" + xmlEscape(last) + "</NextContinuationToken>";
+    }
+    body += contents + "</ListBucketResult>";
+    return Send(fd, 200, body, {"Content-Type: application/xml"}, faults);
+}
+
+bool MockS3Server::HandleMultipart(int fd, Request& request, const Faults& faults) {
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    if (request.method == "POST" && request.HasQuery("uploads")) {
+        if (_buckets.find(request.bucket) == _buckets.end()) {
+            lock.unlock();
+            return SendError(fd, 404, "NoSuchBucket", "The specified bucket does not exist", faults);
+        }
+        const std::string id = "mock-upload-" + std::to_string(_nextUpload++);
+        _uploads[id] = Upload{request.bucket, request.key, {}};
+        lock.unlock();
+        const std::string body = std::string(XML_HEADER) + "<InitiateMultipartUploadResult xmlns=\"" + XML_NS + "\">"
+                + "<Bucket>" + xmlEscape(request.bucket) + "</Bucket>"
+                + "<Key>" + xmlEscape(request.key) + "</Key>"
+                + "<UploadId>" + id + "</UploadId></InitiateMultipartUploadResult>";
+        return Send(fd, 200, body, {"Content-Type: application/xml"}, faults);
+    }
+
+    auto upload = _uploads.find(request.Query("uploadId"));
+    if (upload == _uploads.end() || upload->second.bucket != request.bucket || upload->second.key != request.key) {
+        lock.unlock();
+        return SendError(fd, 404, "NoSuchUpload", "The specified upload does not exist.", faults);
+    }
+
+    if (request.method == "PUT" && request.HasQuery("partNumber")) {
+        const int part = atoi(request.Query("partNumber").c_str());
+        const std::string etag = etagOf(request.body);
+        upload->second.parts[part] = std::move(request.body);
+        _stats.puts++;
+        lock.unlock();
+        return Send(fd, 200, "", {"ETag: " + etag}, faults);
+    }
+
+    if (request.method == "POST") {
+        std::vector<int> numbers;
+        for (const auto& n : xmlValues(request.body, "PartNumber")) {
+            numbers.push_back(atoi(n.c_str()));
+        }
+        if (numbers.empty()) {
+            for (const auto& p : upload->second.parts) {
+                numbers.push_back(p.first);
+            }
+        }
+
+        size_t size = 0;
+        for (int n : numbers) {
+            auto p = upload->second.parts.find(n);
+            if (p == upload->second.parts.end()) {
+                lock.unlock();
+                return SendError(fd, 400, "InvalidPart", "One or more of the specified parts could not be found.", faults);
+            }
+            size += p->second.size();
+        }
+        auto data = std::make_shared<std::string>();
+        data->reserve(size);
+        for (int n : numbers) {
+            data->append(upload->second.parts[n]);
+        }
+
+        auto bucket = _buckets.find(request.bucket);
+        if (bucket == _buckets.end()) {
+            lock.unlock();
+            return SendError(fd, 404, "NoSuchBucket", "The specified bucket does not exist", faults);
+        }
+        Object& object = bucket->second[request.key];
+        object.etag = etagOf(*data);
+        object.modified = time(nullptr);
+        object.data = data;
+        const std::string etag = object.etag;
+        _uploads.erase(upload);
+        _stats.multipart_uploads++;
+        lock.unlock();
+
+        const std::string body = std::string(XML_HEADER) + "<CompleteMultipartUploadResult xmlns=\"" + XML_NS + "\">"
+                + "<Location>/" + xmlEscape(request.bucket) + "/" + xmlEscape(request.key) + "</Location>"
+                + "<Bucket>" + xmlEscape(request.bucket) + "</Bucket>"
+                + "<Key>" + xmlEscape(request.key) + "</Key>"
+                + "<ETag>" + xmlEscape(etag) + "</ETag></CompleteMultipartUploadResult>";
+        return Send(fd, 200, body, {"Content-Type: application/xml"}, faults);
+    }
+
+    if (request.method == "DELETE") {
+        _uploads.erase(upload);
+        lock.unlock();
+        return Send(fd, 204, "", {}, faults);
+    }
+
+    lock.unlock();
+    return SendError(fd, 501, "NotImplemented", "ListParts is not supported", faults);
+}
+
+void MockS3Server::SetFaults(const Faults& faults) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _faults = faults;
+}
+
+MockS3Server::Stats MockS3Server::GetStats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+void MockS3Server::ResetStats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stats = Stats();
+    _stats.peak_in_flight = _inFlight;
+}
+
+void MockS3Server::CreateBucket(const std::string& bucket) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _buckets[bucket];
+}
+
+bool MockS3Server::GetObject(const std::string& bucket, const std::string& key, std::string& content) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto b = _buckets.find(bucket);
+    if (b == _buckets.end()) return false;
+    auto it = b->second.find(key);
+    if (it == b->second.end()) return false;
+    content = *it->second.data;
+    return true;
+}
+
+void MockS3Server::PutObject(const std::string& bucket, const std::string& key, const std::string& content) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    Object& object = _buckets[bucket][key];
+    object.etag = etagOf(content);
+    object.modified = time(nullptr);
+    object.data = std::make_shared<const std::string>(content);
+}
+
+size_t MockS3Server::GetObjectCount(const std::string& bucket) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto b = _buckets.find(bucket);
+    return b == _buckets.end() ? 0 : b->second.size();
+}
+
+}
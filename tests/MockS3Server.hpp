@@ -0,0 +1,131 @@
+#ifndef MOCKS3SERVER_HPP
+#define MOCKS3SERVER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace OrthancPlugins {
+
+/*
+ * In-process S3 stand-in on a loopback port, for the tests and s3bench.
+ * Speaks path-style HTTP/1.1 with keep-alive, one thread per connection:
+ * bucket create/head, PutObject, GetObject (with Range), HeadObject,
+ * DeleteObject, DeleteObjects, multipart uploads and ListObjectsV2.
+ * Signatures are not checked. Faults can be changed while it runs.
+ */
+class MockS3Server
+{
+public:
+    struct Faults {
+        unsigned int latency_ms = 0;        //before every answer
+        unsigned int jitter_ms = 0;         //uniform, on top of latency_ms
+        uint64_t bandwidth = 0;             //bytes/s per connection, both ways, 0: unlimited
+        double slow_down_rate = 0;          //share of requests answered 503 SlowDown
+        double stall_rate = 0;              //share of requests never answered
+        unsigned int stall_ms = 60000;      //a stalled connection is closed after that
+        std::set<std::string> denied_deletes; //keys DeleteObjects answers AccessDenied for
+    };
+
+    struct Stats {
+        uint64_t requests = 0;
+        uint64_t puts = 0;                  //PutObject and UploadPart
+        uint64_t gets = 0;
+        uint64_t heads = 0;
+        uint64_t deletes = 0;               //objects, single or batched
+        uint64_t lists = 0;
+        uint64_t multipart_uploads = 0;     //completed
+        uint64_t slow_downs = 0;
+        uint64_t stalls = 0;
+        uint64_t bytes_in = 0;              //bodies
+        uint64_t bytes_out = 0;
+        uint64_t connections = 0;
+        uint64_t peak_in_flight = 0;        //requests being served at once
+    };
+
+private:
+    struct Request;
+    struct Upload {
+        std::string bucket;
+        std::string key;
+        std::map<int, std::string> parts;
+    };
+    struct Object {
+        std::shared_ptr<const std::string> data;
+        std::string etag;
+        time_t modified;
+    };
+    typedef std::map<std::string, Object> Bucket;
+
+    int _listenFd;
+    uint16_t _port;
+    std::thread _acceptor;
+    std::atomic<bool> _stopping;
+
+    std::mutex _connectionsMutex;
+    std::set<int> _connectionFds;
+    std::vector<std::thread> _connections;
+
+    std::mutex _mutex;
+    std::map<std::string, Bucket> _buckets;
+    std::map<std::string, Upload> _uploads;
+    uint64_t _nextUpload;
+    Faults _faults;
+    Stats _stats;
+    uint64_t _inFlight;
+    std::mt19937_64 _rng;
+
+    void AcceptLoop();
+    void Pause(unsigned int ms);
+    void Serve(int fd);
+    bool ReadRequest(int fd, std::string& buffer, Request& request, Faults& faults);
+    bool Handle(int fd, Request& request, const Faults& faults);
+    bool Send(int fd, int status, const char* body, size_t size, const std::vector<std::string>& headers,
+              const Faults& faults, bool sendBody = true);
+    bool Send(int fd, int status, const std::string& body, const std::vector<std::string>& headers,
+              const Faults& faults);
+    bool SendError(int fd, int status, const std::string& code, const std::string& message, const Faults& faults,
+                   std::vector<std::string> headers = std::vector<std::string>());
+
+    bool HandleBucket(int fd, Request& request, const Faults& faults);
+    bool HandleObject(int fd, Request& request, const Faults& faults);
+    bool HandleDeleteObjects(int fd, Request& request, const Faults& faults);
+    bool HandleList(int fd, Request& request, const Faults& faults);
+    bool HandleMultipart(int fd, Request& request, const Faults& faults);
+
+public:
+    MockS3Server();
+    ~MockS3Server();
+
+    //listens on 127.0.0.1, port 0 picks a free one
+    bool Start(uint16_t port = 0);
+    void Stop();
+
+    uint16_t GetPort() const { return _port; };
+    //for s3_endpoint
+    std::string GetEndpoint() const { return "http://127.0.0.1:" + std::to_string(_port); };
+
+    //true on the threads of any mock, to leave them out of allocation counts
+    static bool IsServerThread();
+
+    void SetFaults(const Faults& faults);
+    Stats GetStats();
+    void ResetStats();
+
+    //direct access to the stored objects
+    void CreateBucket(const std::string& bucket);
+    bool GetObject(const std::string& bucket, const std::string& key, std::string& content);
+    void PutObject(const std::string& bucket, const std::string& key, const std::string& content);
+    size_t GetObjectCount(const std::string& bucket);
+};
+
+}
+#endif // MOCKS3SERVER_HPP
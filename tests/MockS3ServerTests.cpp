@@ -0,0 +1,315 @@
+#include "gtest/gtest.h"
+
+#include "MockS3Server.hpp"
+
+#include <chrono>
+#include <cstring>
+#include <map>
+#include <string>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+struct Response {
+    int status = 0;
+    std::map<std::string, std::string> headers;
+    std::string body;
+};
+
+//minimal keep-alive http client, enough to talk to the mock without the AWS SDK
+class Client {
+    int _fd;
+    std::string _buffer;
+
+    bool Fill(size_t size) {
+        char tmp[65536];
+        while (_buffer.size() < size) {
+            ssize_t n = recv(_fd, tmp, sizeof(tmp), 0);
+            if (n <= 0) return false;
+            _buffer.append(tmp, n);
+        }
+        return true;
+    }
+
+public:
+    explicit Client(uint16_t port, int timeoutMs = 5000) {
+        _fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct timeval tv = {timeoutMs / 1000, (timeoutMs % 1000) * 1000};
+        setsockopt(_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        connect(_fd, reinterpret_cast<struct sockaddr*>(&address), sizeof(address));
+    }
+
+    ~Client() {
+        close(_fd);
+    }
+
+    //status 0 when the connection broke
+    Response Send(const std::string& method, const std::string& target, const std::string& body = "",
+                  const std::string& headers = "") {
+        std::string request = method + " " + target + " HTTP/1.1\r\nHost: localhost\r\n" + headers;
+        if (headers.find("Transfer-Encoding") == std::string::npos) {
+            request += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+        }
+        request += "\r\n" + body;
+        Response response;
+        if (send(_fd, request.data(), request.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.size())) {
+            return response;
+        }
+
+        std::string head;
+        do {
+            size_t end;
+            while ((end = _buffer.find("\r\n\r\n")) == std::string::npos) {
+                if (!Fill(_buffer.size() + 1)) return response;
+            }
+            head = _buffer.substr(0, end);
+            _buffer.erase(0, end + 4);
+            response.status = atoi(head.c_str() + 9);
+        } while (response.status == 100);
+
+        size_t pos = head.find("\r\n");
+        while (pos != std::string::npos) {
+            pos += 2;
+            size_t eol = head.find("\r\n", pos);
+            const std::string line = head.substr(pos, eol == std::string::npos ? std::string::npos : eol - pos);
+            size_t colon = line.find(':');
+            if (colon != std::string::npos) {
+                response.headers[line.substr(0, colon)] = line.substr(colon + 2);
+            }
+            pos = eol;
+        }
+
+        const size_t length = method == "HEAD" ? 0 : atoi(response.headers["Content-Length"].c_str());
+        if (!Fill(length)) {
+            response.status = 0;
+            return response;
+        }
+        response.body = _buffer.substr(0, length);
+        _buffer.erase(0, length);
+        return response;
+    }
+};
+
+class MockS3ServerTest : public ::testing::Test {
+protected:
+    MockS3Server server;
+
+    void SetUp() override {
+        ASSERT_TRUE(server.Start());
+        server.CreateBucket("bucket");
+    }
+};
+
+TEST_F(MockS3ServerTest, PutGetHeadDelete) {
+    Client client(server.GetPort());
+
+    Response put = client.Send("PUT", "/bucket/aa/bb/uuid", "0123456789");
+    EXPECT_EQ(put.status, 200);
+    EXPECT_FALSE(put.headers["ETag"].empty());
+
+    Response get = client.Send("GET", "/bucket/aa/bb/uuid");
+    EXPECT_EQ(get.status, 200);
+    EXPECT_EQ(get.body, "0123456789");
+    EXPECT_EQ(get.headers["ETag"], put.headers["ETag"]);
+
+    Response head = client.Send("HEAD", "/bucket/aa/bb/uuid");
+    EXPECT_EQ(head.status, 200);
+    EXPECT_EQ(head.headers["Content-Length"], "10");
+
+    EXPECT_EQ(client.Send("DELETE", "/bucket/aa/bb/uuid").status, 204);
+    Response missing = client.Send("GET", "/bucket/aa/bb/uuid");
+    EXPECT_EQ(missing.status, 404);
+    EXPECT_NE(missing.body.find("<Code>NoSuchKey</Code>"), std::string::npos);
+    EXPECT_EQ(client.Send("HEAD", "/bucket/aa/bb/uuid").status, 404);
+    EXPECT_EQ(client.Send("GET", "/other/key").status, 404);
+
+    MockS3Server::Stats stats = server.GetStats();
+    EXPECT_EQ(stats.requests, 7u);
+    EXPECT_EQ(stats.puts, 1u);
+    EXPECT_EQ(stats.connections, 1u);
+    EXPECT_EQ(stats.bytes_in, 10u);
+}
+
+TEST_F(MockS3ServerTest, Ranges) {
+    server.PutObject("bucket", "key", "0123456789");
+    Client client(server.GetPort());
+
+    Response r = client.Send("GET", "/bucket/key", "", "Range: bytes=2-5\r\n");
+    EXPECT_EQ(r.status, 206);
+    EXPECT_EQ(r.body, "2345");
+    EXPECT_EQ(r.headers["Content-Range"], "bytes 2-5/10");
+
+    EXPECT_EQ(client.Send("GET", "/bucket/key", "", "Range: bytes=7-\r\n").body, "789");
+    EXPECT_EQ(client.Send("GET", "/bucket/key", "", "Range: bytes=-3\r\n").body, "789");
+    EXPECT_EQ(client.Send("GET", "/bucket/key", "", "Range: bytes=8-100\r\n").body, "89");
+
+    Response invalid = client.Send("GET", "/bucket/key", "", "Range: bytes=10-12\r\n");
+    EXPECT_EQ(invalid.status, 416);
+    EXPECT_NE(invalid.body.find("InvalidRange"), std::string::npos);
+    EXPECT_EQ(invalid.headers["Content-Range"], "bytes */10");
+}
+
+TEST_F(MockS3ServerTest, ChunkedUploads) {
+    Client client(server.GetPort());
+
+    //plain http chunking
+    EXPECT_EQ(client.Send("PUT", "/bucket/chunked", "4\r\nabcd\r\n3\r\nefg\r\n0\r\n\r\n",
+                          "Transfer-Encoding: chunked\r\n").status, 200);
+    //signed streaming payload with a trailing checksum
+    EXPECT_EQ(client.Send("PUT", "/bucket/aws-chunked",
+                          "5;chunk-signature=00\r\nhello\r\n0;chunk-signature=00\r\nx-amz-checksum-crc32:AAAAAA==\r\n\r\n",
+                          "Content-Encoding: aws-chunked\r\nx-amz-decoded-content-length: 5\r\n").status, 200);
+    //and the Expect handshake
+    EXPECT_EQ(client.Send("PUT", "/bucket/expect", "xyz", "Expect: 100-continue\r\n").status, 200);
+
+    std::string content;
+    EXPECT_TRUE(server.GetObject("bucket", "chunked", content));
+    EXPECT_EQ(content, "abcdefg");
+    EXPECT_TRUE(server.GetObject("bucket", "aws-chunked", content));
+    EXPECT_EQ(content, "hello");
+    EXPECT_TRUE(server.GetObject("bucket", "expect", content));
+    EXPECT_EQ(content, "xyz");
+}
+
+TEST_F(MockS3ServerTest, DeleteObjects) {
+    for (int i = 0; i < 5; i++) {
+        server.PutObject("bucket", "k" + std::to_string(i), "x");
+    }
+    Client client(server.GetPort());
+
+    Response r = client.Send("POST", "/bucket?delete",
+                             "<Delete><Object><Key>k1</Key></Object><Object><Key>k3</Key></Object></Delete>");
+    EXPECT_EQ(r.status, 200);
+    EXPECT_NE(r.body.find("<Deleted><Key>k3</Key></Deleted>"), std::string::npos);
+    EXPECT_EQ(server.GetObjectCount("bucket"), 3u);
+    EXPECT_EQ(server.GetStats().deletes, 2u);
+}
+
+TEST_F(MockS3ServerTest, DeleteObjectsDenied) {
+    server.PutObject("bucket", "kept", "x");
+    server.PutObject("bucket", "gone", "x");
+    MockS3Server::Faults faults;
+    faults.denied_deletes = {"kept"};
+    server.SetFaults(faults);
+    Client client(server.GetPort());
+
+    Response r = client.Send("POST", "/bucket?delete",
+                             "<Delete><Quiet>true</Quiet><Object><Key>kept</Key></Object>"
+                             "<Object><Key>gone</Key></Object></Delete>");
+    EXPECT_EQ(r.status, 200);
+    EXPECT_NE(r.body.find("<Error><Key>kept</Key><Code>AccessDenied</Code>"), std::string::npos);
+    EXPECT_EQ(r.body.find("gone"), std::string::npos);
+    EXPECT_EQ(server.GetObjectCount("bucket"), 1u);
+    EXPECT_EQ(server.GetStats().deletes, 1u);
+}
+
+TEST_F(MockS3ServerTest, Multipart) {
+    Client client(server.GetPort());
+
+    Response init = client.Send("POST", "/bucket/big?uploads");
+    EXPECT_EQ(init.status, 200);
+    const size_t b = init.body.find("<UploadId>") + 10;
+    const std::string id = init.body.substr(b, init.body.find("</UploadId>") - b);
+    ASSERT_FALSE(id.empty());
+
+    EXPECT_EQ(client.Send("PUT", "/bucket/big?partNumber=2&uploadId=" + id, "world").status, 200);
+    EXPECT_EQ(client.Send("PUT", "/bucket/big?partNumber=1&uploadId=" + id, "hello ").status, 200);
+    Response done = client.Send("POST", "/bucket/big?uploadId=" + id,
+                                "<CompleteMultipartUpload><Part><PartNumber>1</PartNumber></Part>"
+                                "<Part><PartNumber>2</PartNumber></Part></CompleteMultipartUpload>");
+    EXPECT_EQ(done.status, 200);
+    EXPECT_NE(done.body.find("<CompleteMultipartUploadResult"), std::string::npos);
+    EXPECT_EQ(client.Send("GET", "/bucket/big").body, "hello world");
+
+    EXPECT_EQ(client.Send("PUT", "/bucket/big?partNumber=3&uploadId=" + id, "late").status, 404);
+    EXPECT_EQ(server.GetStats().multipart_uploads, 1u);
+}
+
+TEST_F(MockS3ServerTest, ListObjectsV2) {
+    for (int i = 0; i < 5; i++) {
+        server.PutObject("bucket", "a/" + std::to_string(i), "x");
+    }
+    server.PutObject("bucket", "b/0", "x");
+    Client client(server.GetPort());
+
+    Response page1 = client.Send("GET", "/bucket?list-type=2&prefix=a%2F&max-keys=3");
+    EXPECT_EQ(page1.status, 200);
+    EXPECT_NE(page1.body.find("<KeyCount>3</KeyCount>"), std::string::npos);
+    EXPECT_NE(page1.body.find("<IsTruncated>true</IsTruncated>"), std::string::npos);
+    EXPECT_NE(page1.body.find("<NextContinuationToken>a/2</NextContinuationToken>"), std::string::npos);
+
+    Response page2 = client.Send("GET", "/bucket?list-type=2&prefix=a%2F&max-keys=3&continuation-token=a%2F2");
+    EXPECT_NE(page2.body.find("<KeyCount>2</KeyCount>"), std::string::npos);
+    EXPECT_NE(page2.body.find("<Key>a/4</Key>"), std::string::npos);
+    EXPECT_EQ(page2.body.find("b/0"), std::string::npos);
+    EXPECT_NE(page2.body.find("<IsTruncated>false</IsTruncated>"), std::string::npos);
+}
+
+TEST_F(MockS3ServerTest, SlowDown) {
+    MockS3Server::Faults faults;
+    faults.slow_down_rate = 1;
+    server.SetFaults(faults);
+    Client client(server.GetPort());
+
+    Response r = client.Send("PUT", "/bucket/key", "data");
+    EXPECT_EQ(r.status, 503);
+    EXPECT_NE(r.body.find("<Code>SlowDown</Code>"), std::string::npos);
+    EXPECT_EQ(server.GetObjectCount("bucket"), 0u);
+
+    server.SetFaults(MockS3Server::Faults());
+    EXPECT_EQ(client.Send("PUT", "/bucket/key", "data").status, 200);
+    EXPECT_EQ(server.GetStats().slow_downs, 1u);
+}
+
+TEST_F(MockS3ServerTest, LatencyAndBandwidth) {
+    server.PutObject("bucket", "key", std::string(100000, 'x'));
+    Client client(server.GetPort());
+
+    MockS3Server::Faults faults;
+    faults.latency_ms = 20;
+    server.SetFaults(faults);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_EQ(client.Send("HEAD", "/bucket/key").status, 200);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(20));
+
+    faults.latency_ms = 0;
+    faults.bandwidth = 1000000;
+    server.SetFaults(faults);
+    start = std::chrono::steady_clock::now();
+    EXPECT_EQ(client.Send("GET", "/bucket/key").body.size(), 100000u);
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(90));
+}
+
+TEST_F(MockS3ServerTest, Stall) {
+    MockS3Server::Faults faults;
+    faults.stall_rate = 1;
+    faults.stall_ms = 50;
+    server.SetFaults(faults);
+
+    Client client(server.GetPort());
+    EXPECT_EQ(client.Send("GET", "/bucket/key").status, 0);
+    EXPECT_EQ(server.GetStats().stalls, 1u);
+
+    //a long stall does not hold up Stop
+    faults.stall_ms = 60000;
+    server.SetFaults(faults);
+    Client stalled(server.GetPort(), 100);
+    EXPECT_EQ(stalled.Send("GET", "/bucket/key").status, 0);
+    auto start = std::chrono::steady_clock::now();
+    server.Stop();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+}
+
+} //namespace
@@ -0,0 +1,216 @@
+#include "gtest/gtest.h"
+
+#include "Packer.hpp"
+#include "TestFixtures.hpp"
+#include "Utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+class PackerTest : public TempDirTest {
+protected:
+    FakeS3 s3;
+    std::vector<int64_t> attempts; //sizes of the PUTs, under s3.mutex
+
+    std::unique_ptr<Packer> Create(uint64_t maxPackSize, std::chrono::milliseconds window) {
+        return std::unique_ptr<Packer>(new Packer(context, root + "/pack-index.log", maxPackSize, window,
+                                                  [this](const std::string& key, const void* content, int64_t size) {
+            {
+                std::lock_guard<std::mutex> lock(s3.mutex);
+                attempts.push_back(size);
+            }
+            return s3.up && s3.Put(key, content, size);
+        }));
+    }
+
+    size_t Attempts() {
+        std::lock_guard<std::mutex> lock(s3.mutex);
+        return attempts.size();
+    }
+
+    //what a range GET of the location returns
+    std::string ReadPacked(Packer& packer, const std::string& uuid) {
+        Packer::Location location;
+        if (!packer.Lookup(uuid, location)) {
+            return "<missing>";
+        }
+        std::lock_guard<std::mutex> lock(s3.mutex);
+        auto it = s3.objects.find(location.pack);
+        if (it == s3.objects.end() || location.offset + location.size > it->second.size()) {
+            return "<no pack>";
+        }
+        return it->second.substr(static_cast<size_t>(location.offset), static_cast<size_t>(location.size));
+    }
+
+    //Add blocks until the pack is flushed, every writer gets its own thread
+    std::vector<std::thread> AddAll(Packer& packer, const std::map<std::string, std::string>& attachments,
+                                    std::atomic<int>& failed) {
+        std::vector<std::thread> writers;
+        for (const auto& a : attachments) {
+            writers.emplace_back([&packer, &failed, a]() {
+                if (!packer.Add(a.first, a.second.data(), static_cast<int64_t>(a.second.size()))) {
+                    failed++;
+                }
+            });
+        }
+        return writers;
+    }
+};
+
+TEST_F(PackerTest, SealedAtMaxPackSize) {
+    //the window never expires, only the size seals a pack
+    std::unique_ptr<Packer> packer = Create(10, std::chrono::hours(1));
+    ASSERT_TRUE(packer->Start(2));
+
+    std::atomic<int> failed(0);
+    std::vector<std::thread> writers = AddAll(*packer, {{"a", "aaaaaa"}, {"b", "bbbbbb"}}, failed);
+
+    //the second add doesn't fit, the first pack goes alone
+    ASSERT_TRUE(WaitFor([this]() { return s3.GetCount() == 1; }));
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(s3.GetCount(), 1u);
+    {
+        std::lock_guard<std::mutex> lock(s3.mutex);
+        EXPECT_EQ(s3.objects.begin()->second.size(), 6u);
+    }
+
+    //the open one is uploaded on stop
+    packer->Stop();
+    for (auto& w : writers) {
+        w.join();
+    }
+    EXPECT_EQ(failed, 0);
+    EXPECT_EQ(s3.GetCount(), 2u);
+    EXPECT_EQ(packer->GetPackCount(), 2u);
+    EXPECT_EQ(ReadPacked(*packer, "a"), "aaaaaa");
+    EXPECT_EQ(ReadPacked(*packer, "b"), "bbbbbb");
+
+    EXPECT_FALSE(packer->Add("late", "x", 1));
+}
+
+TEST_F(PackerTest, FlushedWhenTheWindowExpires) {
+    std::unique_ptr<Packer> packer = Create(1024 * 1024, std::chrono::milliseconds(300));
+    ASSERT_TRUE(packer->Start(1));
+
+    std::atomic<int> failed(0);
+    std::vector<std::thread> writers = AddAll(*packer, {{"a", "first"}, {"b", "second"}, {"c", "third"}}, failed);
+    for (auto& w : writers) {
+        w.join();
+    }
+    EXPECT_EQ(failed, 0);
+
+    //one PUT for everything written within the window
+    EXPECT_EQ(Attempts(), 1u);
+    EXPECT_EQ(packer->GetPackCount(), 1u);
+    EXPECT_EQ(ReadPacked(*packer, "a"), "first");
+    EXPECT_EQ(ReadPacked(*packer, "b"), "second");
+    EXPECT_EQ(ReadPacked(*packer, "c"), "third");
+
+    Packer::Location a, c;
+    ASSERT_TRUE(packer->Lookup("a", a));
+    ASSERT_TRUE(packer->Lookup("c", c));
+    EXPECT_EQ(a.pack, c.pack);
+}
+
+TEST_F(PackerTest, FailedUploadFailsTheWholePack) {
+    s3.up = false;
+    std::unique_ptr<Packer> packer = Create(1024 * 1024, std::chrono::milliseconds(300));
+    ASSERT_TRUE(packer->Start(1));
+
+    std::atomic<int> failed(0);
+    std::vector<std::thread> writers = AddAll(*packer, {{"a", "first"}, {"b", "second"}, {"c", "third"}}, failed);
+    for (auto& w : writers) {
+        w.join();
+    }
+
+    //one attempt for the pack, every writer in it sees the failure
+    ASSERT_EQ(Attempts(), 1u);
+    {
+        std::lock_guard<std::mutex> lock(s3.mutex);
+        EXPECT_EQ(attempts.front(), 16);
+    }
+    EXPECT_EQ(failed, 3);
+    EXPECT_EQ(packer->GetPackCount(), 0u);
+    Packer::Location location;
+    EXPECT_FALSE(packer->Lookup("a", location));
+    EXPECT_FALSE(packer->Lookup("b", location));
+    EXPECT_FALSE(packer->Lookup("c", location));
+}
+
+TEST_F(PackerTest, LastRemoveReportsThePack) {
+    std::unique_ptr<Packer> packer = Create(1024 * 1024, std::chrono::milliseconds(300));
+    ASSERT_TRUE(packer->Start(1));
+
+    std::atomic<int> failed(0);
+    std::vector<std::thread> writers = AddAll(*packer, {{"a", "first"}, {"b", "second"}}, failed);
+    for (auto& w : writers) {
+        w.join();
+    }
+    ASSERT_EQ(failed, 0);
+    Packer::Location location;
+    ASSERT_TRUE(packer->Lookup("a", location));
+
+    std::string emptyPack = "unchanged";
+    EXPECT_FALSE(packer->Remove("unknown", emptyPack));
+    EXPECT_EQ(emptyPack, "unchanged");
+
+    EXPECT_TRUE(packer->Remove("a", emptyPack));
+    EXPECT_EQ(emptyPack, "");
+    EXPECT_EQ(packer->GetPackCount(), 1u);
+
+    EXPECT_TRUE(packer->Remove("b", emptyPack));
+    EXPECT_EQ(emptyPack, location.pack);
+    EXPECT_EQ(packer->GetPackCount(), 0u);
+
+    //already gone
+    EXPECT_FALSE(packer->Remove("b", emptyPack));
+}
+
+TEST_F(PackerTest, LiveCountsRebuiltOnReload) {
+    std::string shared, alone;
+    {
+        std::unique_ptr<Packer> packer = Create(1024 * 1024, std::chrono::milliseconds(300));
+        ASSERT_TRUE(packer->Start(1));
+
+        std::atomic<int> failed(0);
+        std::vector<std::thread> writers = AddAll(*packer, {{"a", "first"}, {"b", "second"}}, failed);
+        for (auto& w : writers) {
+            w.join();
+        }
+        ASSERT_TRUE(packer->Add("c", "third", 5));
+        ASSERT_EQ(failed, 0);
+
+        Packer::Location location;
+        ASSERT_TRUE(packer->Lookup("a", location));
+        shared = location.pack;
+        ASSERT_TRUE(packer->Lookup("c", location));
+        alone = location.pack;
+        ASSERT_NE(shared, alone);
+    }
+
+    std::unique_ptr<Packer> packer = Create(1024 * 1024, std::chrono::milliseconds(300));
+    ASSERT_TRUE(packer->Start(1));
+    EXPECT_EQ(packer->GetPackCount(), 2u);
+    EXPECT_EQ(ReadPacked(*packer, "b"), "second");
+
+    //two attachments were counted for the shared pack
+    std::string emptyPack;
+    EXPECT_TRUE(packer->Remove("a", emptyPack));
+    EXPECT_EQ(emptyPack, "");
+    EXPECT_TRUE(packer->Remove("b", emptyPack));
+    EXPECT_EQ(emptyPack, shared);
+    EXPECT_TRUE(packer->Remove("c", emptyPack));
+    EXPECT_EQ(emptyPack, alone);
+    EXPECT_EQ(packer->GetPackCount(), 0u);
+}
+
+} //namespace
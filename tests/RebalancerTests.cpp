@@ -0,0 +1,117 @@
+#include "gtest/gtest.h"
+
+#include "HashRing.hpp"
+#include "Rebalancer.hpp"
+#include "Utils.hpp"
+
+#include <chrono>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+//buckets as sets of keys, placed by a ring
+struct FakeTargets {
+    std::mutex mutex;
+    std::vector<std::set<std::string> > buckets;
+    HashRing ring;
+    size_t moves = 0;
+
+    explicit FakeTargets(const std::vector<std::string>& names):
+        buckets(names.size()),
+        ring(names) {
+    }
+
+    std::unique_ptr<Rebalancer> CreateRebalancer() {
+        return std::unique_ptr<Rebalancer>(new Rebalancer(context, buckets.size(),
+                                                          [this](size_t target, const std::function<bool(const std::string&)>& visit) {
+            std::set<std::string> keys;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                keys = buckets[target];
+            }
+            for (const auto& key : keys) {
+                if (!visit(key)) {
+                    break;
+                }
+            }
+            return true;
+        }, [this](const std::string& key) {
+            return ring.GetOwner(key);
+        }, [this](const std::string& key, size_t from) {
+            std::lock_guard<std::mutex> lock(mutex);
+            buckets[ring.GetOwner(key)].insert(key);
+            buckets[from].erase(key);
+            moves++;
+            return true;
+        }, 4));
+    }
+};
+
+void waitIdle(Rebalancer& rebalancer) {
+    for (int i = 0; i < 500 && rebalancer.IsRunning(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+}
+
+TEST(Rebalancer, MovesTheShareOfANewTarget) {
+    const std::vector<std::string> names = {"a", "b", "c", "d"};
+    const HashRing before(names);
+    FakeTargets targets({"a", "b", "c", "d", "e"});
+
+    const size_t keys = 10000;
+    size_t expected = 0;
+    for (size_t i = 0; i < keys; ++i) {
+        const std::string key = "key-" + std::to_string(i);
+        targets.buckets[before.GetOwner(key)].insert(key);
+        if (targets.ring.GetOwner(key) != before.GetOwner(key)) {
+            expected++;
+        }
+    }
+
+    std::unique_ptr<Rebalancer> rebalancer = targets.CreateRebalancer();
+    ASSERT_TRUE(rebalancer->Start());
+    waitIdle(*rebalancer);
+    ASSERT_FALSE(rebalancer->IsRunning());
+
+    //only the keys changing hands, all of them
+    EXPECT_EQ(targets.moves, expected);
+    EXPECT_EQ(rebalancer->GetMovedCount(), expected);
+    EXPECT_EQ(rebalancer->GetFailedCount(), 0u);
+    EXPECT_GE(rebalancer->GetScannedCount(), keys);
+    size_t total = 0;
+    for (size_t t = 0; t < targets.buckets.size(); ++t) {
+        for (const auto& key : targets.buckets[t]) {
+            EXPECT_EQ(targets.ring.GetOwner(key), t);
+        }
+        total += targets.buckets[t].size();
+    }
+    EXPECT_EQ(total, keys);
+
+    //balanced already, a second run moves nothing
+    targets.moves = 0;
+    ASSERT_TRUE(rebalancer->Start());
+    waitIdle(*rebalancer);
+    EXPECT_EQ(targets.moves, 0u);
+    EXPECT_EQ(rebalancer->GetScannedCount(), keys);
+}
+
+TEST(Rebalancer, Stop) {
+    FakeTargets targets({"a", "b"});
+    for (size_t i = 0; i < 100000; ++i) {
+        targets.buckets[0].insert("key-" + std::to_string(i));
+    }
+
+    std::unique_ptr<Rebalancer> rebalancer = targets.CreateRebalancer();
+    ASSERT_TRUE(rebalancer->Start());
+    EXPECT_FALSE(rebalancer->Start());
+    rebalancer->Stop();
+    EXPECT_FALSE(rebalancer->IsRunning());
+}
+
+} //namespace
@@ -0,0 +1,89 @@
+#include "gtest/gtest.h"
+
+#include "Retry.hpp"
+
+namespace {
+
+using namespace OrthancPlugins;
+
+TEST(RetryPolicy, Classify) {
+    EXPECT_EQ(RetryPolicy::Classify(503, "SlowDown", true), RetryClass::THROTTLING);
+    EXPECT_EQ(RetryPolicy::Classify(429, "", false), RetryClass::THROTTLING);
+    EXPECT_EQ(RetryPolicy::Classify(400, "RequestLimitExceeded", false), RetryClass::THROTTLING);
+
+    //no answer at all
+    EXPECT_EQ(RetryPolicy::Classify(-1, "", true), RetryClass::TRANSIENT);
+    EXPECT_EQ(RetryPolicy::Classify(500, "InternalError", false), RetryClass::TRANSIENT);
+    EXPECT_EQ(RetryPolicy::Classify(503, "ServiceUnavailable", false), RetryClass::TRANSIENT);
+    EXPECT_EQ(RetryPolicy::Classify(400, "RequestTimeout", false), RetryClass::TRANSIENT);
+
+    EXPECT_EQ(RetryPolicy::Classify(404, "NoSuchKey", false), RetryClass::FATAL);
+    EXPECT_EQ(RetryPolicy::Classify(403, "AccessDenied", false), RetryClass::FATAL);
+    EXPECT_EQ(RetryPolicy::Classify(416, "InvalidRange", false), RetryClass::FATAL);
+    EXPECT_EQ(RetryPolicy::Classify(501, "NotImplemented", false), RetryClass::FATAL);
+}
+
+TEST(RetryPolicy, FatalAndMaxRetries) {
+    RetryPolicy policy(3, 10, 1000, 100);
+
+    EXPECT_FALSE(policy.ShouldRetry(RetryClass::FATAL, 0));
+    for (unsigned int i = 0; i < 3; ++i) {
+        EXPECT_TRUE(policy.ShouldRetry(RetryClass::TRANSIENT, i));
+    }
+    EXPECT_FALSE(policy.ShouldRetry(RetryClass::TRANSIENT, 3));
+
+    EXPECT_EQ(policy.GetRetries(RetryClass::TRANSIENT), 3u);
+    EXPECT_EQ(policy.GetRetries(RetryClass::FATAL), 0u);
+    EXPECT_EQ(policy.GetExhausted(), 1u);
+    EXPECT_EQ(policy.GetDenied(), 0u);
+}
+
+TEST(RetryPolicy, FullJitter) {
+    RetryPolicy policy(10, 10, 1000, 10);
+
+    uint64_t highest = 0;
+    for (int i = 0; i < 1000; ++i) {
+        const uint64_t delay = policy.GetDelay(RetryClass::TRANSIENT, 2);
+        EXPECT_LE(delay, 40u);
+        highest = std::max(highest, delay);
+    }
+    //spread over the whole range
+    EXPECT_GT(highest, 30u);
+
+    //throttling backs off harder, everything stays under the cap
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_LE(policy.GetDelay(RetryClass::THROTTLING, 0), 10 * RetryPolicy::THROTTLE_FACTOR);
+        EXPECT_LE(policy.GetDelay(RetryClass::TRANSIENT, 100), 1000u);
+    }
+}
+
+TEST(RetryPolicy, Budget) {
+    RetryPolicy policy(3, 10, 1000, 10);
+
+    //starts with a full burst
+    int64_t granted = 0;
+    while (policy.ShouldRetry(RetryClass::THROTTLING, 0)) {
+        granted++;
+    }
+    EXPECT_EQ(granted, RetryPolicy::MAX_BURST);
+    EXPECT_EQ(policy.GetDenied(), 1u);
+    EXPECT_EQ(policy.GetBudget(), 0);
+
+    //then 10% of the requests
+    granted = 0;
+    for (int i = 0; i < 1000; ++i) {
+        policy.OnRequest();
+        if (policy.ShouldRetry(RetryClass::TRANSIENT, 0)) {
+            granted++;
+        }
+    }
+    EXPECT_EQ(granted, 100);
+
+    //saved up to the burst only
+    for (int i = 0; i < 1000; ++i) {
+        policy.OnRequest();
+    }
+    EXPECT_EQ(policy.GetBudget(), static_cast<double>(RetryPolicy::MAX_BURST));
+}
+
+} //namespace
@@ -0,0 +1,693 @@
+#include "gtest/gtest.h"
+
+#include "AllocationCounter.hpp"
+#include "MockS3Server.hpp"
+#include "Rebalancer.hpp"
+#include "S3ops.hpp"
+#include "Timer.hpp"
+#include "Utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * S3Direct and S3TransferManager against the mock, through s3_endpoint.
+ *
+ * Besides correctness, the thresholds below fail the build on the usual
+ * performance regressions:
+ *  - a GET or PUT copying the body (a body sized buffer more per operation)
+ *  - allocations growing with the object size (per chunk on the wire)
+ *  - requests serialized (throughput floors with an injected latency, so
+ *    they hold on slow machines: the time is spent waiting, not computing)
+ */
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const char* BUCKET = "s3-tests";
+const uint64_t KB = 1024;
+const uint64_t MB = 1024 * 1024;
+
+std::string payload(size_t size, unsigned int seed = 1) {
+    std::string data(size, '\0');
+    std::mt19937 rng(seed);
+    for (auto& c : data) {
+        c = static_cast<char>(rng());
+    }
+    return data;
+}
+
+class S3Test : public ::testing::TestWithParam<S3Method> {
+protected:
+    MockS3Server server;
+    std::unique_ptr<S3Impl> s3;
+
+    void SetUp() override {
+        //no instance metadata lookups from the SDK
+        setenv("AWS_EC2_METADATA_DISABLED", "true", 1);
+        ASSERT_TRUE(server.Start());
+    }
+
+    void TearDown() override {
+        s3.reset();
+        server.Stop();
+    }
+
+    static S3Options Options() {
+        S3Options options;
+        options.download_part_size = 1 * MB;
+        options.download_concurrency = 4;
+        options.max_connections = 16;
+        options.transfer_threads = 8;
+        options.transfer_buffer_size = 5 * MB;
+        options.aws_log_level = Aws::Utils::Logging::LogLevel::Error;
+        return options;
+    }
+
+    void Connect(const S3Options& options = Options()) {
+        ASSERT_NO_FATAL_FAILURE(ConnectBuckets({BUCKET}, options));
+    }
+
+    //objects spread over several buckets of the mock
+    void ConnectBuckets(const std::vector<std::string>& buckets, const S3Options& options = Options()) {
+        std::vector<S3Target> targets;
+        for (const auto& bucket : buckets) {
+            targets.push_back(S3Target{bucket, {server.GetEndpoint()}});
+        }
+        ASSERT_NO_FATAL_FAILURE(ConnectTargets(targets, options));
+    }
+
+    void ConnectTargets(const std::vector<S3Target>& targets, const S3Options& options = Options()) {
+        if (GetParam() == S3Method::TRANSFER_MANAGER) {
+            s3.reset(new S3TransferManager(context));
+        } else {
+            s3.reset(new S3Direct(context));
+        }
+        s3->SetOptions(options);
+        ASSERT_TRUE(s3->ConfigureAwsSdk("mock", "mock", targets, "us-east-1"));
+        server.ResetStats();
+    }
+
+    bool Put(const std::string& path, const std::string& data) {
+        return s3->UploadFileToS3(path, data.data(), static_cast<int64_t>(data.size()));
+    }
+
+    bool Get(const std::string& path, std::string& data) {
+        void* content = nullptr;
+        int64_t size = 0;
+        if (!s3->DownloadFileFromS3(path, &content, &size)) {
+            return false;
+        }
+        data.assign(static_cast<const char*>(content), static_cast<size_t>(size));
+        free(content);
+        return true;
+    }
+
+    //GETs and PUTs of size bytes from threads in parallel, operations per second
+    double Throughput(unsigned int threads, unsigned int operations, size_t size) {
+        const std::string data = payload(size);
+        for (unsigned int t = 0; t < threads; ++t) {
+            server.PutObject(BUCKET, "tp/" + std::to_string(t), data);
+        }
+
+        std::atomic<unsigned int> failed(0);
+        Stopwatch timer;
+        std::vector<std::thread> workers;
+        for (unsigned int t = 0; t < threads; ++t) {
+            workers.emplace_back([&, t]() {
+                const std::string path = "tp/" + std::to_string(t);
+                std::string read;
+                for (unsigned int i = 0; i < operations; ++i) {
+                    const bool ok = i % 2 == 0 ? Get(path, read) : Put(path, data);
+                    if (!ok) {
+                        failed++;
+                    }
+                }
+            });
+        }
+        for (auto& w : workers) {
+            w.join();
+        }
+        const double seconds = timer.elapsed() / 1e6;
+
+        EXPECT_EQ(failed, 0u);
+        return threads * operations / seconds;
+    }
+};
+
+TEST_P(S3Test, RoundTrip) {
+    ASSERT_NO_FATAL_FAILURE(Connect());
+
+    //empty, tiny, one part, just over one part, several parts of both methods
+    for (size_t size : {0ul, 1ul, 64 * KB, MB + 1, 12 * MB}) {
+        const std::string path = "rt/" + std::to_string(size);
+        const std::string data = payload(size, static_cast<unsigned int>(size));
+
+        ASSERT_TRUE(Put(path, data)) << size;
+        std::string stored;
+        ASSERT_TRUE(server.GetObject(BUCKET, path, stored)) << size;
+        EXPECT_TRUE(stored == data) << size;
+
+        std::string read;
+        ASSERT_TRUE(Get(path, read)) << size;
+        EXPECT_EQ(read.size(), size);
+        EXPECT_TRUE(read == data) << size;
+    }
+}
+
+TEST_P(S3Test, MissingObject) {
+    ASSERT_NO_FATAL_FAILURE(Connect());
+
+    std::string read;
+    EXPECT_FALSE(Get("missing", read));
+    //like S3, deleting what is not there succeeds
+    EXPECT_TRUE(s3->DeleteFileFromS3("missing"));
+}
+
+TEST_P(S3Test, Delete) {
+    ASSERT_NO_FATAL_FAILURE(Connect());
+
+    ASSERT_TRUE(Put("one", "1"));
+    EXPECT_TRUE(s3->DeleteFileFromS3("one"));
+    EXPECT_EQ(server.GetObjectCount(BUCKET), 0u);
+
+    std::vector<std::string> paths;
+    for (int i = 0; i < 10; ++i) {
+        paths.push_back("batch/" + std::to_string(i));
+        server.PutObject(BUCKET, paths.back(), "x");
+    }
+    paths.resize(5);
+    paths.push_back("batch/missing");
+
+    std::vector<std::string> failed;
+    EXPECT_TRUE(s3->DeleteFilesFromS3(paths, failed));
+    EXPECT_TRUE(failed.empty());
+    EXPECT_EQ(server.GetObjectCount(BUCKET), 5u);
+    EXPECT_EQ(server.GetStats().deletes, 7u);
+}
+
+TEST_P(S3Test, DownloadRange) {
+    ASSERT_NO_FATAL_FAILURE(Connect());
+
+    const std::string data = payload(MB);
+    server.PutObject(BUCKET, "range", data);
+
+    void* content = nullptr;
+    ASSERT_TRUE(s3->DownloadRangeFromS3("range", 1000, 5000, &content));
+    EXPECT_TRUE(std::string(static_cast<const char*>(content), 5000) == data.substr(1000, 5000));
+    free(content);
+
+    EXPECT_FALSE(s3->DownloadRangeFromS3("range", 2 * MB, 10, &content));
+}
+
+TEST_P(S3Test, GetDoesNotCopyTheBody) {
+    const size_t size = 4 * MB;
+    S3Options options = Options();
+    //S3Direct: a buffer of the first range, grown once to the object size
+    //S3TransferManager: under one buffer, a single GET too
+    options.download_part_size = size;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    server.PutObject(BUCKET, "body", payload(size));
+
+    std::string read;
+    ASSERT_TRUE(Get("body", read));
+
+    const int gets = 4;
+    AllocationCounter counter;
+    for (int i = 0; i < gets; ++i) {
+        void* content = nullptr;
+        int64_t length = 0;
+        ASSERT_TRUE(s3->DownloadFileFromS3("body", &content, &length));
+        free(content);
+    }
+    const AllocationCounter::Stats stats = counter.Get();
+
+    //the buffer handed over to Orthanc and nothing else of that size
+    EXPECT_LE(stats.large_bytes / gets, size + size / 8);
+}
+
+TEST_P(S3Test, SmallGetDoesNotAllocateAPart) {
+    //the TransferManager sizes its own buffers
+    if (GetParam() == S3Method::TRANSFER_MANAGER) {
+        return;
+    }
+    const size_t size = 64 * KB;
+    const size_t mid = 3 * MB;
+    S3Options options = Options();
+    options.download_part_size = 8 * MB;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    const std::string midData = payload(mid);
+    server.PutObject(BUCKET, "small", payload(size));
+    server.PutObject(BUCKET, "mid", midData);
+
+    std::string read;
+    ASSERT_TRUE(Get("small", read));
+
+    const int gets = 4;
+    AllocationCounter counter;
+    for (int i = 0; i < gets; ++i) {
+        void* content = nullptr;
+        int64_t length = 0;
+        ASSERT_TRUE(s3->DownloadFileFromS3("small", &content, &length));
+        EXPECT_EQ(length, static_cast<int64_t>(size));
+        free(content);
+    }
+    const AllocationCounter::Stats stats = counter.Get();
+
+    //the first range only, not download_part_size
+    EXPECT_LE(stats.large_bytes / gets, S3Direct::PROBE_SIZE);
+
+    //between the probe and one part: the probe, then the rest in one range
+    server.ResetStats();
+    ASSERT_TRUE(Get("mid", read));
+    EXPECT_TRUE(read == midData);
+    EXPECT_EQ(server.GetStats().gets, 2u);
+}
+
+TEST_P(S3Test, PutDoesNotCopyTheBody) {
+    const size_t size = 4 * MB;
+    ASSERT_NO_FATAL_FAILURE(Connect());
+    const std::string data = payload(size);
+    ASSERT_TRUE(Put("body", data));
+
+    const int puts = 4;
+    AllocationCounter counter;
+    for (int i = 0; i < puts; ++i) {
+        ASSERT_TRUE(Put("body", data));
+    }
+    const AllocationCounter::Stats stats = counter.Get();
+
+    //the SDK streams from the caller's buffer
+    EXPECT_LT(stats.large_bytes / puts, size / 8);
+}
+
+TEST_P(S3Test, AllocationsDoNotGrowWithSize) {
+    const size_t small = 16 * KB;
+    const size_t large = 4 * MB;
+    S3Options options = Options();
+    options.download_part_size = large;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    server.PutObject(BUCKET, "small", payload(small));
+    server.PutObject(BUCKET, "large", payload(large));
+    const std::string smallData = payload(small);
+    const std::string largeData = payload(large);
+
+    std::string read;
+    ASSERT_TRUE(Get("small", read));
+    ASSERT_TRUE(Get("large", read));
+
+    auto count = [this](std::function<bool()> op) {
+        AllocationCounter counter;
+        EXPECT_TRUE(op());
+        return counter.Get().allocations;
+    };
+    auto get = [this](const char* path) {
+        return [this, path]() {
+            void* content = nullptr;
+            int64_t length = 0;
+            const bool ok = s3->DownloadFileFromS3(path, &content, &length);
+            free(content);
+            return ok;
+        };
+    };
+
+    const uint64_t smallGet = count(get("small"));
+    const uint64_t largeGet = count(get("large"));
+    const uint64_t smallPut = count([&]() { return Put("small", smallData); });
+    const uint64_t largePut = count([&]() { return Put("large", largeData); });
+
+    //a loose ceiling on the SDK overhead of one request
+    EXPECT_LT(smallGet, 3000u);
+    EXPECT_LT(smallPut, 3000u);
+    //4 MB arrive in ~256 curl chunks of 16 KB, one allocation each would show
+    EXPECT_LT(largeGet, smallGet + 128) << smallGet << " allocations for " << small << " bytes";
+    EXPECT_LT(largePut, smallPut + 128) << smallPut << " allocations for " << small << " bytes";
+}
+
+TEST_P(S3Test, ThroughputFloor) {
+    ASSERT_NO_FATAL_FAILURE(Connect());
+
+    const unsigned int threads = 8;
+    const unsigned int latencyMs = 10;
+    MockS3Server::Faults faults;
+    faults.latency_ms = latencyMs;
+    server.SetFaults(faults);
+
+    const double opsPerSecond = Throughput(threads, 20, 64 * KB);
+
+    //serialized requests would top out at 1000 / latencyMs
+    const double ideal = threads * 1000.0 / latencyMs;
+    EXPECT_GT(opsPerSecond, 0.4 * ideal);
+    EXPECT_GE(server.GetStats().peak_in_flight, threads / 2);
+}
+
+TEST_P(S3Test, LargeGetsUseParallelRanges) {
+    ASSERT_NO_FATAL_FAILURE(Connect());
+    //16 parts of S3Direct, 4 buffers of S3TransferManager
+    const std::string data = payload(16 * MB);
+    server.PutObject(BUCKET, "large", data);
+
+    MockS3Server::Faults faults;
+    faults.latency_ms = 20;
+    server.SetFaults(faults);
+
+    std::string read;
+    ASSERT_TRUE(Get("large", read));
+    EXPECT_TRUE(read == data);
+    EXPECT_GE(server.GetStats().peak_in_flight, 2u);
+}
+
+TEST_P(S3Test, ThrottlingIsRetried) {
+    S3Options options = Options();
+    options.retry_base_delay_ms = 1;
+    options.retry_max_delay_ms = 20;
+    options.retry_budget_percent = 50;
+    //4 SlowDown in a row are likely enough over all the requests
+    options.max_retries = 10;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    std::shared_ptr<RetryPolicy> retry = s3->GetRetryPolicy();
+    ASSERT_TRUE(retry);
+
+    MockS3Server::Faults faults;
+    faults.slow_down_rate = 0.2;
+    server.SetFaults(faults);
+
+    const std::string data = payload(64 * KB);
+    for (int i = 0; i < 20; ++i) {
+        const std::string path = "throttled/" + std::to_string(i);
+        ASSERT_TRUE(Put(path, data)) << i;
+        std::string read;
+        ASSERT_TRUE(Get(path, read)) << i;
+        EXPECT_TRUE(read == data);
+    }
+
+    EXPECT_GT(server.GetStats().slow_downs, 0u);
+    //the throttled HEADs of TransferManager count as transient
+    EXPECT_EQ(retry->GetRetries(RetryClass::THROTTLING) + retry->GetRetries(RetryClass::TRANSIENT),
+              server.GetStats().slow_downs);
+    EXPECT_EQ(retry->GetRetries(RetryClass::FATAL), 0u);
+}
+
+TEST_P(S3Test, RetryBudgetCapsRetries) {
+    S3Options options = Options();
+    options.retry_base_delay_ms = 1;
+    options.retry_max_delay_ms = 5;
+    options.retry_budget_percent = 10;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    std::shared_ptr<RetryPolicy> retry = s3->GetRetryPolicy();
+    server.PutObject(BUCKET, "throttled", "x");
+
+    //an endpoint answering nothing but SlowDown
+    MockS3Server::Faults faults;
+    faults.slow_down_rate = 1;
+    server.SetFaults(faults);
+
+    const int requests = 50;
+    std::string read;
+    for (int i = 0; i < requests; ++i) {
+        EXPECT_FALSE(Get("throttled", read));
+    }
+
+    //without a budget every request would be retried max_retries times;
+    //a throttled HEAD has no error code, so it's only transient
+    const uint64_t retries = retry->GetRetries(RetryClass::THROTTLING) + retry->GetRetries(RetryClass::TRANSIENT);
+    EXPECT_LE(retries, RetryPolicy::MAX_BURST + requests / 10 + 1);
+    EXPECT_GT(retry->GetDenied(), 0u);
+    EXPECT_EQ(server.GetStats().requests, requests + retries);
+}
+
+TEST_P(S3Test, FatalErrorsAreNotRetried) {
+    ASSERT_NO_FATAL_FAILURE(Connect());
+
+    std::string read;
+    EXPECT_FALSE(Get("missing", read));
+    EXPECT_EQ(s3->GetRetryPolicy()->GetRetries(RetryClass::TRANSIENT), 0u);
+    EXPECT_EQ(s3->GetRetryPolicy()->GetRetries(RetryClass::THROTTLING), 0u);
+}
+
+TEST_P(S3Test, HedgedGetBeatsAStall) {
+    S3Options options = Options();
+    options.hedge_reads = true;
+    options.hedge_percentile = 50;
+    options.hedge_budget_percent = 100;
+    options.hedge_min_delay_ms = 200;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    std::shared_ptr<HedgePolicy> hedge = s3->GetHedgePolicy();
+    ASSERT_TRUE(hedge);
+
+    const std::string data = payload(64 * KB);
+    server.PutObject(BUCKET, "hedged", data);
+
+    //enough first bytes for a delay, refreshed after a second
+    void* content = nullptr;
+    for (uint64_t i = 0; i < HedgePolicy::MIN_SAMPLES; ++i) {
+        ASSERT_TRUE(s3->DownloadRangeFromS3("hedged", 0, 1000, &content));
+        free(content);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+    EXPECT_EQ(hedge->GetHedges(), 0u);
+
+    //the first request stalls, the hedge doesn't
+    MockS3Server::Faults faults;
+    faults.stall_rate = 1;
+    faults.stall_ms = 5000;
+    server.SetFaults(faults);
+    std::thread unstall([this]() {
+        while (server.GetStats().stalls == 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        server.SetFaults(MockS3Server::Faults());
+    });
+
+    Stopwatch timer;
+    const bool ok = s3->DownloadRangeFromS3("hedged", 1000, 5000, &content);
+    const double seconds = timer.elapsed() / 1e6;
+    unstall.join();
+
+    ASSERT_TRUE(ok);
+    EXPECT_TRUE(std::string(static_cast<const char*>(content), 5000) == data.substr(1000, 5000));
+    free(content);
+    EXPECT_LT(seconds, 2.0);
+    EXPECT_EQ(hedge->GetHedges(), 1u);
+    EXPECT_EQ(hedge->GetWins(), 1u);
+}
+
+TEST_P(S3Test, CircuitBreakerFailsFastAndRecovers) {
+    S3Options options = Options();
+    options.breaker_failures = 3;
+    options.retry_base_delay_ms = 1;
+    options.retry_max_delay_ms = 5;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    std::shared_ptr<CircuitBreaker> breaker = s3->GetCircuitBreaker();
+    ASSERT_TRUE(breaker);
+    ASSERT_TRUE(Put("breaker", "x"));
+
+    //connections refused until the breaker trips
+    const uint16_t port = server.GetPort();
+    server.Stop();
+    std::string read;
+    for (int i = 0; i < 10 && !breaker->IsOpen(); ++i) {
+        EXPECT_FALSE(Get("breaker", read));
+    }
+    ASSERT_TRUE(breaker->IsOpen());
+    EXPECT_EQ(breaker->GetTrips(), 1u);
+
+    //then nothing is sent at all
+    Stopwatch timer;
+    EXPECT_FALSE(Get("breaker", read));
+    EXPECT_LT(timer.elapsed(), 100000u);
+    EXPECT_GT(breaker->GetRejected(), 0u);
+    EXPECT_FALSE(s3->Probe());
+
+    ASSERT_TRUE(server.Start(port));
+    EXPECT_TRUE(s3->Probe());
+    EXPECT_FALSE(breaker->IsOpen());
+    EXPECT_GT(breaker->GetLastTimeToRecover(), 0u);
+    ASSERT_TRUE(Get("breaker", read));
+    EXPECT_EQ(read, "x");
+}
+
+TEST_P(S3Test, ThrottlingIsNotAnOutage) {
+    S3Options options = Options();
+    options.breaker_failures = 3;
+    options.eject_failures = 3;
+    options.retry_base_delay_ms = 1;
+    options.retry_max_delay_ms = 5;
+    ASSERT_NO_FATAL_FAILURE(Connect(options));
+    std::shared_ptr<CircuitBreaker> breaker = s3->GetCircuitBreaker();
+    ASSERT_TRUE(breaker);
+    ASSERT_TRUE(Put("throttled", "x"));
+
+    //every request answered SlowDown: failed, but S3 is there
+    MockS3Server::Faults faults;
+    faults.slow_down_rate = 1;
+    server.SetFaults(faults);
+    std::string read;
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_FALSE(Get("throttled", read));
+    }
+    EXPECT_FALSE(breaker->IsOpen());
+    EXPECT_EQ(breaker->GetTrips(), 0u);
+    EXPECT_FALSE(s3->GetEndpointBalancer(0)->IsEjected(0));
+
+    server.SetFaults(MockS3Server::Faults());
+    ASSERT_TRUE(Get("throttled", read));
+    EXPECT_EQ(read, "x");
+}
+
+TEST_P(S3Test, StripedOverBuckets) {
+    const std::vector<std::string> buckets = {"stripe-a", "stripe-b", "stripe-c"};
+    ASSERT_NO_FATAL_FAILURE(ConnectBuckets({buckets[0], buckets[1]}));
+
+    const size_t objects = 300;
+    for (size_t i = 0; i < objects; ++i) {
+        ASSERT_TRUE(Put("striped/" + std::to_string(i), std::to_string(i)));
+    }
+    EXPECT_GT(server.GetObjectCount(buckets[0]), objects / 4);
+    EXPECT_GT(server.GetObjectCount(buckets[1]), objects / 4);
+    EXPECT_EQ(server.GetObjectCount(buckets[0]) + server.GetObjectCount(buckets[1]), objects);
+
+    //a bucket added: everything still readable from the previous owners
+    ASSERT_NO_FATAL_FAILURE(ConnectBuckets(buckets));
+    std::string read;
+    for (size_t i = 0; i < objects; ++i) {
+        ASSERT_TRUE(Get("striped/" + std::to_string(i), read));
+        EXPECT_EQ(read, std::to_string(i));
+    }
+
+    //and deletes reach the objects not moved yet
+    std::string deleted;
+    for (size_t i = 0; i < objects && deleted.empty(); ++i) {
+        if (s3->GetOwner("striped/" + std::to_string(i)) == 2) {
+            deleted = "striped/" + std::to_string(i);
+        }
+    }
+    ASSERT_FALSE(deleted.empty());
+    ASSERT_TRUE(s3->DeleteFileFromS3(deleted));
+    for (const auto& bucket : buckets) {
+        EXPECT_FALSE(server.GetObject(bucket, deleted, read));
+    }
+
+    //only the share of the new bucket moves
+    Rebalancer rebalancer(context, s3->GetTargetCount(),
+                          [this](size_t target, const std::function<bool(const std::string&)>& visit) {
+        return s3->ListObjects(target, visit);
+    }, [this](const std::string& key) {
+        return s3->GetOwner(key);
+    }, [this](const std::string& key, size_t from) {
+        return s3->MoveObject(key, from);
+    }, 4);
+    ASSERT_TRUE(rebalancer.Start());
+    for (int i = 0; i < 1000 && rebalancer.IsRunning(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    ASSERT_FALSE(rebalancer.IsRunning());
+    EXPECT_EQ(rebalancer.GetFailedCount(), 0u);
+    EXPECT_EQ(rebalancer.GetMovedCount(), server.GetObjectCount(buckets[2]));
+    EXPECT_LT(rebalancer.GetMovedCount(), objects / 2);
+
+    for (size_t i = 0; i < objects; ++i) {
+        const std::string key = "striped/" + std::to_string(i);
+        EXPECT_EQ(server.GetObject(buckets[s3->GetOwner(key)], key, read), key != deleted) << key;
+    }
+    EXPECT_EQ(server.GetObjectCount(buckets[0]) + server.GetObjectCount(buckets[1]) + server.GetObjectCount(buckets[2]), objects - 1);
+
+    std::vector<std::string> failed;
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < objects; ++i) {
+        paths.push_back("striped/" + std::to_string(i));
+    }
+    ASSERT_TRUE(s3->DeleteFilesFromS3(paths, failed));
+    for (const auto& bucket : buckets) {
+        EXPECT_EQ(server.GetObjectCount(bucket), 0u);
+    }
+}
+
+TEST_P(S3Test, BalancedOverEndpoints) {
+    //two names of the mock, the same data behind both
+    const std::string localhost = "http://localhost:" + std::to_string(server.GetPort());
+    ASSERT_NO_FATAL_FAILURE(ConnectTargets({S3Target{BUCKET, {server.GetEndpoint(), localhost}}}));
+    std::shared_ptr<EndpointBalancer> balancer = s3->GetEndpointBalancer(0);
+    ASSERT_EQ(balancer->GetSize(), 2u);
+
+    //from threads, so requests overlap
+    std::atomic<unsigned int> failed(0);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < 4; ++t) {
+        workers.emplace_back([&, t]() {
+            const std::string path = "balanced/" + std::to_string(t);
+            std::string read;
+            for (unsigned int i = 0; i < 25; ++i) {
+                if (!Put(path, path) || !Get(path, read) || read != path) {
+                    failed++;
+                }
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    EXPECT_EQ(failed, 0u);
+    EXPECT_GT(balancer->GetRequests(0), 10u);
+    EXPECT_GT(balancer->GetRequests(1), 10u);
+    EXPECT_EQ(balancer->GetOutstanding(0), 0);
+    EXPECT_EQ(balancer->GetOutstanding(1), 0);
+    EXPECT_GT(balancer->GetLatency(0), 0u);
+    EXPECT_GT(balancer->GetLatency(1), 0u);
+}
+
+TEST_P(S3Test, FailingEndpointIsEjected) {
+    //an endpoint nobody listens to
+    MockS3Server dead;
+    ASSERT_TRUE(dead.Start());
+    const uint16_t port = dead.GetPort();
+    const std::string endpoint = dead.GetEndpoint();
+    dead.Stop();
+
+    S3Options options = Options();
+    options.eject_failures = 2;
+    options.health_check_ms = 20;
+    options.retry_base_delay_ms = 1;
+    options.retry_max_delay_ms = 5;
+    ASSERT_NO_FATAL_FAILURE(ConnectTargets({S3Target{BUCKET, {server.GetEndpoint(), endpoint}}}, options));
+    std::shared_ptr<EndpointBalancer> balancer = s3->GetEndpointBalancer(0);
+
+    for (int i = 0; i < 100 && !balancer->IsEjected(1); ++i) {
+        Put("ejected", "x");
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    ASSERT_TRUE(balancer->IsEjected(1));
+    EXPECT_FALSE(balancer->IsEjected(0));
+    EXPECT_GT(balancer->GetEjections(1), 0u);
+
+    //then every request goes to the other one
+    std::string read;
+    for (int i = 0; i < 20; ++i) {
+        ASSERT_TRUE(Put("ejected", std::to_string(i)));
+        ASSERT_TRUE(Get("ejected", read));
+        EXPECT_EQ(read, std::to_string(i));
+    }
+
+    //until it answers a health check again
+    ASSERT_TRUE(dead.Start(port));
+    for (int i = 0; i < 200 && balancer->IsEjected(1); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_FALSE(balancer->IsEjected(1));
+}
+
+INSTANTIATE_TEST_SUITE_P(Methods, S3Test,
+                         ::testing::Values(S3Method::DIRECT, S3Method::TRANSFER_MANAGER),
+                         [](const ::testing::TestParamInfo<S3Method>& info) {
+    return std::string(info.param == S3Method::DIRECT ? "Direct" : "TransferManager");
+});
+
+} //namespace
@@ -0,0 +1,95 @@
+#include "gtest/gtest.h"
+
+#include "Spool.hpp"
+#include "TestFixtures.hpp"
+#include "Utils.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+const char* UUID = "0b6b9a2e-34f9-4a5b-8a36-4b1f2d7c0e11";
+
+//down at first, probed by the spool
+struct SpoolS3 : FakeS3 {
+    std::atomic<int> probes{0};
+};
+
+class SpoolTest : public TempDirTest {
+protected:
+    SpoolS3 s3;
+    std::shared_ptr<CircuitBreaker> breaker = std::make_shared<CircuitBreaker>(1);
+
+    void SetUp() override {
+        TempDirTest::SetUp();
+        s3.up = false;
+    }
+
+    std::unique_ptr<Spool> Create() {
+        return std::unique_ptr<Spool>(new Spool(context, root + "/spool", breaker,
+                                                [this](const std::string& uuid, const void* content, int64_t size, OrthancPluginContentType) {
+            return s3.up && s3.Put(uuid, content, size);
+        }, [this](const std::string& uuid, OrthancPluginContentType) {
+            return s3.Remove(uuid);
+        }, [this]() {
+            s3.probes++;
+            return s3.up.load();
+        }, std::chrono::milliseconds(10)));
+    }
+};
+
+TEST_F(SpoolTest, WriteReadRemove) {
+    breaker->RecordFailure();
+    std::unique_ptr<Spool> spool = Create();
+    ASSERT_TRUE(spool->Start());
+
+    ASSERT_TRUE(spool->Write(UUID, "dicom", 5, OrthancPluginContentType_Dicom));
+    EXPECT_EQ(spool->GetPendingCount(), 1u);
+    EXPECT_EQ(Read(*spool, UUID), "dicom");
+
+    EXPECT_TRUE(spool->Remove(UUID));
+    EXPECT_FALSE(spool->Remove(UUID));
+    EXPECT_EQ(Read(*spool, UUID), "<missing>");
+    EXPECT_EQ(spool->GetPendingCount(), 0u);
+    EXPECT_EQ(s3.removes, 0);
+}
+
+TEST_F(SpoolTest, DrainsOnceS3Answers) {
+    breaker->RecordFailure();
+    std::unique_ptr<Spool> spool = Create();
+    ASSERT_TRUE(spool->Start());
+    ASSERT_TRUE(spool->Write(UUID, "dicom", 5, OrthancPluginContentType_Dicom));
+
+    //probed while down, nothing uploaded
+    ASSERT_TRUE(WaitFor([this]() { return s3.probes >= 3; }));
+    EXPECT_TRUE(breaker->IsOpen());
+    EXPECT_EQ(spool->GetPendingCount(), 1u);
+
+    s3.up = true;
+    ASSERT_TRUE(WaitFor([&spool]() { return spool->GetPendingCount() == 0; }));
+    EXPECT_FALSE(breaker->IsOpen());
+    EXPECT_EQ(s3.objects[UUID], "dicom");
+    EXPECT_EQ(spool->GetDrainedCount(), 1u);
+    EXPECT_EQ(Read(*spool, UUID), "<missing>");
+}
+
+TEST_F(SpoolTest, DrainedAfterRestart) {
+    breaker->RecordFailure();
+    {
+        std::unique_ptr<Spool> spool = Create();
+        ASSERT_TRUE(spool->Start());
+        ASSERT_TRUE(spool->Write(UUID, "json", 4, OrthancPluginContentType_DicomAsJson));
+    }
+
+    s3.up = true;
+    std::unique_ptr<Spool> spool = Create();
+    ASSERT_TRUE(spool->Start());
+    ASSERT_TRUE(WaitFor([&spool]() { return spool->GetPendingCount() == 0; }));
+    EXPECT_EQ(s3.objects[UUID], "json");
+}
+
+} //namespace
@@ -0,0 +1,67 @@
+#include "gtest/gtest.h"
+
+#include "MemStreamBuf.hpp"
+
+#include <iostream>
+#include <string>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+TEST(MemStreamBuf, WritesAtOffsets) {
+    char data[8] = {0};
+    Stream::MemStreamBuf buf(data, sizeof(data));
+    std::iostream s(&buf);
+
+    s.seekp(4);
+    s.write("5678", 4);
+    s.seekp(0);
+    s.write("1234", 4);
+
+    EXPECT_TRUE(s.good());
+    EXPECT_EQ(std::string(data, sizeof(data)), "12345678");
+    EXPECT_EQ(buf.size(), 8u);
+}
+
+TEST(MemStreamBuf, DoesNotGrow) {
+    char data[4] = {0};
+    Stream::MemStreamBuf buf(data, sizeof(data));
+    std::iostream s(&buf);
+
+    s.write("12345", 5);
+    EXPECT_FALSE(s.good());
+    EXPECT_EQ(std::string(data, sizeof(data)), "1234");
+
+    s.clear();
+    s.seekp(5);
+    EXPECT_FALSE(s.good());
+}
+
+TEST(MemStreamBuf, StreamTestSeek3a) {
+    char data[6] = {'a', 'b', 'c', 'd', 'e', 'f'};
+    Stream::MemStreamBuf buf(data, sizeof(data), true);
+    std::iostream s(&buf);
+
+    s.seekg(3);
+    char c = 0;
+    s.get(c);
+    EXPECT_EQ(c, 'd');
+    s.seekg(-3, std::ios::end);
+    s.get(c);
+    EXPECT_EQ(c, 'd');
+}
+
+TEST(MemStreamBuf, ReadsOnlyWhatWasWritten) {
+    char data[8] = {0};
+    Stream::MemStreamBuf buf(data, sizeof(data));
+    std::iostream s(&buf);
+
+    s << "<Error>";
+    std::string body;
+    std::getline(s, body);
+    EXPECT_EQ(body, "<Error>");
+    EXPECT_TRUE(s.eof());
+}
+
+} //namespace
@@ -0,0 +1,29 @@
+#include <orthanc/OrthancCPlugin.h>
+
+#include <cstdlib>
+#include <iostream>
+
+//the plugin context of the code under test, logs go to stderr
+namespace {
+
+OrthancPluginErrorCode invokeService(OrthancPluginContext*, _OrthancPluginService service, const void* params) {
+    switch (service) {
+    case _OrthancPluginService_LogError:
+    case _OrthancPluginService_LogWarning:
+        std::cerr << static_cast<const char*>(params) << std::endl;
+        return OrthancPluginErrorCode_Success;
+    case _OrthancPluginService_LogInfo:
+        return OrthancPluginErrorCode_Success;
+    default:
+        return OrthancPluginErrorCode_NotImplemented;
+    }
+}
+
+OrthancPluginContext testContext = {nullptr, "1.4.0", free, invokeService};
+
+}
+
+namespace OrthancPlugins {
+    //declared in Utils.hpp, defined by Plugin.cpp in the plugin
+    OrthancPluginContext* context = &testContext;
+}
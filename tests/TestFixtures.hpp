@@ -0,0 +1,100 @@
+#ifndef TESTFIXTURES_HPP
+#define TESTFIXTURES_HPP
+
+#include "gtest/gtest.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace OrthancPlugins {
+
+/*
+ * Shared by the tests of what sits between Orthanc and S3 (journal, spool,
+ * dedup, packer, disk cache): S3 reduced to a map, a scratch directory per
+ * test, and the polling and reading helpers around them.
+ */
+
+//S3 as seen by those components; each test decides in its callbacks what up means
+struct FakeS3 {
+    std::mutex mutex;
+    std::map<std::string, std::string> objects;
+    std::atomic<bool> up{true};
+    std::atomic<int> uploads{0};
+    std::atomic<int> removes{0};
+
+    bool Put(const std::string& key, const void* content, int64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        uploads++;
+        objects[key].assign(static_cast<const char*>(content), static_cast<size_t>(size));
+        return true;
+    }
+
+    bool Remove(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        removes++;
+        return objects.erase(key) > 0;
+    }
+
+    bool Get(const std::string& key, std::string& data) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = objects.find(key);
+        if (it == objects.end()) {
+            return false;
+        }
+        data = it->second;
+        return true;
+    }
+
+    size_t GetCount() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return objects.size();
+    }
+};
+
+//root: a fresh directory under /tmp, removed with everything in it afterwards
+class TempDirTest : public ::testing::Test {
+protected:
+    std::string root;
+
+    void SetUp() override {
+        char dir[] = "/tmp/s3-tests-XXXXXX";
+        ASSERT_NE(mkdtemp(dir), nullptr);
+        root = dir;
+    }
+
+    void TearDown() override {
+        std::string command = "rm -rf " + root;
+        EXPECT_EQ(system(command.c_str()), 0);
+    }
+
+    //for the background threads: polls every 10 ms, gives up after 5 s
+    static bool WaitFor(std::function<bool()> condition) {
+        for (int i = 0; i < 500 && !condition(); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return condition();
+    }
+
+    //Read of a journal, spool or cache as a string, "<missing>" when it fails
+    template <typename Store>
+    static std::string Read(Store& store, const std::string& uuid) {
+        void* content = nullptr;
+        int64_t size = 0;
+        if (!store.Read(uuid, &content, &size)) {
+            return "<missing>";
+        }
+        std::string data(static_cast<const char*>(content), static_cast<size_t>(size));
+        free(content);
+        return data;
+    }
+};
+
+}
+#endif // TESTFIXTURES_HPP
@@ -0,0 +1,129 @@
+#include "gtest/gtest.h"
+
+#include "AllocationCounter.hpp"
+#include "Utils.hpp"
+#include "Core/OrthancException.h"
+
+#include <cstdlib>
+#include <sstream>
+#include <string>
+#include <thread>
+
+namespace {
+
+using namespace OrthancPlugins;
+
+class UtilsTest : public ::testing::Test {
+protected:
+    std::string root;
+
+    void SetUp() override {
+        char dir[] = "/tmp/s3-utils-XXXXXX";
+        ASSERT_NE(mkdtemp(dir), nullptr);
+        root = dir;
+    }
+
+    void TearDown() override {
+        std::string command = "rm -rf " + root;
+        EXPECT_EQ(system(command.c_str()), 0);
+    }
+};
+
+TEST_F(UtilsTest, WriteReadRemove) {
+    //like the storage area: aa/bb/uuid
+    const std::string path = root + "/aa/bb/uuid";
+    const std::string data = "0123456789";
+
+    Utils::writeFile(data, path);
+    EXPECT_TRUE(Utils::isRegularFile(path));
+    EXPECT_TRUE(Utils::isExistingFile(path));
+    EXPECT_TRUE(Utils::isDirectory(root + "/aa/bb"));
+    EXPECT_EQ(Utils::getFileSize(path), data.size());
+
+    void* content = nullptr;
+    int64_t size = 0;
+    Utils::readFile(&content, &size, path);
+    ASSERT_EQ(size, static_cast<int64_t>(data.size()));
+    EXPECT_EQ(std::string(static_cast<const char*>(content), static_cast<size_t>(size)), data);
+    free(content);
+
+    //the file and its two emptied parents
+    Utils::removeFile(path);
+    EXPECT_FALSE(Utils::isExistingFile(path));
+    EXPECT_FALSE(Utils::isDirectory(root + "/aa"));
+    EXPECT_TRUE(Utils::isDirectory(root));
+}
+
+TEST_F(UtilsTest, EmptyFile) {
+    const std::string path = root + "/aa/bb/empty";
+    Utils::writeFile(std::string(), path);
+    EXPECT_EQ(Utils::getFileSize(path), 0u);
+
+    void* content = nullptr;
+    int64_t size = -1;
+    Utils::readFile(&content, &size, path);
+    EXPECT_EQ(size, 0);
+    EXPECT_EQ(content, nullptr);
+}
+
+TEST_F(UtilsTest, Errors) {
+    const std::string path = root + "/aa/bb/uuid";
+    Utils::writeFile("x", path);
+
+    //never overwrites
+    EXPECT_THROW(Utils::writeFile("y", path), Orthanc::OrthancException);
+    //a file where a directory should be
+    EXPECT_THROW(Utils::writeFile("y", path + "/child"), Orthanc::OrthancException);
+    EXPECT_THROW(Utils::makeDirectory(path), Orthanc::OrthancException);
+    EXPECT_THROW(Utils::removeFile(root + "/aa"), Orthanc::OrthancException);
+
+    void* content = nullptr;
+    int64_t size = 0;
+    EXPECT_THROW(Utils::readFile(&content, &size, root + "/missing"), Orthanc::OrthancException);
+    EXPECT_THROW(Utils::getFileSize(root + "/missing"), Orthanc::OrthancException);
+    //nothing to do
+    EXPECT_NO_THROW(Utils::removeFile(root + "/missing"));
+}
+
+TEST_F(UtilsTest, MakeDirectory) {
+    const std::string path = root + "/a/b/c";
+    Utils::makeDirectory(path);
+    EXPECT_TRUE(Utils::isDirectory(path));
+    EXPECT_FALSE(Utils::isRegularFile(path));
+    EXPECT_NO_THROW(Utils::makeDirectory(path));
+}
+
+TEST_F(UtilsTest, ReadFileAllocatesOnce) {
+    const size_t size = 4 * 1024 * 1024;
+    const std::string path = root + "/aa/bb/large";
+    Utils::writeFile(std::string(size, 'x'), path);
+
+    void* content = nullptr;
+    int64_t read = 0;
+    AllocationCounter counter;
+    Utils::readFile(&content, &read, path);
+    const AllocationCounter::Stats stats = counter.Get();
+    free(content);
+
+    //read straight into the buffer handed over to Orthanc
+    EXPECT_EQ(read, static_cast<int64_t>(size));
+    EXPECT_LE(stats.large_bytes, size + size / 8);
+}
+
+TEST(Utils, GetStreamSize) {
+    std::stringstream s("0123456789");
+    s.seekg(4);
+    EXPECT_EQ(Utils::GetStreamSize(s), 10);
+    //and rewinds
+    EXPECT_EQ(s.tellg(), 0);
+}
+
+TEST(Utils, AvailableCores) {
+    const unsigned int cores = Utils::getAvailableCores();
+    EXPECT_GE(cores, 1u);
+    if (std::thread::hardware_concurrency() > 0) {
+        EXPECT_LE(cores, std::thread::hardware_concurrency());
+    }
+}
+
+} //namespace
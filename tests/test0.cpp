@@ -1,11 +0,0 @@
-#include <iostream>
-#include "gtest/gtest.h"
-
-namespace {
-
-TEST(S3Storage, Example) {
-    int a =5;
-    EXPECT_EQ(a, 5);
-}
-
-} //namespace